@@ -0,0 +1,194 @@
+// A stand-in for server.js without the model: it negotiates and parses
+// requests with the same protocol.js, checks that every frame's header adds
+// up to the bytes that follow, and answers with an opaque mask. Point the
+// plugin's benchmarks at it to check the C client against the node layout:
+//
+//   node check_protocol.js /tmp/check.sock [maxBatch] [version] &
+//   virtual-background-bench-batch -S /tmp/check.sock
+//
+// Layout errors are printed as they are found and counted on exit.
+
+const net = require('net');
+const fs = require('fs');
+const process = require('process');
+
+const {
+    REQUEST_HEADER, RESPONSE_HEADER, HELLO_HEADER, HELLO_RESPONSE_HEADER, HELLO_LENGTH,
+    BATCH_HEADER, BATCH_RESPONSE_HEADER, BATCH_PREAMBLE_LENGTH,
+    PROTOCOL_VERSION, PIXEL_FORMAT_BGR24, PIXEL_FORMAT_RGB24, MASK_ENCODING_RAW8,
+    readRequestPreamble, readBatchFrameHeader,
+} = require('./protocol');
+
+// no plugin gives a frame this many microseconds
+const MAX_BUDGET_US = 60 * 1000 * 1000;
+
+const socketPath = process.argv[2];
+const maxBatch = parseInt(process.argv[3] || "4", 10);
+// lower to check the layouts older servers speak
+const maxVersion = Math.min(PROTOCOL_VERSION, parseInt(process.argv[4] || `${PROTOCOL_VERSION}`, 10));
+const counts = {requests: 0, batches: 0, frames: 0, errors: 0};
+
+
+function getHelloResponse(protocolVersion) {
+    const buf = Buffer.alloc(protocolVersion >= 3 ? 24 : 20);
+    HELLO_RESPONSE_HEADER.copy(buf, 0);
+    buf.writeUInt16LE(protocolVersion, 8);
+    buf.writeUInt16LE(1, 14);
+    buf.writeUInt16LE((1 << PIXEL_FORMAT_BGR24) | (1 << PIXEL_FORMAT_RGB24), 16);
+    buf.writeUInt16LE(1 << MASK_ENCODING_RAW8, 18);
+    if (protocolVersion >= 3) {
+        buf.writeUInt16LE(maxBatch, 20);
+    }
+    return buf;
+}
+
+function getIntBuffer(value) {
+    const buf = Buffer.alloc(4);
+    buf.writeInt32LE(value);
+    return buf;
+}
+
+// returns what is wrong with a frame of length pixel bytes, or null
+function checkFrame(frame, length) {
+    const {height, width, stride, pixelFormat, budgetUs, segmentationThreshold} = frame;
+    const rowBytes = stride || width * 3;
+    if (height <= 0 || width <= 0 || rowBytes < width * 3) {
+        return `bad geometry ${width}x${height} stride ${stride}`;
+    }
+    if (pixelFormat !== PIXEL_FORMAT_BGR24 && pixelFormat !== PIXEL_FORMAT_RGB24) {
+        return `bad pixel format ${pixelFormat}`;
+    }
+    if (!(segmentationThreshold >= 0 && segmentationThreshold <= 1)) {
+        return `bad threshold ${segmentationThreshold}`;
+    }
+    if (budgetUs > MAX_BUDGET_US) {
+        return `bad budget ${budgetUs} us`;
+    }
+    if (length !== rowBytes * height) {
+        return `${length} pixel bytes for ${height} rows of ${rowBytes}`;
+    }
+    return null;
+}
+
+function fail(socket, message) {
+    counts.errors++;
+    console.error(`!! ${message}`);
+    socket.destroy();
+}
+
+// Handles the first complete message in buffer. Returns how many bytes it
+// used, 0 if the message is not all there yet, or -1 after a layout error.
+function handleMessage(socket, state, buffer) {
+    if (buffer.length < 12) {
+        return 0;
+    }
+    const header = buffer.subarray(0, 8);
+    if (header.equals(HELLO_HEADER)) {
+        if (buffer.length < HELLO_LENGTH) {
+            return 0;
+        }
+        state.protocolVersion = Math.min(maxVersion, buffer.readUInt16LE(8));
+        socket.write(getHelloResponse(state.protocolVersion));
+        return HELLO_LENGTH;
+    }
+    const length = buffer.readUInt32LE(8);
+    if (buffer.length < length) {
+        return 0;
+    }
+
+    if (state.protocolVersion >= 3 && header.equals(BATCH_HEADER)) {
+        const count = buffer.readUInt16LE(12);
+        if (count < 1 || count > maxBatch) {
+            fail(socket, `batch of ${count} frames, at most ${maxBatch} advertised`);
+            return -1;
+        }
+        const response = [Buffer.alloc(BATCH_PREAMBLE_LENGTH)];
+        let responseLength = BATCH_PREAMBLE_LENGTH;
+        let offset = BATCH_PREAMBLE_LENGTH;
+        for (let i = 0; i < count; i++) {
+            const frame = readBatchFrameHeader(buffer, offset, state.protocolVersion);
+            offset += frame.headerLength;
+            const error = frame.id >= count ? `frame id ${frame.id} in a batch of ${count}` :
+                    offset + frame.length > length ? `frame ${i} runs past the request` :
+                    checkFrame(frame, frame.length);
+            if (error !== null) {
+                fail(socket, `v${state.protocolVersion} batch frame ${i}: ${error}`);
+                return -1;
+            }
+            offset += frame.length;
+            const maskHeader = Buffer.alloc(8);
+            maskHeader.writeUInt32LE(frame.id, 0);
+            maskHeader.writeInt32LE(frame.height * frame.width, 4);
+            response.push(maskHeader, Buffer.alloc(frame.height * frame.width, 255));
+            responseLength += 8 + frame.height * frame.width;
+        }
+        if (offset !== length) {
+            fail(socket, `v${state.protocolVersion} batch frames end at ${offset}, the request at ${length}`);
+            return -1;
+        }
+        BATCH_RESPONSE_HEADER.copy(response[0], 0);
+        response[0].writeUInt32LE(responseLength, 8);
+        response[0].writeUInt16LE(count, 12);
+        socket.write(Buffer.concat(response));
+        counts.batches++;
+        counts.frames += count;
+        return length;
+    }
+
+    if (!header.equals(REQUEST_HEADER)) {
+        fail(socket, `unknown header ${header.toString('hex')}`);
+        return -1;
+    }
+    const frame = readRequestPreamble(buffer, state.protocolVersion);
+    const error = checkFrame(frame, length - frame.dataOffset);
+    if (error !== null) {
+        fail(socket, `v${state.protocolVersion} request: ${error}`);
+        return -1;
+    }
+    socket.write(Buffer.concat([RESPONSE_HEADER, getIntBuffer(frame.height * frame.width),
+                                Buffer.alloc(frame.height * frame.width, 255)]));
+    counts.requests++;
+    counts.frames++;
+    return length;
+}
+
+function handleConnection(socket) {
+    const state = {protocolVersion: 1};
+    let pending = Buffer.alloc(0);
+    socket.on('error', () => socket.destroy());
+    socket.on('data', (chunk) => {
+        pending = Buffer.concat([pending, chunk]);
+        while (true) {
+            const used = handleMessage(socket, state, pending);
+            if (used <= 0) {
+                return;
+            }
+            pending = pending.subarray(used);
+        }
+    });
+}
+
+
+if (socketPath === undefined) {
+    console.error("usage: node check_protocol.js socket_path [maxBatch] [version]");
+    process.exit(2);
+}
+try {
+    fs.unlinkSync(socketPath);
+} catch (e) {
+}
+const server = net.Server();
+server.on('connection', handleConnection);
+server.listen(socketPath, () => console.info(`Checking v${maxVersion} requests on ${socketPath}, batches up to ${maxBatch}`));
+
+function finish() {
+    console.info(`${counts.requests} requests, ${counts.batches} batches, ${counts.frames} frames, ` +
+                 `${counts.errors} layout errors`);
+    try {
+        fs.unlinkSync(socketPath);
+    } catch (e) {
+    }
+    process.exit(counts.errors ? 1 : 0);
+}
+process.on('SIGINT', finish);
+process.on('SIGTERM', finish);
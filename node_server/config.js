@@ -11,5 +11,14 @@ module.exports = {
         multiplier: 0.75,
         quantBytes: 2,
     },
+    // advertised to v2 clients, which then send frames already at this size
+    // so the model can run at internalResolution 'full'
+    protocol: {
+        preferredWidth: 480,
+        preferredHeight: 360,
+        strideAlignment: 1,
+        // most frames a v3 client may send in one batch request
+        maxBatch: 4,
+    },
     debugTimings: false
 };
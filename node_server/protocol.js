@@ -0,0 +1,85 @@
+// The wire format shared with the OBS plugin, see src/segmentation_client.h.
+// Kept free of the model so check_protocol.js can parse requests the same way.
+
+const REQUEST_HEADER = Buffer.from([0xee, 0x61, 0xbe, 0xc4, 0x38, 0xd2, 0x56, 0xa9]);
+const RESPONSE_HEADER = Buffer.from([0x50, 0x77, 0x3d, 0xda, 0xc8, 0x7d, 0x5d, 0x97]);
+const HELLO_HEADER = Buffer.from([0xee, 0x61, 0xbe, 0xc4, 0x48, 0x45, 0x4c, 0x32]);
+const HELLO_RESPONSE_HEADER = Buffer.from([0x50, 0x77, 0x3d, 0xda, 0x48, 0x45, 0x4c, 0x32]);
+const HELLO_LENGTH = 16;
+const BATCH_HEADER = Buffer.from([0xee, 0x61, 0xbe, 0xc4, 0x42, 0x41, 0x54, 0x33]);
+const BATCH_RESPONSE_HEADER = Buffer.from([0x50, 0x77, 0x3d, 0xda, 0x42, 0x41, 0x54, 0x33]);
+const BATCH_PREAMBLE_LENGTH = 16;
+// BatchFrameHeader: v3 stops before budget_us, v4 appends it
+const BATCH_FRAME_HEADER_V3_LENGTH = 24;
+const BATCH_FRAME_HEADER_V4_LENGTH = 28;
+// the mask length of a frame dropped because its deadline passed
+const MASK_LENGTH_DROPPED = -2;
+
+const PROTOCOL_VERSION = 4;
+const PIXEL_FORMAT_BGR24 = 0;
+const PIXEL_FORMAT_RGB24 = 1;
+const MASK_ENCODING_RAW8 = 0;
+
+
+// RequestPreamble after the header and length; pixels start at dataOffset
+function readRequestPreamble(buffer, protocolVersion) {
+    const request = {
+        segmentationThreshold: buffer.readFloatLE(12),
+        height: buffer.readInt16LE(16),
+        width: buffer.readInt16LE(18),
+        blur: buffer.readInt16LE(20),
+        growshrink: buffer.readInt16LE(22),
+        stride: 0,
+        pixelFormat: PIXEL_FORMAT_BGR24,
+        budgetUs: 0,
+        dataOffset: 24,
+    };
+    if (protocolVersion >= 2) {
+        request.stride = buffer.readUInt16LE(24);
+        request.pixelFormat = buffer.readUInt8(26);
+        request.dataOffset = 28;
+    }
+    if (protocolVersion >= 4) {
+        request.budgetUs = buffer.readUInt32LE(28);
+        request.dataOffset = 32;
+    }
+    return request;
+}
+
+// BatchFrameHeader at offset; its pixels start at offset + headerLength
+function readBatchFrameHeader(buffer, offset, protocolVersion) {
+    return {
+        id: buffer.readUInt32LE(offset),
+        length: buffer.readUInt32LE(offset + 4),
+        segmentationThreshold: buffer.readFloatLE(offset + 8),
+        height: buffer.readInt16LE(offset + 12),
+        width: buffer.readInt16LE(offset + 14),
+        blur: buffer.readInt16LE(offset + 16),
+        growshrink: buffer.readInt16LE(offset + 18),
+        stride: buffer.readUInt16LE(offset + 20),
+        pixelFormat: buffer.readUInt8(offset + 22),
+        budgetUs: protocolVersion >= 4 ? buffer.readUInt32LE(offset + 24) : 0,
+        headerLength: protocolVersion >= 4 ? BATCH_FRAME_HEADER_V4_LENGTH : BATCH_FRAME_HEADER_V3_LENGTH,
+    };
+}
+
+
+module.exports = {
+    REQUEST_HEADER,
+    RESPONSE_HEADER,
+    HELLO_HEADER,
+    HELLO_RESPONSE_HEADER,
+    HELLO_LENGTH,
+    BATCH_HEADER,
+    BATCH_RESPONSE_HEADER,
+    BATCH_PREAMBLE_LENGTH,
+    BATCH_FRAME_HEADER_V3_LENGTH,
+    BATCH_FRAME_HEADER_V4_LENGTH,
+    MASK_LENGTH_DROPPED,
+    PROTOCOL_VERSION,
+    PIXEL_FORMAT_BGR24,
+    PIXEL_FORMAT_RGB24,
+    MASK_ENCODING_RAW8,
+    readRequestPreamble,
+    readBatchFrameHeader,
+};
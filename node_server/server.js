@@ -9,10 +9,20 @@ const CONFIG = require('./config');
 
 const LOCALHOST = "localhost";
 const outputFile = `${process.env.TMPDIR || "/tmp"}/.segmentation.port`;
+const outputDirectory = `${process.env.TMPDIR || "/tmp"}/.segmentation.d`;
+const poolFile = `${outputDirectory}/${process.pid}.port`;
+// set when the OBS plugin started us on a socket it listens on
+const supervisedFd = process.env.SEGMENTATION_FD;
+const readyFd = process.env.SEGMENTATION_READY_FD;
 
-const REQUEST_HEADER = Buffer.from([0xee, 0x61, 0xbe, 0xc4, 0x38, 0xd2, 0x56, 0xa9]);
-const RESPONSE_HEADER = Buffer.from([0x50, 0x77, 0x3d, 0xda, 0xc8, 0x7d, 0x5d, 0x97]);
+const {
+    REQUEST_HEADER, RESPONSE_HEADER, HELLO_HEADER, HELLO_RESPONSE_HEADER, HELLO_LENGTH,
+    BATCH_HEADER, BATCH_RESPONSE_HEADER, BATCH_PREAMBLE_LENGTH, MASK_LENGTH_DROPPED,
+    PROTOCOL_VERSION, PIXEL_FORMAT_BGR24, PIXEL_FORMAT_RGB24, MASK_ENCODING_RAW8,
+    readRequestPreamble, readBatchFrameHeader,
+} = require('./protocol');
 let NUM_FRAMES = 0;
+let DROPPED_FRAMES = 0;
 
 
 const socketDataPromise = (socket) => {
@@ -60,6 +70,154 @@ const timeit = (name, hrstart, debug) => {
         return buf;
     }
 
+    function getHelloResponse(protocolVersion) {
+        const buf = Buffer.alloc(protocolVersion >= 3 ? 24 : 20);
+        HELLO_RESPONSE_HEADER.copy(buf, 0);
+        buf.writeUInt16LE(protocolVersion, 8);
+        buf.writeInt16LE(CONFIG.protocol.preferredWidth, 10);
+        buf.writeInt16LE(CONFIG.protocol.preferredHeight, 12);
+        buf.writeUInt16LE(CONFIG.protocol.strideAlignment, 14);
+        buf.writeUInt16LE((1 << PIXEL_FORMAT_BGR24) | (1 << PIXEL_FORMAT_RGB24), 16);
+        buf.writeUInt16LE(1 << MASK_ENCODING_RAW8, 18);
+        if (protocolVersion >= 3) {
+            buf.writeUInt16LE(CONFIG.protocol.maxBatch, 20);
+        }
+        return buf;
+    }
+
+    // v4 frames carry the microseconds they had left when sent, 0 for no deadline
+    function getExpiry(arrived, budgetUs) {
+        return budgetUs > 0 ? arrived + BigInt(budgetUs) * 1000n : null;
+    }
+
+    // called right before inference, so frames that waited too long are never run
+    function dropIfExpired(expiresAt) {
+        if (expiresAt === null || process.hrtime.bigint() < expiresAt) {
+            return false;
+        }
+        DROPPED_FRAMES++;
+        console.log(`!! Dropped a frame past its deadline (${DROPPED_FRAMES} so far)`);
+        return true;
+    }
+
+    // drops any per-row padding a v2 client added for stride alignment
+    function packRows(buffer, width, height, stride) {
+        const rowBytes = width * 3;
+        if (!stride || stride === rowBytes) {
+            return buffer.subarray(0, rowBytes * height);
+        }
+        const packed = Buffer.alloc(rowBytes * height);
+        for (let row = 0; row < height; row++) {
+            buffer.copy(packed, row * rowBytes, row * stride, row * stride + rowBytes);
+        }
+        return packed;
+    }
+
+    // runs the model and post processing on one frame, null if it could not be decoded
+    async function segmentFrame(nn, holders, frame) {
+        const {pixels, height, width, pixelFormat, segmentationThreshold, blur, growshrink} = frame;
+        let start = process.hrtime();
+        if (holders.height != height || holders.width != width || holders.image === null) {
+            if (holders.image !== null) {
+                holders.image.release();
+                holders.mask.release();
+            }
+            holders.image = new cv.Matrix(height, width, cv.Constants.CV_8UC3);
+            holders.mask = new cv.Matrix(height, width, cv.Constants.CV_8UC1);
+            holders.height = height;
+            holders.width = width;
+        }
+        let image;
+        if (pixelFormat === PIXEL_FORMAT_RGB24) {
+            image = tf.tensor3d(new Uint8Array(pixels.buffer, pixels.byteOffset, pixels.length),
+                                [height, width, 3], 'int32');
+            start = timeit("created tensor", start);
+        } else {
+            holders.image.put(pixels);
+            start = timeit("added data to image holder", start);
+
+            image = tf.node.decodeImage(holders.image.toBuffer({ext: ".bmp"}));
+            start = timeit("tf decoded image", start);
+        }
+        if (image === null) {
+            return null;
+        }
+        const options = Object.assign({}, CONFIG.segmentationOptions);
+        options.segmentationThreshold = segmentationThreshold;
+        if (frame.fullResolution) {
+            // the client already scaled to protocol.preferredWidth
+            options.internalResolution = 'full';
+        }
+        const segmentation = await nn.segmentPerson(image, options);
+        tf.dispose(image);
+        holders.mask.put(Buffer.from(segmentation.data));
+
+        start = timeit("finished segmentation", start);
+
+        const invertedMask = holders.mask.threshold(0, 255, "Binary");
+        if (growshrink > 0) {
+            invertedMask.dilate(1, cv.Matrix.Ones(growshrink, growshrink));
+        } else if (growshrink < 0) {
+            invertedMask.erode(1, cv.Matrix.Ones(-growshrink, -growshrink));
+        }
+        if (blur > 0) {
+            const adjusted = 2 * blur + 1;
+            invertedMask.gaussianBlur([adjusted, adjusted]);
+        }
+
+        start = timeit("completed post processing", start);
+
+        const resultBuffer = invertedMask.getData();
+        invertedMask.release();
+        return resultBuffer;
+    }
+
+    // Segments every frame of a v3 batch request and answers with one mask per
+    // frame, tagged with the frame's id. body-pix has no batched inference, so
+    // the frames run back to back; the client still saves a round trip each.
+    async function handleBatch(nn, socket, holders, requestBuffer, protocolVersion, arrived) {
+        const count = requestBuffer.readUInt16LE(12);
+        let offset = BATCH_PREAMBLE_LENGTH;
+        const masks = [];
+        for (let i = 0; i < count; i++) {
+            const {
+                id, length, segmentationThreshold, height, width, blur, growshrink, stride, pixelFormat, budgetUs,
+                headerLength,
+            } = readBatchFrameHeader(requestBuffer, offset, protocolVersion);
+            offset += headerLength;
+            const pixels = packRows(requestBuffer.subarray(offset, offset + length), width, height, stride);
+            offset += length;
+            if (dropIfExpired(getExpiry(arrived, budgetUs))) {
+                masks.push({id, mask: null, dropped: true});
+                continue;
+            }
+            const mask = await segmentFrame(nn, holders, {
+                pixels, height, width, pixelFormat, segmentationThreshold, blur, growshrink,
+                fullResolution: true,
+            });
+            masks.push({id, mask, dropped: false});
+        }
+
+        let responseLength = BATCH_PREAMBLE_LENGTH;
+        for (const {mask} of masks) {
+            responseLength += 8 + (mask === null ? 0 : mask.length);
+        }
+        const preamble = Buffer.alloc(BATCH_PREAMBLE_LENGTH);
+        BATCH_RESPONSE_HEADER.copy(preamble, 0);
+        preamble.writeUInt32LE(responseLength, 8);
+        preamble.writeUInt16LE(count, 12);
+        await writePromise(socket, preamble);
+        for (const {id, mask, dropped} of masks) {
+            const header = Buffer.alloc(8);
+            header.writeUInt32LE(id, 0);
+            header.writeInt32LE(dropped ? MASK_LENGTH_DROPPED : mask === null ? -1 : mask.length, 4);
+            await writePromise(socket, header);
+            if (mask !== null) {
+                await writePromise(socket, mask);
+            }
+        }
+    }
+
     async function handleConnection(nn, socket) {
         console.log("!! Got new connection");
         let running = true;
@@ -71,15 +229,9 @@ const timeit = (name, hrstart, debug) => {
             socket.destroy();
             running = false;
         });
-        let holderHeight = 0;
-        let holderWidth = 0;
-        let cvImageHolder = null;
-        let maskImageHolder = null;
+        const holders = {height: 0, width: 0, image: null, mask: null};
+        let protocolVersion = 1;
         while (running) {
-            NUM_FRAMES++;
-            if (NUM_FRAMES > 250) {
-                process.exit(0);
-            }
             const chunks = [];
             let offset = 0;
             let currentTotalSize = 0;
@@ -92,9 +244,41 @@ const timeit = (name, hrstart, debug) => {
                 chunks.push(buf);
                 currentTotalSize += buf.length;
             }
-            const currentBuffer = (chunks.length === 1) ? chunks[0] : Buffer.concat(chunks);
+            // deadlines count from here, the client's clock may not be ours
+            const arrived = process.hrtime.bigint();
+            let currentBuffer = (chunks.length === 1) ? chunks[0] : Buffer.concat(chunks);
             const requestHeader = currentBuffer.subarray(0, 8);
 
+            if (requestHeader.equals(HELLO_HEADER)) {
+                while (currentTotalSize < HELLO_LENGTH) {
+                    const buf = await socketDataPromise(socket);
+                    chunks.push(buf);
+                    currentTotalSize += buf.length;
+                }
+                currentBuffer = Buffer.concat(chunks);
+                protocolVersion = Math.min(PROTOCOL_VERSION, currentBuffer.readUInt16LE(8));
+                console.log(`!! Negotiated protocol v${protocolVersion}`);
+                await writePromise(socket, getHelloResponse(protocolVersion));
+                continue;
+            }
+
+            NUM_FRAMES++;
+            if (NUM_FRAMES > 250) {
+                process.exit(0);
+            }
+
+            if (protocolVersion >= 3 && requestHeader.equals(BATCH_HEADER)) {
+                const requestSize = currentBuffer.readUInt32LE(8);
+                while (currentTotalSize < requestSize) {
+                    const buf = await socketDataPromise(socket);
+                    chunks.push(buf);
+                    currentTotalSize += buf.length;
+                }
+                await handleBatch(nn, socket, holders, Buffer.concat(chunks), protocolVersion, arrived);
+                timeit(`Batch response time ${NUM_FRAMES}`, requestStart, true);
+                continue;
+            }
+
             if (!requestHeader.equals(REQUEST_HEADER)) {
                 socket.destroy();
             }
@@ -112,75 +296,58 @@ const timeit = (name, hrstart, debug) => {
             const requestBuffer = Buffer.concat(chunks);
 
             start = timeit("loaded buffer", start);
-        
-            const segmentationThreshold = requestBuffer.readFloatLE(offset);
-            offset += 4;
-            const height = requestBuffer.readInt16LE(offset);
-            offset += 2;
-            const width = requestBuffer.readInt16LE(offset);
-            offset += 2;
-            const blur = requestBuffer.readInt16LE(offset);
-            offset += 2;
-            const growshrink = requestBuffer.readInt16LE(offset);
-            offset += 2;
-
-            if (holderHeight != height || holderWidth != width || cvImageHolder === null) {
-                if (cvImageHolder !== null) {
-                    cvImageHolder.release();
-                    maskImageHolder.release();
-                }
-                cvImageHolder = new cv.Matrix(height, width, cv.Constants.CV_8UC3);
-                maskImageHolder = new cv.Matrix(height, width, cv.Constants.CV_8UC1);
-                holderHeight = height;
-                holderWidth = width;
-            }
-            cvImageHolder.put(requestBuffer.subarray(offset));
-            start = timeit("added data to image holder", start);
 
-            const image = tf.node.decodeImage(cvImageHolder.toBuffer({ext: ".bmp"}));
-            start = timeit("tf decoded image", start);
-            if (image === null) {
+            const {
+                segmentationThreshold, height, width, blur, growshrink, stride, pixelFormat, budgetUs, dataOffset,
+            } = readRequestPreamble(requestBuffer, protocolVersion);
+            offset = dataOffset;
+            if (dropIfExpired(getExpiry(arrived, budgetUs))) {
                 await writePromise(socket, RESPONSE_HEADER);
-                await writePromise(socket, getIntBuffer(-1));
+                await writePromise(socket, getIntBuffer(MASK_LENGTH_DROPPED));
+                continue;
             }
-            const options = CONFIG.segmentationOptions;
-            options.segmentationThreshold = segmentationThreshold;
-            const segmentation = await nn.segmentPerson(image, options);
-            tf.dispose(image);
-            maskImageHolder.put(Buffer.from(segmentation.data));
-
-            start = timeit("finished segmentation", start);
-            
-            const invertedMask = maskImageHolder.threshold(0, 255, "Binary");
-            if (growshrink > 0) {
-                invertedMask.dilate(1, cv.Matrix.Ones(growshrink, growshrink));
-            } else if (growshrink < 0) {
-                invertedMask.erode(1, cv.Matrix.Ones(-growshrink, -growshrink));
-            }
-            if (blur > 0) {
-                const adjusted = 2 * blur + 1;
-                invertedMask.gaussianBlur([adjusted, adjusted]);
+            const pixels = packRows(requestBuffer.subarray(offset), width, height, stride);
+            const resultBuffer = await segmentFrame(nn, holders, {
+                pixels, height, width, pixelFormat, segmentationThreshold, blur, growshrink,
+                fullResolution: protocolVersion >= 2,
+            });
+            if (resultBuffer === null) {
+                await writePromise(socket, RESPONSE_HEADER);
+                await writePromise(socket, getIntBuffer(-1));
+                continue;
             }
-
-            start = timeit("completed post processing", start);
-
-            const resultBuffer = invertedMask.getData();
-            invertedMask.release();
             await writePromise(socket, RESPONSE_HEADER);
             await writePromise(socket, getIntBuffer(resultBuffer.length));
             await writePromise(socket, resultBuffer);
             timeit(`Response time ${NUM_FRAMES}`, requestStart, true);
         }
-        if (cvImageHolder !== null) {
-            cvImageHolder.release();
-        }
-        if (maskImageHolder !== null) {
-            maskImageHolder.release();
+        if (holders.image !== null) {
+            holders.image.release();
+            holders.mask.release();
         }
     }
 
+    function serveSupervised(nn) {
+        const server = net.Server();
+        server.on('listening', () => {
+            // tells the plugin the model is loaded
+            if (readyFd !== undefined) {
+                const fd = parseInt(readyFd, 10);
+                fs.writeSync(fd, 'R');
+                fs.closeSync(fd);
+            }
+            console.info(`Listening on inherited socket ${supervisedFd}`);
+        });
+        server.on('connection', (socket) => handleConnection(nn, socket));
+        server.listen({fd: parseInt(supervisedFd, 10)});
+    }
+
     async function main() {
         const nn = await bodyPix.load(CONFIG.modelOptions);
+        if (supervisedFd !== undefined) {
+            serveSupervised(nn);
+            return;
+        }
         const server = net.Server();
         let port = 3193; //getRandomPort();
 
@@ -198,9 +365,18 @@ const timeit = (name, hrstart, debug) => {
             const buf = new Buffer(4);
             buf.writeInt32LE(port);
             fs.writeFile(outputFile, buf, () => {});
+            fs.mkdir(outputDirectory, {recursive: true}, () => {
+                fs.writeFile(poolFile, buf, () => {});
+            });
             console.info(`Listening on ${LOCALHOST}:${port}`);
         });
         server.on('connection', (socket) => handleConnection(nn, socket));
+        process.on('exit', () => {
+            try {
+                fs.unlinkSync(poolFile);
+            } catch (e) {
+            }
+        });
         console.log(`Trying to listen on ${port}`);
         server.listen(port, LOCALHOST);
     }
@@ -0,0 +1,850 @@
+// Offline batch segmentation: decodes a video with FFmpeg, segments every
+// frame on a pool of workers against the same segmentation servers the
+// plugin uses and writes the result with the mask in the alpha channel.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "compat.h"
+#include "imgarray.h"
+#include "scale.h"
+#include "segmentation_pool.h"
+#include "segmentation_client.h"
+
+#define DEFAULT_CODEC                  "png"
+#define MAX_BATCH_WORKERS              64
+#define MAX_SEGMENTATION_ATTEMPTS      5
+#define NO_SERVER_TIMEOUT_NS           10000000000ULL
+#define PROGRESS_INTERVAL              100
+#define DEFAULT_BAND_ROWS              32
+
+
+enum JobState {
+    JOB_EMPTY = 0,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+};
+
+
+typedef struct {
+    const char * input_path;
+    const char * output_path;
+    const char * codec_name;
+    int workers;
+    float segmentation_threshold;
+    int blur;
+    int growshrink;
+    // rows per band when streaming frames and masks, 0 to send whole frames
+    int band_rows;
+} BatchOptions;
+
+
+typedef struct {
+    enum JobState state;
+    AVFrame * input;
+    AVFrame * output;
+} BatchJob;
+
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Batch * batch;
+    pthread_t thread_id;
+    ImageScaler * scaler;
+    ImgArray * mask;
+    AVFrame * rgba;
+    uint8_t * alpha;
+    struct SwsContext * rgba_context;
+    struct SwsContext * mask_context;
+    struct SwsContext * output_context;
+
+    // the server a frame is being streamed to while it is scaled, NULL if none was free
+    SegmentationEndpoint * endpoint;
+    int stream_rc;
+    int mask_height;
+    int mask_width;
+    // rows of alpha already merged into rgba as the mask came in
+    int alpha_rows;
+} BatchWorker;
+
+
+struct Batch {
+    BatchOptions options;
+    SegmentationPool * pool;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // jobs live in a ring indexed by frame number, which keeps output ordered
+    BatchJob * jobs;
+    int num_jobs;
+    int64_t next_submit;
+    int64_t next_dispatch;
+    int64_t next_write;
+    uint8_t input_done;
+    uint8_t write_failed;
+    int64_t failed_frames;
+
+    BatchWorker workers[MAX_BATCH_WORKERS];
+    pthread_t writer_id;
+
+    AVFormatContext * input_format;
+    AVCodecContext * decoder;
+    int input_stream;
+
+    AVFormatContext * output_format;
+    AVCodecContext * encoder;
+    AVStream * output_stream;
+
+    uint64_t start_timestamp;
+};
+
+
+void usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s -i input -o output [-w workers] [-c codec] [-t threshold] [-b blur] [-g growshrink] [-s rows]\n"
+            "\n"
+            "  -i  video file to segment\n"
+            "  -o  output file, the container is picked from the extension (e.g. .mov, .mkv)\n"
+            "  -w  number of frames segmented in parallel (default: number of cores)\n"
+            "  -c  encoder, must support a pixel format with alpha (default: " DEFAULT_CODEC ")\n"
+            "  -t  segmentation threshold (default: 0.6)\n"
+            "  -b  feather radius (default: 4)\n"
+            "  -g  grow (positive) or shrink (negative) the outline (default: 0)\n"
+            "  -s  stream frames and masks in bands of this many rows, 0 for whole frames (default: %d)\n"
+            "\n"
+            "Segmentation servers are found the same way the plugin finds them.\n",
+            name, DEFAULT_BAND_ROWS);
+}
+
+
+enum AVPixelFormat choose_alpha_format(const AVCodec * codec)
+{
+    enum AVPixelFormat result = AV_PIX_FMT_NONE;
+    if (codec->pix_fmts == NULL) {
+        return AV_PIX_FMT_RGBA;
+    }
+    for (const enum AVPixelFormat * format = codec->pix_fmts; *format != AV_PIX_FMT_NONE; format++) {
+        const AVPixFmtDescriptor * descriptor = av_pix_fmt_desc_get(*format);
+        if (*format == AV_PIX_FMT_RGBA) {
+            return *format;
+        }
+        if (result == AV_PIX_FMT_NONE && descriptor != NULL && (descriptor->flags & AV_PIX_FMT_FLAG_ALPHA)) {
+            result = *format;
+        }
+    }
+    return result;
+}
+
+
+int open_input(Batch * batch)
+{
+    const AVCodec * codec = NULL;
+
+    if (avformat_open_input(&batch->input_format, batch->options.input_path, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not open %s\n", batch->options.input_path);
+        return 1;
+    }
+    if (avformat_find_stream_info(batch->input_format, NULL) < 0) {
+        fprintf(stderr, "Could not read stream info from %s\n", batch->options.input_path);
+        return 1;
+    }
+    batch->input_stream = av_find_best_stream(batch->input_format, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (batch->input_stream < 0 || codec == NULL) {
+        fprintf(stderr, "No decodable video stream in %s\n", batch->options.input_path);
+        return 1;
+    }
+
+    batch->decoder = avcodec_alloc_context3(codec);
+    if (batch->decoder == NULL) {
+        return 1;
+    }
+    avcodec_parameters_to_context(batch->decoder,
+                                  batch->input_format->streams[batch->input_stream]->codecpar);
+    // let the decoder pick its own thread count
+    batch->decoder->thread_count = 0;
+    if (avcodec_open2(batch->decoder, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open decoder %s\n", codec->name);
+        return 1;
+    }
+    return 0;
+}
+
+
+int open_output(Batch * batch)
+{
+    AVStream * input_stream = batch->input_format->streams[batch->input_stream];
+
+    avformat_alloc_output_context2(&batch->output_format, NULL, NULL, batch->options.output_path);
+    if (batch->output_format == NULL) {
+        fprintf(stderr, "Could not pick a container for %s\n", batch->options.output_path);
+        return 1;
+    }
+
+    const AVCodec * codec = avcodec_find_encoder_by_name(batch->options.codec_name);
+    if (codec == NULL) {
+        fprintf(stderr, "Unknown encoder %s\n", batch->options.codec_name);
+        return 1;
+    }
+    enum AVPixelFormat pixel_format = choose_alpha_format(codec);
+    if (pixel_format == AV_PIX_FMT_NONE) {
+        fprintf(stderr, "Encoder %s has no pixel format with alpha\n", codec->name);
+        return 1;
+    }
+
+    batch->encoder = avcodec_alloc_context3(codec);
+    if (batch->encoder == NULL) {
+        return 1;
+    }
+    batch->encoder->width = batch->decoder->width;
+    batch->encoder->height = batch->decoder->height;
+    batch->encoder->pix_fmt = pixel_format;
+    batch->encoder->sample_aspect_ratio = batch->decoder->sample_aspect_ratio;
+    batch->encoder->time_base = input_stream->time_base;
+    batch->encoder->framerate = av_guess_frame_rate(batch->input_format, input_stream, NULL);
+    if (batch->output_format->oformat->flags & AVFMT_GLOBALHEADER) {
+        batch->encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(batch->encoder, codec, NULL) < 0) {
+        fprintf(stderr, "Could not open encoder %s\n", codec->name);
+        return 1;
+    }
+
+    batch->output_stream = avformat_new_stream(batch->output_format, NULL);
+    if (batch->output_stream == NULL) {
+        return 1;
+    }
+    avcodec_parameters_from_context(batch->output_stream->codecpar, batch->encoder);
+    batch->output_stream->time_base = batch->encoder->time_base;
+
+    if (!(batch->output_format->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&batch->output_format->pb, batch->options.output_path, AVIO_FLAG_WRITE) < 0) {
+            fprintf(stderr, "Could not open %s for writing\n", batch->options.output_path);
+            return 1;
+        }
+    }
+    if (avformat_write_header(batch->output_format, NULL) < 0) {
+        fprintf(stderr, "Could not write header to %s\n", batch->options.output_path);
+        return 1;
+    }
+    return 0;
+}
+
+
+int encode_frame(Batch * batch, AVFrame * frame)
+{
+    int rc = avcodec_send_frame(batch->encoder, frame);
+    if (rc < 0) {
+        return rc;
+    }
+
+    AVPacket * packet = av_packet_alloc();
+    if (packet == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    while ((rc = avcodec_receive_packet(batch->encoder, packet)) == 0) {
+        av_packet_rescale_ts(packet, batch->encoder->time_base, batch->output_stream->time_base);
+        packet->stream_index = batch->output_stream->index;
+        rc = av_interleaved_write_frame(batch->output_format, packet);
+        av_packet_unref(packet);
+        if (rc < 0) {
+            break;
+        }
+    }
+    av_packet_free(&packet);
+    return (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) ? 0 : rc;
+}
+
+
+// runs the scaled frame against whichever server is free first, failing
+// over to the others, and leaves the mask in worker->mask
+int segment(BatchWorker * worker)
+{
+    SegmentationPool * pool = worker->batch->pool;
+    uint64_t waiting_since = os_gettime_ns();
+    int attempts = 0;
+
+    while (attempts < MAX_SEGMENTATION_ATTEMPTS) {
+        SegmentationEndpoint * endpoint = SegmentationPool_acquire(pool);
+        if (endpoint == NULL) {
+            if (os_gettime_ns() - waiting_since > NO_SERVER_TIMEOUT_NS) {
+                return 1;
+            }
+            nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
+            continue;
+        }
+
+        int rc = SegmentationClient_run_segmentation(
+                endpoint->client,
+                os_gettime_ns(),
+                ImageScaler_get_buffer(worker->scaler),
+                ImageScaler_get_buffer_size(worker->scaler)
+        );
+        if (rc == 0) {
+            rc = ImgArray_copy_from_raw_buffer(
+                    worker->mask,
+                    SegmentationClient_get_mask(endpoint->client),
+                    SegmentationClient_get_mask_size(endpoint->client)
+            );
+            SegmentationPool_release(pool, endpoint, 0);
+            return rc;
+        }
+        SegmentationPool_release(pool, endpoint, rc);
+        attempts++;
+        waiting_since = os_gettime_ns();
+    }
+    return 1;
+}
+
+
+void update_scaler_target(BatchWorker * worker)
+{
+    ServerCapabilities capabilities;
+    if (SegmentationPool_get_capabilities(worker->batch->pool, &capabilities) != 0) {
+        ImageScaler_set_target(worker->scaler, MAX_WIDTH, 0, 1, AV_PIX_FMT_BGR24);
+        return;
+    }
+    ImageScaler_set_target(
+            worker->scaler,
+            capabilities.preferred_width > 0 ? capabilities.preferred_width : MAX_WIDTH,
+            capabilities.preferred_height,
+            capabilities.stride_alignment,
+            capabilities.pixel_format == PIXEL_FORMAT_RGB24 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_BGR24
+    );
+}
+
+
+// copies rows of the full resolution alpha into the RGBA frame
+void merge_alpha(BatchWorker * worker, int first_row, int rows)
+{
+    int width = worker->rgba->width;
+    for (int y = first_row; y < first_row + rows; y++) {
+        uint8_t * row = worker->rgba->data[0] + (size_t)y * worker->rgba->linesize[0];
+        const uint8_t * alpha = worker->alpha + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            row[x * 4 + 3] = alpha[x];
+        }
+    }
+}
+
+
+// writes each band of the scaled frame to the server as soon as the scaler has it
+void send_band(void * opaque, const uint8_t * buffer, int first_row, int rows)
+{
+    BatchWorker * worker = (BatchWorker *)opaque;
+    ImageScaler * scaler = worker->scaler;
+    if (worker->endpoint == NULL || worker->stream_rc != 0) {
+        return;
+    }
+    SegmentationClient * client = worker->endpoint->client;
+    if (first_row == 0) {
+        // the size of the frame is only known once the scaler has started on it
+        SegmentationClient_set_dimensions(client, scaler->new_height, scaler->new_width);
+        SegmentationClient_set_format(client, scaler->stride,
+                scaler->pixel_format == AV_PIX_FMT_RGB24 ? PIXEL_FORMAT_RGB24 : PIXEL_FORMAT_BGR24);
+        worker->stream_rc = SegmentationClient_begin_request(client, os_gettime_ns(),
+                                                             (size_t)scaler->buffer_size);
+        if (worker->stream_rc != 0) {
+            return;
+        }
+    }
+    worker->stream_rc = SegmentationClient_write_rows(client, buffer + (size_t)first_row * scaler->stride,
+                                                      (size_t)rows * scaler->stride);
+}
+
+
+// scales each band of the mask up into alpha as it arrives and merges what's ready into rgba
+void receive_band(void * opaque, const uint8_t * mask, int first_row, int rows)
+{
+    BatchWorker * worker = (BatchWorker *)opaque;
+    if (worker->stream_rc != 0 || first_row + rows > worker->mask_height) {
+        worker->stream_rc = SOCK_NO_MASK;
+        return;
+    }
+    int width = worker->rgba->width;
+    const uint8_t * src = mask + (size_t)first_row * worker->mask_width;
+    int mask_stride[] = {worker->mask_width, 0, 0, 0};
+    int alpha_stride[] = {width, 0, 0, 0};
+    int scaled = sws_scale(worker->mask_context, &src, mask_stride, first_row, rows, &worker->alpha, alpha_stride);
+    if (scaled > 0) {
+        merge_alpha(worker, worker->alpha_rows, scaled);
+        worker->alpha_rows += scaled;
+    }
+}
+
+
+// Reads the mask of a streamed frame band by band. Returns 1 if the frame
+// has its alpha, 0 if it has to go through segment() after all.
+int finish_stream(BatchWorker * worker)
+{
+    SegmentationPool * pool = worker->batch->pool;
+    SegmentationEndpoint * endpoint = worker->endpoint;
+    int width = worker->rgba->width;
+    int height = worker->rgba->height;
+    worker->endpoint = NULL;
+
+    int rc = worker->stream_rc;
+    if (rc == 0) {
+        worker->mask_context = sws_getCachedContext(worker->mask_context,
+                                                    worker->mask_width, worker->mask_height, AV_PIX_FMT_GRAY8,
+                                                    width, height, AV_PIX_FMT_GRAY8,
+                                                    SWS_BILINEAR, NULL, NULL, NULL);
+        rc = worker->mask_context == NULL ? SOCK_NO_MASK : 0;
+    }
+    if (rc == 0) {
+        worker->alpha_rows = 0;
+        rc = SegmentationClient_finish_request(endpoint->client, worker->batch->options.band_rows,
+                                               receive_band, worker);
+    }
+    if (rc == 0 && (worker->stream_rc != 0 || worker->alpha_rows != height ||
+            SegmentationClient_get_mask_size(endpoint->client) != (size_t)(worker->mask_width * worker->mask_height))) {
+        rc = SOCK_NO_MASK;
+    }
+    if (rc != 0) {
+        // whatever of the request made it out, the connection can't be reused
+        SegmentationClient_disconnect(endpoint->client);
+    }
+    SegmentationPool_release(pool, endpoint, rc);
+    return rc == 0;
+}
+
+
+int process_job(BatchWorker * worker, BatchJob * job)
+{
+    Batch * batch = worker->batch;
+    AVFrame * input = job->input;
+    int width = input->width;
+    int height = input->height;
+
+    if (width != worker->rgba->width || height != worker->rgba->height) {
+        fprintf(stderr, "Resolution changes mid-stream are not supported\n");
+        return 1;
+    }
+
+    update_scaler_target(worker);
+    worker->stream_rc = 0;
+    worker->endpoint = NULL;
+    int rc;
+    if (batch->options.band_rows > 0) {
+        // Streams only when a server is free right now. Otherwise scaling the
+        // whole frame while waiting for one beats waiting to start scaling.
+        worker->endpoint = SegmentationPool_acquire(batch->pool);
+        rc = ImageScaler_scale_planes_banded(worker->scaler, (const uint8_t * const *)input->data, input->linesize,
+                                             width, height, input->format, batch->options.band_rows,
+                                             send_band, worker);
+    } else {
+        rc = ImageScaler_scale_planes(worker->scaler, (const uint8_t * const *)input->data, input->linesize,
+                                      width, height, input->format);
+    }
+    if (rc) {
+        if (worker->endpoint != NULL) {
+            SegmentationClient_disconnect(worker->endpoint->client);
+            SegmentationPool_release(batch->pool, worker->endpoint, -1);
+            worker->endpoint = NULL;
+        }
+        return 1;
+    }
+    worker->mask_width = ImageScaler_get_new_width(worker->scaler);
+    worker->mask_height = ImageScaler_get_new_height(worker->scaler);
+    SegmentationPool_set_dimensions(batch->pool, worker->mask_height, worker->mask_width);
+    SegmentationPool_set_format(
+            batch->pool,
+            ImageScaler_get_stride(worker->scaler),
+            worker->scaler->pixel_format == AV_PIX_FMT_RGB24 ? PIXEL_FORMAT_RGB24 : PIXEL_FORMAT_BGR24
+    );
+
+    // full resolution RGBA, converted while a streamed frame is with the server
+    worker->rgba_context = sws_getCachedContext(worker->rgba_context,
+                                                width, height, input->format,
+                                                width, height, AV_PIX_FMT_RGBA,
+                                                SWS_BICUBIC, NULL, NULL, NULL);
+    if (worker->rgba_context == NULL) {
+        if (worker->endpoint != NULL) {
+            SegmentationClient_disconnect(worker->endpoint->client);
+            SegmentationPool_release(batch->pool, worker->endpoint, -1);
+            worker->endpoint = NULL;
+        }
+        return 1;
+    }
+    sws_scale(worker->rgba_context, (const uint8_t * const *)input->data, input->linesize, 0, height,
+              worker->rgba->data, worker->rgba->linesize);
+
+    int streamed = worker->endpoint != NULL && finish_stream(worker);
+    int segmented = streamed || (segment(worker) == 0 &&
+            ImgArray_get_size(worker->mask) == (size_t)(worker->mask_width * worker->mask_height));
+
+    // the mask is scaled up into the alpha channel, a streamed one already was band by band
+    if (!streamed) {
+        if (segmented) {
+            const uint8_t * mask = ImgArray_get_buffer(worker->mask);
+            int mask_stride[] = {worker->mask_width, 0, 0, 0};
+            int alpha_stride[] = {width, 0, 0, 0};
+            worker->mask_context = sws_getCachedContext(worker->mask_context,
+                                                        worker->mask_width, worker->mask_height, AV_PIX_FMT_GRAY8,
+                                                        width, height, AV_PIX_FMT_GRAY8,
+                                                        SWS_BILINEAR, NULL, NULL, NULL);
+            if (worker->mask_context == NULL) {
+                return 1;
+            }
+            sws_scale(worker->mask_context, &mask, mask_stride, 0, worker->mask_height, &worker->alpha, alpha_stride);
+        } else {
+            memset(worker->alpha, 255, (size_t)width * height);
+        }
+        merge_alpha(worker, 0, height);
+    }
+    job->output = av_frame_alloc();
+    if (job->output == NULL) {
+        return 1;
+    }
+    job->output->format = batch->encoder->pix_fmt;
+    job->output->width = width;
+    job->output->height = height;
+    if (av_frame_get_buffer(job->output, 0) < 0) {
+        return 1;
+    }
+    worker->output_context = sws_getCachedContext(worker->output_context,
+                                                  width, height, AV_PIX_FMT_RGBA,
+                                                  width, height, batch->encoder->pix_fmt,
+                                                  SWS_BICUBIC, NULL, NULL, NULL);
+    if (worker->output_context == NULL) {
+        return 1;
+    }
+    sws_scale(worker->output_context, (const uint8_t * const *)worker->rgba->data, worker->rgba->linesize,
+              0, height, job->output->data, job->output->linesize);
+    job->output->pts = input->best_effort_timestamp != AV_NOPTS_VALUE ? input->best_effort_timestamp : input->pts;
+
+    if (!segmented) {
+        pthread_mutex_lock(&batch->mutex);
+        batch->failed_frames++;
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    return 0;
+}
+
+
+void * run_worker(void * ptr)
+{
+    BatchWorker * worker = (BatchWorker *)ptr;
+    Batch * batch = worker->batch;
+
+    while (1) {
+        pthread_mutex_lock(&batch->mutex);
+        while (batch->next_dispatch == batch->next_submit && !batch->input_done && !batch->write_failed) {
+            pthread_cond_wait(&batch->cond, &batch->mutex);
+        }
+        if (batch->next_dispatch == batch->next_submit || batch->write_failed) {
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        BatchJob * job = &batch->jobs[batch->next_dispatch % batch->num_jobs];
+        batch->next_dispatch++;
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&batch->mutex);
+
+        int rc = process_job(worker, job);
+
+        pthread_mutex_lock(&batch->mutex);
+        if (rc) {
+            fprintf(stderr, "Failed to process a frame\n");
+            batch->write_failed = 1;
+        }
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    return NULL;
+}
+
+
+void * run_writer(void * ptr)
+{
+    Batch * batch = (Batch *)ptr;
+
+    while (1) {
+        pthread_mutex_lock(&batch->mutex);
+        BatchJob * job = &batch->jobs[batch->next_write % batch->num_jobs];
+        while (!(batch->next_write < batch->next_submit && job->state == JOB_DONE) &&
+               !(batch->input_done && batch->next_write == batch->next_submit) &&
+               !batch->write_failed) {
+            pthread_cond_wait(&batch->cond, &batch->mutex);
+        }
+        if (batch->write_failed || batch->next_write == batch->next_submit) {
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&batch->mutex);
+
+        int rc = encode_frame(batch, job->output);
+        av_frame_free(&job->input);
+        av_frame_free(&job->output);
+
+        pthread_mutex_lock(&batch->mutex);
+        if (rc < 0) {
+            fprintf(stderr, "Failed to encode frame %lld\n", (long long)batch->next_write);
+            batch->write_failed = 1;
+        }
+        job->state = JOB_EMPTY;
+        batch->next_write++;
+        int64_t written = batch->next_write;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+
+        if (written % PROGRESS_INTERVAL == 0) {
+            double seconds = (os_gettime_ns() - batch->start_timestamp) / 1e9;
+            fprintf(stderr, "%lld frames, %.1f fps\n", (long long)written, written / seconds);
+        }
+    }
+    return NULL;
+}
+
+
+// hands a decoded frame to the workers, blocking while the ring is full
+int submit_frame(Batch * batch, AVFrame * frame)
+{
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->next_submit - batch->next_write >= batch->num_jobs && !batch->write_failed) {
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    }
+    if (batch->write_failed) {
+        pthread_mutex_unlock(&batch->mutex);
+        av_frame_free(&frame);
+        return 1;
+    }
+    BatchJob * job = &batch->jobs[batch->next_submit % batch->num_jobs];
+    job->input = frame;
+    job->output = NULL;
+    job->state = JOB_QUEUED;
+    batch->next_submit++;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+    return 0;
+}
+
+
+int decode_packet(Batch * batch, AVPacket * packet, AVFrame * frame)
+{
+    int rc = avcodec_send_packet(batch->decoder, packet);
+    if (rc < 0) {
+        return rc;
+    }
+    while ((rc = avcodec_receive_frame(batch->decoder, frame)) == 0) {
+        AVFrame * copy = av_frame_clone(frame);
+        av_frame_unref(frame);
+        if (copy == NULL || submit_frame(batch, copy)) {
+            return -1;
+        }
+    }
+    return (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) ? 0 : rc;
+}
+
+
+int start_workers(Batch * batch)
+{
+    for (int i = 0; i < batch->options.workers; i++) {
+        BatchWorker * worker = &batch->workers[i];
+        worker->batch = batch;
+        worker->scaler = ImageScaler_create();
+        worker->mask = ImgArray_create();
+        worker->alpha = bzalloc((size_t)batch->decoder->width * batch->decoder->height);
+        worker->rgba = av_frame_alloc();
+        if (!worker->scaler || !worker->mask || !worker->alpha || !worker->rgba) {
+            return 1;
+        }
+        worker->rgba->format = AV_PIX_FMT_RGBA;
+        worker->rgba->width = batch->decoder->width;
+        worker->rgba->height = batch->decoder->height;
+        if (av_frame_get_buffer(worker->rgba, 0) < 0) {
+            return 1;
+        }
+        if (pthread_create(&worker->thread_id, NULL, run_worker, worker)) {
+            worker->thread_id = 0;
+            return 1;
+        }
+    }
+    if (pthread_create(&batch->writer_id, NULL, run_writer, batch)) {
+        batch->writer_id = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+void stop_workers(Batch * batch)
+{
+    pthread_mutex_lock(&batch->mutex);
+    batch->input_done = 1;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+
+    for (int i = 0; i < batch->options.workers; i++) {
+        BatchWorker * worker = &batch->workers[i];
+        if (worker->thread_id) {
+            pthread_join(worker->thread_id, NULL);
+        }
+    }
+    if (batch->writer_id) {
+        pthread_join(batch->writer_id, NULL);
+    }
+
+    for (int i = 0; i < batch->options.workers; i++) {
+        BatchWorker * worker = &batch->workers[i];
+        ImageScaler_destroy(worker->scaler);
+        if (worker->mask) {
+            ImgArray_destroy(worker->mask);
+        }
+        bfree(worker->alpha);
+        av_frame_free(&worker->rgba);
+        sws_freeContext(worker->rgba_context);
+        sws_freeContext(worker->mask_context);
+        sws_freeContext(worker->output_context);
+    }
+    for (int i = 0; i < batch->num_jobs; i++) {
+        av_frame_free(&batch->jobs[i].input);
+        av_frame_free(&batch->jobs[i].output);
+    }
+}
+
+
+int run_batch(Batch * batch)
+{
+    int rc = 0;
+    AVPacket * packet = av_packet_alloc();
+    AVFrame * frame = av_frame_alloc();
+    if (packet == NULL || frame == NULL) {
+        rc = 1;
+        goto end;
+    }
+
+    batch->start_timestamp = os_gettime_ns();
+    if (start_workers(batch)) {
+        fprintf(stderr, "Could not start workers\n");
+        rc = 1;
+        goto end;
+    }
+
+    while (av_read_frame(batch->input_format, packet) >= 0) {
+        if (packet->stream_index == batch->input_stream) {
+            rc = decode_packet(batch, packet, frame);
+        }
+        av_packet_unref(packet);
+        if (rc) {
+            break;
+        }
+    }
+    if (rc == 0) {
+        rc = decode_packet(batch, NULL, frame);
+    }
+
+end:
+    stop_workers(batch);
+    if (rc == 0 && !batch->write_failed) {
+        encode_frame(batch, NULL);
+        av_write_trailer(batch->output_format);
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    return rc || batch->write_failed;
+}
+
+
+int main(int argc, char ** argv)
+{
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.options.codec_name = DEFAULT_CODEC;
+    batch.options.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    batch.options.segmentation_threshold = 0.6f;
+    batch.options.blur = 4;
+    batch.options.growshrink = 0;
+    batch.options.band_rows = DEFAULT_BAND_ROWS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:o:w:c:t:b:g:s:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                batch.options.input_path = optarg;
+                break;
+            case 'o':
+                batch.options.output_path = optarg;
+                break;
+            case 'w':
+                batch.options.workers = atoi(optarg);
+                break;
+            case 'c':
+                batch.options.codec_name = optarg;
+                break;
+            case 't':
+                batch.options.segmentation_threshold = (float)atof(optarg);
+                break;
+            case 'b':
+                batch.options.blur = atoi(optarg);
+                break;
+            case 'g':
+                batch.options.growshrink = atoi(optarg);
+                break;
+            case 's':
+                batch.options.band_rows = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (batch.options.input_path == NULL || batch.options.output_path == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (batch.options.workers < 1) {
+        batch.options.workers = 1;
+    }
+    if (batch.options.workers > MAX_BATCH_WORKERS) {
+        batch.options.workers = MAX_BATCH_WORKERS;
+    }
+
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+    batch.num_jobs = batch.options.workers * 2;
+    batch.jobs = bzalloc(sizeof(BatchJob) * batch.num_jobs);
+    batch.pool = SegmentationPool_create();
+
+    int rc = 1;
+    if (batch.jobs && batch.pool && open_input(&batch) == 0 && open_output(&batch) == 0) {
+        SegmentationPool_set_parameters(batch.pool, batch.options.segmentation_threshold,
+                                        batch.options.blur, batch.options.growshrink);
+        rc = run_batch(&batch);
+    }
+
+    double seconds = (os_gettime_ns() - batch.start_timestamp) / 1e9;
+    if (batch.start_timestamp != 0 && seconds > 0) {
+        fprintf(stderr, "%lld frames in %.2fs: %.2f fps with %d workers and %d servers (%lld without a mask)\n",
+                (long long)batch.next_write, seconds, batch.next_write / seconds, batch.options.workers,
+                SegmentationPool_get_num_endpoints(batch.pool), (long long)batch.failed_frames);
+    }
+
+    if (batch.output_format) {
+        if (!(batch.output_format->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&batch.output_format->pb);
+        }
+        avformat_free_context(batch.output_format);
+    }
+    avcodec_free_context(&batch.encoder);
+    avcodec_free_context(&batch.decoder);
+    avformat_close_input(&batch.input_format);
+    SegmentationPool_destroy(batch.pool);
+    bfree(batch.jobs);
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.mutex);
+    return rc;
+}
@@ -0,0 +1,246 @@
+// Batching benchmark: several sources send frames to the mock server, each
+// with its own requests or through the shared batcher, and report the
+// throughput they get and the latency batching adds for a range of windows
+// and batch sizes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "compat.h"
+#include "bench_common.h"
+#include "imgarray.h"
+#include "segmentation_batcher.h"
+#include "segmentation_client.h"
+
+#define MAX_BENCH_SOURCES              16
+#define MAX_LATENCY_SAMPLES            8192
+
+
+typedef struct {
+    // 0 sends every frame on its own connection
+    int batched;
+    uint64_t window_ns;
+    int max_batch;
+} BenchMode;
+
+
+typedef struct {
+    const BenchOptions * options;
+    const BenchMode * mode;
+    const char * socket_path;
+    SegmentationBatcher * batcher;
+    uint64_t deadline;
+
+    uint64_t frames;
+    uint64_t failures;
+    uint64_t latencies[MAX_LATENCY_SAMPLES];
+    int num_latencies;
+} BenchSource;
+
+
+// utility methods
+void usage(const char * name);
+void * run_source(void * data);
+void run_mode(const BenchOptions * options, const BenchMode * mode, const char * socket_path);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [-s sources] [-d seconds] [-r fps] [-w width] [-h height] [-b base_ms] [-f per_frame_ms] "
+            "[-m server_max_batch] [-S server_socket]\n",
+            name);
+}
+
+
+void * run_source(void * data)
+{
+    BenchSource * source = (BenchSource *)data;
+    const BenchOptions * options = source->options;
+    size_t frame_size = (size_t)options->width * options->height * 3;
+    uint8_t * frame = (uint8_t *)bzalloc(frame_size);
+    ImgArray * mask = ImgArray_create();
+    SegmentationClient * client = NULL;
+    if (!source->mode->batched) {
+        client = SegmentationClient_create();
+        SegmentationClient_set_socket_path(client, source->socket_path);
+        SegmentationClient_set_dimensions(client, options->height, options->width);
+    }
+    MaskCacheKey key;
+    memset(&key, 0, sizeof(key));
+    key.height = options->height;
+    key.width = options->width;
+    key.segmentation_threshold = 0.5f;
+    key.pixel_format = PIXEL_FORMAT_BGR24;
+
+    uint64_t period = (uint64_t)(1000000000.0 / options->fps);
+    uint64_t next_frame = os_gettime_ns();
+    while (frame != NULL && mask != NULL && next_frame < source->deadline) {
+        uint64_t start = os_gettime_ns();
+        int rc;
+        if (client) {
+            rc = SegmentationClient_run_segmentation(client, start, frame, frame_size);
+        } else {
+            rc = SegmentationBatcher_segment(source->batcher, &key, frame, frame_size, mask, 0,
+                                             source->mode->window_ns, source->mode->max_batch);
+        }
+        uint64_t end = os_gettime_ns();
+        if (rc) {
+            source->failures++;
+        } else {
+            source->frames++;
+            if (source->num_latencies < MAX_LATENCY_SAMPLES) {
+                source->latencies[source->num_latencies++] = end - start;
+            }
+        }
+        // a source that falls behind drops the frames it missed, like a camera would
+        next_frame += period;
+        while (next_frame < end) {
+            next_frame += period;
+        }
+        Bench_sleep_until(next_frame);
+    }
+
+    if (client) {
+        SegmentationClient_destroy(client);
+    }
+    ImgArray_destroy(mask);
+    bfree(frame);
+    return NULL;
+}
+
+
+void run_mode(const BenchOptions * options, const BenchMode * mode, const char * socket_path)
+{
+    static BenchSource sources[MAX_BENCH_SOURCES];
+    static uint64_t latencies[MAX_BENCH_SOURCES * MAX_LATENCY_SAMPLES];
+    pthread_t threads[MAX_BENCH_SOURCES];
+
+    MockServer * server;
+    if (Bench_start_server(options, socket_path, &server)) {
+        return;
+    }
+    SegmentationBatcher * batcher = NULL;
+    if (mode->batched) {
+        batcher = SegmentationBatcher_create();
+        SegmentationPool_set_server_socket(SegmentationBatcher_get_pool(batcher), socket_path);
+    }
+
+    uint64_t start = os_gettime_ns();
+    uint64_t deadline = start + (uint64_t)(options->seconds * 1000000000.0);
+    for (int i = 0; i < options->sources; i++) {
+        memset(&sources[i], 0, sizeof(BenchSource));
+        sources[i].options = options;
+        sources[i].mode = mode;
+        sources[i].socket_path = socket_path;
+        sources[i].batcher = batcher;
+        sources[i].deadline = deadline;
+        pthread_create(&threads[i], NULL, run_source, &sources[i]);
+    }
+    uint64_t frames = 0;
+    uint64_t failures = 0;
+    int num_latencies = 0;
+    for (int i = 0; i < options->sources; i++) {
+        pthread_join(threads[i], NULL);
+        frames += sources[i].frames;
+        failures += sources[i].failures;
+        memcpy(latencies + num_latencies, sources[i].latencies, sources[i].num_latencies * sizeof(uint64_t));
+        num_latencies += sources[i].num_latencies;
+    }
+    double elapsed = (double)(os_gettime_ns() - start) / 1000000000.0;
+
+    double frames_per_batch = 1.0;
+    if (batcher) {
+        BatcherStats stats;
+        SegmentationBatcher_get_stats(batcher, &stats);
+        frames_per_batch = stats.batches ? (double)stats.frames / (double)stats.batches : 0.0;
+        SegmentationBatcher_destroy(batcher);
+    }
+    char busy[16];
+    snprintf(busy, sizeof(busy), "-");
+    if (server) {
+        MockServerStats server_stats;
+        MockServer_get_stats(server, &server_stats);
+        MockServer_destroy(server);
+        snprintf(busy, sizeof(busy), "%.0f%%", 100.0 * (double)server_stats.busy_ns / (elapsed * 1000000000.0));
+    }
+
+    BenchSummary summary;
+    Bench_summarize(latencies, num_latencies, &summary);
+    char label[32];
+    if (mode->batched) {
+        snprintf(label, sizeof(label), "batched %2.0f ms x%d", (double)mode->window_ns / 1000000.0, mode->max_batch);
+    } else {
+        snprintf(label, sizeof(label), "single requests");
+    }
+    printf("%-20s %10.1f %10.1f %10.1f %12.2f %11s %8llu\n",
+           label, frames / elapsed, summary.mean_ns / 1000000.0, summary.p95_ns / 1000000.0, frames_per_batch, busy, (unsigned long long)failures);
+}
+
+
+int main(int argc, char ** argv)
+{
+    BenchOptions options;
+    Bench_init_options(&options);
+    options.sources = 4;
+    options.width = 480;
+    options.height = 360;
+    // a fixed cost per call that dominates the per-frame one, as on a GPU
+    options.server.base_ns = 20000000ULL;
+    options.server.per_frame_ns = 4000000ULL;
+    options.server.max_batch = 8;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:r:w:h:b:f:m:S:")) != -1) {
+        if (Bench_parse_option(&options, opt, optarg)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.sources < 1 || options.sources > MAX_BENCH_SOURCES || options.seconds <= 0 || options.fps <= 0 ||
+            options.width <= 0 || options.height <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // a server going away mid-write must not take the benchmark with it
+    signal(SIGPIPE, SIG_IGN);
+
+    char socket_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    Bench_socket_path(socket_path, sizeof(socket_path), "bench");
+    if (options.server_socket) {
+        snprintf(socket_path, sizeof(socket_path), "%s", options.server_socket);
+        printf("%d sources of %dx%d at %.0f fps, server on %s\n\n",
+               options.sources, options.width, options.height, options.fps, socket_path);
+    } else {
+        printf("%d sources of %dx%d at %.0f fps, model %.1f ms + %.1f ms per frame, server batches up to %d\n\n",
+               options.sources, options.width, options.height, options.fps, options.server.base_ns / 1000000.0,
+               options.server.per_frame_ns / 1000000.0, options.server.max_batch);
+    }
+    printf("%-20s %10s %10s %10s %12s %11s %8s\n",
+           "mode", "frames/s", "mean ms", "p95 ms", "frames/batch", "server busy", "failed");
+
+    BenchMode single = {0, 0, 1};
+    run_mode(&options, &single, socket_path);
+    const uint64_t windows[] = {0, 2000000ULL, 4000000ULL, 8000000ULL};
+    const int batch_sizes[] = {2, 4, 8};
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+            BenchMode mode = {1, windows[w], batch_sizes[b]};
+            run_mode(&options, &mode, socket_path);
+        }
+    }
+
+    // filters asking for larger batches than the server takes, which the batcher has to cap
+    BenchOptions small_server = options;
+    small_server.server.max_batch = options.sources > 2 ? options.sources / 2 : 1;
+    if (!options.server_socket) {
+        printf("\nserver batches up to %d\n", small_server.server.max_batch);
+    }
+    BenchMode oversized = {1, 8000000ULL, MAX_SEGMENTATION_BATCH};
+    run_mode(&small_server, &oversized, socket_path);
+    return 0;
+}
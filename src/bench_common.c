@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "bench_common.h"
+
+
+void Bench_init_options(BenchOptions * options)
+{
+    options->sources = 1;
+    options->seconds = 3.0;
+    options->fps = 30.0;
+    options->height = 240;
+    options->width = 320;
+    options->server.base_ns = 10000000ULL;
+    options->server.per_frame_ns = 0;
+    options->server.per_mpixel_ns = 0;
+    options->server.max_batch = 1;
+    options->server.version = 0;
+    options->server_socket = NULL;
+}
+
+
+int Bench_parse_option(BenchOptions * options, int opt, const char * arg)
+{
+    switch (opt) {
+        case 's':
+            options->sources = atoi(arg);
+            return 0;
+        case 'd':
+            options->seconds = atof(arg);
+            return 0;
+        case 'r':
+            options->fps = atof(arg);
+            return 0;
+        case 'w':
+            options->width = atoi(arg);
+            return 0;
+        case 'h':
+            options->height = atoi(arg);
+            return 0;
+        case 'b':
+            options->server.base_ns = (uint64_t)(atof(arg) * 1000000.0);
+            return 0;
+        case 'f':
+            options->server.per_frame_ns = (uint64_t)(atof(arg) * 1000000.0);
+            return 0;
+        case 'p':
+            options->server.per_mpixel_ns = (uint64_t)(atof(arg) * 1000000.0);
+            return 0;
+        case 'm':
+            options->server.max_batch = atoi(arg);
+            return 0;
+        case 'S':
+            options->server_socket = arg;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+
+void Bench_socket_path(char * path, size_t size, const char * name)
+{
+    const char * tmpdir = getenv("TMPDIR");
+    snprintf(path, size, "%s/virtual-background-%s-%d.sock", tmpdir ? tmpdir : "/tmp", name, (int)getpid());
+}
+
+
+int Bench_start_server(const BenchOptions * options, const char * socket_path, MockServer ** server)
+{
+    *server = NULL;
+    if (options->server_socket != NULL) {
+        return 0;
+    }
+    *server = MockServer_create(socket_path, &(options->server));
+    return *server == NULL;
+}
+
+
+SegmentationThread * Bench_create_thread(const char * socket_path, int height, int width)
+{
+    SegmentationThread * thread = SegmentationThread_create();
+    if (thread == NULL) {
+        return NULL;
+    }
+    SegmentationThread_set_server_socket(thread, socket_path);
+    SegmentationThread_set_dimensions(thread, height, width);
+    SegmentationThread_set_format(thread, width * 3, PIXEL_FORMAT_BGR24);
+    return thread;
+}
+
+
+int Bench_feed_thread(SegmentationThread * thread, int height, int width, double fps, uint64_t deadline,
+                      BenchFrameCallback callback, void * opaque)
+{
+    size_t frame_size = (size_t)width * height * 3;
+    uint8_t * pixels = (uint8_t *)bzalloc(frame_size);
+    if (pixels == NULL) {
+        return 1;
+    }
+
+    uint64_t period = (uint64_t)(1000000000.0 / fps);
+    uint64_t next_frame = os_gettime_ns();
+    uint64_t last_mask = 0;
+    while (next_frame < deadline) {
+        BenchFrame frame;
+        frame.timestamp = os_gettime_ns();
+        // a new picture every frame, so the mask cache can't answer for the server
+        memset(pixels, (int)(frame.timestamp / period) & 0xff, frame_size);
+        SegmentationThread_update_buffer(thread, frame.timestamp, pixels, (int)frame_size);
+        frame.handoff_ns = os_gettime_ns() - frame.timestamp;
+        frame.mask_timestamp = SegmentationThread_get_mask_timestamp(thread);
+        frame.new_mask = frame.mask_timestamp != 0 && frame.mask_timestamp != last_mask;
+        last_mask = frame.mask_timestamp;
+        callback(opaque, &frame);
+
+        next_frame += period;
+        Bench_sleep_until(next_frame);
+    }
+    bfree(pixels);
+    return 0;
+}
+
+
+void Bench_sleep_until(uint64_t timestamp)
+{
+    uint64_t now = os_gettime_ns();
+    if (timestamp <= now) {
+        return;
+    }
+    uint64_t wait = timestamp - now;
+    nanosleep((const struct timespec[]){{(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)}}, NULL);
+}
+
+
+int Bench_compare_samples(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+void Bench_summarize(uint64_t * samples, int count, BenchSummary * summary)
+{
+    memset(summary, 0, sizeof(BenchSummary));
+    if (count == 0) {
+        return;
+    }
+    qsort(samples, count, sizeof(uint64_t), Bench_compare_samples);
+    for (int i = 0; i < count; i++) {
+        summary->mean_ns += (double)samples[i];
+    }
+    summary->mean_ns /= count;
+    summary->p95_ns = samples[count * 95 / 100];
+    summary->p99_ns = samples[count * 99 / 100];
+    summary->max_ns = samples[count - 1];
+}
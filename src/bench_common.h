@@ -0,0 +1,74 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_BENCH_COMMON_H
+#define OBS_VIRTUAL_BACKGROUND_BENCH_COMMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mock_server.h"
+#include "segmentation_thread.h"
+
+
+// What the benchmarks run against the mock server have in common. Each one
+// reads only the fields its flags can set.
+typedef struct {
+    int sources;
+    double seconds;
+    double fps;
+    int height;
+    int width;
+    MockServerOptions server;
+    // a server already listening there instead of the mock, NULL for the mock
+    const char * server_socket;
+} BenchOptions;
+
+
+typedef struct {
+    double mean_ns;
+    uint64_t p95_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} BenchSummary;
+
+
+// one frame handed to a segmentation thread by Bench_feed_thread
+typedef struct {
+    // the frame's timestamp, taken from the monotonic clock as it was handed over
+    uint64_t timestamp;
+    // how long SegmentationThread_update_buffer took
+    uint64_t handoff_ns;
+    // of the newest mask, 0 until the first, and whether it arrived since the last frame
+    uint64_t mask_timestamp;
+    int new_mask;
+} BenchFrame;
+
+typedef void (*BenchFrameCallback)(void * opaque, const BenchFrame * frame);
+
+
+// one source of 320x240 at 30 fps for 3 s, against a 10 ms model taking one frame at a time
+void Bench_init_options(BenchOptions * options);
+// Reads the value of one of the shared flags: -s sources, -d seconds, -r fps,
+// -w width, -h height, -b base_ms, -f per_frame_ms, -p ms_per_megapixel,
+// -m server_max_batch and -S server_socket. Returns non-zero for any other flag.
+int Bench_parse_option(BenchOptions * options, int opt, const char * arg);
+// $TMPDIR/virtual-background-<name>-<pid>.sock
+void Bench_socket_path(char * path, size_t size, const char * name);
+
+// Starts the mock server on socket_path unless options name a server of
+// their own, in which case *server is NULL. Returns non-zero on failure.
+int Bench_start_server(const BenchOptions * options, const char * socket_path, MockServer ** server);
+// a segmentation thread sending BGR frames of height x width to socket_path
+SegmentationThread * Bench_create_thread(const char * socket_path, int height, int width);
+// Hands thread frames of height x width at fps until deadline, paced like a
+// camera, and calls callback after each. Returns non-zero if there was no
+// memory for the frame.
+int Bench_feed_thread(SegmentationThread * thread, int height, int width, double fps, uint64_t deadline,
+                      BenchFrameCallback callback, void * opaque);
+
+// sleeps until the monotonic clock reaches timestamp, returns at once if it has
+void Bench_sleep_until(uint64_t timestamp);
+int Bench_compare_samples(const void * a, const void * b);
+// sorts samples in place, all zero for no samples
+void Bench_summarize(uint64_t * samples, int count, BenchSummary * summary);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_BENCH_COMMON_H
@@ -0,0 +1,135 @@
+// Delay queue benchmark: feeds a source through the queue the way
+// filter_video does with masks aligned, with masks that trail the frames by
+// a few frames and stop for a while in the middle. Reports how deep the
+// queue is before, during and after the stall and how many frames it let go
+// of to catch up. Fails if the depth does not recover after the stall.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include <obs-module.h>
+
+#include "delay_queue.h"
+
+
+// utility methods
+void usage(const char * name);
+uint64_t mask_timestamp_at(struct obs_source_frame * frames, int frame, int lag, int stall_start, int stall_frames);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-r fps] [-n frames] [-l lag] [-s stall_frames] [-b budget_ms]\n", name);
+}
+
+
+// the newest mask when frame arrives: lag frames behind, and stuck at the
+// last mask before the stall until it is over
+uint64_t mask_timestamp_at(struct obs_source_frame * frames, int frame, int lag, int stall_start, int stall_frames)
+{
+    int segmented = frame - lag;
+    if (frame >= stall_start && frame < stall_start + stall_frames) {
+        segmented = stall_start - lag;
+    }
+    return segmented >= 0 ? frames[segmented].timestamp : 0;
+}
+
+
+int main(int argc, char ** argv)
+{
+    int fps = 30;
+    int frame_count = 300;
+    int lag = 2;
+    int stall_frames = 10;
+    int budget_ms = 500;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:l:s:b:")) != -1) {
+        switch (opt) {
+            case 'r':
+                fps = atoi(optarg);
+                break;
+            case 'n':
+                frame_count = atoi(optarg);
+                break;
+            case 'l':
+                lag = atoi(optarg);
+                break;
+            case 's':
+                stall_frames = atoi(optarg);
+                break;
+            case 'b':
+                budget_ms = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    int stall_start = frame_count / 4;
+    if (fps <= 0 || lag < 0 || stall_frames < 0 || budget_ms <= 0 ||
+            frame_count < 2 * (stall_start + stall_frames)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct obs_source_frame * frames = (struct obs_source_frame *)bzalloc(
+            (size_t)frame_count * sizeof(struct obs_source_frame));
+    DelayQueue * queue = DelayQueue_create();
+    if (!frames || !queue) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    uint64_t frame_interval_ns = 1000000000ULL / fps;
+    uint64_t budget_ns = (uint64_t)budget_ms * 1000000ULL;
+    int before_stall = 0;
+    int peak = 0;
+    int after_stall = 0;
+    for (int i = 0; i < frame_count; i++) {
+        frames[i].timestamp = (uint64_t)(i + 1) * frame_interval_ns;
+        if (DelayQueue_push(queue, &frames[i])) {
+            DelayQueue_record_release(queue, DELAY_RELEASE_LATE);
+            continue;
+        }
+
+        uint64_t mask_timestamp = mask_timestamp_at(frames, i, lag, stall_start, stall_frames);
+        while (DelayQueue_pop_stale(queue, mask_timestamp) != NULL) {
+            DelayQueue_record_release(queue, DELAY_RELEASE_SKIPPED);
+        }
+        int expired;
+        struct obs_source_frame * ready = DelayQueue_pop_ready(queue, mask_timestamp, budget_ns, &expired);
+        if (ready != NULL) {
+            int on_time = ready->timestamp <= mask_timestamp;
+            DelayQueue_record_release(queue, on_time ? DELAY_RELEASE_ON_TIME :
+                                             (expired ? DELAY_RELEASE_LATE : DELAY_RELEASE_NO_MASK));
+        }
+
+        int depth = DelayQueue_get_count(queue);
+        if (i == stall_start - 1) {
+            before_stall = depth;
+        }
+        if (depth > peak) {
+            peak = depth;
+        }
+        after_stall = depth;
+    }
+
+    printf("%d frames at %d fps, masks %d frames behind, stalled for %d frames\n",
+           frame_count, fps, lag, stall_frames);
+    printf("depth: %d before the stall, %d at most, %d at the end\n", before_stall, peak, after_stall);
+    printf("released: %llu on time, %llu without mask, %llu late, %llu skipped to catch up\n",
+           (unsigned long long)queue->released_on_time,
+           (unsigned long long)queue->released_no_mask,
+           (unsigned long long)queue->released_late,
+           (unsigned long long)queue->released_skipped);
+
+    int recovered = after_stall <= before_stall;
+    if (!recovered) {
+        printf("the queue stayed %d frames deeper after the stall\n", after_stall - before_stall);
+    }
+    DelayQueue_destroy(queue);
+    bfree(frames);
+    return recovered ? 0 : 1;
+}
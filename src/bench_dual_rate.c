@@ -0,0 +1,200 @@
+// Dual-rate benchmark: sources feed frames to segmentation threads talking
+// to the mock server, once with every frame at full resolution and then
+// with low-resolution passes fused with periodic full-resolution ones, and
+// report how much of the server each takes and how fresh the masks are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "compat.h"
+#include "bench_common.h"
+
+#define MAX_BENCH_SOURCES              8
+#define MAX_AGE_SAMPLES                8192
+
+
+typedef struct {
+    // 1 sends every frame at full resolution
+    int divisor;
+    // passes per second, 0 for every frame
+    double coarse_rate;
+    double fine_rate;
+} BenchMode;
+
+
+typedef struct {
+    const BenchOptions * options;
+    const BenchMode * mode;
+    const char * socket_path;
+    uint64_t deadline;
+
+    uint64_t masks;
+    DualRateStats stats;
+    uint64_t ages[MAX_AGE_SAMPLES];
+    int num_ages;
+} BenchSource;
+
+
+// utility methods
+void usage(const char * name);
+uint64_t rate_interval(double rate);
+void record_frame(void * opaque, const BenchFrame * frame);
+void * run_source(void * data);
+void run_mode(const BenchOptions * options, const BenchMode * mode, const char * socket_path);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [-s sources] [-d seconds] [-r fps] [-w width] [-h height] [-b base_ms] [-p ms_per_megapixel]\n",
+            name);
+}
+
+
+uint64_t rate_interval(double rate)
+{
+    return rate > 0 ? (uint64_t)(1000000000.0 / rate) : 0;
+}
+
+
+// frames are stamped with the monotonic clock, so a mask's age is now minus its timestamp
+void record_frame(void * opaque, const BenchFrame * frame)
+{
+    BenchSource * source = (BenchSource *)opaque;
+    if (frame->mask_timestamp == 0) {
+        return;
+    }
+    if (source->num_ages < MAX_AGE_SAMPLES) {
+        source->ages[source->num_ages++] = frame->timestamp - frame->mask_timestamp;
+    }
+    if (frame->new_mask) {
+        source->masks++;
+    }
+}
+
+
+void * run_source(void * data)
+{
+    BenchSource * source = (BenchSource *)data;
+    const BenchOptions * options = source->options;
+    SegmentationThread * thread = Bench_create_thread(source->socket_path, options->height, options->width);
+    if (thread == NULL) {
+        return NULL;
+    }
+    SegmentationThread_set_dual_rate(thread, source->mode->divisor, rate_interval(source->mode->coarse_rate),
+                                     rate_interval(source->mode->fine_rate));
+    Bench_feed_thread(thread, options->height, options->width, options->fps, source->deadline,
+                      record_frame, source);
+    SegmentationThread_get_dual_rate_stats(thread, &(source->stats));
+    SegmentationThread_destroy(thread);
+    return NULL;
+}
+
+
+void run_mode(const BenchOptions * options, const BenchMode * mode, const char * socket_path)
+{
+    static BenchSource sources[MAX_BENCH_SOURCES];
+    static uint64_t ages[MAX_BENCH_SOURCES * MAX_AGE_SAMPLES];
+    pthread_t threads[MAX_BENCH_SOURCES];
+
+    MockServer * server;
+    if (Bench_start_server(options, socket_path, &server)) {
+        return;
+    }
+
+    uint64_t start = os_gettime_ns();
+    uint64_t deadline = start + (uint64_t)(options->seconds * 1000000000.0);
+    for (int i = 0; i < options->sources; i++) {
+        memset(&sources[i], 0, sizeof(BenchSource));
+        sources[i].options = options;
+        sources[i].mode = mode;
+        sources[i].socket_path = socket_path;
+        sources[i].deadline = deadline;
+        pthread_create(&threads[i], NULL, run_source, &sources[i]);
+    }
+    uint64_t masks = 0;
+    DualRateStats stats;
+    memset(&stats, 0, sizeof(stats));
+    int num_ages = 0;
+    for (int i = 0; i < options->sources; i++) {
+        pthread_join(threads[i], NULL);
+        masks += sources[i].masks;
+        stats.coarse.masks += sources[i].stats.coarse.masks;
+        stats.fine.masks += sources[i].stats.fine.masks;
+        stats.fused += sources[i].stats.fused;
+        memcpy(ages + num_ages, sources[i].ages, sources[i].num_ages * sizeof(uint64_t));
+        num_ages += sources[i].num_ages;
+    }
+    double elapsed = (double)(os_gettime_ns() - start) / 1000000000.0;
+
+    MockServerStats server_stats;
+    MockServer_get_stats(server, &server_stats);
+    MockServer_destroy(server);
+
+    BenchSummary summary;
+    Bench_summarize(ages, num_ages, &summary);
+    char label[32];
+    if (mode->divisor > 1) {
+        snprintf(label, sizeof(label), "1/%d @%.0f + full @%.0f", mode->divisor, mode->coarse_rate, mode->fine_rate);
+    } else {
+        snprintf(label, sizeof(label), "full every frame");
+    }
+    printf("%-22s %9.1f %9.1f %9.1f %9.1f %9.1f %8.0f%% %10.0f%% %8.2f\n",
+           label, masks / elapsed, summary.mean_ns / 1000000.0, summary.p95_ns / 1000000.0,
+           stats.coarse.masks / elapsed, stats.fine.masks / elapsed,
+           stats.coarse.masks ? 100.0 * (double)stats.fused / (double)stats.coarse.masks : 0.0,
+           100.0 * (double)server_stats.busy_ns / (elapsed * 1000000000.0),
+           (double)server_stats.pixels / elapsed / 1000000.0);
+}
+
+
+int main(int argc, char ** argv)
+{
+    BenchOptions options;
+    Bench_init_options(&options);
+    options.width = 640;
+    options.height = 480;
+    // inference cost that grows with the pixels in the frame, as with body-pix
+    options.server.base_ns = 5000000ULL;
+    options.server.per_mpixel_ns = 100000000ULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:r:w:h:b:p:")) != -1) {
+        if (Bench_parse_option(&options, opt, optarg)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.sources < 1 || options.sources > MAX_BENCH_SOURCES || options.seconds <= 0 || options.fps <= 0 ||
+            options.width <= 0 || options.height <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char socket_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    Bench_socket_path(socket_path, sizeof(socket_path), "bench");
+
+    printf("%d sources of %dx%d at %.0f fps, model %.1f ms + %.1f ms per megapixel\n\n",
+           options.sources, options.width, options.height, options.fps,
+           options.server.base_ns / 1000000.0, options.server.per_mpixel_ns / 1000000.0);
+    printf("%-22s %9s %9s %9s %9s %9s %9s %11s %8s\n",
+           "mode", "masks/s", "age ms", "p95 ms", "coarse/s", "full/s", "fused", "server busy", "Mpx/s");
+
+    BenchMode single = {1, 0, 0};
+    run_mode(&options, &single, socket_path);
+    const BenchMode modes[] = {
+            {2, 0, 5},
+            {2, 0, 2},
+            {2, 15, 5},
+            {4, 0, 5},
+    };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        run_mode(&options, &modes[i], socket_path);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Fault recovery benchmark: a segmentation thread talks to the mock server
+// through the fault proxy, which runs clean, then injects one fault for a
+// while, then runs clean again. Reports how long a worker was stuck on one
+// request, how long the displayed mask stayed frozen and how long after the
+// fault ended the first mask of a fresh frame arrived.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "compat.h"
+#include "bench_common.h"
+#include "fault_proxy.h"
+
+#define MAX_MASK_SAMPLES               4096
+
+
+typedef struct {
+    double healthy_seconds;
+    double fault_seconds;
+    double tail_seconds;
+} BenchPhases;
+
+
+typedef struct {
+    const char * name;
+    FaultOptions fault;
+} BenchScenario;
+
+
+typedef struct {
+    // when a new mask was first seen, and the timestamp of the frame it came from
+    uint64_t seen[MAX_MASK_SAMPLES];
+    uint64_t frames[MAX_MASK_SAMPLES];
+    int num_masks;
+
+    // turns the scenario's fault on at fault_start and off again at fault_end
+    FaultProxy * proxy;
+    const FaultOptions * fault;
+    const FaultOptions * clean;
+    uint64_t fault_start;
+    uint64_t fault_end;
+    int phase;
+} BenchTimeline;
+
+
+// utility methods
+void usage(const char * name);
+void record_frame(void * opaque, const BenchFrame * frame);
+void run_scenario(const BenchOptions * options, const BenchPhases * phases, const BenchScenario * scenario,
+                  const char * server_path, const char * proxy_path);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-r fps] [-w width] [-h height] [-f fault_seconds] [-b base_ms]\n", name);
+}
+
+
+// frames are stamped with the monotonic clock, so they line up with the proxy's fault times
+void record_frame(void * opaque, const BenchFrame * frame)
+{
+    BenchTimeline * timeline = (BenchTimeline *)opaque;
+    if (timeline->phase == 0 && frame->timestamp >= timeline->fault_start) {
+        FaultProxy_set_options(timeline->proxy, timeline->fault);
+        timeline->phase = 1;
+    } else if (timeline->phase == 1 && frame->timestamp >= timeline->fault_end) {
+        FaultProxy_set_options(timeline->proxy, timeline->clean);
+        timeline->phase = 2;
+    }
+    if (frame->new_mask && timeline->num_masks < MAX_MASK_SAMPLES) {
+        timeline->seen[timeline->num_masks] = frame->timestamp;
+        timeline->frames[timeline->num_masks] = frame->mask_timestamp;
+        timeline->num_masks++;
+    }
+}
+
+
+void run_scenario(const BenchOptions * options, const BenchPhases * phases, const BenchScenario * scenario,
+                  const char * server_path, const char * proxy_path)
+{
+    static BenchTimeline timeline;
+    memset(&timeline, 0, sizeof(timeline));
+    FaultOptions clean;
+    memset(&clean, 0, sizeof(clean));
+
+    MockServer * server = NULL;
+    FaultProxy * proxy = NULL;
+    SegmentationThread * thread = NULL;
+    if (Bench_start_server(options, server_path, &server) == 0) {
+        proxy = FaultProxy_create(proxy_path, server_path, &clean);
+    }
+    if (proxy != NULL) {
+        thread = Bench_create_thread(proxy_path, options->height, options->width);
+    }
+    if (thread == NULL) {
+        goto end;
+    }
+
+    uint64_t start = os_gettime_ns();
+    timeline.proxy = proxy;
+    timeline.fault = &(scenario->fault);
+    timeline.clean = &clean;
+    timeline.fault_start = start + (uint64_t)(phases->healthy_seconds * 1000000000.0);
+    timeline.fault_end = timeline.fault_start + (uint64_t)(phases->fault_seconds * 1000000000.0);
+    uint64_t deadline = timeline.fault_end + (uint64_t)(phases->tail_seconds * 1000000000.0);
+    if (Bench_feed_thread(thread, options->height, options->width, options->fps, deadline,
+                          record_frame, &timeline)) {
+        goto end;
+    }
+
+    uint64_t longest_request = SegmentationPool_get_longest_request(thread->pool);
+    FaultProxyStats stats;
+    FaultProxy_get_stats(proxy, &stats);
+    // faults that never fired, such as a stall the traffic never reached, end with the fault window
+    uint64_t recovery_start = stats.last_fault_end != 0 ? stats.last_fault_end : timeline.fault_end;
+
+    uint64_t freeze = 0;
+    int fault_masks = 0;
+    int64_t recovery = -1;
+    for (int i = 0; i < timeline.num_masks; i++) {
+        if (i > 0 && timeline.seen[i] - timeline.seen[i - 1] > freeze) {
+            freeze = timeline.seen[i] - timeline.seen[i - 1];
+        }
+        if (timeline.seen[i] >= timeline.fault_start && timeline.seen[i] < timeline.fault_end) {
+            fault_masks++;
+        }
+        if (recovery < 0 && timeline.frames[i] >= recovery_start) {
+            recovery = (int64_t)(timeline.seen[i] - recovery_start);
+        }
+    }
+    printf("%-24s %9.1f %10.0f %10.0f ", scenario->name,
+           fault_masks / phases->fault_seconds, longest_request / 1000000.0, freeze / 1000000.0);
+    if (recovery >= 0) {
+        printf("%11.0f", recovery / 1000000.0);
+    } else {
+        printf("%11s", "never");
+    }
+    printf(" %11llu\n", (unsigned long long)(stats.connections > 0 ? stats.connections - 1 : 0));
+
+    end:
+    SegmentationThread_destroy(thread);
+    FaultProxy_destroy(proxy);
+    MockServer_destroy(server);
+}
+
+
+int main(int argc, char ** argv)
+{
+    BenchOptions options;
+    Bench_init_options(&options);
+    BenchPhases phases;
+    phases.healthy_seconds = 1.0;
+    phases.fault_seconds = 2.0;
+    phases.tail_seconds = 3.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:h:f:b:")) != -1) {
+        // -f is how long the fault lasts here, there is no per-frame cost to set
+        if (opt == 'f') {
+            phases.fault_seconds = atof(optarg);
+        } else if (Bench_parse_option(&options, opt, optarg)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.fps <= 0 || options.width <= 0 || options.height <= 0 || phases.fault_seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char server_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    char proxy_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    Bench_socket_path(server_path, sizeof(server_path), "bench");
+    Bench_socket_path(proxy_path, sizeof(proxy_path), "bench-proxy");
+
+    // responses are a 12 byte header, the 4 byte length and then the mask
+    uint64_t mid_mask = 16 + (uint64_t)options.width * options.height / 2;
+    uint64_t mid_frame = (uint64_t)options.width * options.height * 3 / 2;
+    BenchScenario scenarios[] = {
+            {"stall mid-mask 1.5 s", {FAULT_TO_CLIENT, 0, 0, 0, mid_mask, 1500000000ULL, 0}},
+            {"stall mid-mask 0.5 s", {FAULT_TO_CLIENT, 0, 0, 0, mid_mask, 500000000ULL, 0}},
+            {"reset mid-mask", {FAULT_TO_CLIENT, 0, 0, 0, 0, 0, mid_mask}},
+            {"reset mid-frame", {FAULT_TO_SERVER, 0, 0, 0, 0, 0, mid_frame}},
+            {"short reads and writes", {FAULT_TO_CLIENT | FAULT_TO_SERVER, 0, 7, 0, 0, 0, 0}},
+            {"partial frame writes", {FAULT_TO_SERVER, 1000000ULL, 4096, 0, 0, 0, 0}},
+            {"dribbled masks", {FAULT_TO_CLIENT, 5000000ULL, 256, 0, 0, 0, 0}},
+            {"256 KB/s to the plugin", {FAULT_TO_CLIENT, 0, 0, 256 * 1024, 0, 0, 0}},
+            {"50 ms each way", {FAULT_TO_CLIENT | FAULT_TO_SERVER, 50000000ULL, 0, 0, 0, 0, 0}},
+    };
+
+    printf("%dx%d at %.0f fps, model %.1f ms, %.1f s clean then %.1f s of fault then %.1f s clean\n\n",
+           options.width, options.height, options.fps, options.server.base_ns / 1000000.0,
+           phases.healthy_seconds, phases.fault_seconds, phases.tail_seconds);
+    printf("%-24s %9s %10s %10s %11s %11s\n",
+           "fault", "masks/s", "stall ms", "freeze ms", "recover ms", "reconnects");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run_scenario(&options, &phases, &scenarios[i], server_path, proxy_path);
+    }
+    return 0;
+}
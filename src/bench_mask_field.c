@@ -0,0 +1,253 @@
+// Distance field benchmark: grows or shrinks and feathers a synthetic
+// person mask the way the server does, with a square dilation or erosion
+// and a Gaussian blur, and with a distance field that is built once per
+// mask and then thresholded with a ramp per setting. Reports the time per
+// mask of each and how far apart the results are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "compat.h"
+#include "mask_field.h"
+
+
+typedef struct {
+    int growshrink;
+    int blur;
+} BenchSetting;
+
+
+// utility methods
+void usage(const char * name);
+void draw_person(uint8_t * mask, int height, int width);
+void morph_rows(const uint8_t * src, uint8_t * dst, int height, int width, int before, int after, int grow);
+void morph_columns(const uint8_t * src, uint8_t * dst, int height, int width, int before, int after, int grow);
+void gaussian_blur(uint8_t * mask, float * scratch, int height, int width, int blur);
+void morphology(const uint8_t * mask, uint8_t * dst, uint8_t * tmp, float * scratch,
+                int height, int width, int growshrink, int blur);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-n iterations] [-t threads]\n", name);
+}
+
+
+// a head and shoulders filling the lower middle of the frame
+void draw_person(uint8_t * mask, int height, int width)
+{
+    float head_x = width * 0.5f;
+    float head_y = height * 0.35f;
+    float head_radius = height * 0.17f;
+    float body_y = height * 1.05f;
+    float body_rx = width * 0.3f;
+    float body_ry = height * 0.5f;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float hx = x - head_x;
+            float hy = y - head_y;
+            float bx = (x - head_x) / body_rx;
+            float by = (y - body_y) / body_ry;
+            int inside = hx * hx + hy * hy < head_radius * head_radius || bx * bx + by * by < 1.0f;
+            mask[(size_t)y * width + x] = inside ? 255 : 0;
+        }
+    }
+}
+
+
+// max (grow) or min over a window from x - before to x + after
+void morph_rows(const uint8_t * src, uint8_t * dst, int height, int width, int before, int after, int grow)
+{
+    for (int y = 0; y < height; y++) {
+        const uint8_t * in = src + (size_t)y * width;
+        uint8_t * out = dst + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            int first = x - before > 0 ? x - before : 0;
+            int last = x + after < width - 1 ? x + after : width - 1;
+            uint8_t value = in[first];
+            for (int i = first + 1; i <= last; i++) {
+                value = grow ? (in[i] > value ? in[i] : value) : (in[i] < value ? in[i] : value);
+            }
+            out[x] = value;
+        }
+    }
+}
+
+
+void morph_columns(const uint8_t * src, uint8_t * dst, int height, int width, int before, int after, int grow)
+{
+    for (int y = 0; y < height; y++) {
+        int first = y - before > 0 ? y - before : 0;
+        int last = y + after < height - 1 ? y + after : height - 1;
+        uint8_t * out = dst + (size_t)y * width;
+        memcpy(out, src + (size_t)first * width, width);
+        for (int i = first + 1; i <= last; i++) {
+            const uint8_t * in = src + (size_t)i * width;
+            for (int x = 0; x < width; x++) {
+                out[x] = grow ? (in[x] > out[x] ? in[x] : out[x]) : (in[x] < out[x] ? in[x] : out[x]);
+            }
+        }
+    }
+}
+
+
+// separable, with OpenCV's sigma for a 2 * blur + 1 kernel and replicated edges
+void gaussian_blur(uint8_t * mask, float * scratch, int height, int width, int blur)
+{
+    float kernel[2 * 25 + 1];
+    float sigma = 0.3f * (blur - 1) + 0.8f;
+    float sum = 0.0f;
+    for (int i = -blur; i <= blur; i++) {
+        kernel[i + blur] = expf(-(float)(i * i) / (2.0f * sigma * sigma));
+        sum += kernel[i + blur];
+    }
+    for (int i = 0; i <= 2 * blur; i++) {
+        kernel[i] /= sum;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t * in = mask + (size_t)y * width;
+        float * out = scratch + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            float value = 0.0f;
+            for (int i = -blur; i <= blur; i++) {
+                int at = x + i < 0 ? 0 : (x + i >= width ? width - 1 : x + i);
+                value += kernel[i + blur] * in[at];
+            }
+            out[x] = value;
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        uint8_t * out = mask + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            float value = 0.0f;
+            for (int i = -blur; i <= blur; i++) {
+                int at = y + i < 0 ? 0 : (y + i >= height ? height - 1 : y + i);
+                value += kernel[i + blur] * scratch[(size_t)at * width + x];
+            }
+            out[x] = (uint8_t)(value + 0.5f);
+        }
+    }
+}
+
+
+// what the server does after segmenting: dilate or erode with a growshrink square, then blur
+void morphology(const uint8_t * mask, uint8_t * dst, uint8_t * tmp, float * scratch,
+                int height, int width, int growshrink, int blur)
+{
+    int size = growshrink < 0 ? -growshrink : growshrink;
+    if (size > 1) {
+        // the anchor of an even square sits right of its middle, like OpenCV's
+        int before = size / 2;
+        int after = size - 1 - before;
+        morph_rows(mask, tmp, height, width, before, after, growshrink > 0);
+        morph_columns(tmp, dst, height, width, before, after, growshrink > 0);
+    } else {
+        memcpy(dst, mask, (size_t)height * width);
+    }
+    if (blur > 0) {
+        gaussian_blur(dst, scratch, height, width, blur);
+    }
+}
+
+
+int main(int argc, char ** argv)
+{
+    int width = 640;
+    int height = 360;
+    int iterations = 20;
+    int threads = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:h:n:t:")) != -1) {
+        switch (opt) {
+            case 'w':
+                width = atoi(optarg);
+                break;
+            case 'h':
+                height = atoi(optarg);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (width <= 0 || height <= 0 || iterations <= 0 || threads <= 0 || threads > MAX_TASK_POOL_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t size = (size_t)height * width;
+    uint8_t * mask = (uint8_t *)bzalloc(size);
+    uint8_t * reference = (uint8_t *)bzalloc(size);
+    uint8_t * tmp = (uint8_t *)bzalloc(size);
+    uint8_t * alpha = (uint8_t *)bzalloc(size);
+    float * scratch = (float *)bzalloc(size * sizeof(float));
+    TaskPool * pool = threads > 1 ? TaskPool_create(threads) : NULL;
+    MaskField * field = MaskField_create(pool);
+    if (!mask || !reference || !tmp || !alpha || !scratch || !field) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    draw_person(mask, height, width);
+
+    uint64_t start = os_gettime_ns();
+    for (int i = 0; i < iterations; i++) {
+        MaskField_build(field, mask, height, width);
+    }
+    double build_ms = (os_gettime_ns() - start) / 1000000.0 / iterations;
+
+    printf("%dx%d mask, %d thread%s, field built in %.2f ms per mask\n\n",
+           width, height, threads, threads == 1 ? "" : "s", build_ms);
+    printf("%10s %5s %14s %11s %10s %12s\n",
+           "growshrink", "blur", "morphology ms", "field ms", "mean diff", "off by > 10%");
+
+    BenchSetting settings[] = {
+            {0, 4}, {4, 4}, {-4, 4}, {10, 8}, {-10, 8}, {30, 12}, {-30, 12}, {50, 25}, {-50, 25},
+    };
+    for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+        int growshrink = settings[s].growshrink;
+        int blur = settings[s].blur;
+        float grow = MaskField_grow_for(growshrink);
+        float feather = MaskField_feather_for(blur);
+
+        start = os_gettime_ns();
+        for (int i = 0; i < iterations; i++) {
+            morphology(mask, reference, tmp, scratch, height, width, growshrink, blur);
+        }
+        double morphology_ms = (os_gettime_ns() - start) / 1000000.0 / iterations;
+
+        start = os_gettime_ns();
+        for (int i = 0; i < iterations; i++) {
+            MaskField_apply(field, grow, feather, alpha);
+        }
+        double apply_ms = (os_gettime_ns() - start) / 1000000.0 / iterations;
+
+        uint64_t total = 0;
+        size_t off = 0;
+        for (size_t i = 0; i < size; i++) {
+            int diff = abs((int)alpha[i] - (int)reference[i]);
+            total += diff;
+            off += diff > 25;
+        }
+        printf("%10d %5d %14.2f %11.3f %10.2f %11.3f%%\n", growshrink, blur, morphology_ms, apply_ms,
+               (double)total / size, 100.0 * off / size);
+    }
+
+    MaskField_destroy(field);
+    TaskPool_destroy(pool);
+    bfree(mask);
+    bfree(reference);
+    bfree(tmp);
+    bfree(alpha);
+    bfree(scratch);
+    return 0;
+}
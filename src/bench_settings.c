@@ -0,0 +1,206 @@
+// Settings update benchmark: a segmentation thread segments frames from a
+// fake source against the mock server while another thread drags a slider,
+// calling the setters a filter's update calls at a fixed rate. Reports what
+// a settings update costs, what handing a frame over costs while updates
+// land, and how many masks still came back.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "compat.h"
+#include "bench_common.h"
+
+#define MAX_SAMPLES                    65536
+
+
+typedef struct {
+    uint64_t samples[MAX_SAMPLES];
+    int count;
+} BenchLatencies;
+
+
+typedef struct {
+    BenchLatencies handoffs;
+    int masks;
+} BenchFeed;
+
+
+typedef struct {
+    SegmentationThread * thread;
+    double rate;
+    uint8_t is_running;
+    BenchLatencies updates;
+} BenchSlider;
+
+
+// utility methods
+void usage(const char * name);
+void record_sample(BenchLatencies * latencies, uint64_t sample);
+void print_latencies(const char * name, BenchLatencies * latencies);
+void * run_slider(void * ptr);
+void record_frame(void * opaque, const BenchFrame * frame);
+void run_scenario(const BenchOptions * options, double update_rate, const char * server_path);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-r fps] [-w width] [-h height] [-d seconds] [-b base_ms]\n", name);
+}
+
+
+void record_sample(BenchLatencies * latencies, uint64_t sample)
+{
+    if (latencies->count < MAX_SAMPLES) {
+        latencies->samples[latencies->count++] = sample;
+    }
+}
+
+
+void print_latencies(const char * name, BenchLatencies * latencies)
+{
+    if (latencies->count == 0) {
+        printf("  %-16s %8s\n", name, "-");
+        return;
+    }
+    BenchSummary summary;
+    Bench_summarize(latencies->samples, latencies->count, &summary);
+    printf("  %-16s %8d %10.2f %10.2f %10.2f\n", name, latencies->count,
+           summary.mean_ns / 1000.0, summary.p99_ns / 1000.0, summary.max_ns / 1000.0);
+}
+
+
+// every setter a filter's update calls, in the same order, with a threshold
+// that keeps moving and frames batching turned off
+void * run_slider(void * ptr)
+{
+    BenchSlider * slider = (BenchSlider *)ptr;
+    uint64_t period = (uint64_t)(1000000000.0 / slider->rate);
+    uint64_t next = os_gettime_ns();
+    int step = 0;
+    while (__atomic_load_n(&(slider->is_running), __ATOMIC_SEQ_CST)) {
+        uint64_t start = os_gettime_ns();
+        SegmentationThread_set_distance_field(slider->thread, 0);
+        SegmentationThread_set_parameters(slider->thread, 0.3f + 0.01f * (float)(step % 50), 4, 0);
+        ThreadPolicy policy;
+        ThreadPolicy_init(&policy);
+        SegmentationThread_set_policy(slider->thread, &policy);
+        SegmentationThread_set_batcher(slider->thread, NULL, BATCHER_DEFAULT_WINDOW_NS, BATCHER_DEFAULT_MAX_BATCH);
+        SegmentationThread_set_max_mask_age(slider->thread, 500000000ULL);
+        SegmentationThread_set_dual_rate(slider->thread, 1, 0, 200000000ULL);
+        record_sample(&(slider->updates), os_gettime_ns() - start);
+        step++;
+
+        next += period;
+        Bench_sleep_until(next);
+    }
+    return NULL;
+}
+
+
+void record_frame(void * opaque, const BenchFrame * frame)
+{
+    BenchFeed * feed = (BenchFeed *)opaque;
+    record_sample(&(feed->handoffs), frame->handoff_ns);
+    if (frame->new_mask) {
+        feed->masks++;
+    }
+}
+
+
+void run_scenario(const BenchOptions * options, double update_rate, const char * server_path)
+{
+    static BenchSlider slider;
+    static BenchFeed feed;
+    memset(&slider, 0, sizeof(slider));
+    memset(&feed, 0, sizeof(feed));
+
+    MockServer * server = NULL;
+    SegmentationThread * thread = NULL;
+    pthread_t slider_thread;
+    int slider_started = 0;
+    if (Bench_start_server(options, server_path, &server) == 0) {
+        thread = Bench_create_thread(server_path, options->height, options->width);
+    }
+    if (thread == NULL) {
+        goto end;
+    }
+
+    slider.thread = thread;
+    slider.rate = update_rate;
+    slider.is_running = 1;
+    if (update_rate > 0 && pthread_create(&slider_thread, NULL, run_slider, &slider) == 0) {
+        slider_started = 1;
+    }
+
+    uint64_t start = os_gettime_ns();
+    uint64_t deadline = start + (uint64_t)(options->seconds * 1000000000.0);
+    int rc = Bench_feed_thread(thread, options->height, options->width, options->fps, deadline,
+                               record_frame, &feed);
+    double elapsed = (os_gettime_ns() - start) / 1000000000.0;
+    __atomic_store_n(&(slider.is_running), 0, __ATOMIC_SEQ_CST);
+    if (slider_started) {
+        pthread_join(slider_thread, NULL);
+    }
+    if (rc) {
+        goto end;
+    }
+
+    SnapshotStats parameters;
+    SnapshotStats settings;
+    Snapshot_get_stats(thread->pool->parameters, &parameters);
+    Snapshot_get_stats(thread->settings, &settings);
+    uint64_t publishes = parameters.publishes + settings.publishes;
+    uint64_t longest_grace = parameters.max_grace_ns > settings.max_grace_ns ?
+            parameters.max_grace_ns : settings.max_grace_ns;
+
+    printf("%.0f updates/s: %.1f masks/s, %llu published, %llu unchanged, "
+           "%.2f us average and %.2f us longest wait for readers\n",
+           update_rate, feed.masks / elapsed, (unsigned long long)publishes,
+           (unsigned long long)(parameters.unchanged + settings.unchanged),
+           publishes ? (double)(parameters.grace_ns + settings.grace_ns) / publishes / 1000.0 : 0.0,
+           longest_grace / 1000.0);
+    printf("  %-16s %8s %10s %10s %10s\n", "us per call", "calls", "mean", "p99", "max");
+    print_latencies("settings update", &(slider.updates));
+    print_latencies("frame hand-off", &(feed.handoffs));
+    printf("\n");
+
+    end:
+    SegmentationThread_destroy(thread);
+    MockServer_destroy(server);
+}
+
+
+int main(int argc, char ** argv)
+{
+    BenchOptions options;
+    Bench_init_options(&options);
+    options.fps = 60.0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:h:d:b:")) != -1) {
+        if (Bench_parse_option(&options, opt, optarg)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.fps <= 0 || options.width <= 0 || options.height <= 0 || options.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char server_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    Bench_socket_path(server_path, sizeof(server_path), "bench");
+
+    printf("%dx%d at %.0f fps, model %.1f ms, %.1f s per run\n\n",
+           options.width, options.height, options.fps, options.server.base_ns / 1000000.0, options.seconds);
+    // OBS calls update for every step of a slider drag, typically at the UI's 60 Hz
+    double rates[] = {0, 60, 1000, 10000};
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        run_scenario(&options, rates[i], server_path);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_COMPAT_H
+#define OBS_VIRTUAL_BACKGROUND_COMPAT_H
+
+// The segmentation core is built without libobs so it can be used outside
+// of OBS. These stand in for the few libobs utilities it relies on.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline void * bzalloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+static inline void bfree(void * ptr)
+{
+    free(ptr);
+}
+
+static inline uint64_t os_gettime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif //OBS_VIRTUAL_BACKGROUND_COMPAT_H
@@ -0,0 +1,170 @@
+#include "compat.h"
+
+#include "composite.h"
+
+#define WEIGHT_BITS                    8
+#define WEIGHT_ONE                     (1 << WEIGHT_BITS)
+
+
+typedef struct {
+    MaskCompositor * self;
+    const uint8_t * mask;
+    uint8_t * dst;
+    int dst_linesize;
+    int dst_step;
+} CompositeJob;
+
+
+void free_tables(MaskCompositor * self);
+int build_tables(MaskCompositor * self, int mask_width, int mask_height, int width, int height);
+void build_table(int src_size, int dst_size, int32_t * offsets, uint8_t * weights);
+void composite_rows(void * context, int task, int num_tasks);
+
+
+MaskCompositor * MaskCompositor_create(TaskPool * pool)
+{
+    MaskCompositor * self = (MaskCompositor *)bzalloc(sizeof(MaskCompositor));
+    if (!self) {
+        return NULL;
+    }
+    self->pool = pool;
+    self->num_tasks = pool ? TaskPool_get_parallelism(pool) : 1;
+    return self;
+}
+
+
+void MaskCompositor_destroy(MaskCompositor * self)
+{
+    if (!self) {
+        return;
+    }
+    free_tables(self);
+    bfree(self);
+}
+
+
+int MaskCompositor_apply(MaskCompositor * self, const uint8_t * mask, int mask_width, int mask_height,
+                         uint8_t * dst, int dst_linesize, int dst_step, int width, int height)
+{
+    if (mask_width <= 0 || mask_height <= 0 || width <= 0 || height <= 0) {
+        return 1;
+    }
+    if (self->mask_width != mask_width || self->mask_height != mask_height ||
+            self->width != width || self->height != height) {
+        if (build_tables(self, mask_width, mask_height, width, height)) {
+            return 1;
+        }
+    }
+
+    CompositeJob job = {
+            .self = self,
+            .mask = mask,
+            .dst = dst,
+            .dst_linesize = dst_linesize,
+            .dst_step = dst_step,
+    };
+    if (self->pool) {
+        TaskPool_run(self->pool, self->num_tasks, composite_rows, &job);
+    } else {
+        composite_rows(&job, 0, 1);
+    }
+    return 0;
+}
+
+
+// each task owns a horizontal band of the output
+void composite_rows(void * context, int task, int num_tasks)
+{
+    CompositeJob * job = (CompositeJob *)context;
+    MaskCompositor * self = job->self;
+    const int mask_width = self->mask_width;
+    const int width = self->width;
+    const int step = job->dst_step;
+    const int32_t * x_offsets = self->x_offsets;
+    const uint8_t * x_weights = self->x_weights;
+    uint16_t * row = self->rows + (size_t)task * (mask_width + 1);
+
+    int first = (int)((int64_t)self->height * task / num_tasks);
+    int last = (int)((int64_t)self->height * (task + 1) / num_tasks);
+
+    for (int y = first; y < last; y++) {
+        int sy = self->y_offsets[y];
+        int wy = self->y_weights[y];
+        const uint8_t * top = job->mask + (size_t)sy * mask_width;
+        const uint8_t * bottom = sy + 1 < self->mask_height ? top + mask_width : top;
+
+        // vertical pass, a straight loop the compiler can vectorize
+        for (int x = 0; x < mask_width; x++) {
+            row[x] = (uint16_t)(top[x] * (WEIGHT_ONE - wy) + bottom[x] * wy);
+        }
+        row[mask_width] = row[mask_width - 1];
+
+        uint8_t * dst = job->dst + (size_t)y * job->dst_linesize;
+        for (int x = 0; x < width; x++) {
+            int offset = x_offsets[x];
+            int wx = x_weights[x];
+            uint32_t value = row[offset] * (WEIGHT_ONE - wx) + row[offset + 1] * wx;
+            dst[x * step] = (uint8_t)((value + (1 << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS));
+        }
+    }
+}
+
+
+int build_tables(MaskCompositor * self, int mask_width, int mask_height, int width, int height)
+{
+    free_tables(self);
+    self->x_offsets = (int32_t *)bzalloc(sizeof(int32_t) * width);
+    self->x_weights = (uint8_t *)bzalloc(width);
+    self->y_offsets = (int32_t *)bzalloc(sizeof(int32_t) * height);
+    self->y_weights = (uint8_t *)bzalloc(height);
+    self->rows = (uint16_t *)bzalloc(sizeof(uint16_t) * (mask_width + 1) * self->num_tasks);
+    if (!self->x_offsets || !self->x_weights || !self->y_offsets || !self->y_weights || !self->rows) {
+        free_tables(self);
+        return 1;
+    }
+    build_table(mask_width, width, self->x_offsets, self->x_weights);
+    build_table(mask_height, height, self->y_offsets, self->y_weights);
+    self->mask_width = mask_width;
+    self->mask_height = mask_height;
+    self->width = width;
+    self->height = height;
+    return 0;
+}
+
+
+// pixel centres are aligned, like swscale's bilinear filter
+void build_table(int src_size, int dst_size, int32_t * offsets, uint8_t * weights)
+{
+    for (int i = 0; i < dst_size; i++) {
+        double position = (i + 0.5) * src_size / dst_size - 0.5;
+        if (position < 0) {
+            position = 0;
+        }
+        int offset = (int)position;
+        if (offset > src_size - 1) {
+            offset = src_size - 1;
+        }
+        int weight = (int)((position - offset) * WEIGHT_ONE);
+        offsets[i] = offset;
+        weights[i] = (uint8_t)(weight > WEIGHT_ONE - 1 ? WEIGHT_ONE - 1 : weight);
+    }
+}
+
+
+void free_tables(MaskCompositor * self)
+{
+    bfree(self->x_offsets);
+    bfree(self->x_weights);
+    bfree(self->y_offsets);
+    bfree(self->y_weights);
+    bfree(self->rows);
+    self->x_offsets = NULL;
+    self->x_weights = NULL;
+    self->y_offsets = NULL;
+    self->y_weights = NULL;
+    self->rows = NULL;
+    self->mask_width = 0;
+    self->mask_height = 0;
+    self->width = 0;
+    self->height = 0;
+}
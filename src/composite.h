@@ -0,0 +1,39 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_COMPOSITE_H
+#define OBS_VIRTUAL_BACKGROUND_COMPOSITE_H
+
+#include <stdint.h>
+
+#include "task_pool.h"
+
+
+typedef struct {
+    TaskPool * pool;
+
+    // lookup tables for the current geometry, rebuilt when it changes
+    int mask_width;
+    int mask_height;
+    int width;
+    int height;
+    int32_t * x_offsets;
+    uint8_t * x_weights;
+    int32_t * y_offsets;
+    uint8_t * y_weights;
+
+    // one vertically blended mask row per task
+    uint16_t * rows;
+    int num_tasks;
+} MaskCompositor;
+
+
+// the pool is borrowed and must outlive the compositor
+MaskCompositor * MaskCompositor_create(TaskPool * pool);
+void MaskCompositor_destroy(MaskCompositor * self);
+
+// Bilinearly scales a mask_width x mask_height mask up to width x height and
+// writes it into dst, step bytes apart: 4 for the alpha byte of packed
+// BGRA/RGBA (pass a pointer to the first alpha byte), 1 for an alpha plane.
+int MaskCompositor_apply(MaskCompositor * self, const uint8_t * mask, int mask_width, int mask_height,
+                         uint8_t * dst, int dst_linesize, int dst_step, int width, int height);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_COMPOSITE_H
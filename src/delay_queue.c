@@ -0,0 +1,107 @@
+#include <obs-module.h>
+
+#include "delay_queue.h"
+
+
+DelayQueue * DelayQueue_create()
+{
+    DelayQueue * self = (DelayQueue *)bzalloc(sizeof(DelayQueue));
+    if (!self) {
+        return NULL;
+    }
+    self->head = 0;
+    self->count = 0;
+    return self;
+}
+
+
+void DelayQueue_destroy(DelayQueue * self)
+{
+    if (!self) {
+        return;
+    }
+    bfree(self);
+}
+
+
+int DelayQueue_push(DelayQueue * self, struct obs_source_frame * frame)
+{
+    if (self->count >= MAX_DELAYED_FRAMES) {
+        return 1;
+    }
+    self->frames[(self->head + self->count) % MAX_DELAYED_FRAMES] = frame;
+    self->count++;
+    return 0;
+}
+
+
+struct obs_source_frame * DelayQueue_pop(DelayQueue * self)
+{
+    if (self->count == 0) {
+        return NULL;
+    }
+    struct obs_source_frame * frame = self->frames[self->head];
+    self->frames[self->head] = NULL;
+    self->head = (self->head + 1) % MAX_DELAYED_FRAMES;
+    self->count--;
+    return frame;
+}
+
+
+struct obs_source_frame * DelayQueue_pop_ready(DelayQueue * self, uint64_t mask_timestamp, uint64_t latency_budget_ns,
+        int * expired)
+{
+    *expired = 0;
+    if (self->count == 0) {
+        return NULL;
+    }
+
+    struct obs_source_frame * oldest = self->frames[self->head];
+    struct obs_source_frame * newest = self->frames[(self->head + self->count - 1) % MAX_DELAYED_FRAMES];
+
+    if (mask_timestamp < oldest->timestamp) {
+        if (newest->timestamp - oldest->timestamp < latency_budget_ns && self->count < MAX_DELAYED_FRAMES) {
+            return NULL;
+        }
+        *expired = 1;
+    }
+    return DelayQueue_pop(self);
+}
+
+
+struct obs_source_frame * DelayQueue_pop_stale(DelayQueue * self, uint64_t mask_timestamp)
+{
+    if (self->count < 2) {
+        return NULL;
+    }
+    struct obs_source_frame * next = self->frames[(self->head + 1) % MAX_DELAYED_FRAMES];
+    if (mask_timestamp < next->timestamp) {
+        return NULL;
+    }
+    return DelayQueue_pop(self);
+}
+
+
+void DelayQueue_record_release(DelayQueue * self, enum DelayRelease reason)
+{
+    switch (reason) {
+        case DELAY_RELEASE_ON_TIME:
+            self->released_on_time++;
+            break;
+        case DELAY_RELEASE_NO_MASK:
+            self->released_no_mask++;
+            break;
+        case DELAY_RELEASE_LATE:
+            self->released_late++;
+            break;
+        case DELAY_RELEASE_SKIPPED:
+            self->released_skipped++;
+            break;
+    }
+}
+
+
+int DelayQueue_get_count(DelayQueue * self)
+{
+    return self->count;
+}
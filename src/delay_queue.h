@@ -0,0 +1,51 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_DELAY_QUEUE_H
+#define OBS_VIRTUAL_BACKGROUND_DELAY_QUEUE_H
+
+#include <stdint.h>
+
+#define MAX_DELAYED_FRAMES             32
+
+struct obs_source_frame;
+
+enum DelayRelease {
+    // the mask for this exact frame arrived
+    DELAY_RELEASE_ON_TIME = 0,
+    // a newer frame was segmented instead, this one will never get its own mask
+    DELAY_RELEASE_NO_MASK,
+    // the latency budget ran out or the ring was full
+    DELAY_RELEASE_LATE,
+    // dropped unshown because a newer frame was already covered by the mask
+    DELAY_RELEASE_SKIPPED,
+};
+
+
+typedef struct {
+    struct obs_source_frame * frames[MAX_DELAYED_FRAMES];
+    int head;
+    int count;
+
+    uint64_t released_on_time;
+    uint64_t released_no_mask;
+    uint64_t released_late;
+    uint64_t released_skipped;
+} DelayQueue;
+
+
+DelayQueue * DelayQueue_create();
+void DelayQueue_destroy(DelayQueue * self);
+
+// returns non-zero if the queue was full and the frame could not be held
+int DelayQueue_push(DelayQueue * self, struct obs_source_frame * frame);
+// Pops the oldest frame once a mask at least as new as it has arrived, or
+// once it has been held for the whole latency budget (*expired is set).
+struct obs_source_frame * DelayQueue_pop_ready(DelayQueue * self, uint64_t mask_timestamp, uint64_t latency_budget_ns,
+        int * expired);
+// Pops the oldest frame while the mask also covers the frame after it, so the
+// caller can drop it and catch up instead of staying as deep as it got.
+struct obs_source_frame * DelayQueue_pop_stale(DelayQueue * self, uint64_t mask_timestamp);
+void DelayQueue_record_release(DelayQueue * self, enum DelayRelease reason);
+struct obs_source_frame * DelayQueue_pop(DelayQueue * self);
+int DelayQueue_get_count(DelayQueue * self);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_DELAY_QUEUE_H
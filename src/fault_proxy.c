@@ -0,0 +1,517 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "fault_proxy.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                   0
+#endif
+
+// utility methods
+int proxy_listen(FaultProxy * self, const char * address);
+int proxy_connect(const char * address);
+int proxy_split_address(const char * address, char * host, size_t host_size, int * port);
+void * proxy_accept(void * data);
+void * proxy_serve(void * data);
+int proxy_forward(FaultConnection * connection, int direction, const uint8_t * data, size_t size);
+int proxy_sleep(FaultConnection * connection, int to_fd, uint64_t ns);
+int proxy_send(int fd, const uint8_t * data, size_t size);
+void proxy_reset(FaultConnection * connection);
+void proxy_reap(FaultProxy * self);
+void proxy_free_connection(FaultConnection * connection);
+
+
+FaultProxy * FaultProxy_create(const char * listen_address, const char * target_address, const FaultOptions * options)
+{
+    FaultProxy * self = (FaultProxy *)bzalloc(sizeof(FaultProxy));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    self->listen_fd = -1;
+    self->listen_port = -1;
+    if (options != NULL) {
+        self->options = *options;
+    }
+    strncpy(self->target, target_address, SEGMENTATION_SOCKET_PATH_LENGTH - 1);
+
+    if (proxy_listen(self, listen_address)) {
+        fprintf(stderr, "fault proxy could not listen on %s: %s\n", listen_address, strerror(errno));
+        goto err;
+    }
+
+    self->is_running = 1;
+    if (pthread_create(&(self->accept_thread), NULL, proxy_accept, (void *)self)) {
+        goto err;
+    }
+    self->accepting = 1;
+    return self;
+
+    err:
+    FaultProxy_destroy(self);
+    return NULL;
+}
+
+
+void FaultProxy_destroy(FaultProxy * self)
+{
+    if (!self) {
+        return;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    self->is_running = 0;
+    pthread_mutex_unlock(&(self->mutex));
+    if (self->listen_fd >= 0) {
+        // wakes the accept thread
+        shutdown(self->listen_fd, SHUT_RDWR);
+    }
+    if (self->accepting) {
+        pthread_join(self->accept_thread, NULL);
+    }
+    for (int i = 0; i < self->num_connections; i++) {
+        pthread_mutex_lock(&(self->mutex));
+        if (self->connections[i]->client_fd >= 0) {
+            shutdown(self->connections[i]->client_fd, SHUT_RDWR);
+        }
+        if (self->connections[i]->server_fd >= 0) {
+            shutdown(self->connections[i]->server_fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&(self->mutex));
+        pthread_join(self->connection_threads[i], NULL);
+        proxy_free_connection(self->connections[i]);
+    }
+    if (self->listen_fd >= 0) {
+        close(self->listen_fd);
+        if (self->listen_path[0] != '\0') {
+            unlink(self->listen_path);
+        }
+    }
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+void FaultProxy_set_options(FaultProxy * self, const FaultOptions * options)
+{
+    pthread_mutex_lock(&(self->mutex));
+    if (self->options.directions != 0 && options->directions == 0) {
+        self->stats.last_fault_end = os_gettime_ns();
+    }
+    self->options = *options;
+    self->generation++;
+    self->stall_fired = 0;
+    self->reset_fired = 0;
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+void FaultProxy_get_stats(FaultProxy * self, FaultProxyStats * stats)
+{
+    pthread_mutex_lock(&(self->mutex));
+    *stats = self->stats;
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+int FaultProxy_get_port(FaultProxy * self)
+{
+    return self->listen_port;
+}
+
+
+int proxy_split_address(const char * address, char * host, size_t host_size, int * port)
+{
+    const char * colon = strrchr(address, ':');
+    const char * port_string = colon ? colon + 1 : address;
+    size_t host_length = colon ? (size_t)(colon - address) : 0;
+    if (host_length >= host_size) {
+        return -1;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    char * end = NULL;
+    long value = strtol(port_string, &end, 10);
+    if (end == port_string || *end != '\0' || value < 0 || value > 65535) {
+        return -1;
+    }
+    *port = (int)value;
+    return 0;
+}
+
+
+int proxy_listen(FaultProxy * self, const char * address)
+{
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un unix_address;
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strncpy(self->listen_path, address, SEGMENTATION_SOCKET_PATH_LENGTH - 1);
+        strncpy(unix_address.sun_path, self->listen_path, sizeof(unix_address.sun_path) - 1);
+        unlink(self->listen_path);
+        self->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (self->listen_fd < 0 ||
+                bind(self->listen_fd, (struct sockaddr *)&unix_address, sizeof(unix_address))) {
+            return -1;
+        }
+        return listen(self->listen_fd, FAULT_PROXY_MAX_CONNECTIONS);
+    }
+
+    char host[256];
+    int port;
+    if (proxy_split_address(address, host, sizeof(host), &port)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sockaddr_in inet_address;
+    memset(&inet_address, 0, sizeof(inet_address));
+    inet_address.sin_family = AF_INET;
+    inet_address.sin_port = htons((uint16_t)port);
+    // a fault proxy has no business being reachable from elsewhere unless asked
+    inet_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (host[0] != '\0') {
+        struct hostent * server = gethostbyname(host);
+        if (server == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(&(inet_address.sin_addr.s_addr), server->h_addr, server->h_length);
+    }
+    self->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (self->listen_fd < 0) {
+        return -1;
+    }
+    int trueval = 1;
+    setsockopt(self->listen_fd, SOL_SOCKET, SO_REUSEADDR, &trueval, sizeof(int));
+    socklen_t length = sizeof(inet_address);
+    if (bind(self->listen_fd, (struct sockaddr *)&inet_address, sizeof(inet_address)) ||
+            listen(self->listen_fd, FAULT_PROXY_MAX_CONNECTIONS) ||
+            getsockname(self->listen_fd, (struct sockaddr *)&inet_address, &length)) {
+        return -1;
+    }
+    self->listen_port = ntohs(inet_address.sin_port);
+    return 0;
+}
+
+
+int proxy_connect(const char * address)
+{
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un unix_address;
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strncpy(unix_address.sun_path, address, sizeof(unix_address.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&unix_address, sizeof(unix_address))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256];
+    int port;
+    if (proxy_split_address(address, host, sizeof(host), &port)) {
+        return -1;
+    }
+    struct sockaddr_in inet_address;
+    memset(&inet_address, 0, sizeof(inet_address));
+    inet_address.sin_family = AF_INET;
+    inet_address.sin_port = htons((uint16_t)port);
+    inet_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (host[0] != '\0') {
+        struct hostent * server = gethostbyname(host);
+        if (server == NULL) {
+            return -1;
+        }
+        memcpy(&(inet_address.sin_addr.s_addr), server->h_addr, server->h_length);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&inet_address, sizeof(inet_address))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+void * proxy_accept(void * data)
+{
+    FaultProxy * self = (FaultProxy *)data;
+    while (1) {
+        int fd = accept(self->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // the server sees a connection only once the plugin has made one
+        int server_fd = proxy_connect(self->target);
+        pthread_mutex_lock(&(self->mutex));
+        if (self->num_connections == FAULT_PROXY_MAX_CONNECTIONS) {
+            proxy_reap(self);
+        }
+        FaultConnection * connection = NULL;
+        if (server_fd >= 0 && self->is_running && self->num_connections < FAULT_PROXY_MAX_CONNECTIONS) {
+            connection = (FaultConnection *)bzalloc(sizeof(FaultConnection));
+        }
+        if (connection != NULL) {
+            connection->proxy = self;
+            connection->client_fd = fd;
+            connection->server_fd = server_fd;
+            connection->generation = self->generation;
+            connection->buffer = (uint8_t *)bzalloc(FAULT_PROXY_BUFFER_SIZE);
+            if (connection->buffer != NULL &&
+                    pthread_create(&(self->connection_threads[self->num_connections]), NULL,
+                                   proxy_serve, (void *)connection) == 0) {
+                self->connections[self->num_connections++] = connection;
+                self->stats.connections++;
+            } else {
+                if (connection->buffer) {
+                    bfree(connection->buffer);
+                }
+                bfree(connection);
+                connection = NULL;
+            }
+        }
+        pthread_mutex_unlock(&(self->mutex));
+        if (connection == NULL) {
+            close(fd);
+            if (server_fd >= 0) {
+                close(server_fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+void * proxy_serve(void * data)
+{
+    FaultConnection * connection = (FaultConnection *)data;
+    FaultProxy * proxy = connection->proxy;
+    int rc = 0;
+    while (rc == 0) {
+        struct pollfd fds[2];
+        fds[0].fd = connection->client_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = connection->server_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2 && rc == 0; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t read_bytes = recv(fds[i].fd, connection->buffer, FAULT_PROXY_BUFFER_SIZE, 0);
+            if (read_bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (read_bytes <= 0) {
+                rc = -1;
+                break;
+            }
+            rc = proxy_forward(connection, i == 0 ? FAULT_TO_SERVER : FAULT_TO_CLIENT,
+                               connection->buffer, (size_t)read_bytes);
+        }
+    }
+    // one side hung up or was reset, so the other goes too
+    pthread_mutex_lock(&(proxy->mutex));
+    if (connection->client_fd >= 0) {
+        shutdown(connection->client_fd, SHUT_RDWR);
+    }
+    if (connection->server_fd >= 0) {
+        shutdown(connection->server_fd, SHUT_RDWR);
+    }
+    connection->done = 1;
+    pthread_mutex_unlock(&(proxy->mutex));
+    return NULL;
+}
+
+
+int proxy_forward(FaultConnection * connection, int direction, const uint8_t * data, size_t size)
+{
+    FaultProxy * proxy = connection->proxy;
+    int index = direction == FAULT_TO_SERVER ? 0 : 1;
+    int to_fd = direction == FAULT_TO_SERVER ? connection->server_fd : connection->client_fd;
+    size_t offset = 0;
+    while (offset < size) {
+        pthread_mutex_lock(&(proxy->mutex));
+        if (connection->generation != proxy->generation) {
+            connection->generation = proxy->generation;
+            connection->bytes[0] = 0;
+            connection->bytes[1] = 0;
+        }
+        FaultOptions options = proxy->options;
+        int faulty = (options.directions & direction) != 0;
+        uint64_t sent = connection->bytes[index];
+        size_t length = size - offset;
+        if (faulty && options.chunk_bytes > 0 && length > options.chunk_bytes) {
+            length = options.chunk_bytes;
+        }
+
+        int stall = 0;
+        if (faulty && options.stall_ns > 0 && !proxy->stall_fired && sent + length >= options.stall_after_bytes) {
+            // forwards up to the stall point first
+            length = (size_t)(options.stall_after_bytes - sent);
+            if (length == 0) {
+                stall = 1;
+                proxy->stall_fired = 1;
+                proxy->stats.stalls++;
+            }
+        }
+        if (faulty && options.reset_after_bytes > 0 && !proxy->reset_fired &&
+                sent + length >= options.reset_after_bytes) {
+            length = (size_t)(options.reset_after_bytes - sent);
+            if (length == 0) {
+                proxy->reset_fired = 1;
+                proxy->stats.resets++;
+                proxy->stats.last_fault_end = os_gettime_ns();
+                pthread_mutex_unlock(&(proxy->mutex));
+                proxy_reset(connection);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&(proxy->mutex));
+
+        if (stall) {
+            int rc = proxy_sleep(connection, to_fd, options.stall_ns);
+            pthread_mutex_lock(&(proxy->mutex));
+            proxy->stats.last_fault_end = os_gettime_ns();
+            pthread_mutex_unlock(&(proxy->mutex));
+            if (rc) {
+                return -1;
+            }
+            continue;
+        }
+        if (faulty) {
+            uint64_t wait = options.delay_ns;
+            if (options.bytes_per_second > 0) {
+                wait += (uint64_t)length * 1000000000ULL / options.bytes_per_second;
+            }
+            if (proxy_sleep(connection, to_fd, wait)) {
+                return -1;
+            }
+        }
+        if (proxy_send(to_fd, data + offset, length)) {
+            return -1;
+        }
+        offset += length;
+
+        pthread_mutex_lock(&(proxy->mutex));
+        if (connection->generation == proxy->generation) {
+            connection->bytes[index] += length;
+        }
+        if (direction == FAULT_TO_SERVER) {
+            proxy->stats.bytes_to_server += length;
+        } else {
+            proxy->stats.bytes_to_client += length;
+        }
+        pthread_mutex_unlock(&(proxy->mutex));
+    }
+    return 0;
+}
+
+
+// Sleeps in slices so destroy is never held up and a receiver that gave up
+// waiting ends the fault early. Returns -1 in either case.
+int proxy_sleep(FaultConnection * connection, int to_fd, uint64_t ns)
+{
+    FaultProxy * proxy = connection->proxy;
+    uint64_t end = os_gettime_ns() + ns;
+    while (1) {
+        pthread_mutex_lock(&(proxy->mutex));
+        int running = proxy->is_running;
+        pthread_mutex_unlock(&(proxy->mutex));
+        char peek;
+        if (!running || recv(to_fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            return -1;
+        }
+        uint64_t now = os_gettime_ns();
+        if (now >= end) {
+            return 0;
+        }
+        uint64_t wait = end - now < FAULT_PROXY_POLL_NS ? end - now : FAULT_PROXY_POLL_NS;
+        nanosleep((const struct timespec[]){{(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)}}, NULL);
+    }
+}
+
+
+int proxy_send(int fd, const uint8_t * data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t written = send(fd, data + offset, size - offset, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += (size_t)written;
+    }
+    return 0;
+}
+
+
+// A zero linger makes close send a TCP reset instead of a clean FIN. Unix
+// sockets have no reset, the peer just sees the connection end mid-message.
+void proxy_reset(FaultConnection * connection)
+{
+    FaultProxy * proxy = connection->proxy;
+    struct linger linger;
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    pthread_mutex_lock(&(proxy->mutex));
+    setsockopt(connection->client_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    setsockopt(connection->server_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(connection->client_fd);
+    close(connection->server_fd);
+    connection->client_fd = -1;
+    connection->server_fd = -1;
+    pthread_mutex_unlock(&(proxy->mutex));
+}
+
+
+// makes room for new connections by joining the finished ones, called with the mutex held
+void proxy_reap(FaultProxy * self)
+{
+    int kept = 0;
+    for (int i = 0; i < self->num_connections; i++) {
+        if (self->connections[i]->done) {
+            pthread_join(self->connection_threads[i], NULL);
+            proxy_free_connection(self->connections[i]);
+            continue;
+        }
+        self->connections[kept] = self->connections[i];
+        self->connection_threads[kept] = self->connection_threads[i];
+        kept++;
+    }
+    self->num_connections = kept;
+}
+
+
+void proxy_free_connection(FaultConnection * connection)
+{
+    if (connection->client_fd >= 0) {
+        close(connection->client_fd);
+    }
+    if (connection->server_fd >= 0) {
+        close(connection->server_fd);
+    }
+    bfree(connection->buffer);
+    bfree(connection);
+}
@@ -0,0 +1,102 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_FAULT_PROXY_H
+#define OBS_VIRTUAL_BACKGROUND_FAULT_PROXY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "segmentation_client.h"
+
+#define FAULT_PROXY_MAX_CONNECTIONS    32
+#define FAULT_PROXY_BUFFER_SIZE        65536
+// how often sleeping connections look for shutdown and hung up peers
+#define FAULT_PROXY_POLL_NS            10000000ULL
+
+
+enum FaultDirection {
+    // responses, server to plugin
+    FAULT_TO_CLIENT = 1,
+    // requests, plugin to server
+    FAULT_TO_SERVER = 2
+};
+
+
+typedef struct {
+    // FaultDirection bits the faults apply to, 0 forwards everything untouched
+    int directions;
+    // waited before forwarding each chunk
+    uint64_t delay_ns;
+    // forwards in writes of at most this many bytes, 0 for as much as was read
+    size_t chunk_bytes;
+    // 0 for no cap
+    uint64_t bytes_per_second;
+    // Once per set_options, the first connection to forward this many more
+    // bytes stops for stall_ns, e.g. half way through a mask.
+    uint64_t stall_after_bytes;
+    uint64_t stall_ns;
+    // once per set_options, resets both sides after this many more bytes, 0 for never
+    uint64_t reset_after_bytes;
+} FaultOptions;
+
+
+typedef struct {
+    uint64_t connections;
+    uint64_t bytes_to_server;
+    uint64_t bytes_to_client;
+    uint64_t stalls;
+    uint64_t resets;
+    // when the last fault ended: a stall finished, a reset was sent or faults were switched off
+    uint64_t last_fault_end;
+} FaultProxyStats;
+
+
+typedef struct FaultProxy FaultProxy;
+
+typedef struct {
+    FaultProxy * proxy;
+    int client_fd;
+    int server_fd;
+    // bytes forwarded each way since the options last changed
+    uint64_t generation;
+    uint64_t bytes[2];
+    uint8_t * buffer;
+    // set once both sides are shut, so the accept thread can reap it
+    uint8_t done;
+} FaultConnection;
+
+
+// Sits between the plugin and a segmentation server and injects faults
+// into what it forwards. Addresses are a port, host:port or, when they
+// contain a '/', a Unix socket path.
+struct FaultProxy {
+    char target[SEGMENTATION_SOCKET_PATH_LENGTH];
+    char listen_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    int listen_port;
+    int listen_fd;
+    pthread_t accept_thread;
+    uint8_t accepting;
+
+    pthread_mutex_t mutex;
+    FaultOptions options;
+    // bumped by set_options, re-arms the one-off stall and reset
+    uint64_t generation;
+    uint8_t stall_fired;
+    uint8_t reset_fired;
+    FaultConnection * connections[FAULT_PROXY_MAX_CONNECTIONS];
+    pthread_t connection_threads[FAULT_PROXY_MAX_CONNECTIONS];
+    int num_connections;
+    uint8_t is_running;
+    FaultProxyStats stats;
+};
+
+
+FaultProxy * FaultProxy_create(const char * listen_address, const char * target_address, const FaultOptions * options);
+void FaultProxy_destroy(FaultProxy * self);
+// applies to everything forwarded from now on, open connections included
+void FaultProxy_set_options(FaultProxy * self, const FaultOptions * options);
+void FaultProxy_get_stats(FaultProxy * self, FaultProxyStats * stats);
+// the port listened on, useful when listen_address asked for port 0; -1 for a Unix socket
+int FaultProxy_get_port(FaultProxy * self);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_FAULT_PROXY_H
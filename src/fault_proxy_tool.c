@@ -0,0 +1,123 @@
+// Fault-injecting proxy for trying the plugin against a misbehaving
+// segmentation server: point the plugin at the listen address and the
+// proxy at the real server, and it forwards everything with the
+// requested delays, partial writes, bandwidth cap, stall or reset.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "fault_proxy.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+
+// utility methods
+void usage(const char * name);
+void handle_signal(int signal_number);
+
+
+void usage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s -l listen -t target [-D delay_ms] [-c chunk_bytes] [-b bytes_per_second]\n"
+            "          [-s stall_after_bytes] [-S stall_ms] [-r reset_after_bytes] [-d to-client|to-server|both]\n"
+            "addresses are a port, host:port or a Unix socket path\n",
+            name);
+}
+
+
+void handle_signal(int signal_number)
+{
+    (void)signal_number;
+    stopping = 1;
+}
+
+
+int main(int argc, char ** argv)
+{
+    const char * listen_address = NULL;
+    const char * target_address = NULL;
+    FaultOptions options;
+    memset(&options, 0, sizeof(options));
+    options.directions = FAULT_TO_CLIENT | FAULT_TO_SERVER;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:D:c:b:s:S:r:d:")) != -1) {
+        switch (opt) {
+            case 'l':
+                listen_address = optarg;
+                break;
+            case 't':
+                target_address = optarg;
+                break;
+            case 'D':
+                options.delay_ns = (uint64_t)(atof(optarg) * 1000000.0);
+                break;
+            case 'c':
+                options.chunk_bytes = (size_t)atol(optarg);
+                break;
+            case 'b':
+                options.bytes_per_second = (uint64_t)atoll(optarg);
+                break;
+            case 's':
+                options.stall_after_bytes = (uint64_t)atoll(optarg);
+                break;
+            case 'S':
+                options.stall_ns = (uint64_t)(atof(optarg) * 1000000.0);
+                break;
+            case 'r':
+                options.reset_after_bytes = (uint64_t)atoll(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "to-client") == 0) {
+                    options.directions = FAULT_TO_CLIENT;
+                } else if (strcmp(optarg, "to-server") == 0) {
+                    options.directions = FAULT_TO_SERVER;
+                } else if (strcmp(optarg, "both") == 0) {
+                    options.directions = FAULT_TO_CLIENT | FAULT_TO_SERVER;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (listen_address == NULL || target_address == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    FaultProxy * proxy = FaultProxy_create(listen_address, target_address, &options);
+    if (proxy == NULL) {
+        return 1;
+    }
+    if (FaultProxy_get_port(proxy) >= 0) {
+        printf("forwarding port %d to %s\n", FaultProxy_get_port(proxy), target_address);
+    } else {
+        printf("forwarding %s to %s\n", listen_address, target_address);
+    }
+    fflush(stdout);
+    while (!stopping) {
+        pause();
+    }
+
+    FaultProxyStats stats;
+    FaultProxy_get_stats(proxy, &stats);
+    FaultProxy_destroy(proxy);
+    printf("%llu connections, %llu bytes to the server, %llu bytes to the client, %llu stalls, %llu resets\n",
+           (unsigned long long)stats.connections, (unsigned long long)stats.bytes_to_server,
+           (unsigned long long)stats.bytes_to_client, (unsigned long long)stats.stalls,
+           (unsigned long long)stats.resets);
+    return 0;
+}
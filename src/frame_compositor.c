@@ -0,0 +1,212 @@
+#include <obs-module.h>
+#include <libswscale/swscale.h>
+
+#include "frame_compositor.h"
+#include "scale.h"
+
+struct obs_source_frame * copy_with_alpha(FrameCompositor * self, struct obs_source_frame * frame,
+                                          enum video_format format);
+struct obs_source_frame * convert_to_bgra(FrameCompositor * self, struct obs_source_frame * frame);
+void copy_plane(uint8_t * dst, uint32_t dst_linesize, const uint8_t * src, uint32_t src_linesize,
+                uint32_t row_bytes, uint32_t rows);
+void copy_frame_properties(struct obs_source_frame * dst, const struct obs_source_frame * src);
+
+
+FrameCompositor * FrameCompositor_create(TaskPool * tasks)
+{
+    FrameCompositor * self = (FrameCompositor *)bzalloc(sizeof(FrameCompositor));
+    if (!self) {
+        return NULL;
+    }
+    self->compositor = MaskCompositor_create(tasks);
+    self->pool = FramePool_create();
+    if (!self->compositor || !self->pool) {
+        FrameCompositor_destroy(self);
+        return NULL;
+    }
+    return self;
+}
+
+
+void FrameCompositor_destroy(FrameCompositor * self)
+{
+    if (!self) {
+        return;
+    }
+    MaskCompositor_destroy(self->compositor);
+    FramePool_destroy(self->pool);
+    if (self->convert_context) {
+        sws_freeContext(self->convert_context);
+    }
+    bfree(self);
+}
+
+
+void FrameCompositor_release_buffers(FrameCompositor * self)
+{
+    FramePool_release_idle(self->pool);
+    if (self->convert_context) {
+        sws_freeContext(self->convert_context);
+        self->convert_context = NULL;
+    }
+}
+
+
+size_t FrameCompositor_get_memory_usage(FrameCompositor * self)
+{
+    return sizeof(FrameCompositor) + FramePool_get_memory_usage(self->pool);
+}
+
+
+struct obs_source_frame * FrameCompositor_apply(FrameCompositor * self, obs_source_t * parent,
+                                                struct obs_source_frame * frame,
+                                                const uint8_t * mask, int mask_width, int mask_height)
+{
+    struct obs_source_frame * output;
+
+    switch (frame->format) {
+        case VIDEO_FORMAT_BGRA:
+        case VIDEO_FORMAT_RGBA:
+            MaskCompositor_apply(self->compositor, mask, mask_width, mask_height,
+                                 frame->data[0] + 3, frame->linesize[0], 4, frame->width, frame->height);
+            return frame;
+        case VIDEO_FORMAT_I40A:
+        case VIDEO_FORMAT_I42A:
+        case VIDEO_FORMAT_YUVA:
+            MaskCompositor_apply(self->compositor, mask, mask_width, mask_height,
+                                 frame->data[3], frame->linesize[3], 1, frame->width, frame->height);
+            return frame;
+        case VIDEO_FORMAT_I420:
+            output = copy_with_alpha(self, frame, VIDEO_FORMAT_I40A);
+            break;
+        case VIDEO_FORMAT_I422:
+            output = copy_with_alpha(self, frame, VIDEO_FORMAT_I42A);
+            break;
+        case VIDEO_FORMAT_I444:
+            output = copy_with_alpha(self, frame, VIDEO_FORMAT_YUVA);
+            break;
+        case VIDEO_FORMAT_BGRX:
+            output = copy_with_alpha(self, frame, VIDEO_FORMAT_BGRA);
+            break;
+        default:
+            output = convert_to_bgra(self, frame);
+            break;
+    }
+
+    // every pooled frame is still on screen, show this one unmasked
+    if (output == NULL) {
+        return frame;
+    }
+
+    if (output->format == VIDEO_FORMAT_BGRA) {
+        MaskCompositor_apply(self->compositor, mask, mask_width, mask_height,
+                             output->data[0] + 3, output->linesize[0], 4, output->width, output->height);
+    } else {
+        MaskCompositor_apply(self->compositor, mask, mask_width, mask_height,
+                             output->data[3], output->linesize[3], 1, output->width, output->height);
+    }
+
+    copy_frame_properties(output, frame);
+    FramePool_hand_out(self->pool, output);
+    obs_source_release_frame(parent, frame);
+    return output;
+}
+
+
+struct obs_source_frame * copy_with_alpha(FrameCompositor * self, struct obs_source_frame * frame,
+                                          enum video_format format)
+{
+    struct obs_source_frame * output = FramePool_get(self->pool, format, frame->width, frame->height);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    uint32_t width = frame->width;
+    uint32_t height = frame->height;
+    uint32_t chroma_width = (width + 1) / 2;
+    uint32_t chroma_height = (height + 1) / 2;
+
+    switch (frame->format) {
+        case VIDEO_FORMAT_I420:
+            copy_plane(output->data[0], output->linesize[0], frame->data[0], frame->linesize[0], width, height);
+            copy_plane(output->data[1], output->linesize[1], frame->data[1], frame->linesize[1], chroma_width, chroma_height);
+            copy_plane(output->data[2], output->linesize[2], frame->data[2], frame->linesize[2], chroma_width, chroma_height);
+            break;
+        case VIDEO_FORMAT_I422:
+            copy_plane(output->data[0], output->linesize[0], frame->data[0], frame->linesize[0], width, height);
+            copy_plane(output->data[1], output->linesize[1], frame->data[1], frame->linesize[1], chroma_width, height);
+            copy_plane(output->data[2], output->linesize[2], frame->data[2], frame->linesize[2], chroma_width, height);
+            break;
+        case VIDEO_FORMAT_I444:
+            for (int plane = 0; plane < 3; plane++) {
+                copy_plane(output->data[plane], output->linesize[plane], frame->data[plane], frame->linesize[plane],
+                           width, height);
+            }
+            break;
+        case VIDEO_FORMAT_BGRX:
+            copy_plane(output->data[0], output->linesize[0], frame->data[0], frame->linesize[0], width * 4, height);
+            break;
+        default:
+            return NULL;
+    }
+    return output;
+}
+
+
+struct obs_source_frame * convert_to_bgra(FrameCompositor * self, struct obs_source_frame * frame)
+{
+    enum AVPixelFormat format = get_ffmpeg_video_format(frame->format);
+    if (format == AV_PIX_FMT_NONE) {
+        return NULL;
+    }
+    struct obs_source_frame * output = FramePool_get(self->pool, VIDEO_FORMAT_BGRA, frame->width, frame->height);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    self->convert_context = sws_getCachedContext(self->convert_context,
+                                                 frame->width, frame->height, format,
+                                                 frame->width, frame->height, AV_PIX_FMT_BGRA,
+                                                 SWS_POINT, NULL, NULL, NULL);
+    if (self->convert_context == NULL) {
+        return NULL;
+    }
+    // OBS' default for HD sources is 709, SD sources are 601
+    sws_setColorspaceDetails(self->convert_context,
+                             sws_getCoefficients(frame->height >= 720 ? SWS_CS_ITU709 : SWS_CS_ITU601),
+                             frame->full_range, sws_getCoefficients(SWS_CS_DEFAULT), 1, 0, 1 << 16, 1 << 16);
+
+    int src_linesize[MAX_AV_PLANES];
+    int dst_linesize[MAX_AV_PLANES];
+    for (int i = 0; i < MAX_AV_PLANES; i++) {
+        src_linesize[i] = (int)frame->linesize[i];
+        dst_linesize[i] = (int)output->linesize[i];
+    }
+    sws_scale(self->convert_context, (const uint8_t * const *)frame->data, src_linesize, 0, frame->height,
+              output->data, dst_linesize);
+    return output;
+}
+
+
+void copy_plane(uint8_t * dst, uint32_t dst_linesize, const uint8_t * src, uint32_t src_linesize,
+                uint32_t row_bytes, uint32_t rows)
+{
+    if (dst_linesize == src_linesize) {
+        memcpy(dst, src, (size_t)src_linesize * rows);
+        return;
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        memcpy(dst + (size_t)y * dst_linesize, src + (size_t)y * src_linesize, row_bytes);
+    }
+}
+
+
+void copy_frame_properties(struct obs_source_frame * dst, const struct obs_source_frame * src)
+{
+    dst->timestamp = src->timestamp;
+    dst->full_range = src->full_range;
+    dst->flip = src->flip;
+    memcpy(dst->color_matrix, src->color_matrix, sizeof(dst->color_matrix));
+    memcpy(dst->color_range_min, src->color_range_min, sizeof(dst->color_range_min));
+    memcpy(dst->color_range_max, src->color_range_max, sizeof(dst->color_range_max));
+}
@@ -0,0 +1,37 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_FRAME_COMPOSITOR_H
+#define OBS_VIRTUAL_BACKGROUND_FRAME_COMPOSITOR_H
+
+#include <obs-module.h>
+#include <libswscale/swscale.h>
+
+#include "composite.h"
+#include "frame_pool.h"
+#include "task_pool.h"
+
+
+// Bakes the mask into the alpha of async frames so the GPU only has to
+// draw them. Formats with an alpha channel are written in place. Planar
+// YUV is copied to its alpha sibling (I420 -> I40A, ...) and everything
+// else is converted to BGRA, both into pooled output frames.
+typedef struct {
+    MaskCompositor * compositor;
+    FramePool * pool;
+    struct SwsContext * convert_context;
+} FrameCompositor;
+
+
+FrameCompositor * FrameCompositor_create(TaskPool * tasks);
+void FrameCompositor_destroy(FrameCompositor * self);
+
+// Returns the frame to hand back to OBS. If that is a pooled frame, the
+// input frame has already been released to parent.
+struct obs_source_frame * FrameCompositor_apply(FrameCompositor * self, obs_source_t * parent,
+                                                struct obs_source_frame * frame,
+                                                const uint8_t * mask, int mask_width, int mask_height);
+
+// frees the pooled frames and the conversion context until they are needed again
+void FrameCompositor_release_buffers(FrameCompositor * self);
+size_t FrameCompositor_get_memory_usage(FrameCompositor * self);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_FRAME_COMPOSITOR_H
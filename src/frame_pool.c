@@ -0,0 +1,110 @@
+#include <obs-module.h>
+#include <util/threading.h>
+
+#include "frame_pool.h"
+
+// utility methods
+size_t frame_size(const struct obs_source_frame * frame);
+
+
+FramePool * FramePool_create()
+{
+    FramePool * self = (FramePool *)bzalloc(sizeof(FramePool));
+    if (!self) {
+        return NULL;
+    }
+    self->num_frames = 0;
+    return self;
+}
+
+
+void FramePool_destroy(FramePool * self)
+{
+    if (!self) {
+        return;
+    }
+    for (int i = 0; i < self->num_frames; i++) {
+        // if OBS still holds the frame, its release destroys it
+        if (os_atomic_dec_long(&self->frames[i]->refs) == 0) {
+            obs_source_frame_destroy(self->frames[i]);
+        }
+    }
+    bfree(self);
+}
+
+
+struct obs_source_frame * FramePool_get(FramePool * self, enum video_format format, uint32_t width, uint32_t height)
+{
+    int free_index = -1;
+    for (int i = 0; i < self->num_frames; i++) {
+        struct obs_source_frame * frame = self->frames[i];
+        if (os_atomic_load_long(&frame->refs) != 1) {
+            continue;
+        }
+        if (frame->format == format && frame->width == width && frame->height == height) {
+            return frame;
+        }
+        free_index = i;
+    }
+
+    if (free_index == -1) {
+        if (self->num_frames >= FRAME_POOL_SIZE) {
+            return NULL;
+        }
+        free_index = self->num_frames++;
+    } else {
+        obs_source_frame_destroy(self->frames[free_index]);
+    }
+
+    struct obs_source_frame * frame = obs_source_frame_create(format, width, height);
+    if (frame == NULL) {
+        self->frames[free_index] = self->frames[--self->num_frames];
+        return NULL;
+    }
+    frame->refs = 1;
+    self->frames[free_index] = frame;
+    return frame;
+}
+
+
+void FramePool_release_idle(FramePool * self)
+{
+    for (int i = self->num_frames - 1; i >= 0; i--) {
+        if (os_atomic_load_long(&self->frames[i]->refs) == 1) {
+            obs_source_frame_destroy(self->frames[i]);
+            self->frames[i] = self->frames[--self->num_frames];
+        }
+    }
+}
+
+
+size_t FramePool_get_memory_usage(FramePool * self)
+{
+    size_t result = sizeof(FramePool);
+    for (int i = 0; i < self->num_frames; i++) {
+        result += frame_size(self->frames[i]);
+    }
+    return result;
+}
+
+
+size_t frame_size(const struct obs_source_frame * frame)
+{
+    size_t result = 0;
+    for (int i = 0; i < MAX_AV_PLANES && frame->data[i] != NULL; i++) {
+        uint32_t height = frame->height;
+        // the chroma planes of 4:2:0 formats are half height
+        if ((frame->format == VIDEO_FORMAT_I420 || frame->format == VIDEO_FORMAT_I40A) && (i == 1 || i == 2)) {
+            height = (height + 1) / 2;
+        }
+        result += (size_t)frame->linesize[i] * height;
+    }
+    return result;
+}
+
+
+void FramePool_hand_out(FramePool * self, struct obs_source_frame * frame)
+{
+    UNUSED_PARAMETER(self);
+    os_atomic_inc_long(&frame->refs);
+}
@@ -0,0 +1,32 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_FRAME_POOL_H
+#define OBS_VIRTUAL_BACKGROUND_FRAME_POOL_H
+
+#include <obs-module.h>
+
+#define FRAME_POOL_SIZE                4
+
+
+// Output frames for filter_video when the source format has no room for
+// alpha. The pool keeps one reference to each frame and adds one for OBS
+// whenever a frame is handed out, so obs_source_release_frame only drops
+// OBS's reference and the frame can be reused once OBS is done with it.
+typedef struct {
+    struct obs_source_frame * frames[FRAME_POOL_SIZE];
+    int num_frames;
+} FramePool;
+
+
+FramePool * FramePool_create();
+void FramePool_destroy(FramePool * self);
+
+// returns a frame OBS no longer holds, (re)allocated for this format and
+// size, or NULL if every frame is still in use
+struct obs_source_frame * FramePool_get(FramePool * self, enum video_format format, uint32_t width, uint32_t height);
+// call right before returning the frame from filter_video
+void FramePool_hand_out(FramePool * self, struct obs_source_frame * frame);
+// destroys every frame OBS no longer holds
+void FramePool_release_idle(FramePool * self);
+size_t FramePool_get_memory_usage(FramePool * self);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_FRAME_POOL_H
@@ -1,6 +1,13 @@
-#include <obs-module.h>
+#include <sys/mman.h>
+
+#include "compat.h"
 
 #include "imgarray.h"
+#include "thread_policy.h"
+
+// utility methods
+uint8_t * allocate_buffer(ImgArray * self, size_t size);
+void free_buffer(ImgArray * self);
 
 
 ImgArray * ImgArray_create()
@@ -11,6 +18,10 @@ ImgArray * ImgArray_create()
     }
     arr->buffer = NULL;
     arr->size = 0;
+    arr->pinning = 0;
+    arr->mapped = 0;
+    arr->locked = 0;
+    return arr;
 }
 
 
@@ -19,9 +30,7 @@ void ImgArray_destroy(ImgArray * self)
     if (!self) {
         return;
     }
-    if (self->buffer) {
-        bfree(self->buffer);
-    }
+    free_buffer(self);
     bfree(self);
 }
 
@@ -43,6 +52,47 @@ int ImgArray_copy_from_array(ImgArray *self, ImgArray *other)
     return ImgArray_copy_from_raw_buffer(self, other->buffer, other->size);
 }
 
+void ImgArray_clear(ImgArray *self)
+{
+    free_buffer(self);
+    self->size = 0;
+}
+
+int ImgArray_set_pinning(ImgArray *self, int pinning)
+{
+    if (self->pinning == pinning) {
+        return 0;
+    }
+    self->pinning = pinning;
+    if (!self->buffer) {
+        return 0;
+    }
+    // move what's there into a buffer allocated the new way
+    uint8_t * old_buffer = self->buffer;
+    uint8_t old_mapped = self->mapped;
+    uint8_t old_locked = self->locked;
+    uint8_t * buffer = allocate_buffer(self, self->size);
+    if (!buffer) {
+        self->buffer = old_buffer;
+        self->mapped = old_mapped;
+        self->locked = old_locked;
+        return 1;
+    }
+    memcpy(buffer, old_buffer, self->size);
+    if (old_mapped) {
+        munmap(old_buffer, self->size);
+    } else {
+        bfree(old_buffer);
+    }
+    self->buffer = buffer;
+    return 0;
+}
+
+int ImgArray_is_locked(ImgArray *self)
+{
+    return self->locked;
+}
+
 uint8_t * ImgArray_get_buffer(ImgArray *self)
 {
     return self->buffer;
@@ -58,10 +108,48 @@ uint8_t * ImgArray_ensure_buffer(ImgArray * self, size_t size)
     if (self->buffer && self->size == size) {
         return self->buffer;
     }
-    if (self->buffer) {
-        bfree(self->buffer);
-    }
-    self->buffer = (uint8_t *)bzalloc(size);
+    free_buffer(self);
+    self->buffer = allocate_buffer(self, size);
     self->size = size;
     return self->buffer;
-}
\ No newline at end of file
+}
+
+
+uint8_t * allocate_buffer(ImgArray * self, size_t size)
+{
+    self->mapped = 0;
+    self->locked = 0;
+    if (!self->pinning || size == 0) {
+        return (uint8_t *)bzalloc(size);
+    }
+    void * buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return NULL;
+    }
+    self->mapped = 1;
+#ifdef MADV_HUGEPAGE
+    if (self->pinning & THREAD_POLICY_HUGE_PAGES) {
+        madvise(buffer, size, MADV_HUGEPAGE);
+    }
+#endif
+    // fails beyond RLIMIT_MEMLOCK, which is only 64KB on many systems
+    if ((self->pinning & THREAD_POLICY_LOCK_MEMORY) && mlock(buffer, size) == 0) {
+        self->locked = 1;
+    }
+    return (uint8_t *)buffer;
+}
+
+
+void free_buffer(ImgArray * self)
+{
+    if (self->buffer) {
+        if (self->mapped) {
+            munmap(self->buffer, self->size);
+        } else {
+            bfree(self->buffer);
+        }
+    }
+    self->buffer = NULL;
+    self->mapped = 0;
+    self->locked = 0;
+}
@@ -8,6 +8,11 @@
 typedef struct {
     uint8_t * buffer;
     size_t size;
+    // THREAD_POLICY_LOCK_MEMORY / THREAD_POLICY_HUGE_PAGES, see ImgArray_set_pinning
+    int pinning;
+    // buffer came from mmap rather than bzalloc
+    uint8_t mapped;
+    uint8_t locked;
 } ImgArray;
 
 
@@ -18,5 +23,12 @@ uint8_t * ImgArray_get_buffer(ImgArray *self);
 size_t ImgArray_get_size(ImgArray *self);
 int ImgArray_copy_from_raw_buffer(ImgArray *self, const uint8_t * other, size_t size);
 int ImgArray_copy_from_array(ImgArray *self, ImgArray *other);
+// frees the buffer, the array is empty until it is filled again
+void ImgArray_clear(ImgArray *self);
+// Allocates the buffer, now and from then on, locked into RAM and/or backed by
+// huge pages. Either is best effort: without the rights the buffer is still
+// allocated, just not pinned, and ImgArray_is_locked says so.
+int ImgArray_set_pinning(ImgArray *self, int pinning);
+int ImgArray_is_locked(ImgArray *self);
 
 #endif //OBS_VIRTUAL_BACKGROUND_IMGARRAY_H
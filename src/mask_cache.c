@@ -0,0 +1,320 @@
+#include <pthread.h>
+#include <errno.h>
+
+#include "compat.h"
+#include "mask_cache.h"
+
+// 8 independent 64-bit lanes over 64 byte stripes. Each lane only needs a
+// 32x32->64 multiply, which SSE2, AVX2 and NEON all have, so the loop
+// below vectorizes without any intrinsics.
+#define HASH_LANES                     8
+#define HASH_STRIPE                    (HASH_LANES * 8)
+#define HASH_PRIME                     0x9E3779B185EBCA87ULL
+
+static const uint64_t hash_secret[HASH_LANES] = {
+        0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+        0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+
+// utility methods
+void cache_lock(MaskCache * self);
+void cache_unlock(MaskCache * self);
+int keys_equal(const MaskCacheKey * a, const MaskCacheKey * b);
+MaskCacheEntry * find_entry(MaskCache * self, const MaskCacheKey * key);
+MaskCacheEntry * reserve_entry(MaskCache * self, const MaskCacheKey * key);
+int evict_entry(MaskCache * self);
+void clear_entry(MaskCache * self, MaskCacheEntry * entry);
+void hash_stripe(uint64_t * acc, const uint8_t * data);
+uint64_t mix64(uint64_t value);
+
+
+MaskCache * MaskCache_create(size_t max_bytes)
+{
+    MaskCache * self = (MaskCache *)bzalloc(sizeof(MaskCache));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(self->cond), &attr);
+    pthread_condattr_destroy(&attr);
+    self->max_bytes = max_bytes;
+    self->bytes = 0;
+    self->clock = 0;
+    return self;
+}
+
+
+void MaskCache_destroy(MaskCache * self)
+{
+    if (!self) {
+        return;
+    }
+    for (int i = 0; i < MASK_CACHE_MAX_ENTRIES; i++) {
+        if (self->entries[i].mask) {
+            ImgArray_destroy(self->entries[i].mask);
+        }
+    }
+    pthread_cond_destroy(&(self->cond));
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+uint64_t MaskCache_hash(const uint8_t * data, size_t size)
+{
+    uint64_t acc[HASH_LANES];
+    for (int i = 0; i < HASH_LANES; i++) {
+        acc[i] = hash_secret[(i + 1) % HASH_LANES];
+    }
+
+    size_t stripes = size / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; s++) {
+        hash_stripe(acc, data + s * HASH_STRIPE);
+    }
+    size_t remaining = size - stripes * HASH_STRIPE;
+    if (remaining > 0) {
+        // the length is mixed in below, so zero padding is unambiguous
+        uint8_t tail[HASH_STRIPE] = {0};
+        memcpy(tail, data + stripes * HASH_STRIPE, remaining);
+        hash_stripe(acc, tail);
+    }
+
+    uint64_t result = (uint64_t)size * HASH_PRIME;
+    for (int i = 0; i < HASH_LANES; i++) {
+        result = (result ^ mix64(acc[i])) * HASH_PRIME;
+    }
+    return mix64(result);
+}
+
+
+int MaskCache_acquire(MaskCache * self, const MaskCacheKey * key, ImgArray * dst)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += MASK_CACHE_WAIT_NS % 1000000000ULL;
+    deadline.tv_sec += MASK_CACHE_WAIT_NS / 1000000000ULL + deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    int waited = 0;
+    int result;
+    cache_lock(self);
+    while (1) {
+        MaskCacheEntry * entry = find_entry(self, key);
+        if (entry == NULL) {
+            result = reserve_entry(self, key) ? MASK_CACHE_MISS : MASK_CACHE_BUSY;
+            self->stats.misses++;
+            break;
+        }
+        if (!entry->pending) {
+            entry->last_used = ++self->clock;
+            if (ImgArray_copy_from_array(dst, entry->mask)) {
+                result = MASK_CACHE_BUSY;
+                self->stats.misses++;
+            } else {
+                result = MASK_CACHE_HIT;
+                self->stats.hits++;
+            }
+            break;
+        }
+        // another instance is segmenting this very frame right now
+        if (!waited) {
+            self->stats.waits++;
+            waited = 1;
+        }
+        if (pthread_cond_timedwait(&(self->cond), &(self->mutex), &deadline) == ETIMEDOUT) {
+            result = MASK_CACHE_BUSY;
+            self->stats.misses++;
+            break;
+        }
+    }
+    cache_unlock(self);
+    return result;
+}
+
+
+void MaskCache_fulfill(MaskCache * self, const MaskCacheKey * key, const uint8_t * mask, size_t size)
+{
+    cache_lock(self);
+    MaskCacheEntry * entry = find_entry(self, key);
+    if (entry == NULL) {
+        entry = reserve_entry(self, key);
+    }
+    if (entry == NULL || size > self->max_bytes) {
+        if (entry) {
+            clear_entry(self, entry);
+        }
+        pthread_cond_broadcast(&(self->cond));
+        cache_unlock(self);
+        return;
+    }
+
+    // keep the entry out of the way of evict_entry while making room
+    entry->pending = 1;
+    if (entry->mask) {
+        self->bytes -= ImgArray_get_size(entry->mask);
+    }
+    while (self->bytes + size > self->max_bytes && evict_entry(self) == 0) {
+    }
+    if (self->bytes + size > self->max_bytes ||
+            (!entry->mask && !(entry->mask = ImgArray_create())) ||
+            ImgArray_copy_from_raw_buffer(entry->mask, mask, size)) {
+        if (entry->mask) {
+            self->bytes += ImgArray_get_size(entry->mask);
+        }
+        clear_entry(self, entry);
+    } else {
+        self->bytes += size;
+        entry->pending = 0;
+        entry->last_used = ++self->clock;
+    }
+    pthread_cond_broadcast(&(self->cond));
+    cache_unlock(self);
+}
+
+
+void MaskCache_abandon(MaskCache * self, const MaskCacheKey * key)
+{
+    cache_lock(self);
+    MaskCacheEntry * entry = find_entry(self, key);
+    if (entry != NULL && entry->pending) {
+        clear_entry(self, entry);
+        // a waiter takes over the reservation
+        pthread_cond_broadcast(&(self->cond));
+    }
+    cache_unlock(self);
+}
+
+
+void MaskCache_get_stats(MaskCache * self, MaskCacheStats * stats)
+{
+    cache_lock(self);
+    *stats = self->stats;
+    stats->entries = 0;
+    for (int i = 0; i < MASK_CACHE_MAX_ENTRIES; i++) {
+        if (self->entries[i].used && !self->entries[i].pending) {
+            stats->entries++;
+        }
+    }
+    stats->bytes = self->bytes;
+    cache_unlock(self);
+}
+
+
+int keys_equal(const MaskCacheKey * a, const MaskCacheKey * b)
+{
+    return a->hash == b->hash &&
+            a->size == b->size &&
+            a->height == b->height &&
+            a->width == b->width &&
+            a->stride == b->stride &&
+            a->pixel_format == b->pixel_format &&
+            a->segmentation_threshold == b->segmentation_threshold &&
+            a->blur == b->blur &&
+            a->growshrink == b->growshrink;
+}
+
+
+MaskCacheEntry * find_entry(MaskCache * self, const MaskCacheKey * key)
+{
+    for (int i = 0; i < MASK_CACHE_MAX_ENTRIES; i++) {
+        if (self->entries[i].used && keys_equal(&(self->entries[i].key), key)) {
+            return &(self->entries[i]);
+        }
+    }
+    return NULL;
+}
+
+
+// claims a free slot for key, evicting if needed; NULL if every slot is pending
+MaskCacheEntry * reserve_entry(MaskCache * self, const MaskCacheKey * key)
+{
+    MaskCacheEntry * entry = NULL;
+    for (int i = 0; i < MASK_CACHE_MAX_ENTRIES && entry == NULL; i++) {
+        if (!self->entries[i].used) {
+            entry = &(self->entries[i]);
+        }
+    }
+    if (entry == NULL) {
+        if (evict_entry(self)) {
+            return NULL;
+        }
+        return reserve_entry(self, key);
+    }
+    entry->key = *key;
+    entry->used = 1;
+    entry->pending = 1;
+    entry->last_used = ++self->clock;
+    return entry;
+}
+
+
+// drops the least recently used finished entry, returns 1 if there was none
+int evict_entry(MaskCache * self)
+{
+    MaskCacheEntry * oldest = NULL;
+    for (int i = 0; i < MASK_CACHE_MAX_ENTRIES; i++) {
+        MaskCacheEntry * entry = &(self->entries[i]);
+        if (!entry->used || entry->pending) {
+            continue;
+        }
+        if (oldest == NULL || entry->last_used < oldest->last_used) {
+            oldest = entry;
+        }
+    }
+    if (oldest == NULL) {
+        return 1;
+    }
+    clear_entry(self, oldest);
+    self->stats.evictions++;
+    return 0;
+}
+
+
+void clear_entry(MaskCache * self, MaskCacheEntry * entry)
+{
+    if (entry->mask) {
+        self->bytes -= ImgArray_get_size(entry->mask);
+        ImgArray_destroy(entry->mask);
+        entry->mask = NULL;
+    }
+    entry->used = 0;
+    entry->pending = 0;
+}
+
+
+void hash_stripe(uint64_t * acc, const uint8_t * data)
+{
+    uint64_t words[HASH_LANES];
+    memcpy(words, data, sizeof(words));
+    for (int i = 0; i < HASH_LANES; i++) {
+        uint64_t key = words[i] ^ hash_secret[i];
+        acc[i ^ 1] += words[i];
+        acc[i] += (key & 0xFFFFFFFFULL) * (key >> 32);
+    }
+}
+
+
+uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+
+void cache_lock(MaskCache * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+}
+
+void cache_unlock(MaskCache * self)
+{
+    pthread_mutex_unlock(&(self->mutex));
+}
@@ -0,0 +1,89 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_MASK_CACHE_H
+#define OBS_VIRTUAL_BACKGROUND_MASK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "segmentation_client.h"
+#include "imgarray.h"
+
+#define MASK_CACHE_MAX_ENTRIES         64
+#define MASK_CACHE_DEFAULT_BYTES       (16 * 1024 * 1024)
+// how long a worker waits for another one segmenting the same frame
+#define MASK_CACHE_WAIT_NS             250000000ULL
+
+
+enum MaskCacheResult {
+    // the mask was copied out of the cache
+    MASK_CACHE_HIT = 0,
+    // the caller now segments the frame and must MaskCache_fulfill or MaskCache_abandon the key
+    MASK_CACHE_MISS = 1,
+    // nothing cached and the key could not be reserved, segment without telling the cache
+    MASK_CACHE_BUSY = 2
+};
+
+
+// everything the mask of a frame depends on
+typedef struct {
+    uint64_t hash;
+    size_t size;
+    int height;
+    int width;
+    int stride;
+    enum PixelFormat pixel_format;
+    float segmentation_threshold;
+    int blur;
+    int growshrink;
+} MaskCacheKey;
+
+
+typedef struct {
+    MaskCacheKey key;
+    uint8_t used;
+    // reserved by a worker that is still segmenting the frame
+    uint8_t pending;
+    uint64_t last_used;
+    ImgArray * mask;
+} MaskCacheEntry;
+
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    // lookups that found the frame being segmented and waited for it
+    uint64_t waits;
+    uint64_t evictions;
+    int entries;
+    size_t bytes;
+} MaskCacheStats;
+
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    MaskCacheEntry entries[MASK_CACHE_MAX_ENTRIES];
+    size_t max_bytes;
+    size_t bytes;
+    // bumped on every access, entries with the lowest last_used go first
+    uint64_t clock;
+    MaskCacheStats stats;
+} MaskCache;
+
+
+MaskCache * MaskCache_create(size_t max_bytes);
+void MaskCache_destroy(MaskCache * self);
+
+// hash of a scaled frame, for MaskCacheKey.hash
+uint64_t MaskCache_hash(const uint8_t * data, size_t size);
+
+int MaskCache_acquire(MaskCache * self, const MaskCacheKey * key, ImgArray * dst);
+// stores the mask of a key the caller got a MISS or BUSY for
+void MaskCache_fulfill(MaskCache * self, const MaskCacheKey * key, const uint8_t * mask, size_t size);
+// gives up a MISS reservation, e.g. because segmentation failed
+void MaskCache_abandon(MaskCache * self, const MaskCacheKey * key);
+
+void MaskCache_get_stats(MaskCache * self, MaskCacheStats * stats);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_MASK_CACHE_H
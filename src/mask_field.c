@@ -0,0 +1,338 @@
+#include <math.h>
+
+#include "compat.h"
+
+#include "mask_field.h"
+#include "mask_fusion.h"
+
+
+typedef struct {
+    MaskField * self;
+    const uint8_t * mask;
+} FieldJob;
+
+
+int ensure_field_buffers(MaskField * self, int height, int width);
+size_t field_scratch_size(int width);
+void field_columns(void * context, int task, int num_tasks);
+void field_rows(void * context, int task, int num_tasks);
+void field_envelope(const float * f, int n, float limit, int32_t * v, double * z, float * d);
+
+
+MaskField * MaskField_create(TaskPool * pool)
+{
+    MaskField * self = (MaskField *)bzalloc(sizeof(MaskField));
+    if (!self) {
+        return NULL;
+    }
+    self->pool = pool;
+    self->num_tasks = pool ? TaskPool_get_parallelism(pool) : 1;
+    self->field = ImgArray_create();
+    self->encoded = ImgArray_create();
+    self->columns = ImgArray_create();
+    self->scratch = ImgArray_create();
+    if (!self->field || !self->encoded || !self->columns || !self->scratch) {
+        MaskField_destroy(self);
+        return NULL;
+    }
+    return self;
+}
+
+
+void MaskField_destroy(MaskField * self)
+{
+    if (!self) {
+        return;
+    }
+    ImgArray_destroy(self->field);
+    ImgArray_destroy(self->encoded);
+    ImgArray_destroy(self->columns);
+    ImgArray_destroy(self->scratch);
+    bfree(self);
+}
+
+
+void MaskField_clear(MaskField * self)
+{
+    ImgArray_clear(self->field);
+    ImgArray_clear(self->encoded);
+    ImgArray_clear(self->columns);
+    ImgArray_clear(self->scratch);
+    self->height = 0;
+    self->width = 0;
+}
+
+
+size_t MaskField_get_memory_usage(MaskField * self)
+{
+    return sizeof(MaskField) + ImgArray_get_size(self->field) + ImgArray_get_size(self->encoded) +
+           ImgArray_get_size(self->columns) + ImgArray_get_size(self->scratch);
+}
+
+
+int MaskField_build(MaskField * self, const uint8_t * mask, int height, int width)
+{
+    if (mask == NULL || height <= 0 || width <= 0) {
+        return 1;
+    }
+    if (ensure_field_buffers(self, height, width)) {
+        return 1;
+    }
+    FieldJob job = {
+            .self = self,
+            .mask = mask,
+    };
+    if (self->pool) {
+        TaskPool_run(self->pool, self->num_tasks, field_columns, &job);
+        TaskPool_run(self->pool, self->num_tasks, field_rows, &job);
+    } else {
+        field_columns(&job, 0, 1);
+        field_rows(&job, 0, 1);
+    }
+
+    const float * field = (const float *)ImgArray_get_buffer(self->field);
+    uint8_t * encoded = ImgArray_get_buffer(self->encoded);
+    size_t size = (size_t)height * width;
+    for (size_t i = 0; i < size; i++) {
+        float level = 128.0f + MASK_FIELD_LEVELS_PER_PIXEL * field[i] + 0.5f;
+        level = level < 0.0f ? 0.0f : level;
+        level = level > 255.0f ? 255.0f : level;
+        encoded[i] = (uint8_t)level;
+    }
+    return 0;
+}
+
+
+int MaskField_apply(MaskField * self, float grow, float feather, uint8_t * dst)
+{
+    if (dst == NULL || self->height <= 0 || self->width <= 0) {
+        return 1;
+    }
+    if (feather < 1.0f) {
+        feather = 1.0f;
+    }
+    const float * field = (const float *)ImgArray_get_buffer(self->field);
+    size_t size = (size_t)self->height * self->width;
+    float scale = 255.0f / feather;
+    float offset = 127.5f + grow * scale + 0.5f;
+    for (size_t i = 0; i < size; i++) {
+        float alpha = field[i] * scale + offset;
+        alpha = alpha < 0.0f ? 0.0f : alpha;
+        alpha = alpha > 255.0f ? 255.0f : alpha;
+        dst[i] = (uint8_t)alpha;
+    }
+    return 0;
+}
+
+
+int MaskField_apply_encoded(const uint8_t * encoded, size_t size, float grow, float feather, uint8_t * dst)
+{
+    if (encoded == NULL || dst == NULL) {
+        return 1;
+    }
+    if (feather < 1.0f) {
+        feather = 1.0f;
+    }
+    // the same ramp as MaskField_apply, with the distance decoded on the way
+    float scale = 255.0f / (MASK_FIELD_LEVELS_PER_PIXEL * feather);
+    float offset = 127.5f + (grow - 128.0f / MASK_FIELD_LEVELS_PER_PIXEL) * (255.0f / feather) + 0.5f;
+    for (size_t i = 0; i < size; i++) {
+        float alpha = encoded[i] * scale + offset;
+        alpha = alpha < 0.0f ? 0.0f : alpha;
+        alpha = alpha > 255.0f ? 255.0f : alpha;
+        dst[i] = (uint8_t)alpha;
+    }
+    return 0;
+}
+
+
+float MaskField_grow_for(int growshrink)
+{
+    // the server dilates or erodes with a growshrink pixel square
+    return growshrink / 2.0f;
+}
+
+
+float MaskField_feather_for(int blur)
+{
+    if (blur <= 0) {
+        return 1.0f;
+    }
+    // a ramp as steep as the middle of the server's 2 * blur + 1 Gaussian,
+    // with OpenCV's sigma for that kernel size
+    float sigma = 0.3f * (blur - 1) + 0.8f;
+    float feather = sigma * 2.5066283f;
+    return feather > 1.0f ? feather : 1.0f;
+}
+
+
+int ensure_field_buffers(MaskField * self, int height, int width)
+{
+    size_t size = (size_t)height * width;
+    size_t scratch = (size_t)self->num_tasks * field_scratch_size(width);
+    if (!ImgArray_ensure_buffer(self->field, size * sizeof(float)) ||
+        !ImgArray_ensure_buffer(self->encoded, size) ||
+        !ImgArray_ensure_buffer(self->columns, size * sizeof(int32_t)) ||
+        !ImgArray_ensure_buffer(self->scratch, scratch)) {
+        return 1;
+    }
+    self->height = height;
+    self->width = width;
+    return 0;
+}
+
+
+// one task's envelope intersections, four rows of floats and the vertices, kept 8 byte aligned
+size_t field_scratch_size(int width)
+{
+    size_t size = sizeof(double) * 2 * ((size_t)width + 1) + sizeof(float) * 4 * width + sizeof(int32_t) * width;
+    return (size + 7) & ~(size_t)7;
+}
+
+
+// Each task owns a vertical band and sweeps it down then up, a whole band
+// row at a time so the inner loops run along memory and vectorise. Every
+// pixel gets the distance to the nearest pixel of the other class above or
+// below it, so the rows can measure to either class: its own is at 0.
+void field_columns(void * context, int task, int num_tasks)
+{
+    FieldJob * job = (FieldJob *)context;
+    MaskField * self = job->self;
+    int height = self->height;
+    int width = self->width;
+    int first = (int)((int64_t)width * task / num_tasks);
+    int last = (int)((int64_t)width * (task + 1) / num_tasks);
+    int32_t * columns = (int32_t *)ImgArray_get_buffer(self->columns);
+    // nothing further than the field's range is told apart
+    int32_t far = MASK_FIELD_RANGE + 1;
+
+    for (int x = first; x < last; x++) {
+        columns[x] = far;
+    }
+    for (int y = 1; y < height; y++) {
+        const uint8_t * mask = job->mask + (size_t)y * width;
+        const uint8_t * mask_above = mask - width;
+        int32_t * row = columns + (size_t)y * width;
+        const int32_t * above = row - width;
+        for (int x = first; x < last; x++) {
+            int32_t next = above[x] < far ? above[x] + 1 : far;
+            row[x] = (mask[x] >= MASK_FUSION_THRESHOLD) != (mask_above[x] >= MASK_FUSION_THRESHOLD) ? 1 : next;
+        }
+    }
+    for (int y = height - 2; y >= 0; y--) {
+        const uint8_t * mask = job->mask + (size_t)y * width;
+        const uint8_t * mask_below = mask + width;
+        int32_t * row = columns + (size_t)y * width;
+        const int32_t * below = row + width;
+        for (int x = first; x < last; x++) {
+            int32_t next = (mask[x] >= MASK_FUSION_THRESHOLD) != (mask_below[x] >= MASK_FUSION_THRESHOLD) ?
+                    1 : below[x] + 1;
+            row[x] = row[x] < next ? row[x] : next;
+        }
+    }
+}
+
+
+// each task owns a horizontal band and finishes it a row at a time
+void field_rows(void * context, int task, int num_tasks)
+{
+    FieldJob * job = (FieldJob *)context;
+    MaskField * self = job->self;
+    int height = self->height;
+    int width = self->width;
+    int first = (int)((int64_t)height * task / num_tasks);
+    int last = (int)((int64_t)height * (task + 1) / num_tasks);
+    const int32_t * columns = (const int32_t *)ImgArray_get_buffer(self->columns);
+    float * field = (float *)ImgArray_get_buffer(self->field);
+    double * z = (double *)(ImgArray_get_buffer(self->scratch) + (size_t)task * field_scratch_size(width));
+    float * to_background = (float *)(z + 2 * ((size_t)width + 1));
+    float * to_foreground = to_background + width;
+    float * inside = to_foreground + width;
+    float * outside = inside + width;
+    int32_t * vertices = (int32_t *)(outside + width);
+    float limit = (float)(MASK_FIELD_RANGE + 1) * (MASK_FIELD_RANGE + 1);
+
+    for (int y = first; y < last; y++) {
+        const int32_t * column = columns + (size_t)y * width;
+        const uint8_t * mask = job->mask + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            float squared = (float)column[x] * (float)column[x];
+            uint8_t foreground = mask[x] >= MASK_FUSION_THRESHOLD;
+            to_background[x] = foreground ? squared : 0.0f;
+            to_foreground[x] = foreground ? 0.0f : squared;
+        }
+        field_envelope(to_background, width, limit, vertices, z, inside);
+        field_envelope(to_foreground, width, limit, vertices, z, outside);
+
+        // from the pixel's centre to the outline half way to the nearest other pixel
+        float * out = field + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            out[x] = mask[x] >= MASK_FUSION_THRESHOLD ? sqrtf(inside[x]) - 0.5f : 0.5f - sqrtf(outside[x]);
+        }
+    }
+}
+
+
+// Felzenszwalb and Huttenlocher's lower envelope of the parabolas rooted at
+// (q, f[q]): d[p] = min over q of (p - q)^2 + f[q], capped at limit. Roots
+// at or above limit can't lower anything and are left out, as are zeros
+// inside a run of zeros, which only the run's ends can be nearest to. That
+// leaves d wrong only where f is 0, which the caller doesn't read, and rows
+// far from the outline cost a single scan. The intersections are kept as
+// fractions, exact in doubles, so nothing is divided. z needs 2 * n + 2
+// entries.
+void field_envelope(const float * f, int n, float limit, int32_t * v, double * z, float * d)
+{
+    // z[k] = numerators[k] / denominators[k], with a 0 denominator for infinity
+    double * numerators = z;
+    double * denominators = z + n + 1;
+    int k = -1;
+    for (int q = 0; q < n; q++) {
+        if (f[q] >= limit || (f[q] == 0.0f && q > 0 && q < n - 1 && f[q - 1] == 0.0f && f[q + 1] == 0.0f)) {
+            continue;
+        }
+        if (k < 0) {
+            k = 0;
+            v[0] = q;
+            numerators[0] = -1.0;
+            denominators[0] = 0.0;
+            numerators[1] = 1.0;
+            denominators[1] = 0.0;
+            continue;
+        }
+        double root = (double)f[q] + (double)q * q;
+        double numerator;
+        double denominator;
+        // z[0] is -infinity, so this stops at the first parabola at the latest
+        while (1) {
+            int r = v[k];
+            numerator = root - ((double)f[r] + (double)r * r);
+            denominator = 2.0 * (q - r);
+            if (numerator * denominators[k] > numerators[k] * denominator) {
+                break;
+            }
+            k--;
+        }
+        k++;
+        v[k] = q;
+        numerators[k] = numerator;
+        denominators[k] = denominator;
+        numerators[k + 1] = 1.0;
+        denominators[k + 1] = 0.0;
+    }
+    if (k < 0) {
+        for (int q = 0; q < n; q++) {
+            d[q] = limit;
+        }
+        return;
+    }
+    k = 0;
+    for (int q = 0; q < n; q++) {
+        while (numerators[k + 1] < q * denominators[k + 1]) {
+            k++;
+        }
+        float offset = (float)(q - v[k]);
+        float distance = offset * offset + f[v[k]];
+        d[q] = distance < limit ? distance : limit;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_MASK_FIELD_H
+#define OBS_VIRTUAL_BACKGROUND_MASK_FIELD_H
+
+#include <stdint.h>
+
+#include "imgarray.h"
+#include "task_pool.h"
+
+// encoded fields step this many levels per pixel of distance around 128,
+// so they reach MASK_FIELD_RANGE pixels either side of the outline
+#define MASK_FIELD_LEVELS_PER_PIXEL    2
+#define MASK_FIELD_RANGE               64
+
+
+// Signed distance from every mask pixel to the subject's outline, positive
+// inside. Growing, shrinking and feathering the mask are then a threshold
+// and a ramp over the field, so they can change every frame without the
+// mask being segmented, dilated or blurred again.
+typedef struct {
+    TaskPool * pool;
+    int num_tasks;
+    int height;
+    int width;
+
+    // height x width floats, in mask pixels
+    ImgArray * field;
+    // the field as a byte per pixel, see MaskField_build
+    ImgArray * encoded;
+    // per column distance to the nearest pixel of the class being measured
+    ImgArray * columns;
+    // per task lower envelope of one row
+    ImgArray * scratch;
+} MaskField;
+
+
+// the pool is borrowed, may be NULL and must outlive the field
+MaskField * MaskField_create(TaskPool * pool);
+void MaskField_destroy(MaskField * self);
+void MaskField_clear(MaskField * self);
+size_t MaskField_get_memory_usage(MaskField * self);
+
+// Builds the exact Euclidean distance field of a mask thresholded at
+// MASK_FUSION_THRESHOLD, in time linear in its size. Distances past
+// MASK_FIELD_RANGE all come out as MASK_FIELD_RANGE + 0.5. Also fills
+// self->encoded with 128 + MASK_FIELD_LEVELS_PER_PIXEL * distance, clamped,
+// for uploading as an 8 bit texture.
+int MaskField_build(MaskField * self, const uint8_t * mask, int height, int width);
+// Writes height x width alpha bytes for an outline moved out by grow mask
+// pixels (in when negative) with a linear edge feather pixels wide.
+int MaskField_apply(MaskField * self, float grow, float feather, uint8_t * dst);
+// MaskField_apply for size bytes of a field encoded by MaskField_build, the
+// way the shader reads the uploaded texture
+int MaskField_apply_encoded(const uint8_t * encoded, size_t size, float grow, float feather, uint8_t * dst);
+
+// what the server's growshrink and blur settings come closest to
+float MaskField_grow_for(int growshrink);
+float MaskField_feather_for(int blur);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_MASK_FIELD_H
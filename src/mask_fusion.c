@@ -0,0 +1,116 @@
+#include "compat.h"
+
+#include "mask_fusion.h"
+
+
+MaskFusion * MaskFusion_create()
+{
+    MaskFusion * self = (MaskFusion *)bzalloc(sizeof(MaskFusion));
+    if (!self) {
+        return NULL;
+    }
+    self->upscaler = MaskCompositor_create(NULL);
+    self->frame = ImgArray_create();
+    self->mask = ImgArray_create();
+    if (!self->upscaler || !self->frame || !self->mask) {
+        MaskFusion_destroy(self);
+        return NULL;
+    }
+    return self;
+}
+
+
+void MaskFusion_destroy(MaskFusion * self)
+{
+    if (!self) {
+        return;
+    }
+    MaskCompositor_destroy(self->upscaler);
+    ImgArray_destroy(self->frame);
+    ImgArray_destroy(self->mask);
+    bfree(self);
+}
+
+
+void MaskFusion_clear(MaskFusion * self)
+{
+    ImgArray_clear(self->frame);
+    ImgArray_clear(self->mask);
+}
+
+
+size_t MaskFusion_get_memory_usage(MaskFusion * self)
+{
+    return sizeof(MaskFusion) + ImgArray_get_size(self->frame) + ImgArray_get_size(self->mask);
+}
+
+
+int MaskFusion_downscale(MaskFusion * self, const uint8_t * frame, int height, int width, int stride, int divisor)
+{
+    if (frame == NULL || height <= 0 || width <= 0 || divisor < 1) {
+        return 1;
+    }
+    if (stride <= 0) {
+        stride = width * 3;
+    }
+    int out_height = height / divisor > 0 ? height / divisor : 1;
+    int out_width = width / divisor > 0 ? width / divisor : 1;
+    int block_height = height < divisor ? height : divisor;
+    int block_width = width < divisor ? width : divisor;
+    uint32_t area = (uint32_t)(block_height * block_width);
+    uint8_t * dst = ImgArray_ensure_buffer(self->frame, (size_t)out_height * out_width * 3);
+    if (dst == NULL) {
+        return 1;
+    }
+
+    for (int y = 0; y < out_height; y++) {
+        const uint8_t * top = frame + (size_t)y * block_height * stride;
+        for (int x = 0; x < out_width; x++) {
+            uint32_t sums[3] = {0, 0, 0};
+            for (int by = 0; by < block_height; by++) {
+                const uint8_t * src = top + (size_t)by * stride + (size_t)x * block_width * 3;
+                for (int bx = 0; bx < block_width * 3; bx += 3) {
+                    sums[0] += src[bx];
+                    sums[1] += src[bx + 1];
+                    sums[2] += src[bx + 2];
+                }
+            }
+            dst[0] = (uint8_t)((sums[0] + area / 2) / area);
+            dst[1] = (uint8_t)((sums[1] + area / 2) / area);
+            dst[2] = (uint8_t)((sums[2] + area / 2) / area);
+            dst += 3;
+        }
+    }
+    self->frame_height = out_height;
+    self->frame_width = out_width;
+    return 0;
+}
+
+
+int MaskFusion_fuse(MaskFusion * self, const uint8_t * coarse, int coarse_height, int coarse_width,
+                    const uint8_t * fine, int height, int width, int * used_fine)
+{
+    if (used_fine != NULL) {
+        *used_fine = 0;
+    }
+    uint8_t * dst = ImgArray_ensure_buffer(self->mask, (size_t)height * width);
+    if (dst == NULL || MaskCompositor_apply(self->upscaler, coarse, coarse_width, coarse_height,
+                                            dst, width, 1, width, height)) {
+        return 1;
+    }
+    if (fine == NULL) {
+        return 0;
+    }
+
+    size_t agreed = 0;
+    size_t size = (size_t)height * width;
+    for (size_t i = 0; i < size; i++) {
+        int same_side = (dst[i] >= MASK_FUSION_THRESHOLD) == (fine[i] >= MASK_FUSION_THRESHOLD);
+        dst[i] = same_side ? fine[i] : dst[i];
+        agreed += same_side;
+    }
+    if (used_fine != NULL) {
+        *used_fine = agreed > 0;
+    }
+    return 0;
+}
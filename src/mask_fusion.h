@@ -0,0 +1,42 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_MASK_FUSION_H
+#define OBS_VIRTUAL_BACKGROUND_MASK_FUSION_H
+
+#include <stdint.h>
+
+#include "composite.h"
+#include "imgarray.h"
+
+// mask values at or above this are foreground
+#define MASK_FUSION_THRESHOLD          128
+
+
+// Per worker scratch for dual-rate segmentation: a low-resolution copy of
+// the frame to send, and the coarse mask scaled back up and fused with the
+// latest full-resolution one.
+typedef struct {
+    MaskCompositor * upscaler;
+    ImgArray * frame;
+    int frame_height;
+    int frame_width;
+    ImgArray * mask;
+} MaskFusion;
+
+
+MaskFusion * MaskFusion_create();
+void MaskFusion_destroy(MaskFusion * self);
+void MaskFusion_clear(MaskFusion * self);
+size_t MaskFusion_get_memory_usage(MaskFusion * self);
+
+// Box-filters a frame of 3 bytes per pixel down by divisor on each side into
+// self->frame, packed without row padding. The channel order is kept.
+int MaskFusion_downscale(MaskFusion * self, const uint8_t * frame, int height, int width, int stride, int divisor);
+// Scales a coarse mask up to height x width into self->mask and, where fine
+// (height x width too, NULL for none) puts the pixel on the same side of
+// MASK_FUSION_THRESHOLD, takes fine's value for its sharper edges. Where they
+// disagree the subject has moved since fine was taken and coarse wins.
+// used_fine, if not NULL, is set when fine contributed.
+int MaskFusion_fuse(MaskFusion * self, const uint8_t * coarse, int coarse_height, int coarse_width,
+                    const uint8_t * fine, int height, int width, int * used_fine);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_MASK_FUSION_H
@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "mock_server.h"
+
+// utility methods
+void * accept_connections(void * data);
+void * serve_connection(void * data);
+int mock_hello(MockConnection * connection);
+int mock_request(MockConnection * connection);
+int mock_batch(MockConnection * connection);
+int mock_infer(MockServer * server, uint64_t arrived, const uint32_t * budgets, const uint64_t * pixels,
+               uint8_t * dropped, int count);
+uint8_t * mock_buffer(MockConnection * connection, size_t size);
+int mock_read(int fd, void * data, size_t size);
+int mock_write(int fd, const void * data, size_t size);
+int mock_write_mask(int fd, MockConnection * connection, int height, int width, int dropped);
+
+
+MockServer * MockServer_create(const char * socket_path, const MockServerOptions * options)
+{
+    MockServer * self = (MockServer *)bzalloc(sizeof(MockServer));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_mutex_init(&(self->model_mutex), NULL);
+    self->options = *options;
+    self->num_connections = 0;
+    strncpy(self->socket_path, socket_path, SEGMENTATION_SOCKET_PATH_LENGTH - 1);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, self->socket_path, sizeof(address.sun_path) - 1);
+    unlink(self->socket_path);
+    self->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (self->listen_fd < 0 ||
+            bind(self->listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+            listen(self->listen_fd, MOCK_MAX_CONNECTIONS)) {
+        fprintf(stderr, "mock server could not listen on %s: %s\n", self->socket_path, strerror(errno));
+        goto err;
+    }
+
+    self->is_running = 1;
+    if (pthread_create(&(self->accept_thread), NULL, accept_connections, (void *)self)) {
+        goto err;
+    }
+    self->accepting = 1;
+    return self;
+
+    err:
+    MockServer_destroy(self);
+    return NULL;
+}
+
+
+void MockServer_destroy(MockServer * self)
+{
+    if (!self) {
+        return;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    self->is_running = 0;
+    pthread_mutex_unlock(&(self->mutex));
+    if (self->listen_fd >= 0) {
+        // wakes the accept thread
+        shutdown(self->listen_fd, SHUT_RDWR);
+    }
+    if (self->accepting) {
+        pthread_join(self->accept_thread, NULL);
+    }
+    for (int i = 0; i < self->num_connections; i++) {
+        shutdown(self->connections[i]->fd, SHUT_RDWR);
+        pthread_join(self->connection_threads[i], NULL);
+        close(self->connections[i]->fd);
+        if (self->connections[i]->buffer) {
+            bfree(self->connections[i]->buffer);
+        }
+        bfree(self->connections[i]);
+    }
+    if (self->listen_fd >= 0) {
+        close(self->listen_fd);
+        unlink(self->socket_path);
+    }
+    pthread_mutex_destroy(&(self->model_mutex));
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+const char * MockServer_get_socket_path(MockServer * self)
+{
+    return self->socket_path;
+}
+
+
+void MockServer_get_stats(MockServer * self, MockServerStats * stats)
+{
+    pthread_mutex_lock(&(self->mutex));
+    *stats = self->stats;
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+void * accept_connections(void * data)
+{
+    MockServer * self = (MockServer *)data;
+    while (1) {
+        int fd = accept(self->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        pthread_mutex_lock(&(self->mutex));
+        MockConnection * connection = NULL;
+        if (self->is_running && self->num_connections < MOCK_MAX_CONNECTIONS) {
+            connection = (MockConnection *)bzalloc(sizeof(MockConnection));
+        }
+        if (connection != NULL) {
+            connection->server = self;
+            connection->fd = fd;
+            connection->version = PROTOCOL_VERSION_1;
+            if (pthread_create(&(self->connection_threads[self->num_connections]), NULL,
+                               serve_connection, (void *)connection) == 0) {
+                self->connections[self->num_connections++] = connection;
+                self->stats.connections++;
+            } else {
+                bfree(connection);
+                connection = NULL;
+            }
+        }
+        pthread_mutex_unlock(&(self->mutex));
+        if (connection == NULL) {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+
+void * serve_connection(void * data)
+{
+    MockConnection * connection = (MockConnection *)data;
+    char header[HEADER_LENGTH];
+    int rc = 0;
+    while (rc == 0 && mock_read(connection->fd, header, HEADER_LENGTH) == 0) {
+        if (memcmp(header, HELLO_HEADER, HEADER_LENGTH) == 0) {
+            rc = mock_hello(connection);
+        } else if (memcmp(header, REQUEST_HEADER, HEADER_LENGTH) == 0) {
+            rc = mock_request(connection);
+        } else if (memcmp(header, BATCH_HEADER, HEADER_LENGTH) == 0 &&
+                connection->version >= PROTOCOL_VERSION_3) {
+            rc = mock_batch(connection);
+        } else {
+            rc = -1;
+        }
+    }
+    // the fd stays open until destroy so it can't be reused under us
+    shutdown(connection->fd, SHUT_RDWR);
+    return NULL;
+}
+
+
+int mock_hello(MockConnection * connection)
+{
+    MockServer * server = connection->server;
+    HelloRequest request;
+    if (mock_read(connection->fd, (char *)&request + HEADER_LENGTH, sizeof(request) - HEADER_LENGTH)) {
+        return -1;
+    }
+    int supported = server->options.version > 0 ? server->options.version : PROTOCOL_VERSION_4;
+    connection->version = request.version < supported ? request.version : supported;
+
+    HelloResponse response;
+    memcpy(response.header, HELLO_RESPONSE_HEADER, HEADER_LENGTH);
+    response.version = (uint16_t)connection->version;
+    response.preferred_width = 0;
+    response.preferred_height = 0;
+    response.stride_alignment = 1;
+    response.pixel_formats = FORMAT_BIT(PIXEL_FORMAT_BGR24) | FORMAT_BIT(PIXEL_FORMAT_RGB24);
+    response.mask_encodings = FORMAT_BIT(MASK_ENCODING_RAW8);
+    if (mock_write(connection->fd, &response, sizeof(response))) {
+        return -1;
+    }
+    if (connection->version >= PROTOCOL_VERSION_3) {
+        HelloResponseV3 extension;
+        extension.max_batch = (uint16_t)server->options.max_batch;
+        extension.reserved = 0;
+        return mock_write(connection->fd, &extension, sizeof(extension));
+    }
+    return 0;
+}
+
+
+int mock_request(MockConnection * connection)
+{
+    RequestPreamble preamble;
+    size_t preamble_size = connection->version >= PROTOCOL_VERSION_4 ? PREAMBLE_V4_SIZE :
+            connection->version >= PROTOCOL_VERSION_2 ? PREAMBLE_V2_SIZE : PREAMBLE_V1_SIZE;
+    preamble.budget_us = 0;
+    if (mock_read(connection->fd, (char *)&preamble + HEADER_LENGTH, preamble_size - HEADER_LENGTH) ||
+            preamble.length < preamble_size) {
+        return -1;
+    }
+    size_t frame_size = preamble.length - preamble_size;
+    uint8_t * frame = mock_buffer(connection, frame_size);
+    if (frame == NULL || mock_read(connection->fd, frame, frame_size)) {
+        return -1;
+    }
+    uint8_t dropped;
+    uint64_t pixels = (uint64_t)preamble.height * preamble.width;
+    mock_infer(connection->server, os_gettime_ns(), &(preamble.budget_us), &pixels, &dropped, 1);
+
+    pthread_mutex_lock(&(connection->server->mutex));
+    connection->server->stats.requests++;
+    pthread_mutex_unlock(&(connection->server->mutex));
+
+    if (mock_write(connection->fd, RESPONSE_HEADER, HEADER_LENGTH)) {
+        return -1;
+    }
+    return mock_write_mask(connection->fd, connection, preamble.height, preamble.width, dropped);
+}
+
+
+int mock_batch(MockConnection * connection)
+{
+    BatchPreamble preamble;
+    BatchFrameHeader frames[MAX_SEGMENTATION_BATCH];
+    uint32_t budgets[MAX_SEGMENTATION_BATCH];
+    uint64_t pixels[MAX_SEGMENTATION_BATCH];
+    uint8_t dropped[MAX_SEGMENTATION_BATCH];
+    size_t header_size = connection->version >= PROTOCOL_VERSION_4 ?
+            sizeof(BatchFrameHeader) : BATCH_FRAME_HEADER_V3_SIZE;
+    if (mock_read(connection->fd, (char *)&preamble + HEADER_LENGTH, sizeof(preamble) - HEADER_LENGTH) ||
+            preamble.count > MAX_SEGMENTATION_BATCH) {
+        return -1;
+    }
+    for (int i = 0; i < preamble.count; i++) {
+        frames[i].budget_us = 0;
+        if (mock_read(connection->fd, &frames[i], header_size)) {
+            return -1;
+        }
+        budgets[i] = frames[i].budget_us;
+        pixels[i] = (uint64_t)frames[i].height * frames[i].width;
+        uint8_t * frame = mock_buffer(connection, frames[i].length);
+        if (frame == NULL || mock_read(connection->fd, frame, frames[i].length)) {
+            return -1;
+        }
+    }
+    mock_infer(connection->server, os_gettime_ns(), budgets, pixels, dropped, preamble.count);
+
+    pthread_mutex_lock(&(connection->server->mutex));
+    connection->server->stats.batches++;
+    pthread_mutex_unlock(&(connection->server->mutex));
+
+    BatchPreamble response;
+    memcpy(response.header, BATCH_RESPONSE_HEADER, HEADER_LENGTH);
+    response.count = preamble.count;
+    response.reserved = 0;
+    response.length = sizeof(BatchPreamble);
+    for (int i = 0; i < preamble.count; i++) {
+        response.length += sizeof(BatchMaskHeader) + (dropped[i] ? 0 : (uint32_t)(frames[i].height * frames[i].width));
+    }
+    if (mock_write(connection->fd, &response, sizeof(response))) {
+        return -1;
+    }
+    for (int i = 0; i < preamble.count; i++) {
+        if (mock_write(connection->fd, &(frames[i].id), sizeof(uint32_t)) ||
+                mock_write_mask(connection->fd, connection, frames[i].height, frames[i].width, dropped[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// One model, so callers queue up behind each other like on a single GPU.
+// Once it is free, frames whose budget ran out while they waited are
+// dropped and the rest inferred. Returns how many were inferred.
+int mock_infer(MockServer * server, uint64_t arrived, const uint32_t * budgets, const uint64_t * pixels,
+               uint8_t * dropped, int count)
+{
+    pthread_mutex_lock(&(server->model_mutex));
+    uint64_t now = os_gettime_ns();
+    int frames = 0;
+    uint64_t inferred_pixels = 0;
+    for (int i = 0; i < count; i++) {
+        dropped[i] = budgets[i] != 0 && now >= arrived + budgets[i] * 1000ULL;
+        frames += !dropped[i];
+        inferred_pixels += dropped[i] ? 0 : pixels[i];
+    }
+    uint64_t cost = frames ? server->options.base_ns + server->options.per_frame_ns * (uint64_t)frames +
+            server->options.per_mpixel_ns * inferred_pixels / 1000000ULL : 0;
+    struct timespec ts = {(time_t)(cost / 1000000000ULL), (long)(cost % 1000000000ULL)};
+    while (cost && nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+    pthread_mutex_unlock(&(server->model_mutex));
+
+    pthread_mutex_lock(&(server->mutex));
+    server->stats.frames += frames;
+    server->stats.dropped += count - frames;
+    server->stats.pixels += inferred_pixels;
+    server->stats.busy_ns += cost;
+    pthread_mutex_unlock(&(server->mutex));
+    return frames;
+}
+
+
+// writes the length and an all-foreground mask of height x width, or just MASK_LENGTH_DROPPED
+int mock_write_mask(int fd, MockConnection * connection, int height, int width, int dropped)
+{
+    if (dropped) {
+        int32_t length = MASK_LENGTH_DROPPED;
+        return mock_write(fd, &length, sizeof(length));
+    }
+    int32_t length = height > 0 && width > 0 ? height * width : 0;
+    uint8_t * mask = mock_buffer(connection, (size_t)length);
+    if (mask == NULL && length > 0) {
+        return -1;
+    }
+    memset(mask, 255, (size_t)length);
+    if (mock_write(fd, &length, sizeof(length))) {
+        return -1;
+    }
+    return mock_write(fd, mask, (size_t)length);
+}
+
+
+uint8_t * mock_buffer(MockConnection * connection, size_t size)
+{
+    if (connection->buffer_size < size) {
+        uint8_t * buffer = (uint8_t *)realloc(connection->buffer, size);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        connection->buffer = buffer;
+        connection->buffer_size = size;
+    }
+    return connection->buffer;
+}
+
+
+int mock_read(int fd, void * data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t read_bytes = recv(fd, (uint8_t *)data + offset, size - offset, 0);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes <= 0) {
+            return -1;
+        }
+        offset += (size_t)read_bytes;
+    }
+    return 0;
+}
+
+
+int mock_write(int fd, const void * data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t written = send(fd, (const uint8_t *)data + offset, size - offset, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += (size_t)written;
+    }
+    return 0;
+}
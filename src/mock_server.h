@@ -0,0 +1,76 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_MOCK_SERVER_H
+#define OBS_VIRTUAL_BACKGROUND_MOCK_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "segmentation_client.h"
+
+#define MOCK_MAX_CONNECTIONS           32
+
+
+typedef struct {
+    // every inference costs base_ns plus per_frame_ns for each frame in it,
+    // and per_mpixel_ns for every million pixels in those frames
+    uint64_t base_ns;
+    uint64_t per_frame_ns;
+    uint64_t per_mpixel_ns;
+    // advertised to v3 clients
+    int max_batch;
+    // the newest protocol version spoken, 0 for the newest there is
+    int version;
+} MockServerOptions;
+
+
+typedef struct {
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t batches;
+    uint64_t frames;
+    // frames dropped past their deadline instead of inferred
+    uint64_t dropped;
+    uint64_t pixels;
+    // time the model was busy
+    uint64_t busy_ns;
+} MockServerStats;
+
+
+typedef struct MockServer MockServer;
+
+typedef struct {
+    MockServer * server;
+    int fd;
+    int version;
+    uint8_t * buffer;
+    size_t buffer_size;
+} MockConnection;
+
+
+// A stand-in for the node server speaking the same protocol on a Unix
+// socket, with a model that takes a fixed time per call and per frame and
+// answers with all-foreground masks. Like the node server it runs one
+// inference at a time however many clients are connected.
+struct MockServer {
+    char socket_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    int listen_fd;
+    MockServerOptions options;
+    pthread_t accept_thread;
+    uint8_t accepting;
+
+    pthread_mutex_t mutex;
+    pthread_mutex_t model_mutex;
+    MockConnection * connections[MOCK_MAX_CONNECTIONS];
+    pthread_t connection_threads[MOCK_MAX_CONNECTIONS];
+    int num_connections;
+    uint8_t is_running;
+    MockServerStats stats;
+};
+
+
+MockServer * MockServer_create(const char * socket_path, const MockServerOptions * options);
+void MockServer_destroy(MockServer * self);
+const char * MockServer_get_socket_path(MockServer * self);
+void MockServer_get_stats(MockServer * self, MockServerStats * stats);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_MOCK_SERVER_H
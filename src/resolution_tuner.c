@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <math.h>
+
+#include "compat.h"
+#include "resolution_tuner.h"
+
+// utility methods
+void restart_measuring(ResolutionTuner * self, uint64_t now);
+int align_width(ResolutionTuner * self, double width);
+void record_decision(ResolutionTuner * self, uint64_t now, int width);
+
+
+ResolutionTuner * ResolutionTuner_create()
+{
+    ResolutionTuner * self = (ResolutionTuner *)bzalloc(sizeof(ResolutionTuner));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    self->min_width = RESOLUTION_TUNER_ALIGNMENT;
+    self->max_width = RESOLUTION_TUNER_ALIGNMENT;
+    self->width = RESOLUTION_TUNER_ALIGNMENT;
+    self->target_ns = 0;
+    self->num_decisions = 0;
+    restart_measuring(self, 0);
+    return self;
+}
+
+
+void ResolutionTuner_destroy(ResolutionTuner * self)
+{
+    if (!self) {
+        return;
+    }
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+void ResolutionTuner_configure(ResolutionTuner * self, int min_width, int max_width, uint64_t target_ns)
+{
+    if (max_width < min_width) {
+        max_width = min_width;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    if (min_width != self->min_width || max_width != self->max_width || target_ns != self->target_ns) {
+        self->min_width = min_width;
+        self->max_width = max_width;
+        self->target_ns = target_ns;
+        self->width = align_width(self, max_width);
+        restart_measuring(self, 0);
+    }
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+int ResolutionTuner_update(ResolutionTuner * self, uint64_t now, uint64_t latency_ns, uint64_t sample)
+{
+    pthread_mutex_lock(&(self->mutex));
+    int width = self->width;
+    if (sample == self->last_sample || self->target_ns == 0) {
+        goto done;
+    }
+    self->last_sample = sample;
+    if (now < self->settle_until) {
+        goto done;
+    }
+
+    if (self->num_samples == 0) {
+        self->latency_ns = (double)latency_ns;
+    } else {
+        self->latency_ns = RESOLUTION_TUNER_LATENCY_ALPHA * (double)latency_ns +
+                (1.0 - RESOLUTION_TUNER_LATENCY_ALPHA) * self->latency_ns;
+    }
+    self->num_samples++;
+    if (self->num_samples < RESOLUTION_TUNER_MIN_SAMPLES ||
+            now - self->last_decision_timestamp < RESOLUTION_TUNER_INTERVAL_NS) {
+        goto done;
+    }
+
+    double target = (double)self->target_ns;
+    if (self->latency_ns > target * RESOLUTION_TUNER_UPPER_BAND && width > self->min_width) {
+        // cut straight to the width that should land just under the target
+        int next = align_width(self, width * sqrt(target / self->latency_ns));
+        if (next >= width) {
+            next = align_width(self, width - RESOLUTION_TUNER_ALIGNMENT);
+        }
+        record_decision(self, now, next);
+    } else if (self->latency_ns < target * RESOLUTION_TUNER_LOWER_BAND && width < self->max_width) {
+        // but only creep back up
+        int next = align_width(self, width * (1.0 + RESOLUTION_TUNER_GROWTH));
+        if (next <= width) {
+            next = align_width(self, width + RESOLUTION_TUNER_ALIGNMENT);
+        }
+        record_decision(self, now, next);
+    }
+    width = self->width;
+
+done:
+    pthread_mutex_unlock(&(self->mutex));
+    return width;
+}
+
+
+int ResolutionTuner_get_width(ResolutionTuner * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+    int result = self->width;
+    pthread_mutex_unlock(&(self->mutex));
+    return result;
+}
+
+
+uint64_t ResolutionTuner_get_num_decisions(ResolutionTuner * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+    uint64_t result = self->num_decisions;
+    pthread_mutex_unlock(&(self->mutex));
+    return result;
+}
+
+
+uint64_t ResolutionTuner_get_decisions(ResolutionTuner * self, uint64_t since, ResolutionDecision * dst, int * count)
+{
+    pthread_mutex_lock(&(self->mutex));
+    uint64_t total = self->num_decisions;
+    if (total > RESOLUTION_TUNER_LOG_LENGTH && since < total - RESOLUTION_TUNER_LOG_LENGTH) {
+        since = total - RESOLUTION_TUNER_LOG_LENGTH;
+    }
+    *count = 0;
+    for (uint64_t i = since; i < total; i++) {
+        dst[(*count)++] = self->decisions[i % RESOLUTION_TUNER_LOG_LENGTH];
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    return total;
+}
+
+
+void restart_measuring(ResolutionTuner * self, uint64_t now)
+{
+    self->settle_until = now + RESOLUTION_TUNER_SETTLE_NS;
+    self->last_decision_timestamp = now;
+    self->latency_ns = 0;
+    self->num_samples = 0;
+}
+
+
+int align_width(ResolutionTuner * self, double width)
+{
+    int result = ((int)width / RESOLUTION_TUNER_ALIGNMENT) * RESOLUTION_TUNER_ALIGNMENT;
+    if (result > self->max_width) {
+        result = (self->max_width / RESOLUTION_TUNER_ALIGNMENT) * RESOLUTION_TUNER_ALIGNMENT;
+    }
+    if (result < self->min_width) {
+        result = self->min_width;
+    }
+    if (result < RESOLUTION_TUNER_ALIGNMENT) {
+        result = RESOLUTION_TUNER_ALIGNMENT;
+    }
+    return result;
+}
+
+
+void record_decision(ResolutionTuner * self, uint64_t now, int width)
+{
+    if (width == self->width) {
+        return;
+    }
+    ResolutionDecision * decision = &(self->decisions[self->num_decisions % RESOLUTION_TUNER_LOG_LENGTH]);
+    decision->timestamp = now;
+    decision->from_width = self->width;
+    decision->to_width = width;
+    decision->latency_ns = (uint64_t)self->latency_ns;
+    decision->target_ns = self->target_ns;
+    self->num_decisions++;
+    self->width = width;
+    restart_measuring(self, now);
+}
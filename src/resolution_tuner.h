@@ -0,0 +1,69 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_RESOLUTION_TUNER_H
+#define OBS_VIRTUAL_BACKGROUND_RESOLUTION_TUNER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define RESOLUTION_TUNER_LOG_LENGTH    16
+// widths are kept to multiples of this
+#define RESOLUTION_TUNER_ALIGNMENT     16
+// masks that arrive this soon after a change may still be from the old width
+#define RESOLUTION_TUNER_SETTLE_NS     500000000ULL
+// shortest time between two decisions
+#define RESOLUTION_TUNER_INTERVAL_NS   1000000000ULL
+#define RESOLUTION_TUNER_MIN_SAMPLES   5
+// Hysteresis band around the target, as fractions of it. Inference cost
+// grows with the square of the width, so the lower edge has to sit well
+// below 1 / (1 + RESOLUTION_TUNER_GROWTH)^2 or a step up lands right back
+// above the upper edge.
+#define RESOLUTION_TUNER_UPPER_BAND    1.1
+#define RESOLUTION_TUNER_LOWER_BAND    0.7
+#define RESOLUTION_TUNER_GROWTH        0.1
+#define RESOLUTION_TUNER_LATENCY_ALPHA 0.3
+
+
+typedef struct {
+    uint64_t timestamp;
+    int from_width;
+    int to_width;
+    uint64_t latency_ns;
+    uint64_t target_ns;
+} ResolutionDecision;
+
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int min_width;
+    int max_width;
+    uint64_t target_ns;
+    int width;
+
+    uint64_t last_sample;
+    uint64_t settle_until;
+    uint64_t last_decision_timestamp;
+    double latency_ns;
+    int num_samples;
+
+    ResolutionDecision decisions[RESOLUTION_TUNER_LOG_LENGTH];
+    uint64_t num_decisions;
+} ResolutionTuner;
+
+
+ResolutionTuner * ResolutionTuner_create();
+void ResolutionTuner_destroy(ResolutionTuner * self);
+
+// starts at max_width; changing the range or the target restarts measuring
+void ResolutionTuner_configure(ResolutionTuner * self, int min_width, int max_width, uint64_t target_ns);
+// Feeds the latest mask latency, sample counts how many masks it has seen so
+// repeated calls with the same mask are ignored. Returns the width to scale to.
+int ResolutionTuner_update(ResolutionTuner * self, uint64_t now, uint64_t latency_ns, uint64_t sample);
+int ResolutionTuner_get_width(ResolutionTuner * self);
+uint64_t ResolutionTuner_get_num_decisions(ResolutionTuner * self);
+
+// Copies decisions with an index of at least since, oldest first, and
+// returns the total number of decisions made so far. Older ones than the
+// last RESOLUTION_TUNER_LOG_LENGTH are gone.
+uint64_t ResolutionTuner_get_decisions(ResolutionTuner * self, uint64_t since, ResolutionDecision * dst, int * count);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_RESOLUTION_TUNER_H
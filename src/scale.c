@@ -1,67 +1,60 @@
-#include <obs-module.h>
+#include "compat.h"
 #include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
 
 #include "scale.h"
 
-#define MAX_WIDTH 640
-
-static inline enum AVPixelFormat get_ffmpeg_video_format(enum video_format format)
-{
-    switch (format) {
-        case VIDEO_FORMAT_I420:
-            return AV_PIX_FMT_YUV420P;
-        case VIDEO_FORMAT_NV12:
-            return AV_PIX_FMT_NV12;
-        case VIDEO_FORMAT_YUY2:
-            return AV_PIX_FMT_YUYV422;
-        case VIDEO_FORMAT_UYVY:
-            return AV_PIX_FMT_UYVY422;
-        case VIDEO_FORMAT_RGBA:
-            return AV_PIX_FMT_RGBA;
-        case VIDEO_FORMAT_BGRA:
-        case VIDEO_FORMAT_BGRX:
-            return AV_PIX_FMT_BGRA;
-        case VIDEO_FORMAT_Y800:
-            return AV_PIX_FMT_GRAY8;
-        case VIDEO_FORMAT_I444:
-            return AV_PIX_FMT_YUV444P;
-        case VIDEO_FORMAT_BGR3:
-            return AV_PIX_FMT_BGR24;
-        case VIDEO_FORMAT_I422:
-            return AV_PIX_FMT_YUV422P;
-        case VIDEO_FORMAT_I40A:
-            return AV_PIX_FMT_YUVA420P;
-        case VIDEO_FORMAT_I42A:
-            return AV_PIX_FMT_YUVA422P;
-        case VIDEO_FORMAT_YUVA:
-            return AV_PIX_FMT_YUVA444P;
-        case VIDEO_FORMAT_NONE:
-        case VIDEO_FORMAT_YVYU:
-        case VIDEO_FORMAT_AYUV:
-            /* not supported by FFmpeg */
-            return AV_PIX_FMT_NONE;
-    }
-
-    return AV_PIX_FMT_NONE;
-}
-
-
-const int ImageScaler_scale_image(ImageScaler *scaler, const struct obs_source_frame *frame)
-{
-    int width = frame->width;
-    int height = frame->height;
-
-    if (width <= MAX_WIDTH) {
-        scaler->new_width = width;
-        scaler->new_height = height;
-    } else {
-        scaler->new_width = MAX_WIDTH;
-        scaler->new_height = (int) (((double) MAX_WIDTH) / width * height);
+typedef struct {
+    ImageScaler *scaler;
+    const uint8_t * const *data;
+    const int *linesize;
+    // source rows of each slice, num_slices + 1 boundaries
+    int src_rows[MAX_SCALE_SLICES + 1];
+    int dst_rows[MAX_SCALE_SLICES + 1];
+    int plane_shift[4];
+} SliceJob;
+
+
+// utility methods
+int prepare_buffer(ImageScaler *scaler, int width, int height);
+int plan_slices(ImageScaler *scaler, SliceJob *job, int height, enum AVPixelFormat format);
+void scale_slice(void *context, int task, int num_tasks);
+void free_slice_contexts(ImageScaler *scaler, int from);
+
+
+const int ImageScaler_scale_planes(ImageScaler *scaler, const uint8_t * const *data, const int *linesize,
+                                   int width, int height, enum AVPixelFormat format)
+{
+    if (prepare_buffer(scaler, width, height)) {
+        return 1;
     }
 
+    SliceJob job;
+    int num_slices = plan_slices(scaler, &job, height, format);
+    if (num_slices > 1) {
+        for (int i = 0; i < num_slices; i++) {
+            scaler->slice_contexts[i] = sws_getCachedContext(scaler->slice_contexts[i],
+                                       width, job.src_rows[i + 1] - job.src_rows[i], format,
+                                       scaler->new_width, job.dst_rows[i + 1] - job.dst_rows[i], scaler->pixel_format,
+                                       SWS_BICUBIC, NULL, NULL, NULL);
+            if (scaler->slice_contexts[i] == NULL) {
+                return 1;
+            }
+        }
+        free_slice_contexts(scaler, num_slices);
+        scaler->num_slices = num_slices;
+        job.scaler = scaler;
+        job.data = data;
+        job.linesize = linesize;
+        TaskPool_run(scaler->tasks, num_slices, scale_slice, &job);
+        return 0;
+    }
+    free_slice_contexts(scaler, 0);
+    scaler->num_slices = 1;
+
     struct SwsContext * sws_context = sws_getCachedContext(scaler->scale_context,
-                                       width, height, get_ffmpeg_video_format(frame->format),
-                                       scaler->new_width, scaler->new_height, AV_PIX_FMT_BGR24,
+                                       width, height, format,
+                                       scaler->new_width, scaler->new_height, scaler->pixel_format,
                                        SWS_BICUBIC, NULL, NULL, NULL);
     scaler->scale_context = sws_context;
 
@@ -69,7 +62,108 @@ const int ImageScaler_scale_image(ImageScaler *scaler, const struct obs_source_f
         return 1;
     }
 
-    int buffer_size = scaler->new_width * scaler->new_height * 3;
+    int new_stride[] = {scaler->stride, 0, 0};
+
+    sws_scale(
+            sws_context,                            /* swsContext c*/
+            data,                                   /* srcSlice[] */
+            linesize,                               /* srcStride[] */
+            0,                             /* srcSliceY */
+              height,                               /* srcSliceH */
+              (uint8_t **)&scaler->buffer,           /* dst[] */
+              new_stride                            /* dstStride[] */
+              );
+
+    return 0;
+}
+
+
+const int ImageScaler_scale_planes_banded(ImageScaler *scaler, const uint8_t * const *data, const int *linesize,
+                                          int width, int height, enum AVPixelFormat format, int band_rows,
+                                          ImageScalerBandCallback callback, void *opaque)
+{
+    if (prepare_buffer(scaler, width, height)) {
+        return 1;
+    }
+    free_slice_contexts(scaler, 0);
+    scaler->num_slices = 1;
+
+    scaler->scale_context = sws_getCachedContext(scaler->scale_context,
+                                                 width, height, format,
+                                                 scaler->new_width, scaler->new_height, scaler->pixel_format,
+                                                 SWS_BICUBIC, NULL, NULL, NULL);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (scaler->scale_context == NULL || desc == NULL) {
+        return 1;
+    }
+
+    // source slices must cover whole chroma rows, and swscale holds back the
+    // last few output rows of each until the next one fills its filter taps
+    int row_alignment = 1 << desc->log2_chroma_h;
+    int src_band = (int)((int64_t)(band_rows > 0 ? band_rows : scaler->new_height) * height / scaler->new_height);
+    src_band = (src_band + row_alignment - 1) / row_alignment * row_alignment;
+    if (src_band < row_alignment) {
+        src_band = row_alignment;
+    }
+    if (desc->flags & AV_PIX_FMT_FLAG_PAL) {
+        // the second plane is the palette, not rows to step through
+        src_band = height;
+    }
+
+    uint8_t *dst[] = {scaler->buffer, NULL, NULL, NULL};
+    int dst_stride[] = {scaler->stride, 0, 0, 0};
+    int done = 0;
+    for (int y = 0; y < height; y += src_band) {
+        int rows = height - y < src_band ? height - y : src_band;
+        const uint8_t *src[4] = {NULL, NULL, NULL, NULL};
+        for (int p = 0; p < 4; p++) {
+            if (data[p] != NULL) {
+                int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+                src[p] = data[p] + (size_t)(y >> shift) * linesize[p];
+            }
+        }
+        int scaled = sws_scale(scaler->scale_context, src, linesize, y, rows, dst, dst_stride);
+        if (scaled < 0) {
+            return 1;
+        }
+        if (scaled > 0 && callback != NULL) {
+            callback(opaque, scaler->buffer, done, scaled);
+        }
+        done += scaled;
+    }
+    return 0;
+}
+
+
+void ImageScaler_set_task_pool(ImageScaler *scaler, TaskPool *tasks)
+{
+    scaler->tasks = tasks;
+}
+
+
+// picks the output size and makes sure buffer holds it
+int prepare_buffer(ImageScaler *scaler, int width, int height)
+{
+    // fit inside the target box, never upscale
+    double ratio = 1.0;
+    if (scaler->max_width > 0 && width > scaler->max_width) {
+        ratio = ((double) scaler->max_width) / width;
+    }
+    if (scaler->max_height > 0 && height * ratio > scaler->max_height) {
+        ratio = ((double) scaler->max_height) / height;
+    }
+    if (ratio == 1.0) {
+        scaler->new_width = width;
+        scaler->new_height = height;
+    } else {
+        scaler->new_width = (int) (ratio * width);
+        scaler->new_height = (int) (ratio * height);
+    }
+
+    int alignment = scaler->stride_alignment > 0 ? scaler->stride_alignment : 1;
+    scaler->stride = (scaler->new_width * 3 + alignment - 1) / alignment * alignment;
+
+    int buffer_size = scaler->stride * scaler->new_height;
     if (scaler->buffer == NULL || scaler->buffer_size != buffer_size) {
         if (scaler->buffer != NULL) {
             bfree(scaler->buffer);
@@ -80,20 +174,89 @@ const int ImageScaler_scale_image(ImageScaler *scaler, const struct obs_source_f
             return 1;
         }
     }
+    return 0;
+}
 
-    int new_stride[] = {scaler->new_width * 3, 0, 0};
 
-    sws_scale(
-            sws_context,                            /* swsContext c*/
-            (const uint8_t * const *)frame->data,        /* srcSlice[] */
-            (const int *)frame->linesize,           /* srcStride[] */
-            0,                             /* srcSliceY */
-              height,                               /* srcSliceH */
-              (uint8_t **)&scaler->buffer,           /* dst[] */
-              new_stride                            /* dstStride[] */
-              );
+// Splits the output rows evenly and maps each boundary back onto the source,
+// rounded to whole chroma rows. Each slice is filtered on its own, so rows
+// next to a boundary see clamped edges instead of their neighbours; that is
+// invisible to the segmentation model. Returns the number of slices.
+int plan_slices(ImageScaler *scaler, SliceJob *job, int height, enum AVPixelFormat format)
+{
+    if (scaler->tasks == NULL || height < SCALE_SLICE_MIN_HEIGHT) {
+        return 1;
+    }
+    int num_slices = TaskPool_get_parallelism(scaler->tasks);
+    if (num_slices > MAX_SCALE_SLICES) {
+        num_slices = MAX_SCALE_SLICES;
+    }
+    if (num_slices > scaler->new_height / SCALE_SLICE_MIN_ROWS) {
+        num_slices = scaler->new_height / SCALE_SLICE_MIN_ROWS;
+    }
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (num_slices <= 1 || desc == NULL) {
+        return 1;
+    }
 
-    return 0;
+    int row_alignment = 1 << desc->log2_chroma_h;
+    for (int p = 0; p < 4; p++) {
+        job->plane_shift[p] = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+    }
+    job->src_rows[0] = 0;
+    job->dst_rows[0] = 0;
+    for (int i = 1; i < num_slices; i++) {
+        int dst_row = scaler->new_height * i / num_slices;
+        int src_row = (int)((int64_t)dst_row * height / scaler->new_height);
+        job->src_rows[i] = src_row / row_alignment * row_alignment;
+        job->dst_rows[i] = dst_row;
+        if (job->src_rows[i] <= job->src_rows[i - 1]) {
+            return 1;
+        }
+    }
+    job->src_rows[num_slices] = height;
+    job->dst_rows[num_slices] = scaler->new_height;
+    return num_slices;
+}
+
+
+void scale_slice(void *context, int task, int num_tasks)
+{
+    SliceJob *job = (SliceJob *)context;
+    ImageScaler *scaler = job->scaler;
+
+    const uint8_t *src[4] = {NULL, NULL, NULL, NULL};
+    for (int p = 0; p < 4; p++) {
+        if (job->data[p] != NULL) {
+            src[p] = job->data[p] + (size_t)(job->src_rows[task] >> job->plane_shift[p]) * job->linesize[p];
+        }
+    }
+    uint8_t *dst[] = {scaler->buffer + (size_t)job->dst_rows[task] * scaler->stride, NULL, NULL};
+    int dst_stride[] = {scaler->stride, 0, 0};
+
+    sws_scale(scaler->slice_contexts[task], src, job->linesize,
+              0, job->src_rows[task + 1] - job->src_rows[task], dst, dst_stride);
+}
+
+
+void free_slice_contexts(ImageScaler *scaler, int from)
+{
+    for (int i = from; i < MAX_SCALE_SLICES; i++) {
+        if (scaler->slice_contexts[i] != NULL) {
+            sws_freeContext(scaler->slice_contexts[i]);
+            scaler->slice_contexts[i] = NULL;
+        }
+    }
+}
+
+
+void ImageScaler_set_target(ImageScaler *scaler, int max_width, int max_height, int stride_alignment,
+                            enum AVPixelFormat pixel_format)
+{
+    scaler->max_width = max_width;
+    scaler->max_height = max_height;
+    scaler->stride_alignment = stride_alignment;
+    scaler->pixel_format = pixel_format;
 }
 
 
@@ -112,11 +275,30 @@ int ImageScaler_get_new_width(ImageScaler *scaler)
     return scaler->new_width;
 }
 
+int ImageScaler_get_stride(ImageScaler *scaler)
+{
+    return scaler->stride;
+}
+
 int ImageScaler_get_buffer_size(ImageScaler *scaler)
 {
     return scaler->buffer_size;
 }
 
+void ImageScaler_release_buffers(ImageScaler *scaler)
+{
+    if (scaler->buffer != NULL) {
+        bfree(scaler->buffer);
+        scaler->buffer = NULL;
+    }
+    scaler->buffer_size = 0;
+    if (scaler->scale_context != NULL) {
+        sws_freeContext(scaler->scale_context);
+        scaler->scale_context = NULL;
+    }
+    free_slice_contexts(scaler, 0);
+}
+
 ImageScaler * ImageScaler_create()
 {
     ImageScaler * result = (ImageScaler *)bzalloc(sizeof(ImageScaler));
@@ -127,9 +309,17 @@ ImageScaler * ImageScaler_create()
     result->new_width = 0;
     result->old_height = 0;
     result->old_width = 0;
+    result->max_width = MAX_WIDTH;
+    result->max_height = 0;
+    result->stride_alignment = 1;
+    result->pixel_format = AV_PIX_FMT_BGR24;
+    result->stride = 0;
     result->buffer = NULL;
     result->buffer_size = 0;
     result->scale_context = NULL;
+    result->tasks = NULL;
+    result->num_slices = 1;
+    return result;
 }
 
 void ImageScaler_destroy(ImageScaler *scaler)
@@ -143,6 +333,7 @@ void ImageScaler_destroy(ImageScaler *scaler)
             sws_freeContext(scaler->scale_context);
             scaler->scale_context = NULL;
         }
+        free_slice_contexts(scaler, 0);
         bfree(scaler);
     }
 }
@@ -7,16 +7,45 @@
 
 #include <libswscale/swscale.h>
 
+#include "task_pool.h"
+
+#define MAX_WIDTH 640
+// one per thread of the plugin's task pool, which has at most MAX_COMPOSITE_THREADS
+#define MAX_SCALE_SLICES 4
+// smaller frames are scaled in one go, splitting them costs more than it saves
+#define SCALE_SLICE_MIN_HEIGHT 720
+// fewest output rows a slice is worth
+#define SCALE_SLICE_MIN_ROWS 16
+
+struct obs_source_frame;
+enum video_format;
+
+// rows first_row to first_row + rows - 1 of buffer are scaled, see ImageScaler_scale_planes_banded
+typedef void (*ImageScalerBandCallback)(void *opaque, const uint8_t *buffer, int first_row, int rows);
+
 typedef struct {
     int new_height;
     int new_width;
     int old_width;
     int old_height;
 
+    // what the segmentation server wants to be fed
+    int max_width;
+    int max_height;
+    int stride_alignment;
+    enum AVPixelFormat pixel_format;
+    int stride;
+
     uint8_t *buffer;
     size_t buffer_size;
 
     struct SwsContext * scale_context;
+
+    // large frames are split into horizontal slices, each scaled by its own
+    // context on the task pool straight into its rows of buffer
+    TaskPool * tasks;
+    int num_slices;
+    struct SwsContext * slice_contexts[MAX_SCALE_SLICES];
 } ImageScaler;
 
 ImageScaler * ImageScaler_create();
@@ -24,10 +53,31 @@ void ImageScaler_destroy(ImageScaler *scaler);
 int ImageScaler_get_new_height(ImageScaler *scaler);
 int ImageScaler_get_new_width(ImageScaler *scaler);
 
+int ImageScaler_get_stride(ImageScaler *scaler);
 int ImageScaler_get_buffer_size(ImageScaler *scaler);
 const uint8_t * ImageScaler_get_buffer(ImageScaler *scaler);
+// frees the scaled frame and the swscale context until the next frame
+void ImageScaler_release_buffers(ImageScaler *scaler);
 
+// Scales large frames in slices on tasks, which must outlive the scaler.
+// NULL, or a pool with a parallelism of 1, scales on the calling thread.
+void ImageScaler_set_task_pool(ImageScaler *scaler, TaskPool *tasks);
+// max_width or max_height of 0 leave that side unconstrained
+void ImageScaler_set_target(ImageScaler *scaler, int max_width, int max_height, int stride_alignment,
+                            enum AVPixelFormat pixel_format);
+const int ImageScaler_scale_planes(ImageScaler *scaler, const uint8_t * const *data, const int *linesize,
+                                   int width, int height, enum AVPixelFormat format);
+// Scales on the calling thread, feeding swscale about band_rows output rows'
+// worth of source at a time, and calls callback as each band of output rows
+// is finished, so it can go out while the rest of the frame is scaled. The
+// new dimensions and stride are set before the first call.
+const int ImageScaler_scale_planes_banded(ImageScaler *scaler, const uint8_t * const *data, const int *linesize,
+                                          int width, int height, enum AVPixelFormat format, int band_rows,
+                                          ImageScalerBandCallback callback, void *opaque);
+// implemented in scale_obs.c, which is part of the plugin rather than the core library
 const int ImageScaler_scale_image(ImageScaler *scaler, const struct obs_source_frame *frame);
+// AV_PIX_FMT_NONE for formats FFmpeg cannot convert, also from scale_obs.c
+enum AVPixelFormat get_ffmpeg_video_format(enum video_format format);
 
 
 #endif //OBS_VIRTUAL_BACKGROUND_SCALE_H
\ No newline at end of file
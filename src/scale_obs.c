@@ -0,0 +1,61 @@
+#include <obs-module.h>
+#include <libswscale/swscale.h>
+
+#include "scale.h"
+
+enum AVPixelFormat get_ffmpeg_video_format(enum video_format format)
+{
+    switch (format) {
+        case VIDEO_FORMAT_I420:
+            return AV_PIX_FMT_YUV420P;
+        case VIDEO_FORMAT_NV12:
+            return AV_PIX_FMT_NV12;
+        case VIDEO_FORMAT_YUY2:
+            return AV_PIX_FMT_YUYV422;
+        case VIDEO_FORMAT_UYVY:
+            return AV_PIX_FMT_UYVY422;
+        case VIDEO_FORMAT_RGBA:
+            return AV_PIX_FMT_RGBA;
+        case VIDEO_FORMAT_BGRA:
+        case VIDEO_FORMAT_BGRX:
+            return AV_PIX_FMT_BGRA;
+        case VIDEO_FORMAT_Y800:
+            return AV_PIX_FMT_GRAY8;
+        case VIDEO_FORMAT_I444:
+            return AV_PIX_FMT_YUV444P;
+        case VIDEO_FORMAT_BGR3:
+            return AV_PIX_FMT_BGR24;
+        case VIDEO_FORMAT_I422:
+            return AV_PIX_FMT_YUV422P;
+        case VIDEO_FORMAT_I40A:
+            return AV_PIX_FMT_YUVA420P;
+        case VIDEO_FORMAT_I42A:
+            return AV_PIX_FMT_YUVA422P;
+        case VIDEO_FORMAT_YUVA:
+            return AV_PIX_FMT_YUVA444P;
+        case VIDEO_FORMAT_NONE:
+        case VIDEO_FORMAT_YVYU:
+        case VIDEO_FORMAT_AYUV:
+            /* not supported by FFmpeg */
+            return AV_PIX_FMT_NONE;
+    }
+
+    return AV_PIX_FMT_NONE;
+}
+
+
+const int ImageScaler_scale_image(ImageScaler *scaler, const struct obs_source_frame *frame)
+{
+    int linesize[MAX_AV_PLANES];
+    for (int i = 0; i < MAX_AV_PLANES; i++) {
+        linesize[i] = (int)frame->linesize[i];
+    }
+    return ImageScaler_scale_planes(
+            scaler,
+            (const uint8_t * const *)frame->data,
+            linesize,
+            frame->width,
+            frame->height,
+            get_ffmpeg_video_format(frame->format)
+    );
+}
@@ -0,0 +1,397 @@
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "compat.h"
+#include "segmentation_batcher.h"
+
+// utility methods
+void batcher_lock(SegmentationBatcher * self);
+void batcher_unlock(SegmentationBatcher * self);
+int gather_batch(SegmentationBatcher * self, BatchRequest ** batch, int max_count, int now);
+void requeue(SegmentationBatcher * self, BatchRequest ** requests, int count);
+int batch_limit(SegmentationEndpoint * endpoint);
+int dispatch_batch(SegmentationBatcher * self, SegmentationEndpoint * endpoint, BatchRequest ** batch, int count);
+void fail_batch(SegmentationBatcher * self, BatchRequest ** batch, int count);
+int drop_expired(SegmentationBatcher * self, BatchRequest ** batch, int count);
+int send_singly(SegmentationClient * client, BatchRequest ** batch, int count);
+SegmentationEndpoint * wait_for_endpoint(SegmentationBatcher * self);
+void configure_client(SegmentationClient * client, const MaskCacheKey * key);
+void * run_dispatcher(void * data);
+
+
+SegmentationBatcher * SegmentationBatcher_create()
+{
+    SegmentationBatcher * self = (SegmentationBatcher *)bzalloc(sizeof(SegmentationBatcher));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(self->queue_cond), &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&(self->done_cond), NULL);
+    self->queued = 0;
+    self->num_threads = 0;
+    self->pool = SegmentationPool_create();
+    if (!self->pool) {
+        goto err;
+    }
+
+    self->is_running = 1;
+    for (int i = 0; i < BATCHER_DISPATCHERS; i++) {
+        if (pthread_create(&(self->thread_ids[i]), NULL, run_dispatcher, (void *)self)) {
+            goto err;
+        }
+        self->num_threads++;
+#ifdef _GNU_SOURCE
+        pthread_setname_np(self->thread_ids[i], "virtual-background-batcher");
+#endif
+    }
+    return self;
+
+    err:
+    SegmentationBatcher_destroy(self);
+    return NULL;
+}
+
+
+void SegmentationBatcher_destroy(SegmentationBatcher * self)
+{
+    if (!self) {
+        return;
+    }
+    batcher_lock(self);
+    self->is_running = 0;
+    pthread_cond_broadcast(&(self->queue_cond));
+    batcher_unlock(self);
+    for (int i = 0; i < self->num_threads; i++) {
+        pthread_join(self->thread_ids[i], NULL);
+    }
+    if (self->pool) {
+        SegmentationPool_destroy(self->pool);
+    }
+    pthread_cond_destroy(&(self->queue_cond));
+    pthread_cond_destroy(&(self->done_cond));
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+SegmentationPool * SegmentationBatcher_get_pool(SegmentationBatcher * self)
+{
+    return self->pool;
+}
+
+
+int SegmentationBatcher_segment(SegmentationBatcher * self, const MaskCacheKey * key,
+                                const uint8_t * frame, size_t size, ImgArray * mask,
+                                uint64_t deadline, uint64_t window_ns, int max_batch)
+{
+    BatchRequest request;
+    request.key = key;
+    request.frame = frame;
+    request.size = size;
+    request.mask = mask;
+    request.submitted = os_gettime_ns();
+    request.send_by = request.submitted + window_ns;
+    request.deadline = deadline;
+    request.max_batch = max_batch < 1 ? 1 : max_batch;
+    request.rc = -1;
+    request.done = 0;
+
+    batcher_lock(self);
+    if (!self->is_running || self->queued >= BATCHER_MAX_QUEUE) {
+        batcher_unlock(self);
+        return -1;
+    }
+    self->queue[self->queued++] = &request;
+    pthread_cond_broadcast(&(self->queue_cond));
+    while (!request.done) {
+        pthread_cond_wait(&(self->done_cond), &(self->mutex));
+    }
+    batcher_unlock(self);
+    return request.rc;
+}
+
+
+void SegmentationBatcher_get_stats(SegmentationBatcher * self, BatcherStats * stats)
+{
+    batcher_lock(self);
+    *stats = self->stats;
+    batcher_unlock(self);
+}
+
+
+void * run_dispatcher(void * data)
+{
+    SegmentationBatcher * self = (SegmentationBatcher *)data;
+    BatchRequest * batch[MAX_SEGMENTATION_BATCH];
+
+    batcher_lock(self);
+    while (1) {
+        while (self->is_running && self->queued == 0) {
+            pthread_cond_wait(&(self->queue_cond), &(self->mutex));
+        }
+        if (!self->is_running) {
+            break;
+        }
+        // frames keep piling up in the queue while every endpoint is busy
+        batcher_unlock(self);
+        SegmentationEndpoint * endpoint = wait_for_endpoint(self);
+        batcher_lock(self);
+        if (endpoint == NULL) {
+            int count = gather_batch(self, batch, MAX_SEGMENTATION_BATCH, 1);
+            fail_batch(self, batch, count);
+            continue;
+        }
+        batcher_unlock(self);
+        int limit = batch_limit(endpoint);
+        batcher_lock(self);
+        int count = drop_expired(self, batch, gather_batch(self, batch, limit, 0));
+        if (count == 0) {
+            // the other dispatcher took them, or they expired
+            SegmentationPool_cancel(self->pool, endpoint);
+            continue;
+        }
+        batcher_unlock(self);
+        // frames it had to put back are still queued and their threads still waiting
+        count = dispatch_batch(self, endpoint, batch, count);
+        batcher_lock(self);
+        for (int i = 0; i < count; i++) {
+            batch[i]->done = 1;
+        }
+        pthread_cond_broadcast(&(self->done_cond));
+    }
+    batcher_unlock(self);
+    return NULL;
+}
+
+
+// Waits, with the lock held, until the queue holds as many frames as its
+// most impatient frame allows, or max_count, or that frame's window is up,
+// then takes the oldest of them. With now set it takes what is there
+// without waiting. Returns how many it took.
+int gather_batch(SegmentationBatcher * self, BatchRequest ** batch, int max_count, int now)
+{
+    while (self->is_running && self->queued > 0) {
+        int limit = max_count;
+        uint64_t send_by = self->queue[0]->send_by;
+        for (int i = 0; i < self->queued; i++) {
+            if (self->queue[i]->max_batch < limit) {
+                limit = self->queue[i]->max_batch;
+            }
+            if (self->queue[i]->send_by < send_by) {
+                send_by = self->queue[i]->send_by;
+            }
+        }
+
+        if (now || self->queued >= limit || os_gettime_ns() >= send_by) {
+            int count = self->queued < limit ? self->queued : limit;
+            for (int i = 0; i < count; i++) {
+                batch[i] = self->queue[i];
+            }
+            self->queued -= count;
+            memmove(self->queue, self->queue + count, self->queued * sizeof(BatchRequest *));
+            return count;
+        }
+
+        struct timespec until;
+        until.tv_sec = (time_t)(send_by / 1000000000ULL);
+        until.tv_nsec = (long)(send_by % 1000000000ULL);
+        pthread_cond_timedwait(&(self->queue_cond), &(self->mutex), &until);
+    }
+    return 0;
+}
+
+
+// Puts frames back at the head of the queue, they are the oldest. Frames
+// submitted since may have filled it, and those that no longer fit fail.
+void requeue(SegmentationBatcher * self, BatchRequest ** requests, int count)
+{
+    batcher_lock(self);
+    int room = BATCHER_MAX_QUEUE - self->queued;
+    if (count > room) {
+        fail_batch(self, requests + room, count - room);
+        count = room;
+    }
+    memmove(self->queue + count, self->queue, self->queued * sizeof(BatchRequest *));
+    for (int i = 0; i < count; i++) {
+        self->queue[i] = requests[i];
+    }
+    self->queued += count;
+    pthread_cond_broadcast(&(self->queue_cond));
+    batcher_unlock(self);
+}
+
+
+// called with the lock held when no server can be reached
+void fail_batch(SegmentationBatcher * self, BatchRequest ** batch, int count)
+{
+    for (int i = 0; i < count; i++) {
+        batch[i]->rc = -1;
+        batch[i]->done = 1;
+    }
+    self->stats.failures += count;
+    pthread_cond_broadcast(&(self->done_cond));
+}
+
+
+// Called with the lock held. Fails the frames past their deadline and packs
+// the rest at the front of batch, returns how many are left.
+int drop_expired(SegmentationBatcher * self, BatchRequest ** batch, int count)
+{
+    uint64_t now = os_gettime_ns();
+    int live = 0;
+    for (int i = 0; i < count; i++) {
+        if (batch[i]->deadline != 0 && now >= batch[i]->deadline) {
+            batch[i]->rc = SOCK_DEADLINE_EXPIRED;
+            batch[i]->done = 1;
+            self->stats.expired++;
+        } else {
+            batch[live++] = batch[i];
+        }
+    }
+    if (live < count) {
+        pthread_cond_broadcast(&(self->done_cond));
+    }
+    return live;
+}
+
+
+// Connects a fresh endpoint, which has to before it knows whether it takes
+// batches, and returns the most frames one batch to it may hold.
+int batch_limit(SegmentationEndpoint * endpoint)
+{
+    SegmentationClient * client = endpoint->client;
+    const ServerCapabilities * capabilities = SegmentationClient_get_capabilities(client);
+    if (capabilities->version == PROTOCOL_VERSION_UNKNOWN) {
+        SegmentationClient_connect(client);
+    }
+    if (capabilities->version >= PROTOCOL_VERSION_3 && capabilities->max_batch < MAX_SEGMENTATION_BATCH) {
+        return capabilities->max_batch > 1 ? capabilities->max_batch : 1;
+    }
+    return MAX_SEGMENTATION_BATCH;
+}
+
+
+// Sends the batch and fills in every frame's rc. A reconnect may have
+// found a server taking fewer frames, so the rest go back to the queue.
+// Returns how many frames were sent; only those are finished.
+int dispatch_batch(SegmentationBatcher * self, SegmentationEndpoint * endpoint, BatchRequest ** batch, int count)
+{
+    uint64_t now = os_gettime_ns();
+    SegmentationClient * client = endpoint->client;
+    const ServerCapabilities * capabilities = SegmentationClient_get_capabilities(client);
+    int batched = capabilities->version >= PROTOCOL_VERSION_3;
+    if (batched && count > capabilities->max_batch) {
+        requeue(self, batch + capabilities->max_batch, count - capabilities->max_batch);
+        count = capabilities->max_batch;
+    }
+
+    int rc;
+    if (batched && count > 1) {
+        SegmentationBatchFrame frames[MAX_SEGMENTATION_BATCH];
+        for (int i = 0; i < count; i++) {
+            const MaskCacheKey * key = batch[i]->key;
+            frames[i].id = (uint32_t)i;
+            frames[i].segmentation_threshold = key->segmentation_threshold;
+            frames[i].height = key->height;
+            frames[i].width = key->width;
+            frames[i].blur = key->blur;
+            frames[i].growshrink = key->growshrink;
+            frames[i].stride = key->stride;
+            frames[i].pixel_format = key->pixel_format;
+            frames[i].frame = batch[i]->frame;
+            frames[i].frame_size = batch[i]->size;
+            frames[i].mask = batch[i]->mask;
+            frames[i].deadline = batch[i]->deadline;
+        }
+        rc = SegmentationClient_run_batch(client, os_gettime_ns(), frames, count);
+        for (int i = 0; i < count; i++) {
+            batch[i]->rc = rc ? rc : frames[i].rc;
+        }
+    } else {
+        rc = send_singly(client, batch, count);
+    }
+    SegmentationPool_release(self->pool, endpoint, rc);
+
+    batcher_lock(self);
+    self->stats.batches++;
+    self->stats.batch_sizes[count]++;
+    self->stats.frames += count;
+    if (!batched) {
+        self->stats.single_requests += count;
+    }
+    for (int i = 0; i < count; i++) {
+        self->stats.gather_ns += now - batch[i]->submitted;
+        if (batch[i]->rc == SOCK_DEADLINE_EXPIRED) {
+            self->stats.expired++;
+        } else if (batch[i]->rc == SOCK_FRAME_DROPPED) {
+            self->stats.dropped++;
+        } else if (batch[i]->rc) {
+            self->stats.failures++;
+        }
+    }
+    batcher_unlock(self);
+    return count;
+}
+
+
+// for servers without batch requests; returns the first failure of the connection
+int send_singly(SegmentationClient * client, BatchRequest ** batch, int count)
+{
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        configure_client(client, batch[i]->key);
+        SegmentationClient_set_deadline(client, batch[i]->deadline);
+        int rc = SegmentationClient_run_segmentation(client, os_gettime_ns(), batch[i]->frame, batch[i]->size);
+        if (rc == 0) {
+            rc = ImgArray_copy_from_raw_buffer(batch[i]->mask, SegmentationClient_get_mask(client),
+                                               SegmentationClient_get_mask_size(client));
+        }
+        batch[i]->rc = rc;
+        if (rc && rc != SOCK_DEADLINE_EXPIRED && rc != SOCK_FRAME_DROPPED && !result) {
+            result = rc;
+        }
+    }
+    return result;
+}
+
+
+SegmentationEndpoint * wait_for_endpoint(SegmentationBatcher * self)
+{
+    while (self->is_running) {
+        SegmentationEndpoint * endpoint = SegmentationPool_acquire(self->pool);
+        if (endpoint != NULL) {
+            return endpoint;
+        }
+        if (SegmentationPool_get_num_healthy(self->pool) == 0) {
+            return NULL;
+        }
+        // every endpoint is busy with the other dispatcher's batch
+        nanosleep((const struct timespec[]){{0, BATCHER_ACQUIRE_RETRY_NS}}, NULL);
+    }
+    return NULL;
+}
+
+
+void configure_client(SegmentationClient * client, const MaskCacheKey * key)
+{
+    SegmentationClient_set_dimensions(client, key->height, key->width);
+    SegmentationClient_set_parameters(client, key->segmentation_threshold, key->blur, key->growshrink);
+    SegmentationClient_set_format(client, key->stride, key->pixel_format);
+}
+
+
+void batcher_lock(SegmentationBatcher * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+}
+
+void batcher_unlock(SegmentationBatcher * self)
+{
+    pthread_mutex_unlock(&(self->mutex));
+}
@@ -0,0 +1,89 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_SEGMENTATION_BATCHER_H
+#define OBS_VIRTUAL_BACKGROUND_SEGMENTATION_BATCHER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "segmentation_client.h"
+#include "segmentation_pool.h"
+#include "mask_cache.h"
+#include "imgarray.h"
+
+#define BATCHER_MAX_QUEUE              64
+// batches in flight at once, each on its own endpoint
+#define BATCHER_DISPATCHERS            2
+#define BATCHER_DEFAULT_WINDOW_NS      4000000ULL
+#define BATCHER_DEFAULT_MAX_BATCH      4
+// how often a dispatcher looks for a free endpoint while all are busy
+#define BATCHER_ACQUIRE_RETRY_NS       1000000L
+
+
+// a frame waiting in the batcher, owned by the thread that submitted it
+typedef struct {
+    const MaskCacheKey * key;
+    const uint8_t * frame;
+    size_t size;
+    ImgArray * mask;
+    uint64_t submitted;
+    // the batch this frame lands in is sent by then at the latest
+    uint64_t send_by;
+    // past it the frame is dropped instead of sent, 0 for never
+    uint64_t deadline;
+    int max_batch;
+    int rc;
+    uint8_t done;
+} BatchRequest;
+
+
+typedef struct {
+    uint64_t batches;
+    uint64_t frames;
+    // frames sent one by one because their server predates batches
+    uint64_t single_requests;
+    uint64_t failures;
+    // frames whose deadline passed while they waited for a batch, and
+    // frames the server dropped past theirs
+    uint64_t expired;
+    uint64_t dropped;
+    // total time frames spent waiting for their batch to fill
+    uint64_t gather_ns;
+    // batch_sizes[n] counts batches of n frames
+    uint64_t batch_sizes[MAX_SEGMENTATION_BATCH + 1];
+} BatcherStats;
+
+
+// Gathers frames from any number of segmentation threads into batch requests
+// on a shared pool of servers.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t queue_cond;
+    pthread_cond_t done_cond;
+    BatchRequest * queue[BATCHER_MAX_QUEUE];
+    int queued;
+
+    SegmentationPool * pool;
+    pthread_t thread_ids[BATCHER_DISPATCHERS];
+    int num_threads;
+    uint8_t is_running;
+    BatcherStats stats;
+} SegmentationBatcher;
+
+
+SegmentationBatcher * SegmentationBatcher_create();
+// every thread using the batcher must be destroyed first
+void SegmentationBatcher_destroy(SegmentationBatcher * self);
+SegmentationPool * SegmentationBatcher_get_pool(SegmentationBatcher * self);
+
+// Segments frame, whose geometry and parameters are in key, into mask. The
+// frame's batch is sent once it holds max_batch frames, or window_ns after
+// the frame arrived, whichever is first. Blocks until the mask is back and
+// returns non-zero if it could not be segmented: SOCK_DEADLINE_EXPIRED if
+// deadline (0 for none) passed before it was sent, SOCK_FRAME_DROPPED if
+// the server dropped it.
+int SegmentationBatcher_segment(SegmentationBatcher * self, const MaskCacheKey * key,
+                                const uint8_t * frame, size_t size, ImgArray * mask,
+                                uint64_t deadline, uint64_t window_ns, int max_batch);
+void SegmentationBatcher_get_stats(SegmentationBatcher * self, BatcherStats * stats);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_SEGMENTATION_BATCHER_H
@@ -1,9 +1,12 @@
-#include <obs-module.h>
+#include "compat.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "segmentation_client.h"
@@ -11,15 +14,37 @@
 
 const char REQUEST_HEADER[] =          {-18, 97, -66, -60, 56, -46, 86, -87};
 const char RESPONSE_HEADER[] =         {80, 119, 61, -38, -56, 125, 93, -105};
+const char HELLO_HEADER[] =            {-18, 97, -66, -60, 72, 69, 76, 50};
+const char HELLO_RESPONSE_HEADER[] =   {80, 119, 61, -38, 72, 69, 76, 50};
+const char BATCH_HEADER[] =            {-18, 97, -66, -60, 66, 65, 84, 51};
+const char BATCH_RESPONSE_HEADER[] =   {80, 119, 61, -38, 66, 65, 84, 51};
+
+#define CLIENT_PIXEL_FORMATS           (FORMAT_BIT(PIXEL_FORMAT_BGR24) | FORMAT_BIT(PIXEL_FORMAT_RGB24))
+#define CLIENT_MASK_ENCODINGS          FORMAT_BIT(MASK_ENCODING_RAW8)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                   0
+#endif
 
 
 // utility methods
 int get_segmentation_port(SegmentationClient *client, uint64_t current_timestamp);
 int get_client_socket(SegmentationClient *client, uint64_t current_timestamp);
+int connect_inet(SegmentationClient *client);
+int connect_unix(SegmentationClient *client);
 void invalidate_connection(SegmentationClient *client);
-int write_request(SegmentationClient *client, int sock_fd, const uint8_t *frame_bgr, size_t frame_total_size);
-int read_response(SegmentationClient *client, int sock_fd);
+void reset_capabilities(SegmentationClient *client, int version);
+int handshake(SegmentationClient *client, int sock_fd);
+int write_preamble(SegmentationClient *client, int sock_fd, size_t frame_total_size);
+int read_response(SegmentationClient *client, int sock_fd, int band_rows,
+                  SegmentationBandCallback callback, void *opaque);
 uint8_t * get_mask(SegmentationClient *client, size_t mask_size);
+int write_batch(SegmentationClient *client, int sock_fd, SegmentationBatchFrame *frames, int count);
+int read_batch(SegmentationClient *client, int sock_fd, SegmentationBatchFrame *frames, int count);
+int write_all(SegmentationClient *client, int sock_fd, const void *data, size_t size);
+int read_all(SegmentationClient *client, int sock_fd, void *data, size_t size);
+int io_timed_out();
+uint32_t deadline_budget(uint64_t deadline, uint64_t now);
 
 
 SegmentationClient * SegmentationClient_create()
@@ -30,7 +55,10 @@ SegmentationClient * SegmentationClient_create()
     }
     client->client_socket = -1;
     client->client_port = -1;
+    client->fixed_port = -1;
+    strncpy(client->hostname, SEGMENTATION_HOSTNAME, SEGMENTATION_HOSTNAME_LENGTH - 1);
     client->last_port_timestamp = 0;
+    client->v1_fallback_timestamp = 0;
     client->mask = NULL;
     client->mask_size = 0;
     client->preamble.growshrink = 0;
@@ -39,7 +67,13 @@ SegmentationClient * SegmentationClient_create()
     client->preamble.segmentation_threshold = 0.5f;
     client->preamble.blur = 0;
     client->preamble.length = 0;
+    client->preamble.stride = 0;
+    client->preamble.pixel_format = PIXEL_FORMAT_BGR24;
+    client->preamble.mask_encoding = MASK_ENCODING_RAW8;
+    client->preamble.budget_us = 0;
+    client->deadline = 0;
     memcpy(client->preamble.header, REQUEST_HEADER, HEADER_LENGTH);
+    reset_capabilities(client, PROTOCOL_VERSION_UNKNOWN);
     return client;
 }
 
@@ -55,6 +89,53 @@ void SegmentationClient_destroy(SegmentationClient *client)
     }
 }
 
+void SegmentationClient_set_endpoint(SegmentationClient *client, const char *hostname, int port)
+{
+    if (strncmp(client->hostname, hostname, SEGMENTATION_HOSTNAME_LENGTH) != 0 || client->fixed_port != port) {
+        invalidate_connection(client);
+        reset_capabilities(client, PROTOCOL_VERSION_UNKNOWN);
+    }
+    strncpy(client->hostname, hostname, SEGMENTATION_HOSTNAME_LENGTH - 1);
+    client->hostname[SEGMENTATION_HOSTNAME_LENGTH - 1] = '\0';
+    client->fixed_port = port;
+    client->client_port = port;
+}
+
+void SegmentationClient_set_socket_path(SegmentationClient *client, const char *path)
+{
+    if (strncmp(client->socket_path, path, SEGMENTATION_SOCKET_PATH_LENGTH) != 0) {
+        invalidate_connection(client);
+        reset_capabilities(client, PROTOCOL_VERSION_UNKNOWN);
+    }
+    strncpy(client->socket_path, path, SEGMENTATION_SOCKET_PATH_LENGTH - 1);
+    client->socket_path[SEGMENTATION_SOCKET_PATH_LENGTH - 1] = '\0';
+}
+
+int SegmentationClient_is_connected(SegmentationClient *client)
+{
+    return client->client_socket != -1;
+}
+
+void SegmentationClient_disconnect(SegmentationClient *client)
+{
+    invalidate_connection(client);
+}
+
+int SegmentationClient_connect(SegmentationClient *client)
+{
+    return get_client_socket(client, os_gettime_ns()) < 0 ? -1 : 0;
+}
+
+void SegmentationClient_release_buffers(SegmentationClient *client)
+{
+    invalidate_connection(client);
+    if (client->mask != NULL) {
+        bfree(client->mask);
+        client->mask = NULL;
+    }
+    client->mask_size = 0;
+}
+
 void SegmentationClient_set_dimensions(SegmentationClient *client, int height, int width)
 {
     client->preamble.height = (int16_t)height;
@@ -68,22 +149,85 @@ void SegmentationClient_set_parameters(SegmentationClient *client, float segment
     client->preamble.growshrink = (int16_t)growshrink;
 }
 
+void SegmentationClient_set_format(SegmentationClient *client, int stride, enum PixelFormat pixel_format)
+{
+    client->preamble.stride = (uint16_t)stride;
+    client->preamble.pixel_format = (uint8_t)pixel_format;
+}
+
+void SegmentationClient_set_deadline(SegmentationClient *client, uint64_t deadline)
+{
+    client->deadline = deadline;
+}
+
+const ServerCapabilities * SegmentationClient_get_capabilities(SegmentationClient *client)
+{
+    return &(client->capabilities);
+}
+
 int SegmentationClient_run_segmentation(SegmentationClient *client, uint64_t timestamp, const uint8_t *frame_bgr, size_t frame_total_size)
+{
+    int rc = SegmentationClient_begin_request(client, timestamp, frame_total_size);
+    if (rc == 0) {
+        rc = SegmentationClient_write_rows(client, frame_bgr, frame_total_size);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return SegmentationClient_finish_request(client, 0, NULL, NULL);
+}
+
+int SegmentationClient_begin_request(SegmentationClient *client, uint64_t timestamp, size_t frame_total_size)
 {
     int rc, sock_fd;
 
+    client->stream_remaining = 0;
     sock_fd = get_client_socket(client, timestamp);
     if (sock_fd < 0) {
         return -1;
     }
+    if (client->deadline != 0 && os_gettime_ns() >= client->deadline) {
+        return SOCK_DEADLINE_EXPIRED;
+    }
 
-    rc = write_request(client, sock_fd, frame_bgr, frame_total_size);
+    client->io_deadline = os_gettime_ns() + REQUEST_TIMEOUT_NS;
+    rc = write_preamble(client, sock_fd, frame_total_size);
     if (rc != 0) {
         fprintf(stderr, "Error writing to segmentation service: %d\n", rc);
         return rc;
     }
+    client->stream_remaining = frame_total_size;
+    return 0;
+}
 
-    rc = read_response(client, sock_fd);
+int SegmentationClient_write_rows(SegmentationClient *client, const uint8_t *rows, size_t size)
+{
+    if (client->client_socket == -1 || size > client->stream_remaining) {
+        invalidate_connection(client);
+        return SOCK_FRAME_WRITE_FAILURE;
+    }
+    if (write_all(client, client->client_socket, rows, size)) {
+        invalidate_connection(client);
+        fprintf(stderr, "Error writing to segmentation service: %d\n", SOCK_FRAME_WRITE_FAILURE);
+        return SOCK_FRAME_WRITE_FAILURE;
+    }
+    client->stream_remaining -= size;
+    return 0;
+}
+
+int SegmentationClient_finish_request(SegmentationClient *client, int band_rows,
+                                      SegmentationBandCallback callback, void *opaque)
+{
+    if (client->client_socket == -1 || client->stream_remaining != 0) {
+        // the server is still waiting on the rest of the frame
+        invalidate_connection(client);
+        return SOCK_FRAME_WRITE_FAILURE;
+    }
+
+    int rc = read_response(client, client->client_socket, band_rows, callback, opaque);
+    if (rc == SOCK_FRAME_DROPPED) {
+        return rc;
+    }
     if (rc != 0) {
         fprintf(stderr, "Error reading from segmentation service: %d\n", rc);
         return rc;
@@ -91,6 +235,37 @@ int SegmentationClient_run_segmentation(SegmentationClient *client, uint64_t tim
     return 0;
 }
 
+int SegmentationClient_run_batch(SegmentationClient *client, uint64_t timestamp,
+                                 SegmentationBatchFrame *frames, int count)
+{
+    int rc, sock_fd;
+
+    for (int i = 0; i < count; i++) {
+        frames[i].rc = SOCK_NO_MASK;
+    }
+    sock_fd = get_client_socket(client, timestamp);
+    if (sock_fd < 0) {
+        return -1;
+    }
+    if (client->capabilities.version < PROTOCOL_VERSION_3 || count > client->capabilities.max_batch) {
+        return SOCK_BATCH_UNSUPPORTED;
+    }
+
+    client->io_deadline = os_gettime_ns() + REQUEST_TIMEOUT_NS;
+    rc = write_batch(client, sock_fd, frames, count);
+    if (rc != 0) {
+        fprintf(stderr, "Error writing batch to segmentation service: %d\n", rc);
+        return rc;
+    }
+
+    rc = read_batch(client, sock_fd, frames, count);
+    if (rc != 0) {
+        fprintf(stderr, "Error reading batch from segmentation service: %d\n", rc);
+        return rc;
+    }
+    return 0;
+}
+
 const uint8_t * SegmentationClient_get_mask(SegmentationClient *client)
 {
     return client->mask;
@@ -102,35 +277,39 @@ size_t SegmentationClient_get_mask_size(SegmentationClient *client)
 }
 
 
-int write_request(SegmentationClient *client, int sock_fd, const uint8_t *frame_bgr, size_t frame_total_size)
+int write_preamble(SegmentationClient *client, int sock_fd, size_t frame_total_size)
 {
-    int written;
+    size_t preamble_size = PREAMBLE_V1_SIZE;
+
+    if (client->capabilities.version >= PROTOCOL_VERSION_4) {
+        preamble_size = PREAMBLE_V4_SIZE;
+        client->preamble.mask_encoding = client->capabilities.mask_encoding;
+        client->preamble.budget_us = deadline_budget(client->deadline, os_gettime_ns());
+    } else if (client->capabilities.version >= PROTOCOL_VERSION_2) {
+        preamble_size = PREAMBLE_V2_SIZE;
+        client->preamble.mask_encoding = client->capabilities.mask_encoding;
+    } else if (client->preamble.pixel_format != PIXEL_FORMAT_BGR24 ||
+            (client->preamble.stride != 0 && client->preamble.stride != client->preamble.width * 3)) {
+        // a v1 server only understands tightly packed BGR
+        return SOCK_HANDSHAKE_FAILURE;
+    }
 
-    client->preamble.length = sizeof(client->preamble) + frame_total_size;
+    client->preamble.length = preamble_size + frame_total_size;
 
-    written = write(sock_fd, &(client->preamble), sizeof(client->preamble));
-    if (written != sizeof(client->preamble)) {
+    if (write_all(client, sock_fd, &(client->preamble), preamble_size)) {
         invalidate_connection(client);
         return SOCK_PREAMBLE_WRITE_FAILURE;
     }
-
-    size_t current_offset = 0;
-    while (current_offset < frame_total_size) {
-        written = write(sock_fd, frame_bgr + current_offset, frame_total_size - current_offset);
-        current_offset += written;
-    }
     return 0;
 }
 
-int read_response(SegmentationClient *client, int sock_fd)
+int read_response(SegmentationClient *client, int sock_fd, int band_rows,
+                  SegmentationBandCallback callback, void *opaque)
 {
     char response_header[HEADER_LENGTH];
-    int read_bytes;
 
-    read_bytes = recv(sock_fd, &response_header, HEADER_LENGTH, MSG_WAITALL);
-    if (read_bytes != HEADER_LENGTH) {
+    if (read_all(client, sock_fd, &response_header, HEADER_LENGTH)) {
         invalidate_connection(client);
-        fprintf(stderr, "read_bytes: %d. header_length: %d. %d\n", read_bytes, HEADER_LENGTH, sock_fd);
         return SOCK_NO_HEADER_READ;
     }
 
@@ -140,12 +319,14 @@ int read_response(SegmentationClient *client, int sock_fd)
     }
 
     int32_t mask_length;
-    read_bytes = recv(sock_fd, &mask_length, sizeof(mask_length), 0);
-    if (read_bytes != sizeof(mask_length)) {
+    if (read_all(client, sock_fd, &mask_length, sizeof(mask_length))) {
         invalidate_connection(client);
         return SOCK_UNDERREAD_MASK;
     }
 
+    if (mask_length == MASK_LENGTH_DROPPED) {
+        return SOCK_FRAME_DROPPED;
+    }
     if (mask_length < 0) {
         invalidate_connection(client);
         return SOCK_NEGATIVE_RESPONSE_SIZE;
@@ -157,15 +338,178 @@ int read_response(SegmentationClient *client, int sock_fd)
         return SOCK_NO_MASK;
     }
 
-    int total_read = 0;
-    while (total_read < mask_length) {
-        read_bytes = recv(sock_fd, mask + total_read, mask_length - total_read, 0);
-        total_read += read_bytes;
+    // a raw mask has one byte per pixel, so a band is band_rows * width bytes
+    size_t band_size = (size_t)mask_length;
+    if (band_rows > 0 && client->preamble.width > 0) {
+        band_size = (size_t)band_rows * client->preamble.width;
+    }
+    size_t offset = 0;
+    while (offset < (size_t)mask_length) {
+        size_t size = (size_t)mask_length - offset < band_size ? (size_t)mask_length - offset : band_size;
+        if (read_all(client, sock_fd, mask + offset, size)) {
+            invalidate_connection(client);
+            return SOCK_UNDERREAD_MASK;
+        }
+        if (callback != NULL && client->preamble.width > 0) {
+            int width = client->preamble.width;
+            int first_row = (int)(offset / width);
+            int end_row = (int)((offset + size) / width);
+            if (end_row > first_row) {
+                callback(opaque, mask, first_row, end_row - first_row);
+            }
+        }
+        offset += size;
     }
     return 0;
 }
 
 
+int write_batch(SegmentationClient *client, int sock_fd, SegmentationBatchFrame *frames, int count)
+{
+    BatchPreamble preamble;
+    memcpy(preamble.header, BATCH_HEADER, HEADER_LENGTH);
+    preamble.count = (uint16_t)count;
+    preamble.reserved = 0;
+    size_t header_size = client->capabilities.version >= PROTOCOL_VERSION_4 ?
+            sizeof(BatchFrameHeader) : BATCH_FRAME_HEADER_V3_SIZE;
+    size_t length = sizeof(BatchPreamble);
+    for (int i = 0; i < count; i++) {
+        length += header_size + frames[i].frame_size;
+    }
+    preamble.length = (uint32_t)length;
+
+    if (write_all(client, sock_fd, &preamble, sizeof(preamble))) {
+        invalidate_connection(client);
+        return SOCK_PREAMBLE_WRITE_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        BatchFrameHeader header;
+        header.id = frames[i].id;
+        header.length = (uint32_t)frames[i].frame_size;
+        header.segmentation_threshold = frames[i].segmentation_threshold;
+        header.height = (int16_t)frames[i].height;
+        header.width = (int16_t)frames[i].width;
+        header.blur = (int16_t)frames[i].blur;
+        header.growshrink = (int16_t)frames[i].growshrink;
+        header.stride = (uint16_t)frames[i].stride;
+        header.pixel_format = (uint8_t)frames[i].pixel_format;
+        header.mask_encoding = (uint8_t)client->capabilities.mask_encoding;
+        header.budget_us = deadline_budget(frames[i].deadline, os_gettime_ns());
+        if (write_all(client, sock_fd, &header, header_size) ||
+                write_all(client, sock_fd, frames[i].frame, frames[i].frame_size)) {
+            invalidate_connection(client);
+            return SOCK_PREAMBLE_WRITE_FAILURE;
+        }
+    }
+    return 0;
+}
+
+int read_batch(SegmentationClient *client, int sock_fd, SegmentationBatchFrame *frames, int count)
+{
+    BatchPreamble preamble;
+    if (read_all(client, sock_fd, &preamble, sizeof(preamble))) {
+        invalidate_connection(client);
+        return SOCK_NO_HEADER_READ;
+    }
+    if (memcmp(preamble.header, BATCH_RESPONSE_HEADER, HEADER_LENGTH) != 0) {
+        invalidate_connection(client);
+        return SOCK_INVALID_RESPONSE_HEADER;
+    }
+    if (preamble.count != count) {
+        invalidate_connection(client);
+        return SOCK_BATCH_MISMATCH;
+    }
+
+    for (int i = 0; i < count; i++) {
+        BatchMaskHeader header;
+        if (read_all(client, sock_fd, &header, sizeof(header))) {
+            invalidate_connection(client);
+            return SOCK_UNDERREAD_MASK;
+        }
+        // masks may come back in any order
+        SegmentationBatchFrame * frame = NULL;
+        for (int j = 0; j < count && frame == NULL; j++) {
+            if (frames[j].id == header.id) {
+                frame = &frames[j];
+            }
+        }
+        if (frame == NULL) {
+            invalidate_connection(client);
+            return SOCK_BATCH_MISMATCH;
+        }
+        if (header.length < 0) {
+            frame->rc = header.length == MASK_LENGTH_DROPPED ? SOCK_FRAME_DROPPED : SOCK_NEGATIVE_RESPONSE_SIZE;
+            continue;
+        }
+        uint8_t * mask = ImgArray_ensure_buffer(frame->mask, (size_t)header.length);
+        if (mask == NULL && header.length > 0) {
+            invalidate_connection(client);
+            return SOCK_NO_MASK;
+        }
+        if (read_all(client, sock_fd, mask, (size_t)header.length)) {
+            invalidate_connection(client);
+            return SOCK_UNDERREAD_MASK;
+        }
+        frame->rc = 0;
+    }
+    return 0;
+}
+
+// A server that resets the connection must not raise SIGPIPE in the host
+// process, and one that trickles bytes in under the socket timeouts must
+// not hold the worker past client->io_deadline.
+int write_all(SegmentationClient *client, int sock_fd, const void *data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        if (os_gettime_ns() > client->io_deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        ssize_t written = send(sock_fd, (const uint8_t *)data + offset, size - offset, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written == 0) {
+            errno = ECONNRESET;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += (size_t)written;
+    }
+    return 0;
+}
+
+int read_all(SegmentationClient *client, int sock_fd, void *data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        if (os_gettime_ns() > client->io_deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        ssize_t read_bytes = recv(sock_fd, (uint8_t *)data + offset, size - offset, 0);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes == 0) {
+            errno = ECONNRESET;
+        }
+        if (read_bytes <= 0) {
+            return -1;
+        }
+        offset += (size_t)read_bytes;
+    }
+    return 0;
+}
+
+// after write_all or read_all failed: whether the peer was too slow rather than gone
+int io_timed_out()
+{
+    return errno == ETIMEDOUT || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
 
 int get_client_socket(SegmentationClient *client, uint64_t current_timestamp)
 {
@@ -176,18 +520,17 @@ int get_client_socket(SegmentationClient *client, uint64_t current_timestamp)
         return client->client_socket;
     }
     
-    int port = get_segmentation_port(client, current_timestamp);
-    if (port == -1) {
-        return SOCK_NO_SEGMENTATION_PORT;
+    int is_unix = client->socket_path[0] != '\0';
+    if (!is_unix && get_segmentation_port(client, current_timestamp) == -1) {
+        return -1;
     }
 
     // always mark an attempt so we're not thrashing
     client->last_connect_timestamp = current_timestamp;
 
-    struct sockaddr_in server_addr, client_addr;
-    client->client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    client->client_socket = socket(is_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (client->client_socket == -1) {
-        return SOCK_NO_SOCKET;
+        return -1;
     }
 
     int trueval = 1;
@@ -208,25 +551,70 @@ int get_client_socket(SegmentationClient *client, uint64_t current_timestamp)
         return -1;
     }
 
+    if ((is_unix ? connect_unix(client) : connect_inet(client)) < 0) {
+        close(client->client_socket);
+        client->client_socket = -1;
+        return -1;
+    }
+
+    if (client->capabilities.version == PROTOCOL_VERSION_1 &&
+            current_timestamp - client->v1_fallback_timestamp >= HELLO_RETRY_INTERVAL_NS) {
+        // the hello may have failed for a reason other than a v1 server, or the server was upgraded
+        reset_capabilities(client, PROTOCOL_VERSION_UNKNOWN);
+    }
+    int rc = client->capabilities.version != PROTOCOL_VERSION_1 ? handshake(client, client->client_socket) : 0;
+    if (rc == SOCK_HANDSHAKE_TIMEOUT) {
+        // a server still loading its model answers late, so keep trying v2
+        fprintf(stderr, "Segmentation server did not answer the v2 hello in time\n");
+        invalidate_connection(client);
+        return -1;
+    }
+    if (rc != 0) {
+        // v1 servers hang up on the hello, so retry the next connection without it
+        fprintf(stderr, "Segmentation server did not answer the v2 hello, falling back to v1 for a while\n");
+        invalidate_connection(client);
+        reset_capabilities(client, PROTOCOL_VERSION_1);
+        client->v1_fallback_timestamp = current_timestamp;
+        return -1;
+    }
+    return client->client_socket;
+}
+
+
+int connect_inet(SegmentationClient *client)
+{
+    struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(client->client_port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
-    struct hostent *server = gethostbyname(SEGMENTATION_HOSTNAME);
+    struct hostent *server = gethostbyname(client->hostname);
+    if (server == NULL) {
+        return -1;
+    }
 
     bcopy((char *)server->h_addr, (char *)&server_addr.sin_addr.s_addr, server->h_length);
 
-    if (connect(client->client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(client->client_socket);
-        client->client_socket = -1;
-        return -1;
-    }
-    return client->client_socket;
+    return connect(client->client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr));
+}
+
+
+int connect_unix(SegmentationClient *client)
+{
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, client->socket_path, sizeof(server_addr.sun_path) - 1);
+
+    return connect(client->client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr));
 }
 
 
 int get_segmentation_port(SegmentationClient *client, uint64_t current_timestamp)
 {
+    if (client->fixed_port != -1) {
+        return client->fixed_port;
+    }
     if (client->client_port != -1 && (current_timestamp - client->last_port_timestamp) < CHECK_PORT_INTERVAL) {
         return client->client_port;
     }
@@ -268,10 +656,82 @@ uint8_t * get_mask(SegmentationClient *client, size_t mask_size)
     return client->mask;
 }
 
+int handshake(SegmentationClient *client, int sock_fd)
+{
+    HelloRequest hello;
+    HelloResponse response;
+
+    memcpy(hello.header, HELLO_HEADER, HEADER_LENGTH);
+    hello.version = PROTOCOL_VERSION_4;
+    hello.pixel_formats = CLIENT_PIXEL_FORMATS;
+    hello.mask_encodings = CLIENT_MASK_ENCODINGS;
+    hello.reserved = 0;
+
+    client->io_deadline = os_gettime_ns() + REQUEST_TIMEOUT_NS;
+    if (write_all(client, sock_fd, &hello, sizeof(hello)) ||
+            read_all(client, sock_fd, &response, sizeof(response))) {
+        return io_timed_out() ? SOCK_HANDSHAKE_TIMEOUT : SOCK_HANDSHAKE_FAILURE;
+    }
+    if (memcmp(response.header, HELLO_RESPONSE_HEADER, HEADER_LENGTH) != 0 ||
+            response.version < PROTOCOL_VERSION_2) {
+        return SOCK_HANDSHAKE_FAILURE;
+    }
+
+    uint16_t pixel_formats = response.pixel_formats & CLIENT_PIXEL_FORMATS;
+    uint16_t mask_encodings = response.mask_encodings & CLIENT_MASK_ENCODINGS;
+    if (pixel_formats == 0 || mask_encodings == 0) {
+        return SOCK_HANDSHAKE_FAILURE;
+    }
+
+    client->capabilities.max_batch = 1;
+    if (response.version >= PROTOCOL_VERSION_3) {
+        HelloResponseV3 extension;
+        if (read_all(client, sock_fd, &extension, sizeof(extension))) {
+            return io_timed_out() ? SOCK_HANDSHAKE_TIMEOUT : SOCK_HANDSHAKE_FAILURE;
+        }
+        client->capabilities.max_batch = extension.max_batch < 1 ? 1 :
+                extension.max_batch > MAX_SEGMENTATION_BATCH ? MAX_SEGMENTATION_BATCH : extension.max_batch;
+    }
+
+    client->capabilities.version = response.version >= PROTOCOL_VERSION_4 ? PROTOCOL_VERSION_4 : response.version;
+    client->capabilities.preferred_width = response.preferred_width > 0 ? response.preferred_width : 0;
+    client->capabilities.preferred_height = response.preferred_height > 0 ? response.preferred_height : 0;
+    client->capabilities.stride_alignment = response.stride_alignment > 0 ? response.stride_alignment : 1;
+    // RGB saves the server a channel swap, so prefer it when offered
+    client->capabilities.pixel_format = (pixel_formats & FORMAT_BIT(PIXEL_FORMAT_RGB24)) ?
+            PIXEL_FORMAT_RGB24 : PIXEL_FORMAT_BGR24;
+    client->capabilities.mask_encoding = MASK_ENCODING_RAW8;
+    return 0;
+}
+
+void reset_capabilities(SegmentationClient *client, int version)
+{
+    client->capabilities.version = version;
+    client->capabilities.preferred_width = 0;
+    client->capabilities.preferred_height = 0;
+    client->capabilities.stride_alignment = 1;
+    client->capabilities.pixel_format = PIXEL_FORMAT_BGR24;
+    client->capabilities.mask_encoding = MASK_ENCODING_RAW8;
+    client->capabilities.max_batch = 1;
+}
+
 void invalidate_connection(SegmentationClient *client)
 {
     if (client->client_socket != -1) {
         close(client->client_socket);
         client->client_socket = -1;
     }
-}
\ No newline at end of file
+}
+
+// a frame already past its deadline gets the smallest budget rather than none
+uint32_t deadline_budget(uint64_t deadline, uint64_t now)
+{
+    if (deadline == 0) {
+        return 0;
+    }
+    if (deadline <= now) {
+        return 1;
+    }
+    uint64_t budget = (deadline - now) / 1000ULL;
+    return budget > UINT32_MAX ? UINT32_MAX : budget < 1 ? 1 : (uint32_t)budget;
+}
@@ -4,13 +4,52 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "imgarray.h"
+
 #define SEGMENTATION_PORT_FILENAME     ".segmentation.port"
 #define HEADER_LENGTH                  8
 #define CHECK_PORT_INTERVAL            10000
 #define MIN_RECONNECT_INTERVAL         5000
+// a whole request or handshake, on top of the 1 s socket timeouts on each read and write
+#define REQUEST_TIMEOUT_NS             1000000000ULL
+// after falling back to v1, how long before a connection tries the v2 hello again
+#define HELLO_RETRY_INTERVAL_NS        60000000000ULL
 #define SEGMENTATION_HOSTNAME          "localhost"
+#define SEGMENTATION_HOSTNAME_LENGTH   256
+// sizeof(sockaddr_un.sun_path)
+#define SEGMENTATION_SOCKET_PATH_LENGTH 108
+
+#define PROTOCOL_VERSION_UNKNOWN       0
+#define PROTOCOL_VERSION_1             1
+#define PROTOCOL_VERSION_2             2
+// adds batch requests carrying several frames
+#define PROTOCOL_VERSION_3             3
+// adds a deadline to every frame, which the server may drop it by
+#define PROTOCOL_VERSION_4             4
+#define MAX_SEGMENTATION_BATCH         16
+
+
+// the magic that starts each message, HEADER_LENGTH bytes each
+extern const char REQUEST_HEADER[];
+extern const char RESPONSE_HEADER[];
+extern const char HELLO_HEADER[];
+extern const char HELLO_RESPONSE_HEADER[];
+extern const char BATCH_HEADER[];
+extern const char BATCH_RESPONSE_HEADER[];
 
 
+// wire values, the capability fields carry them as bit masks
+enum PixelFormat {
+    PIXEL_FORMAT_BGR24 = 0,
+    PIXEL_FORMAT_RGB24 = 1,
+};
+
+enum MaskEncoding {
+    MASK_ENCODING_RAW8 = 0,
+};
+
+#define FORMAT_BIT(f)                  (1 << (f))
+
 
 typedef struct {
     char header[HEADER_LENGTH];
@@ -20,16 +59,150 @@ typedef struct {
     int16_t width;
     int16_t blur;
     int16_t growshrink;
+    // v2 only, a v1 preamble ends at PREAMBLE_V1_SIZE. a stride of 0 means tightly packed
+    uint16_t stride;
+    uint8_t pixel_format;
+    uint8_t mask_encoding;
+    // v4 only: microseconds left until the frame's deadline when it was sent, 0 for none
+    uint32_t budget_us;
 } RequestPreamble;
 
+#define PREAMBLE_V1_SIZE               24
+#define PREAMBLE_V2_SIZE               28
+#define PREAMBLE_V4_SIZE               32
+
+// the mask length a v4 server answers with when it dropped a frame past its deadline
+#define MASK_LENGTH_DROPPED            -2
+
+
+// sent by a v2 client right after connecting
+typedef struct {
+    char header[HEADER_LENGTH];
+    uint16_t version;
+    uint16_t pixel_formats;
+    uint16_t mask_encodings;
+    uint16_t reserved;
+} HelloRequest;
+
+
+typedef struct {
+    char header[HEADER_LENGTH];
+    uint16_t version;
+    // the size the model consumes, 0 if the server has no preference
+    int16_t preferred_width;
+    int16_t preferred_height;
+    uint16_t stride_alignment;
+    uint16_t pixel_formats;
+    uint16_t mask_encodings;
+} HelloResponse;
+
+
+// follows the HelloResponse of a v3 server
+typedef struct {
+    // most frames the server takes in one batch request
+    uint16_t max_batch;
+    uint16_t reserved;
+} HelloResponseV3;
+
+
+// Starts a batch request and its response. length covers everything from
+// the header to the last frame or mask.
+typedef struct {
+    char header[HEADER_LENGTH];
+    uint32_t length;
+    uint16_t count;
+    uint16_t reserved;
+} BatchPreamble;
+
+
+// precedes each frame of a batch request, length bytes of pixels follow
+typedef struct {
+    uint32_t id;
+    uint32_t length;
+    float segmentation_threshold;
+    int16_t height;
+    int16_t width;
+    int16_t blur;
+    int16_t growshrink;
+    uint16_t stride;
+    uint8_t pixel_format;
+    uint8_t mask_encoding;
+    // v4 only, as in RequestPreamble
+    uint32_t budget_us;
+} BatchFrameHeader;
+
+// v3 frame headers stop short of budget_us: 24 bytes, against 28 in v4
+#define BATCH_FRAME_HEADER_V3_SIZE     offsetof(BatchFrameHeader, budget_us)
+
+
+// Precedes each mask of a batch response. A length of -1 means that frame
+// failed, MASK_LENGTH_DROPPED that the server dropped it.
+typedef struct {
+    uint32_t id;
+    int32_t length;
+} BatchMaskHeader;
+
+
+typedef struct {
+    int version;
+    int preferred_width;
+    int preferred_height;
+    int stride_alignment;
+    enum PixelFormat pixel_format;
+    enum MaskEncoding mask_encoding;
+    // 1 unless the server speaks v3
+    int max_batch;
+} ServerCapabilities;
+
+
+// one frame of SegmentationClient_run_batch
+typedef struct {
+    uint32_t id;
+    float segmentation_threshold;
+    int height;
+    int width;
+    int blur;
+    int growshrink;
+    int stride;
+    enum PixelFormat pixel_format;
+    const uint8_t * frame;
+    size_t frame_size;
+    // on the os_gettime_ns clock, 0 for none
+    uint64_t deadline;
+
+    // filled in with the frame's mask, rc is non-zero if the server failed it
+    ImgArray * mask;
+    int rc;
+} SegmentationBatchFrame;
+
+
+// Called as each band of a streamed response's mask arrives: rows
+// first_row to first_row + rows - 1 of mask are in, the rest are not yet.
+typedef void (*SegmentationBandCallback)(void *opaque, const uint8_t *mask, int first_row, int rows);
+
 
 typedef struct {
     int client_port;
     int client_socket;
 
+    // when fixed_port is set the client never consults the port file
+    char hostname[SEGMENTATION_HOSTNAME_LENGTH];
+    int fixed_port;
+    // a Unix-domain socket to connect to instead, used when set
+    char socket_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+
     uint64_t last_connect_timestamp;
     uint64_t last_port_timestamp;
+    // when the hello last failed and the client fell back to v1
+    uint64_t v1_fallback_timestamp;
     RequestPreamble preamble;
+    ServerCapabilities capabilities;
+    // of the next request, see SegmentationClient_set_deadline
+    uint64_t deadline;
+    // reads and writes of the request in flight give up after this
+    uint64_t io_deadline;
+    // bytes of a streamed frame still to be written
+    size_t stream_remaining;
 
     uint8_t * mask;
     size_t mask_size;
@@ -45,14 +218,54 @@ enum SocketError {
     SOCK_NO_MASK,
     SOCK_NO_SEGMENTATION_PORT,
     SOCK_NO_SOCKET,
+    SOCK_HANDSHAKE_FAILURE,
+    SOCK_BATCH_UNSUPPORTED,
+    SOCK_BATCH_MISMATCH,
+    // the frame's deadline passed before it was sent
+    SOCK_DEADLINE_EXPIRED,
+    // the server dropped the frame, its deadline passed before inference
+    SOCK_FRAME_DROPPED,
+    // the connection failed part way through the frame
+    SOCK_FRAME_WRITE_FAILURE,
+    // the server took too long to answer the hello, but may yet speak v2
+    SOCK_HANDSHAKE_TIMEOUT,
 };
 
 SegmentationClient * SegmentationClient_create();
 void SegmentationClient_destroy(SegmentationClient *client);
 
+void SegmentationClient_set_endpoint(SegmentationClient *client, const char *hostname, int port);
+void SegmentationClient_set_socket_path(SegmentationClient *client, const char *path);
+int SegmentationClient_is_connected(SegmentationClient *client);
+void SegmentationClient_disconnect(SegmentationClient *client);
+// opens the connection and negotiates the protocol ahead of the first request
+int SegmentationClient_connect(SegmentationClient *client);
+// disconnects and frees the mask buffer
+void SegmentationClient_release_buffers(SegmentationClient *client);
 void SegmentationClient_set_dimensions(SegmentationClient *client, int height, int width);
 void SegmentationClient_set_parameters(SegmentationClient *client, float segmentation_threshold, int blur, int growshrink);
+void SegmentationClient_set_format(SegmentationClient *client, int stride, enum PixelFormat pixel_format);
+// Deadline of the frames passed to run_segmentation, on the os_gettime_ns
+// clock, 0 for none. A frame already past it isn't sent and fails with
+// SOCK_DEADLINE_EXPIRED. A v4 server drops a frame that expires while it
+// waits, which fails with SOCK_FRAME_DROPPED. The connection stays up.
+void SegmentationClient_set_deadline(SegmentationClient *client, uint64_t deadline);
+const ServerCapabilities * SegmentationClient_get_capabilities(SegmentationClient *client);
 int SegmentationClient_run_segmentation(SegmentationClient *client, uint64_t timestamp, const uint8_t *frame_bgr, size_t frame_total_size);
+// The same request in pieces, so a frame can go out while it is still being
+// produced: begin_request sends the preamble for a frame of frame_total_size
+// bytes, write_rows sends the next size bytes of it, e.g. each band as the
+// scaler finishes it, and finish_request reads the mask band_rows rows at a
+// time (0 for all at once), calling callback, which may be NULL, after each.
+int SegmentationClient_begin_request(SegmentationClient *client, uint64_t timestamp, size_t frame_total_size);
+int SegmentationClient_write_rows(SegmentationClient *client, const uint8_t *rows, size_t size);
+int SegmentationClient_finish_request(SegmentationClient *client, int band_rows,
+                                      SegmentationBandCallback callback, void *opaque);
+// Sends count frames in one request, count at most the server's max_batch.
+// Returns non-zero if the exchange itself failed, in which case every frame
+// failed; otherwise each frame has its own rc.
+int SegmentationClient_run_batch(SegmentationClient *client, uint64_t timestamp,
+                                 SegmentationBatchFrame *frames, int count);
 const uint8_t * SegmentationClient_get_mask(SegmentationClient *client);
 size_t SegmentationClient_get_mask_size(SegmentationClient *client);
 
@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "compat.h"
+#include "segmentation_pool.h"
+#include "segmentation_client.h"
+
+
+// utility methods
+void pool_lock(SegmentationPool * self);
+void pool_unlock(SegmentationPool * self);
+void discover_endpoints(SegmentationPool * self);
+void discover_from_environment(SegmentationPool * self, const char * endpoints);
+void discover_from_directory(SegmentationPool * self, const char * tmpdir);
+void discover_from_file(SegmentationPool * self, const char * path);
+void add_endpoint(SegmentationPool * self, const char * hostname, int port);
+void add_socket_endpoint(SegmentationPool * self, const char * path);
+SegmentationEndpoint * find_or_create_endpoint(SegmentationPool * self, const char * hostname, int port);
+void remove_endpoint(SegmentationPool * self, int index);
+int same_input_format(const ServerCapabilities * a, const ServerCapabilities * b);
+double predicted_completion(SegmentationEndpoint * endpoint, uint64_t now);
+void warm_up_endpoint(SegmentationEndpoint * endpoint, const SegmentationParameters * parameters);
+
+
+SegmentationPool * SegmentationPool_create()
+{
+    SegmentationPool * self = (SegmentationPool *)bzalloc(sizeof(SegmentationPool));
+    if (!self) {
+        return NULL;
+    }
+    SegmentationParameters parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.segmentation_threshold = 0.5f;
+    self->parameters = Snapshot_create(&parameters, sizeof(parameters));
+    if (!self->parameters) {
+        bfree(self);
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    self->num_endpoints = 0;
+    self->last_discovery_timestamp = 0;
+    self->height = 0;
+    self->width = 0;
+    self->stride = 0;
+    self->pixel_format = PIXEL_FORMAT_BGR24;
+    return self;
+}
+
+
+void SegmentationPool_destroy(SegmentationPool * self)
+{
+    if (!self) {
+        return;
+    }
+    while (self->num_endpoints > 0) {
+        remove_endpoint(self, self->num_endpoints - 1);
+    }
+    pthread_mutex_destroy(&(self->mutex));
+    Snapshot_destroy(self->parameters);
+    bfree(self);
+}
+
+
+void SegmentationPool_set_dimensions(SegmentationPool * self, int height, int width)
+{
+    pool_lock(self);
+    self->height = height;
+    self->width = width;
+    pool_unlock(self);
+}
+
+
+void SegmentationPool_set_parameters(SegmentationPool * self, float segmentation_threshold, int blur, int growshrink)
+{
+    SegmentationParameters * parameters = (SegmentationParameters *)Snapshot_begin_update(self->parameters);
+    if (!parameters) {
+        return;
+    }
+    parameters->segmentation_threshold = segmentation_threshold;
+    parameters->blur = blur;
+    parameters->growshrink = growshrink;
+    Snapshot_publish(self->parameters, parameters);
+}
+
+
+void SegmentationPool_get_parameters(SegmentationPool * self, SegmentationParameters * parameters)
+{
+    Snapshot_read(self->parameters, parameters);
+}
+
+
+void SegmentationPool_set_format(SegmentationPool * self, int stride, enum PixelFormat pixel_format)
+{
+    pool_lock(self);
+    self->stride = stride;
+    self->pixel_format = pixel_format;
+    pool_unlock(self);
+}
+
+
+void SegmentationPool_set_server_socket(SegmentationPool * self, const char * path)
+{
+    pool_lock(self);
+    if (path == NULL) {
+        path = "";
+    }
+    if (strncmp(self->server_socket, path, SEGMENTATION_SOCKET_PATH_LENGTH) != 0) {
+        strncpy(self->server_socket, path, SEGMENTATION_SOCKET_PATH_LENGTH - 1);
+        // rediscover on the next acquire
+        self->last_discovery_timestamp = 0;
+    }
+    pool_unlock(self);
+}
+
+
+int SegmentationPool_get_capabilities(SegmentationPool * self, ServerCapabilities * capabilities)
+{
+    int found = 0;
+    pool_lock(self);
+    for (int i = 0; i < self->num_endpoints; i++) {
+        ServerCapabilities * current = &(self->endpoints[i]->capabilities);
+        if (!self->endpoints[i]->seen || current->version == PROTOCOL_VERSION_UNKNOWN) {
+            continue;
+        }
+        if (current->version == PROTOCOL_VERSION_1) {
+            found = 0;
+            break;
+        }
+        if (!found) {
+            *capabilities = *current;
+            found = 1;
+        } else if (!same_input_format(capabilities, current)) {
+            // servers disagree, only the v1 format is safe for all of them
+            found = 0;
+            break;
+        } else {
+            // batches have to suit the least capable server
+            if (current->version < capabilities->version) {
+                capabilities->version = current->version;
+            }
+            if (current->max_batch < capabilities->max_batch) {
+                capabilities->max_batch = current->max_batch;
+            }
+        }
+    }
+    pool_unlock(self);
+    return found ? 0 : 1;
+}
+
+
+SegmentationEndpoint * SegmentationPool_acquire(SegmentationPool * self)
+{
+    uint64_t now = os_gettime_ns();
+    SegmentationEndpoint * best = NULL;
+    double best_score = 0;
+
+    pool_lock(self);
+    if (self->last_discovery_timestamp == 0 ||
+            (now - self->last_discovery_timestamp) > CHECK_ENDPOINTS_INTERVAL_NS) {
+        discover_endpoints(self);
+        self->last_discovery_timestamp = now;
+    }
+
+    for (int i = 0; i < self->num_endpoints; i++) {
+        SegmentationEndpoint * endpoint = self->endpoints[i];
+        if (!endpoint->seen || now < endpoint->unhealthy_until) {
+            continue;
+        }
+        double score = predicted_completion(endpoint, now);
+        // on a tie prefer an idle endpoint
+        if (best == NULL || score < best_score ||
+                (score == best_score && best->in_use && !endpoint->in_use)) {
+            best = endpoint;
+            best_score = score;
+        }
+    }
+
+    // if the best endpoint is busy, waiting for it beats a slower idle one
+    if (best == NULL || best->in_use) {
+        pool_unlock(self);
+        return NULL;
+    }
+
+    best->in_use = 1;
+    best->dispatch_timestamp = now;
+    SegmentationParameters parameters;
+    Snapshot_read(self->parameters, &parameters);
+    SegmentationClient_set_dimensions(best->client, self->height, self->width);
+    SegmentationClient_set_parameters(best->client, parameters.segmentation_threshold, parameters.blur,
+                                      parameters.growshrink);
+    SegmentationClient_set_format(best->client, self->stride, self->pixel_format);
+    pool_unlock(self);
+    return best;
+}
+
+
+void SegmentationPool_release(SegmentationPool * self, SegmentationEndpoint * endpoint, int rc)
+{
+    uint64_t now = os_gettime_ns();
+    uint64_t elapsed = now - endpoint->dispatch_timestamp;
+
+    pool_lock(self);
+    endpoint->in_use = 0;
+    endpoint->requests++;
+    if (elapsed > endpoint->longest_request_ns) {
+        endpoint->longest_request_ns = elapsed;
+    }
+    endpoint->capabilities = *SegmentationClient_get_capabilities(endpoint->client);
+    if (rc == 0) {
+        if (endpoint->latency_ns == 0) {
+            endpoint->latency_ns = (double)elapsed;
+        } else {
+            endpoint->latency_ns = ENDPOINT_LATENCY_ALPHA * (double)elapsed +
+                    (1.0 - ENDPOINT_LATENCY_ALPHA) * endpoint->latency_ns;
+        }
+        endpoint->consecutive_failures = 0;
+        endpoint->unhealthy_until = 0;
+    } else if (rc == SOCK_DEADLINE_EXPIRED || rc == SOCK_FRAME_DROPPED) {
+        // the server answered, it is just behind; its latency says nothing about the model
+        endpoint->consecutive_failures = 0;
+        endpoint->unhealthy_until = 0;
+    } else {
+        endpoint->failures++;
+        endpoint->consecutive_failures++;
+        uint32_t shift = endpoint->consecutive_failures - 1;
+        if (shift > ENDPOINT_MAX_BACKOFF_SHIFT) {
+            shift = ENDPOINT_MAX_BACKOFF_SHIFT;
+        }
+        endpoint->unhealthy_until = now + (ENDPOINT_BACKOFF_NS << shift);
+        SegmentationClient_disconnect(endpoint->client);
+        if (endpoint->consecutive_failures == 1) {
+            fprintf(stderr, "Segmentation endpoint %s:%d failed: %d\n",
+                    endpoint->hostname, endpoint->port, rc);
+        }
+    }
+    pool_unlock(self);
+}
+
+
+void SegmentationPool_cancel(SegmentationPool * self, SegmentationEndpoint * endpoint)
+{
+    pool_lock(self);
+    endpoint->in_use = 0;
+    pool_unlock(self);
+}
+
+
+void SegmentationPool_disconnect(SegmentationPool * self)
+{
+    pool_lock(self);
+    for (int i = 0; i < self->num_endpoints; i++) {
+        if (!self->endpoints[i]->in_use) {
+            SegmentationClient_release_buffers(self->endpoints[i]->client);
+        }
+    }
+    pool_unlock(self);
+}
+
+
+int SegmentationPool_warm_up(SegmentationPool * self, int send_frame)
+{
+    uint64_t now = os_gettime_ns();
+    SegmentationEndpoint * warming[MAX_SEGMENTATION_ENDPOINTS];
+    int num_warming = 0;
+
+    SegmentationParameters parameters;
+    Snapshot_read(self->parameters, &parameters);
+    pool_lock(self);
+    discover_endpoints(self);
+    self->last_discovery_timestamp = now;
+    for (int i = 0; i < self->num_endpoints; i++) {
+        SegmentationEndpoint * endpoint = self->endpoints[i];
+        if (endpoint->seen && !endpoint->in_use && now >= endpoint->unhealthy_until &&
+                !SegmentationClient_is_connected(endpoint->client)) {
+            // keeps workers off the endpoint while it connects
+            endpoint->in_use = 1;
+            warming[num_warming++] = endpoint;
+        }
+    }
+    pool_unlock(self);
+
+    for (int i = 0; i < num_warming; i++) {
+        if (SegmentationClient_connect(warming[i]->client) == 0 && send_frame) {
+            warm_up_endpoint(warming[i], &parameters);
+        }
+    }
+
+    int connected = 0;
+    pool_lock(self);
+    for (int i = 0; i < num_warming; i++) {
+        warming[i]->in_use = 0;
+        warming[i]->capabilities = *SegmentationClient_get_capabilities(warming[i]->client);
+    }
+    for (int i = 0; i < self->num_endpoints; i++) {
+        if (SegmentationClient_is_connected(self->endpoints[i]->client)) {
+            connected++;
+        }
+    }
+    pool_unlock(self);
+    return connected;
+}
+
+
+size_t SegmentationPool_get_memory_usage(SegmentationPool * self)
+{
+    size_t result = sizeof(SegmentationPool);
+    pool_lock(self);
+    for (int i = 0; i < self->num_endpoints; i++) {
+        result += sizeof(SegmentationEndpoint) + sizeof(SegmentationClient) +
+                SegmentationClient_get_mask_size(self->endpoints[i]->client);
+    }
+    pool_unlock(self);
+    return result;
+}
+
+
+int SegmentationPool_get_num_endpoints(SegmentationPool * self)
+{
+    pool_lock(self);
+    int result = self->num_endpoints;
+    pool_unlock(self);
+    return result;
+}
+
+
+uint64_t SegmentationPool_get_longest_request(SegmentationPool * self)
+{
+    uint64_t result = 0;
+    pool_lock(self);
+    for (int i = 0; i < self->num_endpoints; i++) {
+        if (self->endpoints[i]->longest_request_ns > result) {
+            result = self->endpoints[i]->longest_request_ns;
+        }
+    }
+    pool_unlock(self);
+    return result;
+}
+
+
+int SegmentationPool_get_num_healthy(SegmentationPool * self)
+{
+    uint64_t now = os_gettime_ns();
+    int result = 0;
+    pool_lock(self);
+    for (int i = 0; i < self->num_endpoints; i++) {
+        if (self->endpoints[i]->seen && now >= self->endpoints[i]->unhealthy_until) {
+            result++;
+        }
+    }
+    pool_unlock(self);
+    return result;
+}
+
+
+int same_input_format(const ServerCapabilities * a, const ServerCapabilities * b)
+{
+    return a->preferred_width == b->preferred_width &&
+            a->preferred_height == b->preferred_height &&
+            a->stride_alignment == b->stride_alignment &&
+            a->pixel_format == b->pixel_format &&
+            a->mask_encoding == b->mask_encoding;
+}
+
+
+double predicted_completion(SegmentationEndpoint * endpoint, uint64_t now)
+{
+    double remaining = 0;
+    if (endpoint->in_use) {
+        remaining = endpoint->latency_ns - (double)(now - endpoint->dispatch_timestamp);
+        if (remaining < 0) {
+            remaining = 0;
+        }
+    }
+    return remaining + endpoint->latency_ns;
+}
+
+
+// runs a blank frame in whatever format the server negotiated, the mask is thrown away
+void warm_up_endpoint(SegmentationEndpoint * endpoint, const SegmentationParameters * parameters)
+{
+    const ServerCapabilities * capabilities = SegmentationClient_get_capabilities(endpoint->client);
+    enum PixelFormat pixel_format = PIXEL_FORMAT_BGR24;
+    int alignment = 1;
+    if (capabilities->version >= PROTOCOL_VERSION_2) {
+        pixel_format = capabilities->pixel_format;
+        alignment = capabilities->stride_alignment > 0 ? capabilities->stride_alignment : 1;
+    }
+    int stride = (WARM_UP_WIDTH * 3 + alignment - 1) / alignment * alignment;
+    size_t size = (size_t)stride * WARM_UP_HEIGHT;
+    uint8_t * frame = (uint8_t *)bzalloc(size);
+    if (frame == NULL) {
+        return;
+    }
+
+    // a deadline left over from the endpoint's last frame would expire the blank one before it is sent
+    SegmentationClient_set_deadline(endpoint->client, 0);
+    SegmentationClient_set_dimensions(endpoint->client, WARM_UP_HEIGHT, WARM_UP_WIDTH);
+    SegmentationClient_set_format(endpoint->client, stride, pixel_format);
+    SegmentationClient_set_parameters(endpoint->client, parameters->segmentation_threshold, parameters->blur,
+                                      parameters->growshrink);
+    int rc = SegmentationClient_run_segmentation(endpoint->client, os_gettime_ns(), frame, size);
+    if (rc != 0) {
+        SegmentationClient_disconnect(endpoint->client);
+    }
+    bfree(frame);
+}
+
+
+void discover_endpoints(SegmentationPool * self)
+{
+    for (int i = 0; i < self->num_endpoints; i++) {
+        self->endpoints[i]->seen = 0;
+    }
+
+    const char * endpoints = getenv(SEGMENTATION_ENDPOINTS_ENV);
+    if (self->server_socket[0] != '\0') {
+        add_socket_endpoint(self, self->server_socket);
+    } else if (endpoints != NULL && endpoints[0] != '\0') {
+        discover_from_environment(self, endpoints);
+    } else {
+        const char * tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL) {
+            tmpdir = "/tmp";
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", tmpdir, SEGMENTATION_PORT_FILENAME);
+        discover_from_file(self, path);
+        discover_from_directory(self, tmpdir);
+    }
+
+    // endpoints that vanished are dropped once nobody is using them
+    for (int i = self->num_endpoints - 1; i >= 0; i--) {
+        if (!self->endpoints[i]->seen && !self->endpoints[i]->in_use) {
+            remove_endpoint(self, i);
+        }
+    }
+}
+
+
+// SEGMENTATION_ENDPOINTS is a comma separated list of "port" or "host:port"
+void discover_from_environment(SegmentationPool * self, const char * endpoints)
+{
+    char * copy = strdup(endpoints);
+    if (copy == NULL) {
+        return;
+    }
+    char * saveptr = NULL;
+    for (char * token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        char * colon = strrchr(token, ':');
+        if (colon == NULL) {
+            add_endpoint(self, SEGMENTATION_HOSTNAME, atoi(token));
+        } else {
+            *colon = '\0';
+            add_endpoint(self, token, atoi(colon + 1));
+        }
+    }
+    free(copy);
+}
+
+
+void discover_from_directory(SegmentationPool * self, const char * tmpdir)
+{
+    char dirname[PATH_MAX];
+    snprintf(dirname, sizeof(dirname), "%s/%s", tmpdir, SEGMENTATION_PORT_DIRNAME);
+
+    DIR * dir = opendir(dirname);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+        discover_from_file(self, path);
+    }
+    closedir(dir);
+}
+
+
+void discover_from_file(SegmentationPool * self, const char * path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    int port;
+    size_t rc = fread(&port, 1, sizeof(int), file);
+    fclose(file);
+    if (rc != sizeof(int)) {
+        return;
+    }
+    add_endpoint(self, SEGMENTATION_HOSTNAME, port);
+}
+
+
+void add_endpoint(SegmentationPool * self, const char * hostname, int port)
+{
+    if (port <= 0 || port > 65535) {
+        return;
+    }
+    find_or_create_endpoint(self, hostname, port);
+}
+
+
+void add_socket_endpoint(SegmentationPool * self, const char * path)
+{
+    find_or_create_endpoint(self, path, 0);
+}
+
+
+SegmentationEndpoint * find_or_create_endpoint(SegmentationPool * self, const char * hostname, int port)
+{
+    for (int i = 0; i < self->num_endpoints; i++) {
+        SegmentationEndpoint * endpoint = self->endpoints[i];
+        if (endpoint->port == port && strncmp(endpoint->hostname, hostname, SEGMENTATION_HOSTNAME_LENGTH) == 0) {
+            endpoint->seen = 1;
+            return endpoint;
+        }
+    }
+    if (self->num_endpoints >= MAX_SEGMENTATION_ENDPOINTS) {
+        return NULL;
+    }
+
+    SegmentationEndpoint * endpoint = (SegmentationEndpoint *)bzalloc(sizeof(SegmentationEndpoint));
+    if (!endpoint) {
+        return NULL;
+    }
+    endpoint->client = SegmentationClient_create();
+    if (!endpoint->client) {
+        bfree(endpoint);
+        return NULL;
+    }
+    strncpy(endpoint->hostname, hostname, SEGMENTATION_HOSTNAME_LENGTH - 1);
+    endpoint->port = port;
+    endpoint->seen = 1;
+    if (port == 0) {
+        SegmentationClient_set_socket_path(endpoint->client, hostname);
+    } else {
+        SegmentationClient_set_endpoint(endpoint->client, hostname, port);
+    }
+    self->endpoints[self->num_endpoints++] = endpoint;
+    return endpoint;
+}
+
+
+void remove_endpoint(SegmentationPool * self, int index)
+{
+    SegmentationEndpoint * endpoint = self->endpoints[index];
+    SegmentationClient_destroy(endpoint->client);
+    bfree(endpoint);
+    for (int i = index; i < self->num_endpoints - 1; i++) {
+        self->endpoints[i] = self->endpoints[i + 1];
+    }
+    self->num_endpoints--;
+}
+
+
+void pool_lock(SegmentationPool * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+}
+
+void pool_unlock(SegmentationPool * self)
+{
+    pthread_mutex_unlock(&(self->mutex));
+}
@@ -0,0 +1,113 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_SEGMENTATION_POOL_H
+#define OBS_VIRTUAL_BACKGROUND_SEGMENTATION_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "segmentation_client.h"
+#include "snapshot.h"
+
+#define SEGMENTATION_PORT_DIRNAME      ".segmentation.d"
+#define SEGMENTATION_ENDPOINTS_ENV     "SEGMENTATION_ENDPOINTS"
+#define MAX_SEGMENTATION_ENDPOINTS     16
+#define CHECK_ENDPOINTS_INTERVAL_NS    2000000000ULL
+#define ENDPOINT_BACKOFF_NS            250000000ULL
+#define ENDPOINT_MAX_BACKOFF_SHIFT     5
+// weight of the newest sample in the latency moving average
+#define ENDPOINT_LATENCY_ALPHA         0.2
+// size of the blank frame that gets a server through its slow first inference
+#define WARM_UP_WIDTH                  160
+#define WARM_UP_HEIGHT                 96
+
+
+typedef struct {
+    // the socket path for Unix-domain endpoints, which have no port
+    char hostname[SEGMENTATION_HOSTNAME_LENGTH];
+    int port;
+    SegmentationClient * client;
+
+    uint8_t in_use;
+    uint8_t seen;
+    uint64_t dispatch_timestamp;
+
+    // health
+    uint32_t consecutive_failures;
+    uint64_t unhealthy_until;
+
+    ServerCapabilities capabilities;
+
+    // exponentially weighted round trip, 0 until the first response
+    double latency_ns;
+    uint64_t requests;
+    uint64_t failures;
+    // the longest a worker spent on one request, failed ones included
+    uint64_t longest_request_ns;
+} SegmentationEndpoint;
+
+
+typedef struct {
+    float segmentation_threshold;
+    int blur;
+    int growshrink;
+} SegmentationParameters;
+
+
+typedef struct {
+    pthread_mutex_t mutex;
+    SegmentationEndpoint * endpoints[MAX_SEGMENTATION_ENDPOINTS];
+    int num_endpoints;
+    uint64_t last_discovery_timestamp;
+    // when set, the only endpoint, replacing discovery
+    char server_socket[SEGMENTATION_SOCKET_PATH_LENGTH];
+
+    // SegmentationParameters, published without taking the mutex
+    Snapshot * parameters;
+    int height;
+    int width;
+    int stride;
+    enum PixelFormat pixel_format;
+} SegmentationPool;
+
+
+SegmentationPool * SegmentationPool_create();
+void SegmentationPool_destroy(SegmentationPool * self);
+
+void SegmentationPool_set_dimensions(SegmentationPool * self, int height, int width);
+void SegmentationPool_set_parameters(SegmentationPool * self, float segmentation_threshold, int blur, int growshrink);
+// lock-free, for workers that latch the parameters per frame
+void SegmentationPool_get_parameters(SegmentationPool * self, SegmentationParameters * parameters);
+void SegmentationPool_set_format(SegmentationPool * self, int stride, enum PixelFormat pixel_format);
+// Fills in the input geometry every negotiated endpoint agrees on. Returns
+// non-zero if frames must be sent in the v1 format, e.g. because one of
+// the endpoints is a v1 server.
+int SegmentationPool_get_capabilities(SegmentationPool * self, ServerCapabilities * capabilities);
+// Uses only the server listening on the Unix socket at path, e.g. one the
+// plugin supervises. NULL or an empty path goes back to discovery.
+void SegmentationPool_set_server_socket(SegmentationPool * self, const char * path);
+
+// Returns the idle, healthy endpoint with the lowest predicted completion
+// time, or NULL if none is available right now. The caller owns the
+// endpoint's client until it hands it back with SegmentationPool_release.
+SegmentationEndpoint * SegmentationPool_acquire(SegmentationPool * self);
+// any rc but 0, SOCK_DEADLINE_EXPIRED and SOCK_FRAME_DROPPED backs the endpoint off
+void SegmentationPool_release(SegmentationPool * self, SegmentationEndpoint * endpoint, int rc);
+// hands an endpoint back without recording a request
+void SegmentationPool_cancel(SegmentationPool * self, SegmentationEndpoint * endpoint);
+
+// Drops every idle connection and frees its buffers. Endpoints stay known
+// and reconnect on their next request.
+void SegmentationPool_disconnect(SegmentationPool * self);
+// Connects and negotiates with every idle, healthy endpoint ahead of the
+// first frame, and with send_frame also segments a blank frame so the
+// server's first, slow inference is out of the way. Returns the number of
+// connected endpoints.
+int SegmentationPool_warm_up(SegmentationPool * self, int send_frame);
+size_t SegmentationPool_get_memory_usage(SegmentationPool * self);
+
+int SegmentationPool_get_num_endpoints(SegmentationPool * self);
+int SegmentationPool_get_num_healthy(SegmentationPool * self);
+// longest_request_ns of the slowest endpoint
+uint64_t SegmentationPool_get_longest_request(SegmentationPool * self);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_SEGMENTATION_POOL_H
@@ -1,50 +1,146 @@
 #include <pthread.h>
 
-#include <obs-module.h>
+#include "compat.h"
 #include <time.h>
 
 #include "segmentation_thread.h"
+#include "segmentation_pool.h"
 #include "segmentation_client.h"
 #include "imgarray.h"
 
-void * run_thread(void *thread_ptr);
-void lock(SegmentationThread * self);
-void unlock(SegmentationThread * self);
-void sleepthread();
-
 
 typedef struct {
     uint64_t timestamp;
+    uint64_t received;
     ImgArray * bgr;
-    uint64_t buffer_counter;
-    uint64_t last_buffer_counter;
+    ImgArray * mask;
     int8_t is_running;
+    // which stream the frame goes to, and its size before a coarse pass shrank it
+    int pass;
+    int full_height;
+    int full_width;
+    MaskFusion * fusion;
+    // builds the distance field of the masks this worker stores
+    MaskField * field;
 } local_data;
 
 
+void * run_thread(void *thread_ptr);
+void lock(SegmentationThread * self);
+void unlock(SegmentationThread * self);
+void sleepthread();
+void signal_work(SegmentationThread * self, int everyone);
+void wait_for_work(SegmentationThread * self, uint64_t work_signals);
+int claim_buffer(SegmentationThread * self, ImgArray * dst, uint64_t * timestamp, uint64_t * received,
+                 MaskCacheKey * key, int * pass);
+int has_pending_buffer(SegmentationThread * self);
+int due_pass(SegmentationThread * self, const SegmentationSettings * settings, uint64_t now);
+int prepare_pass(SegmentationThread * self, local_data * local_data, MaskCacheKey * key);
+int store_mask(SegmentationThread * self, local_data * local_data, const uint8_t * mask, size_t size,
+               int height, int width);
+int store_pass_mask(SegmentationThread * self, local_data * local_data, const uint8_t * mask, size_t size,
+                    const MaskCacheKey * key);
+void count_pass_mask(SegmentationThread * self, local_data * local_data, int fused);
+MaskCache * hash_buffer(SegmentationThread * self, ImgArray * bgr, MaskCacheKey * key);
+void apply_geometry(SegmentationEndpoint * endpoint, const MaskCacheKey * key);
+int take_warm_up(SegmentationThread * self, int * send_frame);
+void warm_up(SegmentationThread * self, int send_frame);
+void record_latency(SegmentationThread * self, uint64_t received);
+void park_worker(SegmentationThread * self, local_data * local_data);
+void release_buffers(SegmentationThread * self);
+size_t memory_usage(SegmentationThread * self);
+uint64_t worker_cpu_time(SegmentationThread * self);
+void apply_policy(SegmentationThread * self, int worker, local_data * local_data);
+int segment_batched(SegmentationThread * self, local_data * local_data, MaskCacheKey * key);
+uint64_t frame_deadline(SegmentationThread * self, uint64_t received);
+int drop_frame(SegmentationThread * self, int rc);
+int drop_late_mask(SegmentationThread * self, uint64_t deadline);
+SegmentationPool * current_pool(SegmentationThread * self);
+
+
+
+
 SegmentationThread * SegmentationThread_create()
 {
     SegmentationThread * self = (SegmentationThread *)bzalloc(sizeof(SegmentationThread));
     if (!self) {
         return NULL;
     }
-    self->thread_id = -1;
-    self->client = SegmentationClient_create();
-    if (!self->client) {
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_mutex_init(&(self->fine_mutex), NULL);
+    pthread_cond_init(&(self->resume_cond), NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(self->work_cond), &attr);
+    pthread_condattr_destroy(&attr);
+    self->work_signals = 0;
+    self->num_workers = 0;
+    self->pool = SegmentationPool_create();
+    SegmentationSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.batch_window_ns = BATCHER_DEFAULT_WINDOW_NS;
+    settings.max_batch = BATCHER_DEFAULT_MAX_BATCH;
+    settings.max_mask_age_ns = 0;
+    settings.coarse_divisor = 1;
+    settings.batcher = NULL;
+    ThreadPolicy_init(&(settings.policy));
+    self->settings = Snapshot_create(&settings, sizeof(settings));
+    if (!self->pool || !self->settings) {
         goto err;
     }
     self->bgr = ImgArray_create();
-    self->mask = ImgArray_create();
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        self->masks[i] = ImgArray_create();
+        self->fields[i] = ImgArray_create();
+        self->mask_timestamps[i] = 0;
+        self->mask_heights[i] = 0;
+        self->mask_widths[i] = 0;
+    }
+    self->latest_mask = 0;
     self->buffer_counter = 0;
+    self->dispatched_counter = 0;
+    self->mask_timestamp = 0;
+    self->buffer_received = 0;
+    self->mask_latency_ns = 0;
+    self->latency_samples = 0;
+    self->cache = NULL;
+    memset(&(self->cache_key), 0, sizeof(MaskCacheKey));
+    self->cache_key.segmentation_threshold = 0.5f;
+    self->buffer_key = self->cache_key;
+    self->suspended = 0;
+    // the first idle worker connects and warms up the server right away
+    self->warm_up_pending = 1;
+    self->warm_up_frame = 1;
+    self->next_warm_up = 0;
+    self->start_timestamp = os_gettime_ns();
+    self->first_mask_pending = 1;
+    self->time_to_first_mask_ns = 0;
+    self->first_masks = 0;
+    self->parked_workers = 0;
+    memset(&(self->suspend_stats), 0, sizeof(SuspendStats));
+    ThreadPolicy_init(&(self->policy));
+    self->policy_generation = 0;
+    self->next_worker_index = 0;
+    memset(&(self->deadline_stats), 0, sizeof(DeadlineStats));
+    self->next_coarse = 0;
+    self->next_fine = 0;
+    memset(&(self->dual_rate_stats), 0, sizeof(DualRateStats));
+    self->fine_mask = ImgArray_create();
+    self->fine_timestamp = 0;
+    self->fine_height = 0;
+    self->fine_width = 0;
     self->is_running = 1;
-    if (pthread_create(&(self->thread_id), NULL, run_thread, (void *)self)) {
-        goto err;
-    }
+    for (int i = 0; i < MAX_SEGMENTATION_WORKERS; i++) {
+        if (pthread_create(&(self->thread_ids[i]), NULL, run_thread, (void *)self)) {
+            goto err;
+        }
+        self->num_workers++;
 #ifdef _GNU_SOURCE
-    pthread_setname_np(self->thread_id, "virtual-background-segmentation");
+        pthread_setname_np(self->thread_ids[i], "virtual-background-segmentation");
 #endif
+    }
 
-    pthread_mutex_init(&(self->mutex), NULL);
     return self;
 
     err:
@@ -60,43 +156,202 @@ void SegmentationThread_destroy(SegmentationThread * self)
     }
     lock(self);
     self->is_running = 0;
+    pthread_cond_broadcast(&(self->resume_cond));
+    signal_work(self, 1);
     unlock(self);
-    pthread_join(self->thread_id, NULL);
+    for (int i = 0; i < self->num_workers; i++) {
+        pthread_join(self->thread_ids[i], NULL);
+    }
     if (self->bgr) {
         ImgArray_destroy(self->bgr);
     }
-    if (self->mask) {
-        ImgArray_destroy(self->mask);
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        if (self->masks[i]) {
+            ImgArray_destroy(self->masks[i]);
+        }
+        if (self->fields[i]) {
+            ImgArray_destroy(self->fields[i]);
+        }
+    }
+    if (self->fine_mask) {
+        ImgArray_destroy(self->fine_mask);
     }
-    if (self->client) {
-        SegmentationClient_destroy(self->client);
+    if (self->pool) {
+        SegmentationPool_destroy(self->pool);
     }
+    Snapshot_destroy(self->settings);
+    pthread_cond_destroy(&(self->resume_cond));
+    pthread_cond_destroy(&(self->work_cond));
+    pthread_mutex_destroy(&(self->fine_mutex));
+    pthread_mutex_destroy(&(self->mutex));
     bfree(self);
 }
 
 
 void SegmentationThread_set_dimensions(SegmentationThread * self, int height, int width)
 {
+    SegmentationPool_set_dimensions(self->pool, height, width);
     lock(self);
-    SegmentationClient_set_dimensions(self->client, height, width);
+    self->cache_key.height = height;
+    self->cache_key.width = width;
     unlock(self);
 }
 
 
+// update_buffer latches them from the pool, so neither mutex is taken here
 void SegmentationThread_set_parameters(SegmentationThread * self, float segmentation_threshold, int blur, int growshrink)
 {
+    SegmentationPool_set_parameters(self->pool, segmentation_threshold, blur, growshrink);
+}
+
+
+void SegmentationThread_set_format(SegmentationThread * self, int stride, enum PixelFormat pixel_format)
+{
+    SegmentationPool_set_format(self->pool, stride, pixel_format);
+    lock(self);
+    self->cache_key.stride = stride;
+    self->cache_key.pixel_format = pixel_format;
+    unlock(self);
+}
+
+
+void SegmentationThread_set_cache(SegmentationThread * self, MaskCache * cache)
+{
+    lock(self);
+    self->cache = cache;
+    unlock(self);
+}
+
+
+void SegmentationThread_set_policy(SegmentationThread * self, const ThreadPolicy * policy)
+{
+    SegmentationSettings current;
+    Snapshot_read(self->settings, &current);
+    if (ThreadPolicy_equals(&(current.policy), policy)) {
+        return;
+    }
     lock(self);
-    SegmentationClient_set_parameters(self->client, segmentation_threshold, blur, growshrink);
+    if (!ThreadPolicy_equals(&(self->policy), policy)) {
+        self->policy = *policy;
+        self->policy_generation++;
+        ImgArray_set_pinning(self->bgr, policy->memory);
+        signal_work(self, 1);
+    }
+    SegmentationSettings * settings = (SegmentationSettings *)Snapshot_begin_update(self->settings);
+    if (settings) {
+        settings->policy = *policy;
+        Snapshot_publish(self->settings, settings);
+    }
     unlock(self);
 }
 
 
+int SegmentationThread_get_policy_reports(SegmentationThread * self, ThreadPolicyReport * dst, uint64_t * generation)
+{
+    int applied = 0;
+    lock(self);
+    *generation = self->policy_generation;
+    for (int i = 0; i < self->num_workers; i++) {
+        dst[i] = self->policy_reports[i];
+        if (dst[i].generation == self->policy_generation) {
+            applied++;
+        }
+    }
+    unlock(self);
+    return applied;
+}
+
+
+void SegmentationThread_set_server_socket(SegmentationThread * self, const char * path)
+{
+    SegmentationPool_set_server_socket(self->pool, path);
+}
+
+
+void SegmentationThread_set_batcher(SegmentationThread * self, SegmentationBatcher * batcher,
+                                    uint64_t window_ns, int max_batch)
+{
+    SegmentationSettings * settings = (SegmentationSettings *)Snapshot_begin_update(self->settings);
+    if (settings) {
+        settings->batcher = batcher;
+        settings->batch_window_ns = window_ns;
+        settings->max_batch = max_batch;
+        Snapshot_publish(self->settings, settings);
+    }
+}
+
+
+void SegmentationThread_set_max_mask_age(SegmentationThread * self, uint64_t max_age_ns)
+{
+    SegmentationSettings * settings = (SegmentationSettings *)Snapshot_begin_update(self->settings);
+    if (settings) {
+        settings->max_mask_age_ns = max_age_ns;
+        Snapshot_publish(self->settings, settings);
+    }
+}
+
+
+void SegmentationThread_get_deadline_stats(SegmentationThread * self, DeadlineStats * stats)
+{
+    lock(self);
+    *stats = self->deadline_stats;
+    unlock(self);
+}
+
+
+void SegmentationThread_set_dual_rate(SegmentationThread * self, int coarse_divisor,
+                                      uint64_t coarse_interval_ns, uint64_t fine_interval_ns)
+{
+    SegmentationSettings * settings = (SegmentationSettings *)Snapshot_begin_update(self->settings);
+    if (settings) {
+        settings->coarse_divisor = coarse_divisor > 1 ? coarse_divisor : 1;
+        settings->coarse_interval_ns = coarse_interval_ns;
+        settings->fine_interval_ns = fine_interval_ns;
+        Snapshot_publish(self->settings, settings);
+    }
+}
+
+
+void SegmentationThread_set_distance_field(SegmentationThread * self, int enabled)
+{
+    SegmentationSettings * settings = (SegmentationSettings *)Snapshot_begin_update(self->settings);
+    if (settings) {
+        settings->distance_field = enabled != 0;
+        Snapshot_publish(self->settings, settings);
+    }
+}
+
+
+void SegmentationThread_get_dual_rate_stats(SegmentationThread * self, DualRateStats * stats)
+{
+    lock(self);
+    *stats = self->dual_rate_stats;
+    unlock(self);
+}
+
+
+int SegmentationThread_get_capabilities(SegmentationThread * self, ServerCapabilities * capabilities)
+{
+    return SegmentationPool_get_capabilities(current_pool(self), capabilities);
+}
+
+
 void SegmentationThread_update_buffer(SegmentationThread * self, uint64_t timestamp, const uint8_t * bgr, int buffer_size)
 {
+    uint64_t now = os_gettime_ns();
+    SegmentationParameters parameters;
+    SegmentationPool_get_parameters(self->pool, &parameters);
     lock(self);
     self->timestamp = timestamp;
+    self->buffer_received = now;
+    self->buffer_key = self->cache_key;
+    self->buffer_key.segmentation_threshold = parameters.segmentation_threshold;
+    self->buffer_key.blur = parameters.blur;
+    self->buffer_key.growshrink = parameters.growshrink;
     self->buffer_counter++;
     ImgArray_copy_from_raw_buffer(self->bgr, bgr, buffer_size);
+    // one idle worker is enough for one frame
+    signal_work(self, 0);
     unlock(self);
 }
 
@@ -104,86 +359,845 @@ void SegmentationThread_update_buffer(SegmentationThread * self, uint64_t timest
 void * run_thread(void *ptr)
 {
     SegmentationThread * self = (SegmentationThread *)ptr;
-    SegmentationClient * client;
+    SegmentationEndpoint * endpoint;
     local_data local_data = {
             .timestamp = 0,
+            .received = 0,
             .bgr = NULL,
-            .buffer_counter = 0,
-            .is_running = 1
+            .mask = NULL,
+            .is_running = 1,
+            .pass = SEGMENTATION_PASS_SINGLE,
+            .full_height = 0,
+            .full_width = 0,
+            .fusion = NULL,
+            .field = NULL
     };
+    // set while a frame whose endpoint failed still waits to be failed over
+    int retrying = 0;
+    // the cache the current frame's key is reserved in, if any
+    MaskCache * reserved = NULL;
+    MaskCacheKey key;
     local_data.bgr = ImgArray_create();
+    local_data.mask = ImgArray_create();
+    local_data.fusion = MaskFusion_create();
+    // each worker builds its own field, a pool would only make them queue for each other
+    local_data.field = MaskField_create(NULL);
+    uint64_t policy_generation = 0;
+    lock(self);
+    int worker = self->next_worker_index++;
+    unlock(self);
 
     while (1) {
         lock(self);
         local_data.is_running = self->is_running;
-        local_data.buffer_counter = self->buffer_counter;
+        int suspended = self->suspended;
+        int policy_changed = self->policy_generation != policy_generation;
+        policy_generation = self->policy_generation;
+        uint64_t work_signals = self->work_signals;
         unlock(self);
+        SegmentationSettings settings;
+        Snapshot_read(self->settings, &settings);
+        int batched = settings.batcher != NULL;
 
         if (!local_data.is_running) {
             goto end;
         }
-        if (local_data.last_buffer_counter == local_data.buffer_counter) {
-            sleepthread();
+        if (policy_changed) {
+            apply_policy(self, worker, &local_data);
+        }
+        if (suspended) {
+            // whatever was being failed over is stale by the time we resume
+            if (reserved) {
+                MaskCache_abandon(reserved, &key);
+                reserved = NULL;
+            }
+            retrying = 0;
+            park_worker(self, &local_data);
+            continue;
+        }
+        if (!retrying && !has_pending_buffer(self)) {
+            int send_frame;
+            if (take_warm_up(self, &send_frame)) {
+                warm_up(self, send_frame);
+            } else {
+                wait_for_work(self, work_signals);
+            }
+            continue;
+        }
+        if (batched) {
+            // a frame failed over from our own pool is dropped, the batcher retries for us
+            if (reserved) {
+                MaskCache_abandon(reserved, &key);
+                reserved = NULL;
+            }
+            retrying = 0;
+            if (segment_batched(self, &local_data, &key)) {
+                goto end;
+            }
             continue;
         }
-        local_data.buffer_counter = local_data.last_buffer_counter;
 
-        lock(self);
-        if (!ImgArray_get_buffer(self->bgr)) {
-            unlock(self);
+        endpoint = SegmentationPool_acquire(self->pool);
+        if (endpoint == NULL) {
             sleepthread();
             continue;
         }
 
-        if (ImgArray_copy_from_array(local_data.bgr, self->bgr)) {
-            unlock(self);
+        // a newer frame always wins over failing over a stale one
+        int claimed = claim_buffer(self, local_data.bgr, &local_data.timestamp, &local_data.received, &key,
+                                   &local_data.pass);
+        if (claimed == 0 && prepare_pass(self, &local_data, &key)) {
+            claimed = -1;
+        }
+        if (claimed < 0) {
+            SegmentationPool_cancel(self->pool, endpoint);
             goto end;
         }
-        client = self->client;
-        local_data.timestamp = self->timestamp;
-        unlock(self);
+        if (claimed > 0 && !retrying) {
+            // another worker claimed it first
+            SegmentationPool_cancel(self->pool, endpoint);
+            continue;
+        }
+        if (claimed == 0) {
+            if (reserved) {
+                MaskCache_abandon(reserved, &key);
+                reserved = NULL;
+            }
+            MaskCache * cache = hash_buffer(self, local_data.bgr, &key);
+            int cached = cache ? MaskCache_acquire(cache, &key, local_data.mask) : MASK_CACHE_BUSY;
+            if (cached == MASK_CACHE_HIT) {
+                // identical frame already segmented, maybe by another instance
+                SegmentationPool_cancel(self->pool, endpoint);
+                retrying = 0;
+                if (drop_late_mask(self, frame_deadline(self, local_data.received))) {
+                    continue;
+                }
+                if (store_pass_mask(self, &local_data, ImgArray_get_buffer(local_data.mask),
+                                    ImgArray_get_size(local_data.mask), &key)) {
+                    goto end;
+                }
+                continue;
+            }
+            if (cached == MASK_CACHE_MISS) {
+                reserved = cache;
+            }
+        }
+        retrying = 0;
+        // the pool set up the client for the newest geometry, which may already differ from this frame's
+        apply_geometry(endpoint, &key);
+        uint64_t deadline = frame_deadline(self, local_data.received);
+        SegmentationClient_set_deadline(endpoint->client, deadline);
 
         int rc = SegmentationClient_run_segmentation(
-                client,
+                endpoint->client,
                 local_data.timestamp,
                 ImgArray_get_buffer(local_data.bgr),
                 ImgArray_get_size(local_data.bgr)
         );
+        if (drop_frame(self, rc)) {
+            // too late to be worth failing over
+            SegmentationPool_release(self->pool, endpoint, rc);
+            if (reserved) {
+                MaskCache_abandon(reserved, &key);
+                reserved = NULL;
+            }
+            continue;
+        }
         if (rc) {
-            sleepthread();
+            SegmentationPool_release(self->pool, endpoint, rc);
+            retrying = SegmentationPool_get_num_healthy(self->pool) > 0;
+            if (!retrying) {
+                if (reserved) {
+                    MaskCache_abandon(reserved, &key);
+                    reserved = NULL;
+                }
+                sleepthread();
+            }
             continue;
         }
 
-        lock(self);
-        rc = ImgArray_copy_from_raw_buffer(
-                self->mask,
-                SegmentationClient_get_mask(client),
-                SegmentationClient_get_mask_size(client)
+        if (reserved) {
+            MaskCache_fulfill(
+                    reserved,
+                    &key,
+                    SegmentationClient_get_mask(endpoint->client),
+                    SegmentationClient_get_mask_size(endpoint->client)
+            );
+            reserved = NULL;
+        }
+        record_latency(self, local_data.received);
+        if (drop_late_mask(self, deadline)) {
+            SegmentationPool_release(self->pool, endpoint, 0);
+            continue;
+        }
+        rc = store_pass_mask(
+                self,
+                &local_data,
+                SegmentationClient_get_mask(endpoint->client),
+                SegmentationClient_get_mask_size(endpoint->client),
+                &key
         );
-        unlock(self);
+        SegmentationPool_release(self->pool, endpoint, 0);
         if (rc) {
             goto end;
         }
-
-        sleepthread();
     }
 
 end:
+    if (reserved) {
+        MaskCache_abandon(reserved, &key);
+    }
     if (local_data.bgr) {
         ImgArray_destroy(local_data.bgr);
     }
+    if (local_data.mask) {
+        ImgArray_destroy(local_data.mask);
+    }
+    MaskFusion_destroy(local_data.fusion);
+    MaskField_destroy(local_data.field);
+    return NULL;
+}
+
+
+// Stores the mask of the frame in local_data as the latest, with its distance
+// field when the filter asked for one. The field is built before taking the
+// lock so nothing reading masks waits for it.
+int store_mask(SegmentationThread * self, local_data * local_data, const uint8_t * mask, size_t size,
+               int height, int width)
+{
+    int rc = 0;
+    uint64_t timestamp = local_data->timestamp;
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    const uint8_t * field = NULL;
+    if (settings.distance_field && local_data->field != NULL && size == (size_t)height * width &&
+            MaskField_build(local_data->field, mask, height, width) == 0) {
+        field = ImgArray_get_buffer(local_data->field->encoded);
+    }
+    uint64_t now = os_gettime_ns();
+    lock(self);
+    if (self->first_mask_pending) {
+        self->time_to_first_mask_ns = now - self->start_timestamp;
+        self->first_masks++;
+        self->first_mask_pending = 0;
+    }
+    // with several endpoints in flight, masks can come back out of order
+    if (timestamp >= self->mask_timestamp) {
+        int next = (self->latest_mask + 1) % MASK_HISTORY_LENGTH;
+        rc = ImgArray_copy_from_raw_buffer(self->masks[next], mask, size);
+        if (rc == 0 && field != NULL) {
+            rc = ImgArray_copy_from_raw_buffer(self->fields[next], field, size);
+        } else {
+            ImgArray_clear(self->fields[next]);
+        }
+        self->mask_timestamps[next] = timestamp;
+        self->mask_heights[next] = height;
+        self->mask_widths[next] = width;
+        self->latest_mask = next;
+        self->mask_timestamp = timestamp;
+    }
+    unlock(self);
+    return rc;
+}
+
+
+void SegmentationThread_suspend(SegmentationThread * self)
+{
+    lock(self);
+    if (!self->suspended) {
+        self->suspended = 1;
+        self->warm_up_pending = 0;
+        self->first_mask_pending = 0;
+        self->suspend_timestamp = os_gettime_ns();
+        self->suspend_cpu_ns = worker_cpu_time(self);
+        self->suspend_stats.suspensions++;
+        self->suspend_stats.suspended_ns = 0;
+        self->suspend_stats.worker_cpu_ns = 0;
+        self->suspend_stats.released_bytes = 0;
+        self->suspend_stats.retained_bytes = 0;
+        signal_work(self, 1);
+    }
+    unlock(self);
+}
+
+
+void SegmentationThread_resume(SegmentationThread * self)
+{
+    lock(self);
+    if (self->suspended) {
+        self->suspended = 0;
+        self->warm_up_pending = 1;
+        self->next_warm_up = 0;
+        self->start_timestamp = os_gettime_ns();
+        self->first_mask_pending = 1;
+        self->suspend_stats.suspended_ns = os_gettime_ns() - self->suspend_timestamp;
+        self->suspend_stats.worker_cpu_ns = worker_cpu_time(self) - self->suspend_cpu_ns;
+        pthread_cond_broadcast(&(self->resume_cond));
+        signal_work(self, 1);
+    }
+    unlock(self);
+}
+
+
+int SegmentationThread_is_suspended(SegmentationThread * self)
+{
+    lock(self);
+    int result = self->suspended;
+    unlock(self);
+    return result;
+}
+
+
+int SegmentationThread_is_parked(SegmentationThread * self)
+{
+    lock(self);
+    int result = self->suspended && self->parked_workers == self->num_workers;
+    unlock(self);
+    return result;
+}
+
+
+void SegmentationThread_get_suspend_stats(SegmentationThread * self, SuspendStats * stats)
+{
+    lock(self);
+    *stats = self->suspend_stats;
+    if (self->suspended) {
+        stats->suspended_ns = os_gettime_ns() - self->suspend_timestamp;
+        stats->worker_cpu_ns = worker_cpu_time(self) - self->suspend_cpu_ns;
+    }
+    unlock(self);
+}
+
+
+size_t SegmentationThread_get_memory_usage(SegmentationThread * self)
+{
+    lock(self);
+    size_t result = memory_usage(self);
+    unlock(self);
+    return result;
+}
+
+
+// Claims the pending frame and segments it through the batcher. Returns
+// non-zero if the worker has to stop.
+int segment_batched(SegmentationThread * self, local_data * local_data, MaskCacheKey * key)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    SegmentationBatcher * batcher = settings.batcher;
+    if (batcher == NULL) {
+        // turned off since the worker looked, the pool takes the frame next time around
+        return 0;
+    }
+    int claimed = claim_buffer(self, local_data->bgr, &local_data->timestamp, &local_data->received, key,
+                               &local_data->pass);
+    if (claimed != 0) {
+        return claimed < 0;
+    }
+    if (prepare_pass(self, local_data, key)) {
+        return 1;
+    }
+    uint64_t window_ns = settings.batch_window_ns;
+    int max_batch = settings.max_batch;
+    uint64_t deadline = frame_deadline(self, local_data->received);
+
+    MaskCache * cache = hash_buffer(self, local_data->bgr, key);
+    int cached = cache ? MaskCache_acquire(cache, key, local_data->mask) : MASK_CACHE_BUSY;
+    if (cached != MASK_CACHE_HIT) {
+        int rc = SegmentationBatcher_segment(batcher, key, ImgArray_get_buffer(local_data->bgr),
+                                             ImgArray_get_size(local_data->bgr), local_data->mask,
+                                             deadline, window_ns, max_batch);
+        if (cached == MASK_CACHE_MISS) {
+            if (rc) {
+                MaskCache_abandon(cache, key);
+            } else {
+                MaskCache_fulfill(cache, key, ImgArray_get_buffer(local_data->mask),
+                                  ImgArray_get_size(local_data->mask));
+            }
+        }
+        if (drop_frame(self, rc)) {
+            return 0;
+        }
+        if (rc) {
+            sleepthread();
+            return 0;
+        }
+        record_latency(self, local_data->received);
+    }
+    if (drop_late_mask(self, deadline)) {
+        return 0;
+    }
+    return store_pass_mask(self, local_data, ImgArray_get_buffer(local_data->mask),
+                           ImgArray_get_size(local_data->mask), key);
+}
+
+
+// Frame timestamps come from the source's clock, so the deadline counts
+// from when the frame with that timestamp got here.
+uint64_t frame_deadline(SegmentationThread * self, uint64_t received)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    return settings.max_mask_age_ns ? received + settings.max_mask_age_ns : 0;
+}
+
+
+// counts and returns non-zero if rc means the frame was dropped for its deadline
+int drop_frame(SegmentationThread * self, int rc)
+{
+    if (rc != SOCK_DEADLINE_EXPIRED && rc != SOCK_FRAME_DROPPED) {
+        return 0;
+    }
+    lock(self);
+    if (rc == SOCK_DEADLINE_EXPIRED) {
+        self->deadline_stats.expired++;
+    } else {
+        self->deadline_stats.dropped_by_server++;
+    }
+    unlock(self);
+    return 1;
+}
+
+
+int drop_late_mask(SegmentationThread * self, uint64_t deadline)
+{
+    if (deadline == 0 || os_gettime_ns() < deadline) {
+        return 0;
+    }
+    lock(self);
+    self->deadline_stats.late_masks++;
+    unlock(self);
+    return 1;
+}
+
+
+SegmentationPool * current_pool(SegmentationThread * self)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    return settings.batcher ? SegmentationBatcher_get_pool(settings.batcher) : self->pool;
+}
+
+
+// scheduling calls only affect the calling thread, so every worker makes its own
+void apply_policy(SegmentationThread * self, int worker, local_data * local_data)
+{
+    lock(self);
+    ThreadPolicy policy = self->policy;
+    uint64_t generation = self->policy_generation;
+    unlock(self);
+
+    ThreadPolicyReport report;
+    ThreadPolicy_apply(&policy, &report);
+    report.generation = generation;
+    ImgArray_set_pinning(local_data->bgr, policy.memory);
+    ImgArray_set_pinning(local_data->mask, policy.memory);
+    if (local_data->fusion) {
+        ImgArray_set_pinning(local_data->fusion->frame, policy.memory);
+        ImgArray_set_pinning(local_data->fusion->mask, policy.memory);
+    }
+
+    lock(self);
+    if (worker < MAX_SEGMENTATION_WORKERS) {
+        self->policy_reports[worker] = report;
+    }
+    unlock(self);
+}
+
+
+void park_worker(SegmentationThread * self, local_data * local_data)
+{
+    lock(self);
+    self->suspend_stats.released_bytes += ImgArray_get_size(local_data->bgr) + ImgArray_get_size(local_data->mask);
+    ImgArray_clear(local_data->bgr);
+    ImgArray_clear(local_data->mask);
+    if (local_data->fusion) {
+        self->suspend_stats.released_bytes += ImgArray_get_size(local_data->fusion->frame) +
+                ImgArray_get_size(local_data->fusion->mask);
+        MaskFusion_clear(local_data->fusion);
+    }
+
+    self->parked_workers++;
+    // the last worker to park knows nothing is in flight any more
+    if (self->suspended && self->parked_workers == self->num_workers) {
+        release_buffers(self);
+    }
+    while (self->suspended && self->is_running) {
+        pthread_cond_wait(&(self->resume_cond), &(self->mutex));
+    }
+    self->parked_workers--;
+    // an idle worker picks up warm_up_pending and reconnects
+    unlock(self);
+}
+
+
+// called with the lock held and every worker parked
+void release_buffers(SegmentationThread * self)
+{
+    size_t before = memory_usage(self);
+    ImgArray_clear(self->bgr);
+    // the latest mask stays so the filter has something to show on resume
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        if (i != self->latest_mask) {
+            ImgArray_clear(self->masks[i]);
+            ImgArray_clear(self->fields[i]);
+            self->mask_timestamps[i] = 0;
+        }
+    }
+    // coarse masks after resuming fuse with nothing until a new full-resolution one
+    ImgArray_clear(self->fine_mask);
+    self->fine_timestamp = 0;
+    self->dispatched_counter = self->buffer_counter;
+    SegmentationPool_disconnect(self->pool);
+    size_t after = memory_usage(self);
+    self->suspend_stats.released_bytes += before > after ? before - after : 0;
+    self->suspend_stats.retained_bytes = after;
+}
+
+
+size_t memory_usage(SegmentationThread * self)
+{
+    size_t result = sizeof(SegmentationThread) + ImgArray_get_size(self->bgr) + ImgArray_get_size(self->fine_mask);
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        result += ImgArray_get_size(self->masks[i]) + ImgArray_get_size(self->fields[i]);
+    }
+    return result + SegmentationPool_get_memory_usage(self->pool);
+}
+
+
+uint64_t worker_cpu_time(SegmentationThread * self)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < self->num_workers; i++) {
+        clockid_t clock_id;
+        struct timespec ts;
+        if (pthread_getcpuclockid(self->thread_ids[i], &clock_id) == 0 && clock_gettime(clock_id, &ts) == 0) {
+            result += (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+        }
+    }
+    return result;
+}
+
+
+void record_latency(SegmentationThread * self, uint64_t received)
+{
+    uint64_t now = os_gettime_ns();
+    lock(self);
+    self->mask_latency_ns = now - received;
+    self->latency_samples++;
+    unlock(self);
+}
+
+
+// fills in the hash of the frame in bgr, returns the cache to look it up in
+MaskCache * hash_buffer(SegmentationThread * self, ImgArray * bgr, MaskCacheKey * key)
+{
+    lock(self);
+    MaskCache * cache = self->cache;
+    unlock(self);
+    if (cache == NULL) {
+        return NULL;
+    }
+    key->size = ImgArray_get_size(bgr);
+    key->hash = MaskCache_hash(ImgArray_get_buffer(bgr), key->size);
+    return cache;
+}
+
+
+void apply_geometry(SegmentationEndpoint * endpoint, const MaskCacheKey * key)
+{
+    SegmentationClient_set_dimensions(endpoint->client, key->height, key->width);
+    SegmentationClient_set_format(endpoint->client, key->stride, key->pixel_format);
+    SegmentationClient_set_parameters(endpoint->client, key->segmentation_threshold, key->blur, key->growshrink);
+}
+
+
+int has_pending_buffer(SegmentationThread * self)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    lock(self);
+    int result = self->buffer_counter != self->dispatched_counter && ImgArray_get_buffer(self->bgr) != NULL &&
+            due_pass(self, &settings, os_gettime_ns()) >= 0;
+    unlock(self);
+    return result;
+}
+
+
+int take_warm_up(SegmentationThread * self, int * send_frame)
+{
+    uint64_t now = os_gettime_ns();
+    lock(self);
+    int result = self->warm_up_pending && now >= self->next_warm_up;
+    if (result) {
+        self->warm_up_pending = 0;
+        *send_frame = self->warm_up_frame;
+    }
+    unlock(self);
+    return result;
+}
+
+
+void warm_up(SegmentationThread * self, int send_frame)
+{
+    int connected = SegmentationPool_warm_up(current_pool(self), send_frame);
+    lock(self);
+    if (connected > 0) {
+        if (send_frame) {
+            self->warm_up_frame = 0;
+        }
+    } else if (self->warm_up_frame && !self->suspended) {
+        // no server yet, keep looking for one until the first frame needs it
+        self->warm_up_pending = 1;
+        self->next_warm_up = os_gettime_ns() + WARM_UP_RETRY_NS;
+    }
+    unlock(self);
+}
+
+
+// returns 0 if a new buffer was copied into dst, 1 if there was none
+// pending and -1 if the copy failed
+int claim_buffer(SegmentationThread * self, ImgArray * dst, uint64_t * timestamp, uint64_t * received,
+                 MaskCacheKey * key, int * pass)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    uint64_t now = os_gettime_ns();
+    lock(self);
+    int due = due_pass(self, &settings, now);
+    if (self->buffer_counter == self->dispatched_counter || !ImgArray_get_buffer(self->bgr) || due < 0) {
+        unlock(self);
+        return 1;
+    }
+    int rc = ImgArray_copy_from_array(dst, self->bgr);
+    *timestamp = self->timestamp;
+    *received = self->buffer_received;
+    *key = self->buffer_key;
+    *pass = due;
+    self->dispatched_counter = self->buffer_counter;
+    if (due == SEGMENTATION_PASS_FINE) {
+        self->next_fine = now + settings.fine_interval_ns;
+        self->dual_rate_stats.fine.frames++;
+    } else if (due == SEGMENTATION_PASS_COARSE) {
+        self->next_coarse = now + settings.coarse_interval_ns;
+        self->dual_rate_stats.coarse.frames++;
+    }
+    unlock(self);
+    return rc ? -1 : 0;
+}
+
+
+// Called with the lock held. Returns the stream the next frame goes to, or
+// -1 while dual-rate is on and neither stream is due. A due full-resolution
+// pass goes first since it is the rarer one.
+int due_pass(SegmentationThread * self, const SegmentationSettings * settings, uint64_t now)
+{
+    if (settings->coarse_divisor <= 1) {
+        return SEGMENTATION_PASS_SINGLE;
+    }
+    if (now >= self->next_fine) {
+        return SEGMENTATION_PASS_FINE;
+    }
+    if (now >= self->next_coarse) {
+        return SEGMENTATION_PASS_COARSE;
+    }
+    return -1;
+}
+
+
+// Remembers the full size of a claimed frame and, for a coarse pass, swaps
+// it and the key for the low-resolution copy. Returns non-zero if the copy
+// could not be made.
+int prepare_pass(SegmentationThread * self, local_data * local_data, MaskCacheKey * key)
+{
+    local_data->full_height = key->height;
+    local_data->full_width = key->width;
+    if (local_data->pass != SEGMENTATION_PASS_COARSE) {
+        return 0;
+    }
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    int divisor = settings.coarse_divisor;
+    MaskFusion * fusion = local_data->fusion;
+    if (fusion == NULL || MaskFusion_downscale(fusion, ImgArray_get_buffer(local_data->bgr),
+                                               key->height, key->width, key->stride, divisor)) {
+        return 1;
+    }
+    ImgArray * frame = local_data->bgr;
+    local_data->bgr = fusion->frame;
+    fusion->frame = frame;
+    key->height = fusion->frame_height;
+    key->width = fusion->frame_width;
+    key->stride = fusion->frame_width * 3;
+    return 0;
+}
+
+
+// Stores the mask of the frame in local_data. A full-resolution mask is also
+// kept for fusing, a coarse one is fused with it and stored at full size.
+int store_pass_mask(SegmentationThread * self, local_data * local_data, const uint8_t * mask, size_t size,
+                    const MaskCacheKey * key)
+{
+    if (local_data->pass == SEGMENTATION_PASS_SINGLE) {
+        return store_mask(self, local_data, mask, size, key->height, key->width);
+    }
+    if (local_data->pass == SEGMENTATION_PASS_FINE) {
+        int rc = 0;
+        pthread_mutex_lock(&(self->fine_mutex));
+        if (local_data->timestamp >= self->fine_timestamp) {
+            rc = ImgArray_copy_from_raw_buffer(self->fine_mask, mask, size);
+            self->fine_timestamp = local_data->timestamp;
+            self->fine_height = key->height;
+            self->fine_width = key->width;
+        }
+        pthread_mutex_unlock(&(self->fine_mutex));
+        count_pass_mask(self, local_data, 0);
+        return rc ? rc : store_mask(self, local_data, mask, size, key->height, key->width);
+    }
+
+    // a mask of some other size can't be scaled back up, show it as it is
+    if (size != (size_t)key->height * key->width) {
+        count_pass_mask(self, local_data, 0);
+        return store_mask(self, local_data, mask, size, key->height, key->width);
+    }
+    int height = local_data->full_height;
+    int width = local_data->full_width;
+    int used_fine;
+    pthread_mutex_lock(&(self->fine_mutex));
+    // a mask from before the size changed has nothing to add
+    int has_fine = ImgArray_get_buffer(self->fine_mask) != NULL &&
+            self->fine_height == height && self->fine_width == width &&
+            ImgArray_get_size(self->fine_mask) == (size_t)height * width;
+    int rc = MaskFusion_fuse(local_data->fusion, mask, key->height, key->width,
+                             has_fine ? ImgArray_get_buffer(self->fine_mask) : NULL, height, width, &used_fine);
+    pthread_mutex_unlock(&(self->fine_mutex));
+    if (rc) {
+        return rc;
+    }
+    count_pass_mask(self, local_data, used_fine);
+    return store_mask(self, local_data, ImgArray_get_buffer(local_data->fusion->mask),
+                      ImgArray_get_size(local_data->fusion->mask), height, width);
 }
 
 
-int SegmentationThread_get_mask(SegmentationThread * self, ImgArray * dst)
+void count_pass_mask(SegmentationThread * self, local_data * local_data, int fused)
 {
+    uint64_t now = os_gettime_ns();
     lock(self);
-    int rc = ImgArray_copy_from_array(dst, self->mask);
+    PassStats * stats = local_data->pass == SEGMENTATION_PASS_FINE ?
+            &(self->dual_rate_stats.fine) : &(self->dual_rate_stats.coarse);
+    stats->masks++;
+    stats->latency_ns += now - local_data->received;
+    self->dual_rate_stats.fused += fused;
+    unlock(self);
+}
+
+
+int SegmentationThread_get_mask(SegmentationThread * self, ImgArray * dst, int * height, int * width)
+{
+    lock(self);
+    int rc = ImgArray_copy_from_array(dst, self->masks[self->latest_mask]);
+    if (rc == 0 && height != NULL && width != NULL) {
+        *height = self->mask_heights[self->latest_mask];
+        *width = self->mask_widths[self->latest_mask];
+    }
     unlock(self);
     return rc;
 }
 
 
+int SegmentationThread_has_mask(SegmentationThread * self)
+{
+    lock(self);
+    int result = ImgArray_get_buffer(self->masks[self->latest_mask]) != NULL;
+    unlock(self);
+    return result;
+}
+
+
+uint64_t SegmentationThread_get_time_to_first_mask(SegmentationThread * self, uint64_t * time_ns)
+{
+    lock(self);
+    *time_ns = self->time_to_first_mask_ns;
+    uint64_t result = self->first_masks;
+    unlock(self);
+    return result;
+}
+
+
+int SegmentationThread_get_mask_for_timestamp(SegmentationThread * self, uint64_t timestamp, ImgArray * dst,
+                                              int * height, int * width)
+{
+    int rc = 1;
+    lock(self);
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        if (self->mask_timestamps[i] == timestamp && ImgArray_get_buffer(self->masks[i])) {
+            rc = ImgArray_copy_from_array(dst, self->masks[i]);
+            if (rc == 0 && height != NULL && width != NULL) {
+                *height = self->mask_heights[i];
+                *width = self->mask_widths[i];
+            }
+            break;
+        }
+    }
+    unlock(self);
+    return rc;
+}
+
+
+int SegmentationThread_get_field(SegmentationThread * self, ImgArray * dst, int * height, int * width)
+{
+    lock(self);
+    // fails on an empty slot too
+    int rc = ImgArray_copy_from_array(dst, self->fields[self->latest_mask]);
+    if (rc == 0 && height != NULL && width != NULL) {
+        *height = self->mask_heights[self->latest_mask];
+        *width = self->mask_widths[self->latest_mask];
+    }
+    unlock(self);
+    return rc;
+}
+
+
+int SegmentationThread_get_field_for_timestamp(SegmentationThread * self, uint64_t timestamp, ImgArray * dst,
+                                               int * height, int * width)
+{
+    int rc = 1;
+    lock(self);
+    for (int i = 0; i < MASK_HISTORY_LENGTH; i++) {
+        if (self->mask_timestamps[i] == timestamp && ImgArray_get_buffer(self->fields[i])) {
+            rc = ImgArray_copy_from_array(dst, self->fields[i]);
+            if (rc == 0 && height != NULL && width != NULL) {
+                *height = self->mask_heights[i];
+                *width = self->mask_widths[i];
+            }
+            break;
+        }
+    }
+    unlock(self);
+    return rc;
+}
+
+
+uint64_t SegmentationThread_get_mask_timestamp(SegmentationThread * self)
+{
+    lock(self);
+    uint64_t result = self->mask_timestamp;
+    unlock(self);
+    return result;
+}
+
+
+uint64_t SegmentationThread_get_mask_latency(SegmentationThread * self, uint64_t * latency_ns)
+{
+    lock(self);
+    *latency_ns = self->mask_latency_ns;
+    uint64_t result = self->latency_samples;
+    unlock(self);
+    return result;
+}
+
+
 void lock(SegmentationThread * self)
 {
     pthread_mutex_lock(&(self->mutex));
@@ -194,6 +1208,46 @@ void unlock(SegmentationThread * self)
     pthread_mutex_unlock(&(self->mutex));
 }
 
+// called with the lock held, wakes one idle worker or all of them
+void signal_work(SegmentationThread * self, int everyone)
+{
+    self->work_signals++;
+    if (everyone) {
+        pthread_cond_broadcast(&(self->work_cond));
+    } else {
+        pthread_cond_signal(&(self->work_cond));
+    }
+}
+
+
+// Waits until signal_work is called after the worker last looked, which
+// it saw as work_signals, or until the next warm-up or dual-rate pass is
+// due, instead of polling for frames.
+void wait_for_work(SegmentationThread * self, uint64_t work_signals)
+{
+    SegmentationSettings settings;
+    Snapshot_read(self->settings, &settings);
+    lock(self);
+    uint64_t until = os_gettime_ns() + WORKER_IDLE_WAIT_NS;
+    if (self->warm_up_pending && self->next_warm_up < until) {
+        until = self->next_warm_up;
+    }
+    if (settings.coarse_divisor > 1 && self->buffer_counter != self->dispatched_counter) {
+        uint64_t due = self->next_fine < self->next_coarse ? self->next_fine : self->next_coarse;
+        if (due < until) {
+            until = due;
+        }
+    }
+    struct timespec deadline;
+    deadline.tv_sec = (time_t)(until / 1000000000ULL);
+    deadline.tv_nsec = (long)(until % 1000000000ULL);
+    while (self->work_signals == work_signals && os_gettime_ns() < until) {
+        pthread_cond_timedwait(&(self->work_cond), &(self->mutex), &deadline);
+    }
+    unlock(self);
+}
+
+
 void sleepthread()
 {
     nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
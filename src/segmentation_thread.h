@@ -4,30 +4,237 @@
 #include <stdint.h>
 #include <pthread.h>
 
-#include "segmentation_client.h"
+#include "segmentation_pool.h"
 #include "imgarray.h"
+#include "mask_cache.h"
+#include "thread_policy.h"
+#include "segmentation_batcher.h"
+#include "mask_fusion.h"
+#include "mask_field.h"
+#include "snapshot.h"
+
+// one worker per endpoint we could be talking to concurrently
+#define MAX_SEGMENTATION_WORKERS       4
+// recent masks kept around so delayed frames can find their own mask
+#define MASK_HISTORY_LENGTH            8
+// how often a cold thread retries connecting before its first frame
+#define WARM_UP_RETRY_NS               500000000ULL
+// longest an idle worker waits for work_cond before looking again
+#define WORKER_IDLE_WAIT_NS            1000000000ULL
+
+
+typedef struct {
+    uint64_t suspensions;
+    // length of the current or last suspension
+    uint64_t suspended_ns;
+    // CPU time every worker together used during it
+    uint64_t worker_cpu_ns;
+    // what parking the workers freed, and what the thread still holds afterwards
+    size_t released_bytes;
+    size_t retained_bytes;
+} SuspendStats;
+
+
+// frames given up on for their deadline, by where it happened
+typedef struct {
+    // past the deadline before they were sent
+    uint64_t expired;
+    // dropped by the server before inference
+    uint64_t dropped_by_server;
+    // segmented, but the mask came back too late to show
+    uint64_t late_masks;
+} DeadlineStats;
+
+
+// what the workers look up for every frame, published without taking the mutex
+typedef struct {
+    // a frame's deadline is this long after it arrived, 0 for none
+    uint64_t max_mask_age_ns;
+    uint64_t batch_window_ns;
+    int max_batch;
+    // see SegmentationThread_set_dual_rate, a divisor of 1 is off
+    int coarse_divisor;
+    uint64_t coarse_interval_ns;
+    uint64_t fine_interval_ns;
+    // see SegmentationThread_set_distance_field
+    int distance_field;
+    // when set, frames are segmented through it instead of the thread's own pool
+    SegmentationBatcher * batcher;
+    // the policy last set, so setting the same one again needs no mutex
+    ThreadPolicy policy;
+} SegmentationSettings;
+
+
+enum SegmentationPass {
+    // dual-rate is off, every frame is sent as it is
+    SEGMENTATION_PASS_SINGLE = 0,
+    SEGMENTATION_PASS_COARSE,
+    SEGMENTATION_PASS_FINE
+};
+
+
+typedef struct {
+    // frames sent or found in the cache
+    uint64_t frames;
+    uint64_t masks;
+    // from update_buffer to the mask, summed over masks
+    uint64_t latency_ns;
+} PassStats;
+
 
 typedef struct {
-    pthread_t thread_id;
+    PassStats coarse;
+    PassStats fine;
+    // coarse masks that took edges from a full-resolution one
+    uint64_t fused;
+} DualRateStats;
+
+
+typedef struct {
+    pthread_t thread_ids[MAX_SEGMENTATION_WORKERS];
+    int num_workers;
     pthread_mutex_t mutex;
     ImgArray * bgr;
     pthread_mutex_t data_mutex;
     uint64_t buffer_counter;
+    uint64_t dispatched_counter;
     uint8_t is_running;
-    SegmentationClient * client;
+    SegmentationPool * pool;
+
+    // geometry of the pending buffer, latched by update_buffer
+    MaskCacheKey buffer_key;
 
-    ImgArray * mask;
+    ImgArray * masks[MASK_HISTORY_LENGTH];
+    uint64_t mask_timestamps[MASK_HISTORY_LENGTH];
+    int mask_heights[MASK_HISTORY_LENGTH];
+    int mask_widths[MASK_HISTORY_LENGTH];
+    // encoded distance field of each mask, empty when it was stored without one
+    ImgArray * fields[MASK_HISTORY_LENGTH];
+    int latest_mask;
     uint64_t timestamp;
+    uint64_t mask_timestamp;
+    // when the pending buffer arrived, and how long the last mask took from there
+    uint64_t buffer_received;
+    uint64_t mask_latency_ns;
+    uint64_t latency_samples;
+
+    // shared with other instances, borrowed
+    MaskCache * cache;
+    // the current geometry; parameters, hash and size are filled in per frame
+    MaskCacheKey cache_key;
+
+    // while suspended the workers wait on resume_cond instead of polling
+    uint8_t suspended;
+    uint8_t warm_up_pending;
+    int parked_workers;
+    pthread_cond_t resume_cond;
+    // idle workers wait on work_cond; work_signals counts the wakeups so
+    // a frame that lands between looking and waiting is not missed
+    pthread_cond_t work_cond;
+    uint64_t work_signals;
+    uint64_t suspend_timestamp;
+    uint64_t suspend_cpu_ns;
+    SuspendStats suspend_stats;
+
+    // connect (and with warm_up_frame, run a blank frame) before frames arrive
+    uint8_t warm_up_frame;
+    uint64_t next_warm_up;
+
+    // time from create or resume to the first mask after it
+    uint64_t start_timestamp;
+    uint8_t first_mask_pending;
+    uint64_t time_to_first_mask_ns;
+    uint64_t first_masks;
+
+    // each worker applies a new policy to itself the next time around its loop
+    ThreadPolicy policy;
+    uint64_t policy_generation;
+    int next_worker_index;
+    ThreadPolicyReport policy_reports[MAX_SEGMENTATION_WORKERS];
+
+    // SegmentationSettings
+    Snapshot * settings;
+    DeadlineStats deadline_stats;
+
+    // with a divisor above 1, frames alternate between a low-resolution and a full-resolution stream
+    uint64_t next_coarse;
+    uint64_t next_fine;
+    DualRateStats dual_rate_stats;
+    // the latest full-resolution mask, fused into coarse ones without holding up update_buffer
+    pthread_mutex_t fine_mutex;
+    ImgArray * fine_mask;
+    uint64_t fine_timestamp;
+    int fine_height;
+    int fine_width;
 } SegmentationThread;
 
 
 SegmentationThread * SegmentationThread_create();
 void SegmentationThread_destroy(SegmentationThread * self);
 
+// the geometry and format apply to the buffers passed to update_buffer after the call
 void SegmentationThread_set_dimensions(SegmentationThread * self, int height, int width);
 void SegmentationThread_set_parameters(SegmentationThread * self, float segmentation_threshold, int blur, int growshrink);
+void SegmentationThread_set_format(SegmentationThread * self, int stride, enum PixelFormat pixel_format);
+// frames found in the cache are not sent to a server; the cache must outlive the thread
+void SegmentationThread_set_cache(SegmentationThread * self, MaskCache * cache);
+void SegmentationThread_set_policy(SegmentationThread * self, const ThreadPolicy * policy);
+// Copies what every worker got from the latest policy. Returns how many of
+// them have applied it so far, up to num_workers.
+int SegmentationThread_get_policy_reports(SegmentationThread * self, ThreadPolicyReport * dst, uint64_t * generation);
+// Sends frames through a batcher shared with other threads, which waits up to
+// window_ns for up to max_batch frames. NULL goes back to the thread's own
+// pool. The batcher must outlive the thread.
+void SegmentationThread_set_batcher(SegmentationThread * self, SegmentationBatcher * batcher,
+                                    uint64_t window_ns, int max_batch);
+// Frames not segmented within max_age_ns of arriving are dropped: before
+// they are sent, by the server, or when their mask arrives. 0 keeps every
+// frame however late.
+void SegmentationThread_set_max_mask_age(SegmentationThread * self, uint64_t max_age_ns);
+void SegmentationThread_get_deadline_stats(SegmentationThread * self, DeadlineStats * stats);
+// Sends frames with each side divided by coarse_divisor at most once every
+// coarse_interval_ns and whole frames at most once every fine_interval_ns,
+// 0 for every frame. Coarse masks are scaled back up and take their edges
+// from the latest full-resolution mask. A divisor of 1 turns this off.
+void SegmentationThread_set_dual_rate(SegmentationThread * self, int coarse_divisor,
+                                      uint64_t coarse_interval_ns, uint64_t fine_interval_ns);
+// Has the workers build each mask's distance field as they store it, for
+// SegmentationThread_get_field to hand out encoded by MaskField_build.
+void SegmentationThread_set_distance_field(SegmentationThread * self, int enabled);
+void SegmentationThread_get_dual_rate_stats(SegmentationThread * self, DualRateStats * stats);
+// segment on the server behind this Unix socket only, NULL to discover servers
+void SegmentationThread_set_server_socket(SegmentationThread * self, const char * path);
+int SegmentationThread_get_capabilities(SegmentationThread * self, ServerCapabilities * capabilities);
 void SegmentationThread_update_buffer(SegmentationThread * self, uint64_t timestamp, const uint8_t * buffer, int buffer_size);
-int SegmentationThread_get_mask(SegmentationThread * self, ImgArray * dst);
+// height and width, if not NULL, receive the size of the copied mask
+int SegmentationThread_get_mask(SegmentationThread * self, ImgArray * dst, int * height, int * width);
+// copies the mask computed from the frame with this exact timestamp, if it is still in the history
+int SegmentationThread_get_mask_for_timestamp(SegmentationThread * self, uint64_t timestamp, ImgArray * dst,
+                                              int * height, int * width);
+// the encoded distance field of the latest mask, or of the mask of this exact
+// timestamp; non-zero if that mask was stored without one
+int SegmentationThread_get_field(SegmentationThread * self, ImgArray * dst, int * height, int * width);
+int SegmentationThread_get_field_for_timestamp(SegmentationThread * self, uint64_t timestamp, ImgArray * dst,
+                                               int * height, int * width);
+int SegmentationThread_has_mask(SegmentationThread * self);
+uint64_t SegmentationThread_get_mask_timestamp(SegmentationThread * self);
+
+// Stops dispatching. Once in-flight requests finish, the workers park, drop
+// their connections and free every buffer but the latest mask.
+void SegmentationThread_suspend(SegmentationThread * self);
+// wakes the workers, which reconnect in the background before the next frame
+void SegmentationThread_resume(SegmentationThread * self);
+int SegmentationThread_is_suspended(SegmentationThread * self);
+// non-zero once every worker of a suspended thread is parked
+int SegmentationThread_is_parked(SegmentationThread * self);
+void SegmentationThread_get_suspend_stats(SegmentationThread * self, SuspendStats * stats);
+size_t SegmentationThread_get_memory_usage(SegmentationThread * self);
+// Time from create or the last resume to the first mask after it. Returns
+// how many of these have been measured, 0 while the first is outstanding.
+uint64_t SegmentationThread_get_time_to_first_mask(SegmentationThread * self, uint64_t * time_ns);
+// Time from SegmentationThread_update_buffer to the mask of that buffer for
+// the last frame a server segmented. Returns the number of such frames so far.
+uint64_t SegmentationThread_get_mask_latency(SegmentationThread * self, uint64_t * latency_ns);
 
 
 #endif //OBS_VIRTUAL_BACKGROUND_SEGMENTATION_THREAD_H
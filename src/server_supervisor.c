@@ -0,0 +1,397 @@
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "compat.h"
+#include "server_supervisor.h"
+
+extern char ** environ;
+
+// utility methods
+int bind_listen_socket(ServerSupervisor * self);
+int launch_server(ServerSupervisor * self, uint64_t now);
+void exec_server(ServerSupervisor * self, char ** envp, int ready_fd);
+char ** build_environment(void);
+void free_environment(char ** envp);
+void check_ready(ServerSupervisor * self, int timeout_ms);
+void check_exited(ServerSupervisor * self, uint64_t now);
+void stop_server(ServerSupervisor * self);
+void close_ready_fd(ServerSupervisor * self);
+void * supervisor_thread(void * data);
+
+
+ServerSupervisor * ServerSupervisor_create(const char * command)
+{
+    ServerSupervisor * self = (ServerSupervisor *)bzalloc(sizeof(ServerSupervisor));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->mutex), NULL);
+    strncpy(self->command, command, SERVER_SUPERVISOR_COMMAND_LENGTH - 1);
+    self->pid = -1;
+    self->ready_fd = -1;
+    self->listen_socket = -1;
+
+    if (bind_listen_socket(self)) {
+        ServerSupervisor_destroy(self);
+        return NULL;
+    }
+
+    self->running = 1;
+    if (pthread_create(&(self->thread), NULL, supervisor_thread, self)) {
+        self->running = 0;
+        ServerSupervisor_destroy(self);
+        return NULL;
+    }
+    return self;
+}
+
+
+void ServerSupervisor_destroy(ServerSupervisor * self)
+{
+    if (!self) {
+        return;
+    }
+    if (self->running) {
+        self->running = 0;
+        pthread_join(self->thread, NULL);
+    }
+    if (self->listen_socket != -1) {
+        close(self->listen_socket);
+        unlink(self->socket_path);
+    }
+    pthread_mutex_destroy(&(self->mutex));
+    bfree(self);
+}
+
+
+const char * ServerSupervisor_get_socket_path(ServerSupervisor * self)
+{
+    return self->socket_path;
+}
+
+
+const char * ServerSupervisor_get_command(ServerSupervisor * self)
+{
+    return self->command;
+}
+
+
+void ServerSupervisor_get_stats(ServerSupervisor * self, SupervisorStats * stats)
+{
+    pthread_mutex_lock(&(self->mutex));
+    *stats = self->stats;
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+// The socket is created here rather than by the server so that it outlives
+// server crashes: connections queue up in the backlog while a replacement
+// starts instead of being refused.
+int bind_listen_socket(ServerSupervisor * self)
+{
+    const char * tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL) {
+        tmpdir = "/tmp";
+    }
+    int length = snprintf(self->socket_path, SEGMENTATION_SOCKET_PATH_LENGTH,
+                          "%s/virtual-background-%d.sock", tmpdir, (int)getpid());
+    if (length < 0 || length >= SEGMENTATION_SOCKET_PATH_LENGTH) {
+        fprintf(stderr, "Segmentation socket path is too long under %s\n", tmpdir);
+        return -1;
+    }
+
+    self->listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (self->listen_socket == -1) {
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, self->socket_path, sizeof(addr.sun_path) - 1);
+
+    // left over from an earlier run under the same pid
+    unlink(self->socket_path);
+    if (bind(self->listen_socket, (struct sockaddr *)&addr, sizeof(addr)) ||
+            listen(self->listen_socket, 16)) {
+        fprintf(stderr, "Could not listen on %s: %s\n", self->socket_path, strerror(errno));
+        close(self->listen_socket);
+        self->listen_socket = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+int launch_server(ServerSupervisor * self, uint64_t now)
+{
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC)) {
+        return -1;
+    }
+    // everything the child needs is allocated before forking
+    char ** envp = build_environment();
+    if (envp == NULL) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        exec_server(self, envp, pipe_fds[1]);
+    }
+    free_environment(envp);
+    close(pipe_fds[1]);
+    if (pid == -1) {
+        close(pipe_fds[0]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&(self->mutex));
+    self->pid = pid;
+    self->ready_fd = pipe_fds[0];
+    self->launch_timestamp = now;
+    self->ready_timestamp = 0;
+    self->stats.starts++;
+    self->stats.pid = pid;
+    self->stats.ready = 0;
+    pthread_mutex_unlock(&(self->mutex));
+    return 0;
+}
+
+
+// runs in the forked child, so only async-signal-safe calls from here on
+void exec_server(ServerSupervisor * self, char ** envp, int ready_fd)
+{
+#ifdef __linux__
+    // don't outlive OBS if it dies without stopping us
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    // move the ready pipe out of the way first in case it landed on the socket's slot
+    int fd = fcntl(ready_fd, F_DUPFD, SERVER_SUPERVISOR_READY_FD + 1);
+    if (fd == -1 ||
+            dup2(self->listen_socket, SERVER_SUPERVISOR_SOCKET_FD) == -1 ||
+            dup2(fd, SERVER_SUPERVISOR_READY_FD) == -1) {
+        _exit(127);
+    }
+    // dup2 clears FD_CLOEXEC on the copies, but does nothing if the socket already is fd 3
+    if (self->listen_socket == SERVER_SUPERVISOR_SOCKET_FD) {
+        fcntl(SERVER_SUPERVISOR_SOCKET_FD, F_SETFD, 0);
+    }
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (int i = SERVER_SUPERVISOR_READY_FD + 1; i < max_fd; i++) {
+        close(i);
+    }
+
+    char command[SERVER_SUPERVISOR_COMMAND_LENGTH + 8] = "exec ";
+    strncat(command, self->command, SERVER_SUPERVISOR_COMMAND_LENGTH);
+    char * argv[] = {"/bin/sh", "-c", command, NULL};
+    execve("/bin/sh", argv, envp);
+    _exit(127);
+}
+
+
+char ** build_environment(void)
+{
+    int count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char ** envp = (char **)bzalloc((count + 3) * sizeof(char *));
+    if (envp == NULL) {
+        return NULL;
+    }
+    int j = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(environ[i], "SEGMENTATION_FD=", 16) == 0 ||
+                strncmp(environ[i], "SEGMENTATION_READY_FD=", 22) == 0) {
+            continue;
+        }
+        envp[j++] = strdup(environ[i]);
+    }
+    char value[64];
+    snprintf(value, sizeof(value), "SEGMENTATION_FD=%d", SERVER_SUPERVISOR_SOCKET_FD);
+    envp[j++] = strdup(value);
+    snprintf(value, sizeof(value), "SEGMENTATION_READY_FD=%d", SERVER_SUPERVISOR_READY_FD);
+    envp[j++] = strdup(value);
+    envp[j] = NULL;
+
+    for (int i = 0; i < j; i++) {
+        if (envp[i] == NULL) {
+            for (int k = 0; k < j; k++) {
+                free(envp[k]);
+            }
+            bfree(envp);
+            return NULL;
+        }
+    }
+    return envp;
+}
+
+
+void free_environment(char ** envp)
+{
+    for (int i = 0; envp[i] != NULL; i++) {
+        free(envp[i]);
+    }
+    bfree(envp);
+}
+
+
+// the server writes a byte to the ready pipe once its model is loaded
+void check_ready(ServerSupervisor * self, int timeout_ms)
+{
+    if (self->ready_fd == -1) {
+        usleep(timeout_ms * 1000);
+        return;
+    }
+    struct pollfd pfd = {self->ready_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return;
+    }
+    char byte;
+    ssize_t rc = read(self->ready_fd, &byte, 1);
+    if (rc == 0 || (rc < 0 && errno != EINTR && errno != EAGAIN)) {
+        // the server closed the pipe without saying so; it's probably exiting
+        close_ready_fd(self);
+        return;
+    }
+    if (rc < 0) {
+        return;
+    }
+
+    uint64_t now = os_gettime_ns();
+    pthread_mutex_lock(&(self->mutex));
+    self->ready_timestamp = now;
+    self->stats.ready = 1;
+    if (self->stats.starts == 1) {
+        self->stats.first_start_latency_ns = now - self->launch_timestamp;
+    } else {
+        uint64_t latency = now - self->crash_timestamp;
+        self->stats.last_restart_latency_ns = latency;
+        if (latency > self->stats.max_restart_latency_ns) {
+            self->stats.max_restart_latency_ns = latency;
+        }
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    close_ready_fd(self);
+    fprintf(stderr, "Segmentation server %d is ready\n", (int)self->pid);
+}
+
+
+void check_exited(ServerSupervisor * self, uint64_t now)
+{
+    int status;
+    if (waitpid(self->pid, &status, WNOHANG) != self->pid) {
+        return;
+    }
+    close_ready_fd(self);
+
+    // a server that got ready and then exited cleanly meant to, it did not crash
+    int planned = self->ready_timestamp != 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (planned || (self->ready_timestamp != 0 && now - self->ready_timestamp > SERVER_SUPERVISOR_STABLE_NS)) {
+        self->consecutive_crashes = 0;
+    }
+    int shift = self->consecutive_crashes;
+    if (shift > SERVER_SUPERVISOR_MAX_BACKOFF_SHIFT) {
+        shift = SERVER_SUPERVISOR_MAX_BACKOFF_SHIFT;
+    }
+    uint64_t backoff = planned ? 0 : SERVER_SUPERVISOR_BACKOFF_NS << shift;
+    if (!planned) {
+        self->consecutive_crashes++;
+    }
+    self->next_launch = now + backoff;
+
+    pthread_mutex_lock(&(self->mutex));
+    // a restart is timed from the first exit it replaces
+    if (self->stats.ready || self->stats.crashes + self->stats.planned_restarts == 0) {
+        self->crash_timestamp = now;
+    }
+    if (planned) {
+        self->stats.planned_restarts++;
+    } else {
+        self->stats.crashes++;
+    }
+    self->stats.ready = 0;
+    self->stats.pid = -1;
+    self->pid = -1;
+    pthread_mutex_unlock(&(self->mutex));
+
+    if (planned) {
+        fprintf(stderr, "Segmentation server exited cleanly, restarting now\n");
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Segmentation server killed by signal %d, restarting in %llu ms\n",
+                WTERMSIG(status), (unsigned long long)(backoff / 1000000ULL));
+    } else {
+        fprintf(stderr, "Segmentation server exited with %d, restarting in %llu ms\n",
+                WEXITSTATUS(status), (unsigned long long)(backoff / 1000000ULL));
+    }
+}
+
+
+void stop_server(ServerSupervisor * self)
+{
+    close_ready_fd(self);
+    if (self->pid == -1) {
+        return;
+    }
+    kill(self->pid, SIGTERM);
+    uint64_t deadline = os_gettime_ns() + SERVER_SUPERVISOR_STOP_NS;
+    while (waitpid(self->pid, NULL, WNOHANG) == 0) {
+        if (os_gettime_ns() > deadline) {
+            kill(self->pid, SIGKILL);
+            waitpid(self->pid, NULL, 0);
+            break;
+        }
+        usleep(SERVER_SUPERVISOR_POLL_MS * 1000);
+    }
+    pthread_mutex_lock(&(self->mutex));
+    self->pid = -1;
+    self->stats.pid = -1;
+    self->stats.ready = 0;
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+void close_ready_fd(ServerSupervisor * self)
+{
+    if (self->ready_fd != -1) {
+        close(self->ready_fd);
+        self->ready_fd = -1;
+    }
+}
+
+
+void * supervisor_thread(void * data)
+{
+    ServerSupervisor * self = (ServerSupervisor *)data;
+    while (self->running) {
+        uint64_t now = os_gettime_ns();
+        if (self->pid == -1) {
+            if (now >= self->next_launch && launch_server(self, now)) {
+                fprintf(stderr, "Could not start segmentation server: %s\n", strerror(errno));
+                self->next_launch = now + (SERVER_SUPERVISOR_BACKOFF_NS << SERVER_SUPERVISOR_MAX_BACKOFF_SHIFT);
+            }
+            if (self->pid == -1) {
+                usleep(SERVER_SUPERVISOR_POLL_MS * 1000);
+                continue;
+            }
+        }
+        check_ready(self, SERVER_SUPERVISOR_POLL_MS);
+        check_exited(self, os_gettime_ns());
+    }
+    stop_server(self);
+    return NULL;
+}
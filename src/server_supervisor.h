@@ -0,0 +1,70 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_SERVER_SUPERVISOR_H
+#define OBS_VIRTUAL_BACKGROUND_SERVER_SUPERVISOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "segmentation_client.h"
+
+#define SERVER_SUPERVISOR_COMMAND_LENGTH  1024
+// the child finds the listening socket and the ready pipe on these
+#define SERVER_SUPERVISOR_SOCKET_FD       3
+#define SERVER_SUPERVISOR_READY_FD        4
+#define SERVER_SUPERVISOR_POLL_MS         100
+// a crashed server is restarted after BACKOFF << consecutive crashes, one
+// that exits with status 0 after becoming ready is restarted right away
+#define SERVER_SUPERVISOR_BACKOFF_NS      500000000ULL
+#define SERVER_SUPERVISOR_MAX_BACKOFF_SHIFT 6
+// a server that stayed up this long is healthy again
+#define SERVER_SUPERVISOR_STABLE_NS       30000000000ULL
+// how long a server gets to exit on SIGTERM before it is killed
+#define SERVER_SUPERVISOR_STOP_NS         2000000000ULL
+
+
+typedef struct {
+    uint64_t starts;
+    uint64_t crashes;
+    // clean exits of a ready server, such as the node server recycling itself
+    uint64_t planned_restarts;
+    int ready;
+    pid_t pid;
+    // from launching the first server until it said it was ready
+    uint64_t first_start_latency_ns;
+    // from a crash or planned exit until the replacement said it was ready
+    uint64_t last_restart_latency_ns;
+    uint64_t max_restart_latency_ns;
+} SupervisorStats;
+
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    volatile int running;
+    char command[SERVER_SUPERVISOR_COMMAND_LENGTH];
+    char socket_path[SEGMENTATION_SOCKET_PATH_LENGTH];
+    int listen_socket;
+
+    pid_t pid;
+    int ready_fd;
+    int consecutive_crashes;
+    uint64_t launch_timestamp;
+    uint64_t crash_timestamp;
+    uint64_t ready_timestamp;
+    uint64_t next_launch;
+    SupervisorStats stats;
+} ServerSupervisor;
+
+
+// Binds a Unix socket the server inherits and starts keeping `command` running
+// on it. Clients connect to ServerSupervisor_get_socket_path.
+ServerSupervisor * ServerSupervisor_create(const char * command);
+// stops the server and removes the socket
+void ServerSupervisor_destroy(ServerSupervisor * self);
+
+const char * ServerSupervisor_get_socket_path(ServerSupervisor * self);
+const char * ServerSupervisor_get_command(ServerSupervisor * self);
+void ServerSupervisor_get_stats(ServerSupervisor * self, SupervisorStats * stats);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_SERVER_SUPERVISOR_H
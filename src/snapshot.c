@@ -0,0 +1,133 @@
+#include <sched.h>
+
+#include "compat.h"
+
+#include "snapshot.h"
+
+
+// utility methods
+uint32_t enter_reader(Snapshot * self);
+void leave_reader(Snapshot * self, uint32_t epoch);
+void wait_for_readers(Snapshot * self);
+
+
+Snapshot * Snapshot_create(const void * initial, size_t size)
+{
+    Snapshot * self = (Snapshot *)bzalloc(sizeof(Snapshot));
+    if (!self) {
+        return NULL;
+    }
+    self->size = size;
+    self->current = bzalloc(size);
+    if (!self->current) {
+        bfree(self);
+        return NULL;
+    }
+    memcpy(self->current, initial, size);
+    self->epoch = 0;
+    self->readers[0] = 0;
+    self->readers[1] = 0;
+    pthread_mutex_init(&(self->write_mutex), NULL);
+    memset(&(self->stats), 0, sizeof(SnapshotStats));
+    return self;
+}
+
+
+void Snapshot_destroy(Snapshot * self)
+{
+    if (!self) {
+        return;
+    }
+    pthread_mutex_destroy(&(self->write_mutex));
+    bfree(self->current);
+    bfree(self);
+}
+
+
+void Snapshot_read(Snapshot * self, void * dst)
+{
+    uint32_t epoch = enter_reader(self);
+    const void * current = __atomic_load_n(&(self->current), __ATOMIC_SEQ_CST);
+    memcpy(dst, current, self->size);
+    leave_reader(self, epoch);
+}
+
+
+void * Snapshot_begin_update(Snapshot * self)
+{
+    void * copy = bzalloc(self->size);
+    if (!copy) {
+        return NULL;
+    }
+    pthread_mutex_lock(&(self->write_mutex));
+    // only publishers replace it, so it holds still while the lock is held
+    memcpy(copy, self->current, self->size);
+    return copy;
+}
+
+
+int Snapshot_publish(Snapshot * self, void * copy)
+{
+    if (memcmp(copy, self->current, self->size) == 0) {
+        self->stats.unchanged++;
+        pthread_mutex_unlock(&(self->write_mutex));
+        bfree(copy);
+        return 0;
+    }
+    void * previous = __atomic_exchange_n(&(self->current), copy, __ATOMIC_SEQ_CST);
+
+    uint64_t start = os_gettime_ns();
+    wait_for_readers(self);
+    uint64_t grace = os_gettime_ns() - start;
+    self->stats.publishes++;
+    self->stats.grace_ns += grace;
+    if (grace > self->stats.max_grace_ns) {
+        self->stats.max_grace_ns = grace;
+    }
+    pthread_mutex_unlock(&(self->write_mutex));
+    bfree(previous);
+    return 1;
+}
+
+
+void Snapshot_get_stats(Snapshot * self, SnapshotStats * stats)
+{
+    pthread_mutex_lock(&(self->write_mutex));
+    *stats = self->stats;
+    pthread_mutex_unlock(&(self->write_mutex));
+}
+
+
+// Counts the reader in for the current epoch. If a publisher flipped the
+// epoch in between, it may already be waiting on the other counter, so the
+// reader backs out and tries again.
+uint32_t enter_reader(Snapshot * self)
+{
+    while (1) {
+        uint32_t epoch = __atomic_load_n(&(self->epoch), __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&(self->readers[epoch]), 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&(self->epoch), __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        __atomic_sub_fetch(&(self->readers[epoch]), 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+void leave_reader(Snapshot * self, uint32_t epoch)
+{
+    __atomic_sub_fetch(&(self->readers[epoch]), 1, __ATOMIC_SEQ_CST);
+}
+
+
+// Readers that count in after the flip load the new copy, so once the old
+// epoch's counter is empty nobody can still hold the previous one. Read
+// sections are a single copy, so this rarely spins at all.
+void wait_for_readers(Snapshot * self)
+{
+    uint32_t epoch = __atomic_load_n(&(self->epoch), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&(self->epoch), epoch ^ 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&(self->readers[epoch]), __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+}
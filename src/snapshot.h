@@ -0,0 +1,52 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_SNAPSHOT_H
+#define OBS_VIRTUAL_BACKGROUND_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+
+typedef struct {
+    uint64_t publishes;
+    // updates that changed nothing and so published nothing
+    uint64_t unchanged;
+    // time publishers spent waiting for readers of the copy they replaced
+    uint64_t grace_ns;
+    uint64_t max_grace_ns;
+} SnapshotStats;
+
+
+// A settings struct that is replaced whole and read without locks, RCU
+// style: every publish swaps in a fresh immutable copy, and the one it
+// replaced is freed once no reader can still be copying it. Readers
+// announce themselves on a counter for the epoch they saw; a publisher
+// flips the epoch and waits for the old epoch's counter to drain.
+typedef struct {
+    size_t size;
+    // the published copy, swapped atomically
+    void * current;
+    uint32_t epoch;
+    uint32_t readers[2];
+
+    // serialises publishers and guards the stats, never taken by readers
+    pthread_mutex_t write_mutex;
+    SnapshotStats stats;
+} Snapshot;
+
+
+Snapshot * Snapshot_create(const void * initial, size_t size);
+// no reader may be left
+void Snapshot_destroy(Snapshot * self);
+
+// copies the current value into dst without taking a lock
+void Snapshot_read(Snapshot * self, void * dst);
+// Returns a private copy of the current value to change, holding off other
+// publishers until Snapshot_publish. NULL if it can't be allocated.
+void * Snapshot_begin_update(Snapshot * self);
+// Publishes copy unless it equals the current value, then frees whichever
+// of them is no longer current. Returns 1 if it published.
+int Snapshot_publish(Snapshot * self, void * copy);
+void Snapshot_get_stats(Snapshot * self, SnapshotStats * stats);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_SNAPSHOT_H
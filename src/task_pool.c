@@ -0,0 +1,197 @@
+#include <pthread.h>
+
+#include "compat.h"
+#include "task_pool.h"
+
+void * run_pool_thread(void * ptr);
+int run_next_task(TaskPool * self);
+
+
+TaskPool * TaskPool_create(int parallelism)
+{
+    TaskPool * self = (TaskPool *)bzalloc(sizeof(TaskPool));
+    if (!self) {
+        return NULL;
+    }
+    pthread_mutex_init(&(self->run_mutex), NULL);
+    pthread_mutex_init(&(self->mutex), NULL);
+    pthread_cond_init(&(self->start_cond), NULL);
+    pthread_cond_init(&(self->done_cond), NULL);
+    self->is_running = 1;
+    self->num_threads = 0;
+    self->generation = 0;
+    ThreadPolicy_init(&(self->policy));
+    self->policy_generation = 0;
+    self->next_thread_index = 0;
+
+    int num_threads = parallelism - 1;
+    if (num_threads > MAX_TASK_POOL_THREADS) {
+        num_threads = MAX_TASK_POOL_THREADS;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&(self->thread_ids[i]), NULL, run_pool_thread, (void *)self)) {
+            break;
+        }
+        self->num_threads++;
+#ifdef _GNU_SOURCE
+        pthread_setname_np(self->thread_ids[i], "virtual-background-tasks");
+#endif
+    }
+    return self;
+}
+
+
+void TaskPool_destroy(TaskPool * self)
+{
+    if (!self) {
+        return;
+    }
+    pthread_mutex_lock(&(self->mutex));
+    self->is_running = 0;
+    pthread_cond_broadcast(&(self->start_cond));
+    pthread_mutex_unlock(&(self->mutex));
+    for (int i = 0; i < self->num_threads; i++) {
+        pthread_join(self->thread_ids[i], NULL);
+    }
+    pthread_cond_destroy(&(self->start_cond));
+    pthread_cond_destroy(&(self->done_cond));
+    pthread_mutex_destroy(&(self->mutex));
+    pthread_mutex_destroy(&(self->run_mutex));
+    bfree(self);
+}
+
+
+int TaskPool_get_parallelism(TaskPool * self)
+{
+    return self->num_threads + 1;
+}
+
+
+void TaskPool_set_policy(TaskPool * self, const ThreadPolicy * policy)
+{
+    pthread_mutex_lock(&(self->mutex));
+    if (!ThreadPolicy_equals(&(self->policy), policy)) {
+        self->policy = *policy;
+        self->policy_generation++;
+        pthread_cond_broadcast(&(self->start_cond));
+    }
+    pthread_mutex_unlock(&(self->mutex));
+}
+
+
+int TaskPool_get_policy_reports(TaskPool * self, ThreadPolicyReport * dst, uint64_t * generation)
+{
+    int applied = 0;
+    pthread_mutex_lock(&(self->mutex));
+    *generation = self->policy_generation;
+    for (int i = 0; i < self->num_threads; i++) {
+        dst[i] = self->policy_reports[i];
+        if (dst[i].generation == self->policy_generation) {
+            applied++;
+        }
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    return applied;
+}
+
+
+void TaskPool_run(TaskPool * self, int num_tasks, TaskFunction function, void * context)
+{
+    if (self->num_threads == 0 || num_tasks <= 1) {
+        for (int i = 0; i < num_tasks; i++) {
+            function(context, i, num_tasks);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&(self->run_mutex));
+    pthread_mutex_lock(&(self->mutex));
+    self->function = function;
+    self->context = context;
+    self->num_tasks = num_tasks;
+    self->next_task = 0;
+    self->pending_tasks = num_tasks;
+    self->generation++;
+    pthread_cond_broadcast(&(self->start_cond));
+    pthread_mutex_unlock(&(self->mutex));
+
+    // the caller works too instead of just waiting
+    while (run_next_task(self)) {
+    }
+
+    pthread_mutex_lock(&(self->mutex));
+    while (self->pending_tasks > 0) {
+        pthread_cond_wait(&(self->done_cond), &(self->mutex));
+    }
+    self->function = NULL;
+    pthread_mutex_unlock(&(self->mutex));
+    pthread_mutex_unlock(&(self->run_mutex));
+}
+
+
+// returns 0 once there is nothing left to claim
+int run_next_task(TaskPool * self)
+{
+    pthread_mutex_lock(&(self->mutex));
+    if (self->function == NULL || self->next_task >= self->num_tasks) {
+        pthread_mutex_unlock(&(self->mutex));
+        return 0;
+    }
+    int task = self->next_task++;
+    TaskFunction function = self->function;
+    void * context = self->context;
+    int num_tasks = self->num_tasks;
+    pthread_mutex_unlock(&(self->mutex));
+
+    function(context, task, num_tasks);
+
+    pthread_mutex_lock(&(self->mutex));
+    self->pending_tasks--;
+    if (self->pending_tasks == 0) {
+        pthread_cond_broadcast(&(self->done_cond));
+    }
+    pthread_mutex_unlock(&(self->mutex));
+    return 1;
+}
+
+
+void * run_pool_thread(void * ptr)
+{
+    TaskPool * self = (TaskPool *)ptr;
+    uint64_t seen_generation = 0;
+    uint64_t policy_generation = 0;
+
+    pthread_mutex_lock(&(self->mutex));
+    int index = self->next_thread_index++;
+    pthread_mutex_unlock(&(self->mutex));
+
+    while (1) {
+        pthread_mutex_lock(&(self->mutex));
+        while (self->is_running && self->generation == seen_generation &&
+                self->policy_generation == policy_generation) {
+            pthread_cond_wait(&(self->start_cond), &(self->mutex));
+        }
+        if (!self->is_running) {
+            pthread_mutex_unlock(&(self->mutex));
+            break;
+        }
+        if (self->policy_generation != policy_generation) {
+            policy_generation = self->policy_generation;
+            ThreadPolicy policy = self->policy;
+            pthread_mutex_unlock(&(self->mutex));
+
+            ThreadPolicyReport report;
+            ThreadPolicy_apply(&policy, &report);
+            report.generation = policy_generation;
+
+            pthread_mutex_lock(&(self->mutex));
+            self->policy_reports[index] = report;
+        }
+        seen_generation = self->generation;
+        pthread_mutex_unlock(&(self->mutex));
+
+        while (run_next_task(self)) {
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_TASK_POOL_H
+#define OBS_VIRTUAL_BACKGROUND_TASK_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "thread_policy.h"
+
+#define MAX_TASK_POOL_THREADS          16
+
+// called once per task index, from the caller's thread or a pool thread
+typedef void (*TaskFunction)(void * context, int task, int num_tasks);
+
+
+typedef struct {
+    pthread_t thread_ids[MAX_TASK_POOL_THREADS];
+    int num_threads;
+    // one batch at a time, callers from other threads queue up here
+    pthread_mutex_t run_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    uint8_t is_running;
+
+    TaskFunction function;
+    void * context;
+    int num_tasks;
+    int next_task;
+    int pending_tasks;
+    uint64_t generation;
+
+    // applied by the pool threads, never to a caller's thread
+    ThreadPolicy policy;
+    uint64_t policy_generation;
+    int next_thread_index;
+    ThreadPolicyReport policy_reports[MAX_TASK_POOL_THREADS];
+} TaskPool;
+
+
+// parallelism counts the calling thread, so a pool of 1 runs everything inline
+TaskPool * TaskPool_create(int parallelism);
+void TaskPool_destroy(TaskPool * self);
+int TaskPool_get_parallelism(TaskPool * self);
+
+void TaskPool_set_policy(TaskPool * self, const ThreadPolicy * policy);
+// Copies what every pool thread got from the latest policy and returns how
+// many have applied it so far, up to TaskPool_get_parallelism - 1.
+int TaskPool_get_policy_reports(TaskPool * self, ThreadPolicyReport * dst, uint64_t * generation);
+
+// runs function for every task index and returns once all of them finished
+void TaskPool_run(TaskPool * self, int num_tasks, TaskFunction function, void * context);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_TASK_POOL_H
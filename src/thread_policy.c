@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "compat.h"
+#include "thread_policy.h"
+
+// utility methods
+pid_t current_tid(void);
+int native_scheduler(enum ThreadScheduler scheduler);
+int clamp_priority(int native, int priority);
+void read_back(ThreadPolicyReport * report);
+int parse_int(const char * value, int * result);
+size_t describe_cpus(uint64_t cpu_mask, char * buffer, size_t size);
+
+
+void ThreadPolicy_init(ThreadPolicy * policy)
+{
+    policy->cpu_mask = 0;
+    policy->nice = 0;
+    policy->scheduler = THREAD_SCHEDULER_OTHER;
+    policy->priority = 0;
+    policy->memory = 0;
+}
+
+
+int ThreadPolicy_is_default(const ThreadPolicy * policy)
+{
+    ThreadPolicy empty;
+    ThreadPolicy_init(&empty);
+    return ThreadPolicy_equals(policy, &empty);
+}
+
+
+int ThreadPolicy_equals(const ThreadPolicy * a, const ThreadPolicy * b)
+{
+    return a->cpu_mask == b->cpu_mask &&
+            a->nice == b->nice &&
+            a->scheduler == b->scheduler &&
+            a->priority == b->priority &&
+            a->memory == b->memory;
+}
+
+
+int ThreadPolicy_parse_cpus(const char * list, uint64_t * cpu_mask)
+{
+    uint64_t mask = 0;
+    const char * p = list;
+    while (*p != '\0') {
+        char * end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return 1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return 1;
+            }
+        }
+        if (first < 0 || last < first || last >= THREAD_POLICY_MAX_CPUS) {
+            return 1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            mask |= 1ULL << cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return 1;
+        }
+        p = end;
+    }
+    *cpu_mask = mask;
+    return 0;
+}
+
+
+int ThreadPolicy_parse(const char * spec, ThreadPolicy * policy)
+{
+    char * copy = strdup(spec);
+    if (copy == NULL) {
+        return 1;
+    }
+    int result = 0;
+    char * saveptr = NULL;
+    for (char * token = strtok_r(copy, " \t;", &saveptr); token != NULL && result == 0;
+            token = strtok_r(NULL, " \t;", &saveptr)) {
+        char * value = strchr(token, '=');
+        if (value == NULL) {
+            result = 1;
+            break;
+        }
+        *value++ = '\0';
+        int number;
+        if (strcmp(token, "cpus") == 0) {
+            result = ThreadPolicy_parse_cpus(value, &(policy->cpu_mask));
+        } else if (strcmp(token, "nice") == 0) {
+            result = parse_int(value, &(policy->nice));
+        } else if (strcmp(token, "priority") == 0) {
+            result = parse_int(value, &(policy->priority));
+        } else if (strcmp(token, "sched") == 0) {
+            if (strcmp(value, "fifo") == 0) {
+                policy->scheduler = THREAD_SCHEDULER_FIFO;
+            } else if (strcmp(value, "rr") == 0) {
+                policy->scheduler = THREAD_SCHEDULER_RR;
+            } else if (strcmp(value, "other") == 0) {
+                policy->scheduler = THREAD_SCHEDULER_OTHER;
+            } else {
+                result = 1;
+            }
+        } else if (strcmp(token, "lock") == 0 && parse_int(value, &number) == 0) {
+            policy->memory = number ? policy->memory | THREAD_POLICY_LOCK_MEMORY :
+                    policy->memory & ~THREAD_POLICY_LOCK_MEMORY;
+        } else if (strcmp(token, "hugepages") == 0 && parse_int(value, &number) == 0) {
+            policy->memory = number ? policy->memory | THREAD_POLICY_HUGE_PAGES :
+                    policy->memory & ~THREAD_POLICY_HUGE_PAGES;
+        } else {
+            result = 1;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+
+int ThreadPolicy_apply(const ThreadPolicy * policy, ThreadPolicyReport * report)
+{
+    int result = 0;
+    pthread_t self = pthread_self();
+    memset(report, 0, sizeof(ThreadPolicyReport));
+    report->tid = current_tid();
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (policy->cpu_mask != 0) {
+        for (int i = 0; i < THREAD_POLICY_MAX_CPUS; i++) {
+            if (policy->cpu_mask & (1ULL << i)) {
+                CPU_SET(i, &cpus);
+            }
+        }
+    } else {
+        // back to every CPU the process may use
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+    }
+    if (pthread_setaffinity_np(self, sizeof(cpus), &cpus)) {
+        result = 1;
+    }
+#endif
+
+    struct sched_param param;
+    if (policy->scheduler != THREAD_SCHEDULER_OTHER) {
+        int native = native_scheduler(policy->scheduler);
+        param.sched_priority = clamp_priority(native, policy->priority);
+        // needs CAP_SYS_NICE or an RLIMIT_RTPRIO, which most desktops don't grant
+        if (pthread_setschedparam(self, native, &param)) {
+            report->fell_back = 1;
+            result = 1;
+        }
+    }
+    if (policy->scheduler == THREAD_SCHEDULER_OTHER || report->fell_back) {
+        int current;
+        if (pthread_getschedparam(self, &current, &param) == 0 && current != SCHED_OTHER) {
+            param.sched_priority = 0;
+            pthread_setschedparam(self, SCHED_OTHER, &param);
+        }
+#ifdef __linux__
+        // nice is per thread on Linux; elsewhere it would renice all of OBS
+        if (setpriority(PRIO_PROCESS, report->tid, policy->nice)) {
+            result = 1;
+        }
+#endif
+    }
+
+    read_back(report);
+    return result;
+}
+
+
+void ThreadPolicy_describe(const ThreadPolicyReport * report, char * buffer, size_t size)
+{
+    int length;
+    if (report->scheduler == THREAD_SCHEDULER_OTHER) {
+        length = snprintf(buffer, size, "thread %d: nice %d%s, cpus ", (int)report->tid, report->nice,
+                          report->fell_back ? " (realtime refused)" : "");
+    } else {
+        length = snprintf(buffer, size, "thread %d: %s priority %d, cpus ", (int)report->tid,
+                          report->scheduler == THREAD_SCHEDULER_FIFO ? "fifo" : "rr", report->priority);
+    }
+    if (length < 0 || (size_t)length >= size) {
+        return;
+    }
+    describe_cpus(report->cpu_mask, buffer + length, size - length);
+}
+
+
+pid_t current_tid(void)
+{
+#ifdef __linux__
+    return (pid_t)syscall(SYS_gettid);
+#else
+    return getpid();
+#endif
+}
+
+
+int native_scheduler(enum ThreadScheduler scheduler)
+{
+    switch (scheduler) {
+        case THREAD_SCHEDULER_FIFO:
+            return SCHED_FIFO;
+        case THREAD_SCHEDULER_RR:
+            return SCHED_RR;
+        default:
+            return SCHED_OTHER;
+    }
+}
+
+
+int clamp_priority(int native, int priority)
+{
+    int min = sched_get_priority_min(native);
+    int max = sched_get_priority_max(native);
+    if (priority < min) {
+        return min;
+    }
+    if (priority > max) {
+        return max;
+    }
+    return priority;
+}
+
+
+void read_back(ThreadPolicyReport * report)
+{
+    int native;
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(), &native, &param) == 0) {
+        report->scheduler = native == SCHED_FIFO ? THREAD_SCHEDULER_FIFO :
+                native == SCHED_RR ? THREAD_SCHEDULER_RR : THREAD_SCHEDULER_OTHER;
+        report->priority = param.sched_priority;
+    }
+#ifdef __linux__
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, report->tid);
+    if (errno == 0) {
+        report->nice = nice;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+        for (int i = 0; i < THREAD_POLICY_MAX_CPUS; i++) {
+            if (CPU_ISSET(i, &cpus)) {
+                report->cpu_mask |= 1ULL << i;
+            }
+        }
+    }
+#endif
+}
+
+
+int parse_int(const char * value, int * result)
+{
+    char * end;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0') {
+        return 1;
+    }
+    *result = (int)number;
+    return 0;
+}
+
+
+size_t describe_cpus(uint64_t cpu_mask, char * buffer, size_t size)
+{
+    if (cpu_mask == 0) {
+        return (size_t)snprintf(buffer, size, "unknown");
+    }
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < THREAD_POLICY_MAX_CPUS && length < size; i++) {
+        if (!(cpu_mask & (1ULL << i))) {
+            continue;
+        }
+        int last = i;
+        while (last + 1 < THREAD_POLICY_MAX_CPUS && (cpu_mask & (1ULL << (last + 1)))) {
+            last++;
+        }
+        int written = last > i ?
+                snprintf(buffer + length, size - length, "%s%d-%d", length ? "," : "", i, last) :
+                snprintf(buffer + length, size - length, "%s%d", length ? "," : "", i);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+        i = last;
+    }
+    return length;
+}
@@ -0,0 +1,65 @@
+#ifndef OBS_VIRTUAL_BACKGROUND_THREAD_POLICY_H
+#define OBS_VIRTUAL_BACKGROUND_THREAD_POLICY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define THREAD_POLICY_MAX_CPUS         64
+#define THREAD_POLICY_DESCRIPTION_LENGTH 128
+
+enum ThreadScheduler {
+    THREAD_SCHEDULER_OTHER = 0,
+    THREAD_SCHEDULER_FIFO = 1,
+    THREAD_SCHEDULER_RR = 2
+};
+
+// what frame buffers are allocated as, see ImgArray_set_pinning
+#define THREAD_POLICY_LOCK_MEMORY      1
+#define THREAD_POLICY_HUGE_PAGES       2
+
+
+typedef struct {
+    // bit n allows CPU n, 0 leaves the affinity alone
+    uint64_t cpu_mask;
+    int nice;
+    enum ThreadScheduler scheduler;
+    // realtime priority, clamped to what the scheduler allows
+    int priority;
+    // THREAD_POLICY_* flags for the buffers the threads work on
+    int memory;
+} ThreadPolicy;
+
+
+// what a thread actually ended up with, read back after applying a policy
+typedef struct {
+    uint64_t generation;
+    pid_t tid;
+    uint64_t cpu_mask;
+    int nice;
+    enum ThreadScheduler scheduler;
+    int priority;
+    // a realtime scheduler was asked for but refused, nice was used instead
+    uint8_t fell_back;
+} ThreadPolicyReport;
+
+
+// the default policy changes nothing
+void ThreadPolicy_init(ThreadPolicy * policy);
+int ThreadPolicy_is_default(const ThreadPolicy * policy);
+int ThreadPolicy_equals(const ThreadPolicy * a, const ThreadPolicy * b);
+
+// "0-3,6" style CPU lists; returns non-zero on anything it can't parse
+int ThreadPolicy_parse_cpus(const char * list, uint64_t * cpu_mask);
+// Space separated key=value pairs: cpus=2-3 nice=-5 sched=fifo priority=10
+// lock=1 hugepages=1. Unknown keys are an error.
+int ThreadPolicy_parse(const char * spec, ThreadPolicy * policy);
+
+// Applies policy to the calling thread and fills in report. Failing to get a
+// realtime scheduler falls back to nice; returns non-zero if anything asked
+// for could not be applied.
+int ThreadPolicy_apply(const ThreadPolicy * policy, ThreadPolicyReport * report);
+void ThreadPolicy_describe(const ThreadPolicyReport * report, char * buffer, size_t size);
+
+
+#endif //OBS_VIRTUAL_BACKGROUND_THREAD_POLICY_H
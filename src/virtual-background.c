@@ -2,6 +2,7 @@
 #include <graphics/image-file.h>
 #include <graphics/graphics.h>
 #include <util/dstr.h>
+#include <util/platform.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -15,16 +16,95 @@ extern int errno ;
 #define SETTING_BLUR                   "blur"
 #define SETTING_GROWSHRINK             "growshrink"
 #define SETTING_SEGMENTATION_THRESHOLD "segmentation_threshold"
+#define SETTING_ALIGN_MASKS            "align_masks"
+#define SETTING_LATENCY_BUDGET         "latency_budget"
+#define SETTING_CPU_COMPOSITE          "cpu_composite"
+#define SETTING_AUTOTUNE               "autotune"
+#define SETTING_TARGET_MASK_AGE        "target_mask_age"
+#define SETTING_MIN_WIDTH              "min_width"
+#define SETTING_MAX_WIDTH              "max_width"
+#define SETTING_SUPERVISE_SERVER       "supervise_server"
+#define SETTING_SERVER_COMMAND         "server_command"
+#define SETTING_THREAD_CPUS            "thread_cpus"
+#define SETTING_THREAD_NICE            "thread_nice"
+#define SETTING_THREAD_SCHEDULER       "thread_scheduler"
+#define SETTING_THREAD_PRIORITY        "thread_priority"
+#define SETTING_LOCK_FRAME_BUFFERS     "lock_frame_buffers"
+#define SETTING_HUGE_PAGES             "huge_pages"
+#define SETTING_BATCH_FRAMES           "batch_frames"
+#define SETTING_BATCH_WINDOW           "batch_window"
+#define SETTING_MAX_BATCH              "max_batch"
+#define SETTING_MAX_MASK_AGE           "max_mask_age"
+#define SETTING_DUAL_RATE              "dual_rate"
+#define SETTING_COARSE_DIVISOR         "coarse_divisor"
+#define SETTING_COARSE_RATE            "coarse_rate"
+#define SETTING_FINE_RATE              "fine_rate"
+#define SETTING_DISTANCE_FIELD         "distance_field"
 
 
 #define TEXT_BLUR                     obs_module_text("Blur")
 #define TEXT_GROWSHRINK               obs_module_text("GrowShrink")
 #define TEXT_SEGMENTATION_THRESHOLD   obs_module_text("SegmentationThreshold")
+#define TEXT_ALIGN_MASKS              obs_module_text("AlignMasks")
+#define TEXT_LATENCY_BUDGET           obs_module_text("LatencyBudget")
+#define TEXT_CPU_COMPOSITE            obs_module_text("CpuComposite")
+#define TEXT_AUTOTUNE                 obs_module_text("Autotune")
+#define TEXT_TARGET_MASK_AGE          obs_module_text("TargetMaskAge")
+#define TEXT_MIN_WIDTH                obs_module_text("MinWidth")
+#define TEXT_MAX_WIDTH                obs_module_text("MaxWidth")
+#define TEXT_SUPERVISE_SERVER         obs_module_text("SuperviseServer")
+#define TEXT_SERVER_COMMAND           obs_module_text("ServerCommand")
+#define TEXT_THREAD_CPUS              obs_module_text("ThreadCpus")
+#define TEXT_THREAD_NICE              obs_module_text("ThreadNice")
+#define TEXT_THREAD_SCHEDULER         obs_module_text("ThreadScheduler")
+#define TEXT_SCHEDULER_NORMAL         obs_module_text("SchedulerNormal")
+#define TEXT_SCHEDULER_FIFO           obs_module_text("SchedulerFifo")
+#define TEXT_SCHEDULER_RR             obs_module_text("SchedulerRoundRobin")
+#define TEXT_THREAD_PRIORITY          obs_module_text("ThreadPriority")
+#define TEXT_LOCK_FRAME_BUFFERS       obs_module_text("LockFrameBuffers")
+#define TEXT_HUGE_PAGES               obs_module_text("HugePages")
+#define TEXT_BATCH_FRAMES             obs_module_text("BatchFrames")
+#define TEXT_BATCH_WINDOW             obs_module_text("BatchWindow")
+#define TEXT_MAX_BATCH                obs_module_text("MaxBatch")
+#define TEXT_MAX_MASK_AGE             obs_module_text("MaxMaskAge")
+#define TEXT_DUAL_RATE                obs_module_text("DualRate")
+#define TEXT_COARSE_DIVISOR           obs_module_text("CoarseDivisor")
+#define TEXT_COARSE_RATE              obs_module_text("CoarseRate")
+#define TEXT_FINE_RATE                obs_module_text("FineRate")
+#define TEXT_DISTANCE_FIELD           obs_module_text("DistanceField")
+
+#define DELAY_STATS_INTERVAL_NS       10000000000ULL
+#define MAX_COMPOSITE_THREADS         4
+#define CACHE_STATS_INTERVAL_NS       60000000000ULL
+// frames are scaled down to this until the first mask is back
+#define FIRST_MASK_WIDTH              160
+// module-wide thread policy, see ThreadPolicy_parse
+#define THREAD_POLICY_ENV             "VIRTUAL_BACKGROUND_THREAD_POLICY"
 
 
 
 /* clang-format on */
 
+// shared by every instance for the CPU compositing kernels and sliced scaling
+static TaskPool *composite_tasks = NULL;
+// lets filters on the same source segment each frame once
+static MaskCache *mask_cache = NULL;
+static uint64_t last_cache_stats_timestamp = 0;
+// one server for every filter that asks for it, started by the first
+static pthread_mutex_t supervisor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ServerSupervisor *server_supervisor = NULL;
+static int supervisor_refs = 0;
+// from THREAD_POLICY_ENV, for the task pool and filters without their own
+static ThreadPolicy module_policy;
+static uint64_t logged_task_policy_generation = 0;
+// batches frames of every filter that opts in into multi-frame requests
+static SegmentationBatcher *segmentation_batcher = NULL;
+
+// every filter draws with the same effect, compiled by the first one
+static pthread_mutex_t effect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gs_effect_t *shared_effect = NULL;
+static int effect_refs = 0;
+
 
 static const char *virtual_background_get_name(void *unused)
 {
@@ -32,24 +112,232 @@ static const char *virtual_background_get_name(void *unused)
     return obs_module_text("VirtualBackgroundName");
 }
 
+static void log_supervisor_stats(ServerSupervisor *supervisor)
+{
+    SupervisorStats stats;
+    ServerSupervisor_get_stats(supervisor, &stats);
+    blog(LOG_INFO, "[virtual-background] segmentation server: %llu starts, %llu crashes, "
+                   "%llu planned restarts, %s, first start %llu ms, last restart %llu ms, slowest restart %llu ms",
+         (unsigned long long)stats.starts,
+         (unsigned long long)stats.crashes,
+         (unsigned long long)stats.planned_restarts,
+         stats.ready ? "ready" : "not ready",
+         (unsigned long long)(stats.first_start_latency_ns / 1000000ULL),
+         (unsigned long long)(stats.last_restart_latency_ns / 1000000ULL),
+         (unsigned long long)(stats.max_restart_latency_ns / 1000000ULL));
+}
+
+static void acquire_supervisor(struct virtual_background_data *filter, const char *command)
+{
+    pthread_mutex_lock(&supervisor_mutex);
+    if (server_supervisor == NULL) {
+        server_supervisor = ServerSupervisor_create(command);
+        if (server_supervisor == NULL) {
+            blog(LOG_WARNING, "[virtual-background] could not supervise \"%s\"", command);
+        } else {
+            blog(LOG_INFO, "[virtual-background] supervising \"%s\" on %s", command,
+                 ServerSupervisor_get_socket_path(server_supervisor));
+            if (segmentation_batcher) {
+                SegmentationPool_set_server_socket(SegmentationBatcher_get_pool(segmentation_batcher),
+                                                   ServerSupervisor_get_socket_path(server_supervisor));
+            }
+        }
+    } else if (strcmp(command, ServerSupervisor_get_command(server_supervisor)) != 0) {
+        blog(LOG_WARNING, "[virtual-background] already supervising \"%s\", not starting \"%s\"",
+             ServerSupervisor_get_command(server_supervisor), command);
+    }
+    if (server_supervisor != NULL) {
+        supervisor_refs++;
+        filter->supervised = 1;
+        SegmentationThread_set_server_socket(filter->thread, ServerSupervisor_get_socket_path(server_supervisor));
+    }
+    pthread_mutex_unlock(&supervisor_mutex);
+}
+
+static void release_supervisor(struct virtual_background_data *filter)
+{
+    if (!filter->supervised) {
+        return;
+    }
+    if (filter->thread) {
+        SegmentationThread_set_server_socket(filter->thread, NULL);
+    }
+    filter->supervised = 0;
+    pthread_mutex_lock(&supervisor_mutex);
+    if (--supervisor_refs == 0) {
+        log_supervisor_stats(server_supervisor);
+        if (segmentation_batcher) {
+            SegmentationPool_set_server_socket(SegmentationBatcher_get_pool(segmentation_batcher), NULL);
+        }
+        ServerSupervisor_destroy(server_supervisor);
+        server_supervisor = NULL;
+    }
+    pthread_mutex_unlock(&supervisor_mutex);
+}
+
+// compiles the effect for the first filter, and again after a failed attempt
+static void acquire_effect(struct virtual_background_data *filter)
+{
+    pthread_mutex_lock(&effect_mutex);
+    if (effect_refs == 0) {
+        char *effect_path = obs_module_file("virtual-background.effect");
+        obs_enter_graphics();
+        shared_effect = gs_effect_create_from_file(effect_path, NULL);
+        obs_leave_graphics();
+        bfree(effect_path);
+        if (shared_effect == NULL) {
+            blog(LOG_ERROR, "[virtual-background] could not compile virtual-background.effect");
+        }
+    }
+    if (shared_effect != NULL) {
+        effect_refs++;
+        filter->effect = shared_effect;
+    }
+    pthread_mutex_unlock(&effect_mutex);
+}
+
+static void release_effect(struct virtual_background_data *filter)
+{
+    if (filter->effect == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&effect_mutex);
+    if (--effect_refs == 0) {
+        obs_enter_graphics();
+        gs_effect_destroy(shared_effect);
+        obs_leave_graphics();
+        shared_effect = NULL;
+    }
+    pthread_mutex_unlock(&effect_mutex);
+    filter->effect = NULL;
+}
+
+static void read_thread_policy(struct virtual_background_data *filter, obs_data_t *settings, ThreadPolicy *policy)
+{
+    ThreadPolicy_init(policy);
+    const char *cpus = obs_data_get_string(settings, SETTING_THREAD_CPUS);
+    if (cpus != NULL && cpus[0] != '\0' && ThreadPolicy_parse_cpus(cpus, &policy->cpu_mask)) {
+        blog(LOG_WARNING, "[virtual-background] '%s': ignoring CPU list \"%s\"",
+             obs_source_get_name(filter->context), cpus);
+    }
+    policy->nice = (int)obs_data_get_int(settings, SETTING_THREAD_NICE);
+    policy->scheduler = (enum ThreadScheduler)obs_data_get_int(settings, SETTING_THREAD_SCHEDULER);
+    policy->priority = (int)obs_data_get_int(settings, SETTING_THREAD_PRIORITY);
+    if (policy->scheduler == THREAD_SCHEDULER_OTHER) {
+        // only meaningful with a realtime scheduler, don't let it count as a change
+        policy->priority = 0;
+    }
+    if (obs_data_get_bool(settings, SETTING_LOCK_FRAME_BUFFERS)) {
+        policy->memory |= THREAD_POLICY_LOCK_MEMORY;
+    }
+    if (obs_data_get_bool(settings, SETTING_HUGE_PAGES)) {
+        policy->memory |= THREAD_POLICY_HUGE_PAGES;
+    }
+    if (ThreadPolicy_is_default(policy)) {
+        *policy = module_policy;
+    }
+}
+
+static void log_policy_reports(const char *name, const ThreadPolicyReport *reports, int count)
+{
+    char description[THREAD_POLICY_DESCRIPTION_LENGTH];
+    for (int i = 0; i < count; i++) {
+        ThreadPolicy_describe(&reports[i], description, sizeof(description));
+        blog(LOG_INFO, "[virtual-background] %s %s", name, description);
+    }
+}
+
+static void log_thread_policies(struct virtual_background_data *filter)
+{
+    ThreadPolicyReport reports[MAX_SEGMENTATION_WORKERS];
+    uint64_t generation;
+    int applied = SegmentationThread_get_policy_reports(filter->thread, reports, &generation);
+    if (generation != filter->logged_policy_generation && applied == filter->thread->num_workers) {
+        filter->logged_policy_generation = generation;
+        char name[256];
+        snprintf(name, sizeof(name), "'%s' worker", obs_source_get_name(filter->context));
+        log_policy_reports(name, reports, applied);
+    }
+
+    ThreadPolicyReport task_reports[MAX_TASK_POOL_THREADS];
+    applied = TaskPool_get_policy_reports(composite_tasks, task_reports, &generation);
+    if (generation != logged_task_policy_generation && applied == TaskPool_get_parallelism(composite_tasks) - 1) {
+        logged_task_policy_generation = generation;
+        log_policy_reports("task pool", task_reports, applied);
+    }
+}
+
+// Runs for every step of a slider drag, so it only publishes values: the
+// effect is shared and the workers pick parameters up without locking.
 static void virtual_background_update(void *data, obs_data_t *settings)
 {
     struct virtual_background_data *filter = data;
+    uint64_t start = os_gettime_ns();
 
     int blur = (int)obs_data_get_int(settings, SETTING_BLUR);
     int growshrink = (int)obs_data_get_int(settings, SETTING_GROWSHRINK);
     float segmentation_threshold = (float)obs_data_get_double(settings, SETTING_SEGMENTATION_THRESHOLD);
 
-    SegmentationThread_set_parameters(filter->thread, segmentation_threshold, blur, growshrink);
+    filter->distance_field = obs_data_get_bool(settings, SETTING_DISTANCE_FIELD);
+    SegmentationThread_set_distance_field(filter->thread, filter->distance_field);
+    filter->grow = MaskField_grow_for(growshrink);
+    filter->feather = MaskField_feather_for(blur);
+    // the server's masks are then the same whatever the sliders say, cache keys included
+    SegmentationThread_set_parameters(filter->thread, segmentation_threshold,
+                                      filter->distance_field ? 0 : blur,
+                                      filter->distance_field ? 0 : growshrink);
 
-    obs_enter_graphics();
+    filter->align_masks = obs_data_get_bool(settings, SETTING_ALIGN_MASKS);
+    filter->latency_budget_ns = (uint64_t)obs_data_get_int(settings, SETTING_LATENCY_BUDGET) * 1000000ULL;
+    filter->cpu_composite = obs_data_get_bool(settings, SETTING_CPU_COMPOSITE);
+
+    filter->autotune = obs_data_get_bool(settings, SETTING_AUTOTUNE);
+    filter->max_width = (int)obs_data_get_int(settings, SETTING_MAX_WIDTH);
+    ResolutionTuner_configure(
+            filter->tuner,
+            (int)obs_data_get_int(settings, SETTING_MIN_WIDTH),
+            filter->max_width,
+            filter->autotune ? (uint64_t)obs_data_get_int(settings, SETTING_TARGET_MASK_AGE) * 1000000ULL : 0
+    );
 
-    char * effect_path = obs_module_file("virtual-background.effect");
-    gs_effect_destroy(filter->effect);
-    filter->effect = gs_effect_create_from_file(effect_path, NULL);
-    bfree(effect_path);
+    ThreadPolicy policy;
+    read_thread_policy(filter, settings, &policy);
+    SegmentationThread_set_policy(filter->thread, &policy);
 
-    obs_leave_graphics();
+    bool batch_frames = obs_data_get_bool(settings, SETTING_BATCH_FRAMES) && segmentation_batcher != NULL;
+    SegmentationThread_set_batcher(
+            filter->thread,
+            batch_frames ? segmentation_batcher : NULL,
+            (uint64_t)obs_data_get_int(settings, SETTING_BATCH_WINDOW) * 1000000ULL,
+            (int)obs_data_get_int(settings, SETTING_MAX_BATCH)
+    );
+    SegmentationThread_set_max_mask_age(filter->thread,
+                                        (uint64_t)obs_data_get_int(settings, SETTING_MAX_MASK_AGE) * 1000000ULL);
+
+    int coarse_rate = (int)obs_data_get_int(settings, SETTING_COARSE_RATE);
+    int fine_rate = (int)obs_data_get_int(settings, SETTING_FINE_RATE);
+    SegmentationThread_set_dual_rate(
+            filter->thread,
+            obs_data_get_bool(settings, SETTING_DUAL_RATE) ? (int)obs_data_get_int(settings, SETTING_COARSE_DIVISOR) : 1,
+            coarse_rate > 0 ? 1000000000ULL / coarse_rate : 0,
+            fine_rate > 0 ? 1000000000ULL / fine_rate : 0
+    );
+
+    const char *server_command = obs_data_get_string(settings, SETTING_SERVER_COMMAND);
+    bool supervise = obs_data_get_bool(settings, SETTING_SUPERVISE_SERVER) &&
+            server_command != NULL && server_command[0] != '\0';
+    if (supervise && !filter->supervised && filter->thread) {
+        acquire_supervisor(filter, server_command);
+    } else if (!supervise) {
+        release_supervisor(filter);
+    }
+
+    uint64_t elapsed = os_gettime_ns() - start;
+    filter->updates++;
+    filter->update_ns += elapsed;
+    if (elapsed > filter->longest_update_ns) {
+        filter->longest_update_ns = elapsed;
+    }
 }
 
 static void virtual_background_defaults(obs_data_t *settings)
@@ -57,6 +345,30 @@ static void virtual_background_defaults(obs_data_t *settings)
     obs_data_set_default_int(settings, SETTING_BLUR, 4);
     obs_data_set_default_int(settings, SETTING_GROWSHRINK, 0);
     obs_data_set_default_double(settings, SETTING_SEGMENTATION_THRESHOLD, 0.6);
+    obs_data_set_default_bool(settings, SETTING_DISTANCE_FIELD, false);
+    obs_data_set_default_bool(settings, SETTING_ALIGN_MASKS, false);
+    obs_data_set_default_int(settings, SETTING_LATENCY_BUDGET, 200);
+    obs_data_set_default_bool(settings, SETTING_CPU_COMPOSITE, false);
+    obs_data_set_default_bool(settings, SETTING_AUTOTUNE, false);
+    obs_data_set_default_int(settings, SETTING_TARGET_MASK_AGE, 100);
+    obs_data_set_default_int(settings, SETTING_MIN_WIDTH, 160);
+    obs_data_set_default_int(settings, SETTING_MAX_WIDTH, MAX_WIDTH);
+    obs_data_set_default_bool(settings, SETTING_SUPERVISE_SERVER, false);
+    obs_data_set_default_string(settings, SETTING_SERVER_COMMAND, "");
+    obs_data_set_default_string(settings, SETTING_THREAD_CPUS, "");
+    obs_data_set_default_int(settings, SETTING_THREAD_NICE, 0);
+    obs_data_set_default_int(settings, SETTING_THREAD_SCHEDULER, THREAD_SCHEDULER_OTHER);
+    obs_data_set_default_int(settings, SETTING_THREAD_PRIORITY, 1);
+    obs_data_set_default_bool(settings, SETTING_LOCK_FRAME_BUFFERS, false);
+    obs_data_set_default_bool(settings, SETTING_HUGE_PAGES, false);
+    obs_data_set_default_bool(settings, SETTING_BATCH_FRAMES, false);
+    obs_data_set_default_int(settings, SETTING_BATCH_WINDOW, BATCHER_DEFAULT_WINDOW_NS / 1000000ULL);
+    obs_data_set_default_int(settings, SETTING_MAX_BATCH, BATCHER_DEFAULT_MAX_BATCH);
+    obs_data_set_default_int(settings, SETTING_MAX_MASK_AGE, 500);
+    obs_data_set_default_bool(settings, SETTING_DUAL_RATE, false);
+    obs_data_set_default_int(settings, SETTING_COARSE_DIVISOR, 2);
+    obs_data_set_default_int(settings, SETTING_COARSE_RATE, 0);
+    obs_data_set_default_int(settings, SETTING_FINE_RATE, 5);
 }
 
 static obs_properties_t *virtual_background_properties(void *data)
@@ -68,6 +380,34 @@ static obs_properties_t *virtual_background_properties(void *data)
     obs_properties_add_float_slider(props, SETTING_SEGMENTATION_THRESHOLD, TEXT_SEGMENTATION_THRESHOLD, 0, 1, 0.05);
     obs_properties_add_int_slider(props, SETTING_GROWSHRINK, TEXT_GROWSHRINK, -50, 50, 1);
     obs_properties_add_int_slider(props, SETTING_BLUR, TEXT_BLUR, 0, 25, 1);
+    obs_properties_add_bool(props, SETTING_DISTANCE_FIELD, TEXT_DISTANCE_FIELD);
+    obs_properties_add_bool(props, SETTING_ALIGN_MASKS, TEXT_ALIGN_MASKS);
+    obs_properties_add_int_slider(props, SETTING_LATENCY_BUDGET, TEXT_LATENCY_BUDGET, 0, 1000, 10);
+    obs_properties_add_bool(props, SETTING_CPU_COMPOSITE, TEXT_CPU_COMPOSITE);
+    obs_properties_add_bool(props, SETTING_AUTOTUNE, TEXT_AUTOTUNE);
+    obs_properties_add_int_slider(props, SETTING_TARGET_MASK_AGE, TEXT_TARGET_MASK_AGE, 20, 1000, 10);
+    obs_properties_add_int_slider(props, SETTING_MIN_WIDTH, TEXT_MIN_WIDTH, 64, 1920, 16);
+    obs_properties_add_int_slider(props, SETTING_MAX_WIDTH, TEXT_MAX_WIDTH, 64, 1920, 16);
+    obs_properties_add_bool(props, SETTING_SUPERVISE_SERVER, TEXT_SUPERVISE_SERVER);
+    obs_properties_add_path(props, SETTING_SERVER_COMMAND, TEXT_SERVER_COMMAND, OBS_PATH_FILE, NULL, NULL);
+    obs_properties_add_text(props, SETTING_THREAD_CPUS, TEXT_THREAD_CPUS, OBS_TEXT_DEFAULT);
+    obs_properties_add_int_slider(props, SETTING_THREAD_NICE, TEXT_THREAD_NICE, -20, 19, 1);
+    obs_property_t *scheduler = obs_properties_add_list(props, SETTING_THREAD_SCHEDULER, TEXT_THREAD_SCHEDULER,
+                                                        OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(scheduler, TEXT_SCHEDULER_NORMAL, THREAD_SCHEDULER_OTHER);
+    obs_property_list_add_int(scheduler, TEXT_SCHEDULER_FIFO, THREAD_SCHEDULER_FIFO);
+    obs_property_list_add_int(scheduler, TEXT_SCHEDULER_RR, THREAD_SCHEDULER_RR);
+    obs_properties_add_int_slider(props, SETTING_THREAD_PRIORITY, TEXT_THREAD_PRIORITY, 1, 99, 1);
+    obs_properties_add_bool(props, SETTING_LOCK_FRAME_BUFFERS, TEXT_LOCK_FRAME_BUFFERS);
+    obs_properties_add_bool(props, SETTING_HUGE_PAGES, TEXT_HUGE_PAGES);
+    obs_properties_add_bool(props, SETTING_BATCH_FRAMES, TEXT_BATCH_FRAMES);
+    obs_properties_add_int_slider(props, SETTING_BATCH_WINDOW, TEXT_BATCH_WINDOW, 0, 33, 1);
+    obs_properties_add_int_slider(props, SETTING_MAX_BATCH, TEXT_MAX_BATCH, 1, MAX_SEGMENTATION_BATCH, 1);
+    obs_properties_add_int_slider(props, SETTING_MAX_MASK_AGE, TEXT_MAX_MASK_AGE, 0, 2000, 10);
+    obs_properties_add_bool(props, SETTING_DUAL_RATE, TEXT_DUAL_RATE);
+    obs_properties_add_int_slider(props, SETTING_COARSE_DIVISOR, TEXT_COARSE_DIVISOR, 2, 8, 1);
+    obs_properties_add_int_slider(props, SETTING_COARSE_RATE, TEXT_COARSE_RATE, 0, 60, 1);
+    obs_properties_add_int_slider(props, SETTING_FINE_RATE, TEXT_FINE_RATE, 1, 30, 1);
     return props;
 }
 
@@ -77,52 +417,209 @@ static void *virtual_background_create(obs_data_t *settings, obs_source_t *conte
             bzalloc(sizeof(struct virtual_background_data));
     filter->context = context;
     filter->thread = SegmentationThread_create();
+    if (filter->thread) {
+        SegmentationThread_set_cache(filter->thread, mask_cache);
+    }
     filter->scaler = ImageScaler_create();
+    if (filter->scaler) {
+        ImageScaler_set_task_pool(filter->scaler, composite_tasks);
+    }
+    filter->tuner = ResolutionTuner_create();
     filter->mask = ImgArray_create();
+    filter->delay_queue = DelayQueue_create();
+    filter->frame_compositor = FrameCompositor_create(composite_tasks);
+    filter->field_alpha = ImgArray_create();
+    pthread_mutex_init(&filter->mask_mutex, NULL);
+    pthread_mutex_init(&filter->frame_mutex, NULL);
+    acquire_effect(filter);
     obs_source_update(context, settings);
     return filter;
 }
 
+static void log_delay_stats(struct virtual_background_data *filter)
+{
+    blog(LOG_INFO, "[virtual-background] aligned frames: %llu on time, %llu without mask, %llu late, "
+                   "%llu skipped to catch up",
+         (unsigned long long)filter->delay_queue->released_on_time,
+         (unsigned long long)filter->delay_queue->released_no_mask,
+         (unsigned long long)filter->delay_queue->released_late,
+         (unsigned long long)filter->delay_queue->released_skipped);
+}
+
+// logs only when something was dropped since the last time
+static void log_deadline_stats(struct virtual_background_data *filter)
+{
+    DeadlineStats stats;
+    SegmentationThread_get_deadline_stats(filter->thread, &stats);
+    if (memcmp(&stats, &filter->logged_deadline_stats, sizeof(DeadlineStats)) == 0) {
+        return;
+    }
+    blog(LOG_INFO, "[virtual-background] deadlines for '%s': %llu expired before sending, "
+                   "%llu dropped by the server, %llu late masks",
+         obs_source_get_name(filter->context),
+         (unsigned long long)stats.expired,
+         (unsigned long long)stats.dropped_by_server,
+         (unsigned long long)stats.late_masks);
+    filter->logged_deadline_stats = stats;
+}
+
+// logs only when masks came back since the last time
+static void log_dual_rate_stats(struct virtual_background_data *filter)
+{
+    DualRateStats stats;
+    SegmentationThread_get_dual_rate_stats(filter->thread, &stats);
+    if (stats.coarse.masks + stats.fine.masks ==
+            filter->logged_dual_rate_stats.coarse.masks + filter->logged_dual_rate_stats.fine.masks) {
+        return;
+    }
+    blog(LOG_INFO, "[virtual-background] dual-rate for '%s': %llu of %llu low resolution masks "
+                   "(%.1f ms average), %llu of %llu full resolution masks (%.1f ms average), %llu fused",
+         obs_source_get_name(filter->context),
+         (unsigned long long)stats.coarse.masks,
+         (unsigned long long)stats.coarse.frames,
+         stats.coarse.masks ? (double)stats.coarse.latency_ns / (double)stats.coarse.masks / 1000000.0 : 0.0,
+         (unsigned long long)stats.fine.masks,
+         (unsigned long long)stats.fine.frames,
+         stats.fine.masks ? (double)stats.fine.latency_ns / (double)stats.fine.masks / 1000000.0 : 0.0,
+         (unsigned long long)stats.fused);
+    filter->logged_dual_rate_stats = stats;
+}
+
+// logs only when the settings changed since the last time
+static void log_update_stats(struct virtual_background_data *filter)
+{
+    if (filter->updates == filter->logged_updates) {
+        return;
+    }
+    blog(LOG_INFO, "[virtual-background] settings updates for '%s': %llu, %.1f us average, %.1f us longest",
+         obs_source_get_name(filter->context),
+         (unsigned long long)filter->updates,
+         (double)filter->update_ns / (double)filter->updates / 1000.0,
+         filter->longest_update_ns / 1000.0);
+    filter->logged_updates = filter->updates;
+}
+
+static void log_cache_stats(void)
+{
+    MaskCacheStats stats;
+    MaskCache_get_stats(mask_cache, &stats);
+    blog(LOG_INFO, "[virtual-background] mask cache: %llu hits, %llu misses, %llu waits, %llu evictions, "
+                   "%d masks in %zu bytes",
+         (unsigned long long)stats.hits,
+         (unsigned long long)stats.misses,
+         (unsigned long long)stats.waits,
+         (unsigned long long)stats.evictions,
+         stats.entries,
+         stats.bytes);
+}
+
+static void log_batcher_stats(void)
+{
+    BatcherStats stats;
+    SegmentationBatcher_get_stats(segmentation_batcher, &stats);
+    if (stats.frames == 0) {
+        return;
+    }
+    blog(LOG_INFO, "[virtual-background] batcher: %llu frames in %llu batches (%.2f per batch), "
+                   "%llu sent singly, %llu failed, %llu expired, %llu dropped by the server, "
+                   "%.2f ms average wait",
+         (unsigned long long)stats.frames,
+         (unsigned long long)stats.batches,
+         (double)stats.frames / (double)stats.batches,
+         (unsigned long long)stats.single_requests,
+         (unsigned long long)stats.failures,
+         (unsigned long long)stats.expired,
+         (unsigned long long)stats.dropped,
+         (double)stats.gather_ns / (double)stats.frames / 1000000.0);
+}
+
+static void flush_delay_queue(struct virtual_background_data *filter)
+{
+    obs_source_t *parent = obs_filter_get_parent(filter->context);
+    struct obs_source_frame *frame;
+    while ((frame = DelayQueue_pop(filter->delay_queue)) != NULL) {
+        obs_source_release_frame(parent, frame);
+    }
+}
+
 static void virtual_background_destroy(void *data)
 {
     struct virtual_background_data *filter = data;
 
+    if (filter->delay_queue->released_on_time + filter->delay_queue->released_no_mask +
+            filter->delay_queue->released_late + filter->delay_queue->released_skipped > 0) {
+        log_delay_stats(filter);
+    }
+    if (filter->thread) {
+        log_deadline_stats(filter);
+        log_dual_rate_stats(filter);
+    }
+    log_update_stats(filter);
+    flush_delay_queue(filter);
+
     obs_enter_graphics();
-    gs_effect_destroy(filter->effect);
     gs_texture_destroy(filter->target);
     obs_leave_graphics();
+    release_effect(filter);
     ImageScaler_destroy(filter->scaler);
     SegmentationThread_destroy(filter->thread);
+    // only once the thread can't reach the server any more
+    filter->thread = NULL;
+    release_supervisor(filter);
     ImgArray_destroy(filter->mask);
+    DelayQueue_destroy(filter->delay_queue);
+    FrameCompositor_destroy(filter->frame_compositor);
+    ImgArray_destroy(filter->field_alpha);
+    ResolutionTuner_destroy(filter->tuner);
+    pthread_mutex_destroy(&filter->mask_mutex);
+    pthread_mutex_destroy(&filter->frame_mutex);
     bfree(filter);
 }
 
 
-static void virtual_background_tick(void *data, float seconds)
+// CPU compositing needs the raw frames, which only async sources hand us
+static bool use_cpu_composite(struct virtual_background_data *filter)
 {
-    struct virtual_background_data *filter = data;
-    const uint8_t * last_frame = ImageScaler_get_buffer(filter->scaler);
-    if (last_frame == NULL) {
-        return;
+    if (!filter->cpu_composite || filter->frame_compositor == NULL) {
+        return false;
     }
+    obs_source_t *parent = obs_filter_get_parent(filter->context);
+    return parent != NULL && (obs_source_get_output_flags(parent) & OBS_SOURCE_ASYNC) != 0;
+}
 
-    int height = ImageScaler_get_new_height(filter->scaler);
-    int width = ImageScaler_get_new_width(filter->scaler);
-
-    SegmentationThread_set_dimensions(filter->thread, height, width);
-    int rc = SegmentationThread_get_mask(filter->thread, filter->mask);
-    if (rc != 0) {
-        return;
+// Copies the mask of the frame stamped timestamp, or the latest for 0, into
+// filter->mask: its distance field as the workers encoded it when that is
+// on, so nothing here builds one. Called with mask_mutex held.
+static int fetch_mask(struct virtual_background_data *filter, uint64_t timestamp)
+{
+    int is_field = filter->distance_field;
+    int rc;
+    if (timestamp != 0) {
+        rc = is_field ?
+                SegmentationThread_get_field_for_timestamp(filter->thread, timestamp, filter->mask,
+                                                           &filter->mask_height, &filter->mask_width) :
+                SegmentationThread_get_mask_for_timestamp(filter->thread, timestamp, filter->mask,
+                                                          &filter->mask_height, &filter->mask_width);
+    } else {
+        rc = is_field ?
+                SegmentationThread_get_field(filter->thread, filter->mask, &filter->mask_height, &filter->mask_width) :
+                SegmentationThread_get_mask(filter->thread, filter->mask, &filter->mask_height, &filter->mask_width);
     }
+    if (rc == 0) {
+        filter->mask_is_field = is_field;
+    }
+    return rc;
+}
 
+// the mask itself, or its encoded distance field
+static void upload_mask(struct virtual_background_data *filter, const uint8_t *mask, int height, int width)
+{
     if (ImgArray_get_size(filter->mask) != width * height) {
         fprintf(stderr, "Invalid mask size from server: %zu. expected %d\n",
                 ImgArray_get_size(filter->mask), width * height);
         return;
     }
 
-    uint8_t * mask = ImgArray_get_buffer(filter->mask);
-
     obs_enter_graphics();
     if (filter->target == NULL || filter->target_height != height || filter->target_width != width) {
         if (filter->target != NULL) {
@@ -136,19 +633,192 @@ static void virtual_background_tick(void *data, float seconds)
                 (const uint8_t **) &mask,
                 0
         );
+        filter->target_height = height;
+        filter->target_width = width;
     }
     gs_texture_set_image(filter->target, mask, width, 0);
     obs_leave_graphics();
 }
 
 
+static size_t memory_usage(struct virtual_background_data *filter)
+{
+    size_t result = sizeof(struct virtual_background_data) +
+            (size_t)ImageScaler_get_buffer_size(filter->scaler) +
+            ImgArray_get_size(filter->mask) +
+            SegmentationThread_get_memory_usage(filter->thread) +
+            FrameCompositor_get_memory_usage(filter->frame_compositor) +
+            ImgArray_get_size(filter->field_alpha);
+    if (filter->target != NULL) {
+        result += (size_t)filter->target_width * filter->target_height;
+    }
+    return result;
+}
+
+// runs on the graphics thread once the workers are parked, while filter_video
+// may still be handed a frame on the video thread
+static void release_buffers(struct virtual_background_data *filter)
+{
+    pthread_mutex_lock(&filter->frame_mutex);
+    size_t before = memory_usage(filter);
+    flush_delay_queue(filter);
+    ImageScaler_release_buffers(filter->scaler);
+    FrameCompositor_release_buffers(filter->frame_compositor);
+    pthread_mutex_lock(&filter->mask_mutex);
+    ImgArray_clear(filter->mask);
+    filter->aligned_mask_ready = 0;
+    ImgArray_clear(filter->field_alpha);
+    pthread_mutex_unlock(&filter->mask_mutex);
+    obs_enter_graphics();
+    gs_texture_destroy(filter->target);
+    filter->target = NULL;
+    obs_leave_graphics();
+    size_t after = memory_usage(filter);
+    pthread_mutex_unlock(&filter->frame_mutex);
+
+    SuspendStats stats;
+    SegmentationThread_get_suspend_stats(filter->thread, &stats);
+    blog(LOG_INFO, "[virtual-background] suspended '%s': released %zu KB, %zu KB still held",
+         obs_source_get_name(filter->context),
+         (before - after + stats.released_bytes) / 1024,
+         after / 1024);
+    filter->buffers_released = 1;
+}
+
+static void update_visibility(struct virtual_background_data *filter)
+{
+    if (filter->showing || filter->active) {
+        if (!SegmentationThread_is_suspended(filter->thread)) {
+            return;
+        }
+        SegmentationThread_resume(filter->thread);
+        SuspendStats stats;
+        SegmentationThread_get_suspend_stats(filter->thread, &stats);
+        blog(LOG_INFO, "[virtual-background] resumed '%s' after %.1f s, workers used %.2f ms of CPU meanwhile",
+             obs_source_get_name(filter->context),
+             stats.suspended_ns / 1000000000.0,
+             stats.worker_cpu_ns / 1000000.0);
+    } else {
+        SegmentationThread_suspend(filter->thread);
+    }
+}
+
+static void virtual_background_show(void *data)
+{
+    struct virtual_background_data *filter = data;
+    filter->showing = 1;
+    update_visibility(filter);
+}
+
+static void virtual_background_hide(void *data)
+{
+    struct virtual_background_data *filter = data;
+    filter->showing = 0;
+    update_visibility(filter);
+}
+
+static void virtual_background_activate(void *data)
+{
+    struct virtual_background_data *filter = data;
+    filter->active = 1;
+    update_visibility(filter);
+}
+
+static void virtual_background_deactivate(void *data)
+{
+    struct virtual_background_data *filter = data;
+    filter->active = 0;
+    update_visibility(filter);
+}
+
+
+static void virtual_background_tick(void *data, float seconds)
+{
+    struct virtual_background_data *filter = data;
+
+    // every filter ticks on the graphics thread, so one of them logs for all
+    uint64_t now = os_gettime_ns();
+    if (mask_cache && now - last_cache_stats_timestamp > CACHE_STATS_INTERVAL_NS) {
+        if (last_cache_stats_timestamp != 0) {
+            log_cache_stats();
+            if (segmentation_batcher) {
+                log_batcher_stats();
+            }
+            pthread_mutex_lock(&supervisor_mutex);
+            if (server_supervisor != NULL) {
+                log_supervisor_stats(server_supervisor);
+            }
+            pthread_mutex_unlock(&supervisor_mutex);
+        }
+        last_cache_stats_timestamp = now;
+    }
+
+    // the parent isn't known yet in create, so pick up where it stands here
+    obs_source_t *parent = obs_filter_get_parent(filter->context);
+    if (!filter->visibility_known && parent != NULL) {
+        filter->showing = obs_source_showing(parent);
+        filter->active = obs_source_active(parent);
+        filter->visibility_known = 1;
+        update_visibility(filter);
+    }
+    if (SegmentationThread_is_suspended(filter->thread)) {
+        if (!filter->buffers_released && SegmentationThread_is_parked(filter->thread)) {
+            release_buffers(filter);
+        }
+        return;
+    }
+    filter->buffers_released = 0;
+    log_thread_policies(filter);
+
+    uint64_t time_to_first_mask;
+    uint64_t first_masks = SegmentationThread_get_time_to_first_mask(filter->thread, &time_to_first_mask);
+    if (first_masks != filter->reported_first_masks) {
+        blog(LOG_INFO, "[virtual-background] first mask for '%s' after %.1f ms",
+             obs_source_get_name(filter->context),
+             time_to_first_mask / 1000000.0);
+        filter->reported_first_masks = first_masks;
+    }
+    if (now - filter->last_deadline_stats_timestamp > DELAY_STATS_INTERVAL_NS) {
+        log_deadline_stats(filter);
+        log_dual_rate_stats(filter);
+        log_update_stats(filter);
+        filter->last_deadline_stats_timestamp = now;
+    }
+
+    const uint8_t * last_frame = ImageScaler_get_buffer(filter->scaler);
+    if (last_frame == NULL) {
+        return;
+    }
+
+    // the mask is already in the frames
+    if (use_cpu_composite(filter)) {
+        return;
+    }
+
+    int rc;
+    pthread_mutex_lock(&filter->mask_mutex);
+    if (filter->align_masks) {
+        // filter_video stages the mask of the frame it just released
+        rc = filter->aligned_mask_ready ? 0 : 1;
+        filter->aligned_mask_ready = 0;
+    } else {
+        rc = fetch_mask(filter, 0);
+    }
+    // right after the setting changes, a mask staged before it would be drawn with the wrong technique
+    if (rc == 0 && filter->mask_is_field == filter->distance_field) {
+        upload_mask(filter, ImgArray_get_buffer(filter->mask), filter->mask_height, filter->mask_width);
+    }
+    pthread_mutex_unlock(&filter->mask_mutex);
+}
+
+
 static void virtual_background_render(void *data, gs_effect_t *effect)
 {
     struct virtual_background_data *filter = data;
     obs_source_t *target = obs_filter_get_target(filter->context);
     gs_eparam_t *param;
 
-    if (!target || !filter->target || !filter->effect) {
+    if (!target || !filter->target || !filter->effect || use_cpu_composite(filter)) {
         obs_source_skip_video_filter(filter->context);
         return;
     }
@@ -160,23 +830,206 @@ static void virtual_background_render(void *data, gs_effect_t *effect)
 
     param = gs_effect_get_param_by_name(filter->effect, "target");
     gs_effect_set_texture(param, filter->target);
-    obs_source_process_filter_end(filter->context, filter->effect, 0, 0);
+    if (filter->distance_field) {
+        // alpha = 0.5 + (distance + grow) / feather, with the distance decoded from the texture
+        float scale = 255.0f / (MASK_FIELD_LEVELS_PER_PIXEL * filter->feather);
+        float offset = 0.5f + (filter->grow - 128.0f / MASK_FIELD_LEVELS_PER_PIXEL) / filter->feather;
+        param = gs_effect_get_param_by_name(filter->effect, "field_scale");
+        gs_effect_set_float(param, scale);
+        param = gs_effect_get_param_by_name(filter->effect, "field_offset");
+        gs_effect_set_float(param, offset);
+        obs_source_process_filter_tech_end(filter->context, filter->effect, 0, 0, "DrawDistanceField");
+    } else {
+        obs_source_process_filter_end(filter->context, filter->effect, 0, 0);
+    }
     UNUSED_PARAMETER(effect);
 }
 
 
+static void log_tuner_decisions(struct virtual_background_data *filter)
+{
+    ResolutionDecision decisions[RESOLUTION_TUNER_LOG_LENGTH];
+    int count;
+    filter->logged_decisions = ResolutionTuner_get_decisions(
+            filter->tuner, filter->logged_decisions, decisions, &count);
+    for (int i = 0; i < count; i++) {
+        blog(LOG_INFO, "[virtual-background] segmentation width %d -> %d, mask age %.1f ms, target %.1f ms",
+             decisions[i].from_width,
+             decisions[i].to_width,
+             decisions[i].latency_ns / 1000000.0,
+             decisions[i].target_ns / 1000000.0);
+    }
+}
+
+// a small first request while there is no mask yet, then the tuner's
+// width when it is on, otherwise default_width
+static int tuned_width(struct virtual_background_data *filter, int default_width)
+{
+    if (!SegmentationThread_has_mask(filter->thread)) {
+        return default_width < FIRST_MASK_WIDTH ? default_width : FIRST_MASK_WIDTH;
+    }
+    if (!filter->autotune) {
+        return default_width;
+    }
+    uint64_t latency_ns;
+    uint64_t samples = SegmentationThread_get_mask_latency(filter->thread, &latency_ns);
+    int width = ResolutionTuner_update(filter->tuner, os_gettime_ns(), latency_ns, samples);
+    if (ResolutionTuner_get_num_decisions(filter->tuner) != filter->logged_decisions) {
+        log_tuner_decisions(filter);
+    }
+    return width;
+}
+
+static void update_scaler_target(struct virtual_background_data *filter)
+{
+    ServerCapabilities capabilities;
+    if (SegmentationThread_get_capabilities(filter->thread, &capabilities) != 0) {
+        // v1 servers take packed BGR and do their own resize
+        filter->pixel_format = PIXEL_FORMAT_BGR24;
+        ImageScaler_set_target(filter->scaler, tuned_width(filter, filter->max_width), 0, 1, AV_PIX_FMT_BGR24);
+        return;
+    }
+
+    // scale once, straight to what the model consumes, unless the tuner is in charge
+    int max_width = capabilities.preferred_width > 0 ? capabilities.preferred_width : filter->max_width;
+    int max_height = filter->autotune ? 0 : capabilities.preferred_height;
+    filter->pixel_format = capabilities.pixel_format;
+    ImageScaler_set_target(
+            filter->scaler,
+            tuned_width(filter, max_width),
+            max_height,
+            capabilities.stride_alignment,
+            capabilities.pixel_format == PIXEL_FORMAT_RGB24 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_BGR24
+    );
+}
+
+static struct obs_source_frame *
+composite_frame(struct virtual_background_data *filter, struct obs_source_frame *frame)
+{
+    struct obs_source_frame *result = frame;
+
+    pthread_mutex_lock(&filter->mask_mutex);
+    // in aligned mode filter->mask already holds the mask of this frame
+    int rc = filter->align_masks ? 0 : fetch_mask(filter, 0);
+    int width = filter->mask_width;
+    int height = filter->mask_height;
+    const uint8_t *mask = ImgArray_get_buffer(filter->mask);
+    if (rc != 0 || width <= 0 || ImgArray_get_size(filter->mask) != (size_t)(width * height)) {
+        mask = NULL;
+    }
+    if (mask != NULL && filter->mask_is_field) {
+        // grow and feather are applied to every frame, the field came built with the mask
+        uint8_t *alpha = ImgArray_ensure_buffer(filter->field_alpha, (size_t)width * height);
+        if (alpha == NULL || MaskField_apply_encoded(mask, (size_t)width * height, filter->grow,
+                                                     filter->feather, alpha) != 0) {
+            alpha = NULL;
+        }
+        mask = alpha;
+    }
+    if (mask != NULL) {
+        result = FrameCompositor_apply(
+                filter->frame_compositor,
+                obs_filter_get_parent(filter->context),
+                frame,
+                mask,
+                width,
+                height
+        );
+    }
+    pthread_mutex_unlock(&filter->mask_mutex);
+    return result;
+}
+
+static struct obs_source_frame *
+delay_frame(struct virtual_background_data *filter, struct obs_source_frame *frame)
+{
+    if (!filter->align_masks) {
+        if (DelayQueue_get_count(filter->delay_queue) > 0) {
+            flush_delay_queue(filter);
+        }
+        return frame;
+    }
+
+    if (DelayQueue_push(filter->delay_queue, frame)) {
+        DelayQueue_record_release(filter->delay_queue, DELAY_RELEASE_LATE);
+        return frame;
+    }
+
+    // after a stall the mask may cover several queued frames; drop all but
+    // the newest of them so the queue gets shallow again
+    uint64_t mask_timestamp = SegmentationThread_get_mask_timestamp(filter->thread);
+    obs_source_t *parent = obs_filter_get_parent(filter->context);
+    struct obs_source_frame *stale;
+    while ((stale = DelayQueue_pop_stale(filter->delay_queue, mask_timestamp)) != NULL) {
+        obs_source_release_frame(parent, stale);
+        DelayQueue_record_release(filter->delay_queue, DELAY_RELEASE_SKIPPED);
+    }
+
+    int expired;
+    struct obs_source_frame *ready = DelayQueue_pop_ready(
+            filter->delay_queue,
+            mask_timestamp,
+            filter->latency_budget_ns,
+            &expired
+    );
+    if (ready == NULL) {
+        return NULL;
+    }
+
+    enum DelayRelease reason;
+    pthread_mutex_lock(&filter->mask_mutex);
+    if (fetch_mask(filter, ready->timestamp) == 0) {
+        filter->aligned_mask_ready = 1;
+        reason = DELAY_RELEASE_ON_TIME;
+    } else {
+        reason = expired ? DELAY_RELEASE_LATE : DELAY_RELEASE_NO_MASK;
+    }
+    pthread_mutex_unlock(&filter->mask_mutex);
+    DelayQueue_record_release(filter->delay_queue, reason);
+
+    if (ready->timestamp - filter->last_stats_timestamp > DELAY_STATS_INTERVAL_NS) {
+        if (filter->last_stats_timestamp != 0) {
+            log_delay_stats(filter);
+        }
+        filter->last_stats_timestamp = ready->timestamp;
+    }
+    return ready;
+}
+
 static struct obs_source_frame *
 virtual_background_filter_video(void *data, struct obs_source_frame *frame)
 {
     struct virtual_background_data *filter = data;
+    pthread_mutex_lock(&filter->frame_mutex);
+    if (SegmentationThread_is_suspended(filter->thread)) {
+        if (DelayQueue_get_count(filter->delay_queue) > 0) {
+            flush_delay_queue(filter);
+        }
+        pthread_mutex_unlock(&filter->frame_mutex);
+        return frame;
+    }
     filter->last_frame_timestamp = frame->timestamp;
+    update_scaler_target(filter);
     ImageScaler_scale_image(filter->scaler, frame);
+    // the geometry goes with the buffer, workers may pick it up right away
+    SegmentationThread_set_dimensions(
+            filter->thread,
+            ImageScaler_get_new_height(filter->scaler),
+            ImageScaler_get_new_width(filter->scaler)
+    );
+    SegmentationThread_set_format(filter->thread, ImageScaler_get_stride(filter->scaler), filter->pixel_format);
     SegmentationThread_update_buffer(
             filter->thread,
             frame->timestamp,
             ImageScaler_get_buffer(filter->scaler),
             ImageScaler_get_buffer_size(filter->scaler)
     );
+
+    frame = delay_frame(filter, frame);
+    if (frame != NULL && use_cpu_composite(filter)) {
+        frame = composite_frame(filter, frame);
+    }
+    pthread_mutex_unlock(&filter->frame_mutex);
     return frame;
 }
 
@@ -195,6 +1048,10 @@ struct obs_source_info virtual_background = {
         .video_render = virtual_background_render,
         .filter_video = virtual_background_filter_video,
         .video_tick = virtual_background_tick,
+        .show = virtual_background_show,
+        .hide = virtual_background_hide,
+        .activate = virtual_background_activate,
+        .deactivate = virtual_background_deactivate,
 };
 
 
@@ -205,6 +1062,17 @@ OBS_MODULE_USE_DEFAULT_LOCALE("virtual_background", "en-US")
 
 bool obs_module_load(void)
 {
+    int cores = os_get_logical_cores();
+    composite_tasks = TaskPool_create(cores < MAX_COMPOSITE_THREADS ? cores : MAX_COMPOSITE_THREADS);
+    ThreadPolicy_init(&module_policy);
+    const char *policy_spec = getenv(THREAD_POLICY_ENV);
+    if (policy_spec != NULL && ThreadPolicy_parse(policy_spec, &module_policy)) {
+        blog(LOG_WARNING, "[virtual-background] ignoring %s=\"%s\"", THREAD_POLICY_ENV, policy_spec);
+        ThreadPolicy_init(&module_policy);
+    }
+    TaskPool_set_policy(composite_tasks, &module_policy);
+    mask_cache = MaskCache_create(MASK_CACHE_DEFAULT_BYTES);
+    segmentation_batcher = SegmentationBatcher_create();
     obs_register_source(&virtual_background);
 
     return true;
@@ -212,4 +1080,17 @@ bool obs_module_load(void)
 
 void obs_module_unload(void)
 {
+    TaskPool_destroy(composite_tasks);
+    composite_tasks = NULL;
+    if (mask_cache) {
+        log_cache_stats();
+        MaskCache_destroy(mask_cache);
+        mask_cache = NULL;
+    }
+    // every filter, and so every thread using it, is gone by now
+    if (segmentation_batcher) {
+        log_batcher_stats();
+        SegmentationBatcher_destroy(segmentation_batcher);
+        segmentation_batcher = NULL;
+    }
 }
\ No newline at end of file
@@ -6,14 +6,23 @@
 #define OBS_VIRTUAL_BACKGROUND_VIRTUAL_BACKGROUND_H
 
 #include <obs-module.h>
+#include <pthread.h>
 #include "scale.h"
 #include "segmentation_thread.h"
 #include "imgarray.h"
+#include "delay_queue.h"
+#include "frame_compositor.h"
+#include "task_pool.h"
+#include "mask_cache.h"
+#include "mask_field.h"
+#include "resolution_tuner.h"
+#include "server_supervisor.h"
 
 struct virtual_background_data {
     uint64_t last_frame_timestamp;
 
     obs_source_t *context;
+    // compiled once for the module, borrowed while the filter exists
     gs_effect_t *effect;
 
     ImgArray *mask;
@@ -24,6 +33,65 @@ struct virtual_background_data {
 
     SegmentationThread *thread;
     ImageScaler *scaler;
+    enum PixelFormat pixel_format;
+
+    // holds async frames back until their own mask arrives
+    uint8_t align_masks;
+    uint64_t latency_budget_ns;
+    DelayQueue *delay_queue;
+    uint8_t aligned_mask_ready;
+    pthread_mutex_t mask_mutex;
+    // held by filter_video on the video thread, and by release_buffers on the
+    // graphics thread while it frees the scaler, delay queue and compositor
+    pthread_mutex_t frame_mutex;
+    uint64_t last_stats_timestamp;
+
+    // bake the mask into async frames instead of a GPU pass
+    uint8_t cpu_composite;
+    FrameCompositor *frame_compositor;
+
+    // segmentation width, fixed at max_width unless the tuner picks it
+    uint8_t autotune;
+    int max_width;
+    ResolutionTuner *tuner;
+    uint64_t logged_decisions;
+
+    // work is suspended while the parent is neither shown nor active
+    uint8_t visibility_known;
+    uint8_t showing;
+    uint8_t active;
+    uint8_t buffers_released;
+
+    // size of filter->mask, which can differ from the scaler's current output
+    int mask_height;
+    int mask_width;
+    uint64_t reported_first_masks;
+
+    // grow/shrink and feathering done here from the mask's distance field
+    // instead of by the server, so the sliders apply on the next frame
+    uint8_t distance_field;
+    float grow;
+    float feather;
+    // filter->mask holds the encoded field the workers built rather than the mask
+    uint8_t mask_is_field;
+    ImgArray *field_alpha;
+
+    // holds a reference on the module's supervised server
+    uint8_t supervised;
+
+    // policy generation of the workers whose placement was last logged
+    uint64_t logged_policy_generation;
+
+    // drop counts of masks past max_mask_age and dual-rate pass counts, as last logged
+    uint64_t last_deadline_stats_timestamp;
+    DeadlineStats logged_deadline_stats;
+    DualRateStats logged_dual_rate_stats;
+
+    // time spent in virtual_background_update, logged with the deadline stats
+    uint64_t updates;
+    uint64_t update_ns;
+    uint64_t longest_update_ns;
+    uint64_t logged_updates;
 };
 
 